@@ -0,0 +1,327 @@
+/*
+ * Minimal stand-in for the atheme and libmowgli headers, so main.c can be
+ * built and exercised outside the services tree.  Only what the module
+ * uses is declared; the implementations live in stub.c.
+ */
+#ifndef WEATHER_BENCH_ATHEME_H
+#define WEATHER_BENCH_ATHEME_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define PACKAGE_STRING "weather-bench"
+#define VENDOR_STRING "bench"
+#define DATADIR "."
+
+#define CHANNELLEN 200
+#define NICKLEN 50
+#define HOSTLEN 63
+#define USERLEN 11
+#define BUFSIZE 1024
+
+#define LG_DEBUG 0x1
+#define LG_INFO 0x2
+#define LG_ERROR 0x4
+
+#define _(x) x
+#define N_(x) x
+
+#define PRIV_ADMIN "general:admin"
+#define AC_NONE NULL
+#define AC_AUTHENTICATED "special:authenticated"
+#define CA_SET 0x008
+#define CA_INVITE 0x100
+
+/* lists */
+typedef struct mowgli_node_ {
+    struct mowgli_node_ *next, *prev;
+    void *data;
+} mowgli_node_t;
+
+typedef struct {
+    mowgli_node_t *head, *tail;
+    size_t count;
+} mowgli_list_t;
+
+#define MOWGLI_LIST_LENGTH(list) ((list)->count)
+#define MOWGLI_ITER_FOREACH(n, head) for (n = (head); n; n = n->next)
+#define MOWGLI_ITER_FOREACH_SAFE(n, tn, head) for (n = (head), tn = n ? n->next : NULL; n != NULL; n = tn, tn = n ? n->next : NULL)
+
+mowgli_node_t *mowgli_node_create(void);
+void mowgli_node_free(mowgli_node_t *n);
+void mowgli_node_add(void *data, mowgli_node_t *n, mowgli_list_t *l);
+void mowgli_node_add_head(void *data, mowgli_node_t *n, mowgli_list_t *l);
+void mowgli_node_add_before(void *data, mowgli_node_t *n, mowgli_list_t *l, mowgli_node_t *before);
+void mowgli_node_delete(mowgli_node_t *n, mowgli_list_t *l);
+
+/* patricia (a plain chained hash here) */
+typedef struct mowgli_patricia_ mowgli_patricia_t;
+
+typedef struct {
+    void *pspare[4];
+    int ispare[4];
+} mowgli_patricia_iteration_state_t;
+
+mowgli_patricia_t *mowgli_patricia_create(void (*canonize_cb)(char *key));
+bool mowgli_patricia_add(mowgli_patricia_t *dict, const char *key, void *data);
+void *mowgli_patricia_retrieve(mowgli_patricia_t *dict, const char *key);
+void *mowgli_patricia_delete(mowgli_patricia_t *dict, const char *key);
+void mowgli_patricia_destroy(mowgli_patricia_t *dict, void (*destroy_cb)(const char *key, void *data, void *privdata), void *privdata);
+unsigned int mowgli_patricia_size(mowgli_patricia_t *dict);
+void mowgli_patricia_foreach_start(mowgli_patricia_t *dict, mowgli_patricia_iteration_state_t *state);
+void *mowgli_patricia_foreach_cur(mowgli_patricia_t *dict, mowgli_patricia_iteration_state_t *state);
+void mowgli_patricia_foreach_next(mowgli_patricia_t *dict, mowgli_patricia_iteration_state_t *state);
+
+#define MOWGLI_PATRICIA_FOREACH(element, state, dict) \
+    for (mowgli_patricia_foreach_start((dict), (state)); ((element) = mowgli_patricia_foreach_cur((dict), (state))) != NULL; mowgli_patricia_foreach_next((dict), (state)))
+
+void strcasecanon(char *str);
+size_t mowgli_strlcpy(char *dest, const char *src, size_t size);
+size_t mowgli_strlcat(char *dest, const char *src, size_t size);
+int irccasecmp(const char *s1, const char *s2);
+
+/* event loop: only runs when a driver calls stub_run_timers() or stub_poll() */
+typedef struct mowgli_eventloop_ mowgli_eventloop_t;
+typedef struct mowgli_eventloop_timer_ mowgli_eventloop_timer_t;
+typedef void mowgli_eventloop_io_t;
+
+typedef enum {
+    MOWGLI_EVENTLOOP_IO_READ,
+    MOWGLI_EVENTLOOP_IO_WRITE
+} mowgli_eventloop_io_dir_t;
+
+typedef void mowgli_eventloop_io_cb_t(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io, mowgli_eventloop_io_dir_t dir, void *userdata);
+
+typedef struct {
+    int fd;
+    void *userdata;
+    mowgli_eventloop_io_cb_t *read_function;
+    mowgli_eventloop_io_cb_t *write_function;
+} mowgli_eventloop_pollable_t;
+
+typedef void mowgli_event_dispatch_func_t(void *arg);
+
+extern mowgli_eventloop_t *base_eventloop;
+
+mowgli_eventloop_timer_t *mowgli_timer_add(mowgli_eventloop_t *eventloop, const char *name, mowgli_event_dispatch_func_t *func, void *arg, time_t when);
+mowgli_eventloop_timer_t *mowgli_timer_add_once(mowgli_eventloop_t *eventloop, const char *name, mowgli_event_dispatch_func_t *func, void *arg, time_t when);
+void mowgli_timer_destroy(mowgli_eventloop_t *eventloop, mowgli_eventloop_timer_t *timer);
+mowgli_eventloop_pollable_t *mowgli_pollable_create(mowgli_eventloop_t *eventloop, int fd, void *userdata);
+void mowgli_pollable_destroy(mowgli_eventloop_t *eventloop, mowgli_eventloop_pollable_t *pollable);
+void mowgli_pollable_setselect(mowgli_eventloop_t *eventloop, mowgli_eventloop_pollable_t *pollable, mowgli_eventloop_io_dir_t dir, mowgli_eventloop_io_cb_t *event_function);
+mowgli_eventloop_pollable_t *mowgli_eventloop_io_pollable(mowgli_eventloop_io_t *io);
+time_t mowgli_eventloop_get_time(mowgli_eventloop_t *eventloop);
+
+#define CURRTIME (mowgli_eventloop_get_time(base_eventloop))
+
+/* configuration */
+typedef struct mowgli_config_file_entry_ {
+    struct mowgli_config_file_entry_ *next;
+    char *varname;
+    char *vardata;
+    int varlinenum;
+    struct mowgli_config_file_entry_ *entries;
+} mowgli_config_file_entry_t;
+
+void add_uint_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, unsigned int *var, unsigned int min, unsigned int max, unsigned int def);
+void add_bool_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, bool *var, bool def);
+void add_dupstr_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, char **var, const char *def);
+void add_duration_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, unsigned int *var, const char *defunit, unsigned int def);
+void add_conf_item(const char *name, mowgli_list_t *conflist, int (*handler)(mowgli_config_file_entry_t *));
+void del_conf_item(const char *name, mowgli_list_t *conflist);
+void conf_report_warning(mowgli_config_file_entry_t *ce, const char *fmt, ...);
+
+/* services objects */
+typedef struct {
+    char *name;
+    char *value;
+} metadata_t;
+
+typedef struct {
+    char name[NICKLEN + 1];
+} myentity_t;
+
+typedef struct myuser_ {
+    myentity_t ent;
+    mowgli_list_t logins;
+    mowgli_list_t metadata;
+    mowgli_list_t privatedata;
+} myuser_t;
+
+#define entity(mu) (&(mu)->ent)
+#define user(mt) ((myuser_t *)(mt))
+
+typedef enum {
+    ENT_ANY = 0,
+    ENT_USER,
+    ENT_GROUP,
+    ENT_CHANNEL
+} myentity_type_t;
+
+typedef struct {
+    mowgli_patricia_iteration_state_t st;
+    myentity_type_t type;
+} myentity_iteration_state_t;
+
+void myentity_foreach_start(myentity_iteration_state_t *state, myentity_type_t type);
+myentity_t *myentity_foreach_cur(myentity_iteration_state_t *state);
+void myentity_foreach_next(myentity_iteration_state_t *state);
+
+#define MYENTITY_FOREACH_T(elem, state, type) \
+    for (myentity_foreach_start((state), (type)); ((elem) = myentity_foreach_cur((state))) != NULL; myentity_foreach_next((state)))
+
+typedef struct user_ {
+    char *nick;
+    char *user;
+    char *host;
+    char *vhost;
+    char *ip;
+    myuser_t *myuser;
+} user_t;
+
+typedef struct channel_ {
+    char *name;
+    mowgli_list_t members;
+} channel_t;
+
+typedef struct chanuser_ {
+    channel_t *chan;
+    user_t *user;
+} chanuser_t;
+
+typedef struct mychan_ mychan_t;
+
+typedef struct {
+    char *nick;
+    char *user;
+    char *host;
+    char *real;
+    char *disp;
+    user_t *me;
+    mowgli_list_t conf_table;
+    mowgli_patricia_t *commands;
+} service_t;
+
+typedef struct {
+    user_t *su;
+    myuser_t *smu;
+    service_t *service;
+} sourceinfo_t;
+
+typedef struct {
+    const char *name;
+    const char *desc;
+    const char *access;
+    int maxparc;
+    void (*cmd)(sourceinfo_t *si, int parc, char *parv[]);
+    struct {
+        const char *path;
+        void (*func)(sourceinfo_t *si, const char *subcmd);
+    } help;
+} command_t;
+
+typedef struct {
+    user_t *u;
+    channel_t *c;
+    char *msg;
+} hook_cmessage_data_t;
+
+typedef enum {
+    fault_needmoreparams = 1,
+    fault_badparams,
+    fault_nosuch_source,
+    fault_nosuch_target,
+    fault_authfail,
+    fault_noprivs,
+    fault_nosuch_key,
+    fault_alreadyexists,
+    fault_toomany,
+    fault_emailfail,
+    fault_notverified,
+    fault_nochange,
+    fault_already_authed,
+    fault_unimplemented,
+    fault_badaccount,
+    fault_internalerror
+} cmd_faultcode_t;
+
+typedef enum {
+    MODULE_UNLOAD_INTENT_PERM,
+    MODULE_UNLOAD_INTENT_RELOAD
+} module_unload_intent_t;
+
+typedef struct module_ module_t;
+
+typedef struct {
+    bool uses_rcommand;
+} ircd_t;
+
+extern ircd_t *ircd;
+
+struct me {
+    bool connected;
+};
+extern struct me me;
+
+#define DECLARE_MODULE_V1(name, norestart, modinit, moddeinit, ver, ven) \
+    void _modinit(module_t *m); \
+    void _moddeinit(module_unload_intent_t intent); \
+    extern int weather_bench_module_declared
+
+void slog(unsigned int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+metadata_t *metadata_find(void *target, const char *name);
+metadata_t *metadata_add(void *target, const char *name, const char *value);
+void metadata_delete(void *target, const char *name);
+void *privatedata_get(void *target, const char *key);
+void privatedata_set(void *target, const char *key, void *data);
+void *privatedata_delete(void *target, const char *key);
+
+void msg(const char *from, const char *target, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void notice(const char *from, const char *target, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void command_fail(sourceinfo_t *si, cmd_faultcode_t code, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void command_success_nodata(sourceinfo_t *si, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void join(const char *chan, const char *nick);
+void part(const char *chan, const char *nick);
+
+void childproc_add(pid_t pid, const char *desc, void (*cb)(pid_t pid, int status, void *data), void *data);
+void childproc_delete_all(void (*cb)(pid_t pid, int status, void *data));
+channel_t *channel_find(const char *name);
+chanuser_t *chanuser_find(channel_t *chan, user_t *user);
+user_t *user_find_named(const char *nick);
+myuser_t *myuser_find(const char *name);
+mychan_t *mychan_find(const char *name);
+bool chanacs_user_has_flag(mychan_t *mychan, user_t *u, unsigned int level);
+bool has_priv(sourceinfo_t *si, const char *priv);
+
+service_t *service_add(const char *name, void (*handler)(sourceinfo_t *si, int parc, char *parv[]));
+void service_delete(service_t *sptr);
+void service_bind_command(service_t *sptr, command_t *cmd);
+void service_unbind_command(service_t *sptr, command_t *cmd);
+void help_display(sourceinfo_t *si, service_t *service, const char *command, mowgli_patricia_t *list);
+
+void hook_add_event(const char *name);
+void hook_add_channel_message(void (*func)(hook_cmessage_data_t *data));
+void hook_del_channel_message(void (*func)(hook_cmessage_data_t *data));
+void hook_add_user_identify(void (*func)(user_t *u));
+void hook_del_user_identify(void (*func)(user_t *u));
+void hook_add_myuser_delete(void (*func)(myuser_t *mu));
+void hook_del_myuser_delete(void (*func)(myuser_t *mu));
+void hook_add_config_ready(void (*func)(void *unused));
+void hook_del_config_ready(void (*func)(void *unused));
+
+#endif
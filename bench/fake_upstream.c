@@ -0,0 +1,602 @@
+/*
+ * Local stand-in for the OpenCage, PirateWeather and Open-Meteo APIs, for
+ * load tests that should not spend real quota.  Point the module at it with
+ *
+ *   opencage_url = "http://127.0.0.1:8089/geocode/v1/json";
+ *   pirate_url = "http://127.0.0.1:8089/forecast";
+ *   openmeteo_url = "http://127.0.0.1:8089/v1/forecast";
+ *
+ * Geocode answers are made up from the query, so different place names get
+ * different coordinates; "nowhere" gets no results.  Forecasts are the
+ * recorded fixtures.  Latency, errors, hung requests and slowly dripped
+ * bodies can be injected:
+ *
+ *   ./fake_upstream [-p port] [-f fixtures] [-l dist] [-g dist] [-m dist]
+ *                   [-e rate] [-s status] [-t rate] [-d bytes:ms] [-q quota]
+ *                   [-i secs]
+ *
+ *   -l  latency before answering, for every request
+ *   -g  latency for geocode requests only, overriding -l
+ *   -m  latency for Open-Meteo requests only, overriding -l
+ *       dist is fixed:MS, uniform:MIN:MAX, normal:MEAN:SD, exp:MEAN or
+ *       lognormal:MEDIAN:SIGMA, all in milliseconds
+ *   -e  fraction of requests answered with an error status (-s, default 503)
+ *   -t  fraction of requests that are never answered
+ *   -d  send bodies in pieces of this many bytes, this many ms apart
+ *   -q  requests each API key may make before it is refused (OpenCage
+ *       answers 402, PirateWeather 429); every answer then carries
+ *       X-RateLimit-Limit/Remaining/Reset headers for its key
+ *   -i  seconds between statistics lines (0 for none)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_CONNS 1024
+#define IN_SIZE 8192
+#define MAX_KEYS 64
+
+typedef enum {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_NORMAL,
+    DIST_EXP,
+    DIST_LOGNORMAL
+} dist_kind_t;
+
+typedef struct {
+    dist_kind_t kind;
+    double a, b;
+} dist_t;
+
+typedef enum {
+    ROUTE_GEOCODE,
+    ROUTE_FORECAST,
+    ROUTE_OPENMETEO,
+    ROUTE_OTHER,
+    ROUTE_COUNT
+} route_t;
+
+static const char *route_names[ROUTE_COUNT] = { "geocode", "forecast", "openmeteo", "other" };
+
+typedef struct {
+    unsigned long requests;
+    unsigned long ok;
+    unsigned long errors;
+    unsigned long hung;
+    unsigned long bytes;
+} route_stats_t;
+
+typedef enum {
+    CONN_READ,      /* waiting for a complete request */
+    CONN_DELAY,     /* answer is ready, waiting out the latency */
+    CONN_WRITE,     /* sending the answer */
+    CONN_HUNG       /* never answered */
+} conn_state_t;
+
+typedef struct {
+    int fd;
+    conn_state_t state;
+    char in[IN_SIZE];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    uint64_t at;        /* ms: when to answer, or send the next piece */
+    bool close_after;
+} conn_t;
+
+static dist_t latency = { DIST_FIXED, 0, 0 };
+static dist_t geocode_latency;
+static bool geocode_latency_set;
+static dist_t openmeteo_latency;
+static bool openmeteo_latency_set;
+static double error_rate;
+static int error_status = 503;
+static double hang_rate;
+static size_t drip_bytes;
+static unsigned int drip_ms;
+static unsigned long quota;
+
+static struct {
+    char key[64];
+    unsigned long used;
+} keys[MAX_KEYS];
+static int key_count;
+
+static char *forecast_full, *forecast_excluded, *openmeteo_full;
+static size_t forecast_full_len, forecast_excluded_len, openmeteo_full_len;
+
+static conn_t *conns[MAX_CONNS];
+static route_stats_t stats[ROUTE_COUNT];
+static unsigned long accepted;
+static volatile sig_atomic_t stopping;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool parse_dist(const char *spec, dist_t *d) {
+    static const struct {
+        const char *name;
+        dist_kind_t kind;
+        int args;
+    } kinds[] = {
+        { "fixed", DIST_FIXED, 1 },
+        { "uniform", DIST_UNIFORM, 2 },
+        { "normal", DIST_NORMAL, 2 },
+        { "exp", DIST_EXP, 1 },
+        { "lognormal", DIST_LOGNORMAL, 2 },
+    };
+    const char *colon = strchr(spec, ':');
+
+    if (!colon)
+        return false;
+
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        if (strlen(kinds[i].name) != (size_t)(colon - spec) || strncmp(kinds[i].name, spec, colon - spec))
+            continue;
+        d->kind = kinds[i].kind;
+        return sscanf(colon + 1, "%lf:%lf", &d->a, &d->b) == kinds[i].args;
+    }
+    return false;
+}
+
+static double gaussian(void) {
+    double u = drand48(), v = drand48();
+    return sqrt(-2 * log(u > 0 ? u : 1e-12)) * cos(2 * M_PI * v);
+}
+
+static uint64_t sample_dist(const dist_t *d) {
+    double ms;
+
+    switch (d->kind) {
+    case DIST_UNIFORM:
+        ms = d->a + drand48() * (d->b - d->a);
+        break;
+    case DIST_NORMAL:
+        ms = d->a + d->b * gaussian();
+        break;
+    case DIST_EXP:
+        ms = -d->a * log(1 - drand48());
+        break;
+    case DIST_LOGNORMAL:
+        ms = d->a * exp(d->b * gaussian());
+        break;
+    default:
+        ms = d->a;
+        break;
+    }
+    return ms > 0 ? (uint64_t)ms : 0;
+}
+
+static char *read_file(const char *dir, const char *name, size_t *len) {
+    char path[512];
+    FILE *f;
+    char *buf;
+    long size;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!(f = fopen(path, "rb"))) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (fread(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "short read on %s\n", path);
+        exit(1);
+    }
+    buf[size] = '\0';
+    fclose(f);
+    *len = size;
+    return buf;
+}
+
+/* Copies the value of a query parameter, undoing %XX, + and _. */
+static void query_param(const char *target, const char *name, char *out, size_t size) {
+    const char *q = strchr(target, '?');
+    size_t namelen = strlen(name), n = 0;
+
+    out[0] = '\0';
+    while (q) {
+        q++;
+        if (!strncmp(q, name, namelen) && q[namelen] == '=') {
+            q += namelen + 1;
+            while (*q && *q != '&' && *q != ' ' && n + 1 < size) {
+                if (*q == '%' && q[1] && q[2]) {
+                    char hex[3] = { q[1], q[2], 0 };
+                    out[n++] = (char)strtol(hex, NULL, 16);
+                    q += 3;
+                } else {
+                    out[n++] = (*q == '+' || *q == '_') ? ' ' : *q;
+                    q++;
+                }
+            }
+            out[n] = '\0';
+            return;
+        }
+        q = strchr(q, '&');
+    }
+}
+
+static char *geocode_body(const char *target, size_t *len) {
+    char place[256], escaped[512];
+    uint32_t h = 2166136261u;
+    size_t n = 0;
+    char *body;
+
+    query_param(target, "q", place, sizeof(place));
+    if (!strncasecmp(place, "nowhere", 7)) {
+        body = strdup("{\"results\":[],\"status\":{\"code\":200,\"message\":\"OK\"},\"total_results\":0}");
+        *len = strlen(body);
+        return body;
+    }
+
+    for (const char *p = place; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+        if (n + 2 >= sizeof(escaped))
+            break;
+        if (*p == '"' || *p == '\\')
+            escaped[n++] = '\\';
+        escaped[n++] = *p;
+    }
+    escaped[n] = '\0';
+
+    body = malloc(1024);
+    *len = snprintf(body, 1024,
+        "{\"documentation\":\"https://opencagedata.com/api\",\"rate\":{\"limit\":2500,\"remaining\":2499,\"reset\":0},"
+        "\"results\":[{\"components\":{\"_type\":\"city\",\"city\":\"%s\"},\"confidence\":5,"
+        "\"formatted\":\"%s, Stand-in\",\"geometry\":{\"lat\":%.6f,\"lng\":%.6f}}],"
+        "\"status\":{\"code\":200,\"message\":\"OK\"},\"total_results\":1}",
+        escaped, escaped, (h % 1600000) / 10000.0 - 80, ((h >> 8) % 3600000) / 10000.0 - 180);
+    return body;
+}
+
+/* The key is the key= parameter for OpenCage, the first path element for PirateWeather. */
+static unsigned long *key_usage(route_t route, const char *target) {
+    char key[64] = "";
+    const char *p;
+
+    if (route == ROUTE_GEOCODE && (p = strstr(target, "key=")) != NULL)
+        sscanf(p + 4, "%63[^&]", key);
+    else if (route == ROUTE_FORECAST && (p = strstr(target, "/forecast/")) != NULL)
+        sscanf(p + 10, "%63[^/?]", key);
+
+    for (int i = 0; i < key_count; i++) {
+        if (!strcmp(keys[i].key, key))
+            return &keys[i].used;
+    }
+    if (key_count == MAX_KEYS)
+        return &keys[MAX_KEYS - 1].used;
+    snprintf(keys[key_count].key, sizeof(keys[key_count].key), "%s", key);
+    return &keys[key_count++].used;
+}
+
+static void respond(conn_t *c, int status, const char *reason, const char *body, size_t body_len, const unsigned long *used) {
+    char head[512], limits[160] = "";
+    int head_len;
+
+    if (used) {
+        time_t now = time(NULL);
+
+        snprintf(limits, sizeof(limits), "X-RateLimit-Limit: %lu\r\nX-RateLimit-Remaining: %lu\r\nX-RateLimit-Reset: %ld\r\n",
+            quota, *used < quota ? quota - *used : 0, (long)(now - now % 86400 + 86400));
+    }
+    head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n%s%s%s\r\n",
+        status, reason, body_len, status == 429 ? "Retry-After: 1\r\n" : "", limits,
+        c->close_after ? "Connection: close\r\n" : "Connection: keep-alive\r\n");
+
+    c->out = malloc(head_len + body_len);
+    memcpy(c->out, head, head_len);
+    memcpy(c->out + head_len, body, body_len);
+    c->out_len = head_len + body_len;
+    c->out_off = 0;
+}
+
+/* Looks for a complete request in the input buffer and prepares its answer. */
+static void handle_request(conn_t *c) {
+    char *end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+    char target[2048] = "";
+    route_t route;
+    size_t consumed, body_len;
+    char *body = NULL;
+    const dist_t *dist = &latency;
+    unsigned long *used = NULL;
+    bool exhausted = false;
+
+    if (!end)
+        return;
+    *end = '\0';
+    consumed = end + 4 - c->in;
+
+    sscanf(c->in, "%*s %2047s", target);
+    c->close_after = strcasestr(c->in, "\r\nConnection: close") != NULL;
+
+    if (strstr(target, "/geocode/")) {
+        route = ROUTE_GEOCODE;
+        if (geocode_latency_set)
+            dist = &geocode_latency;
+    } else if (strstr(target, "/forecast/")) {
+        route = ROUTE_FORECAST;
+    } else if (strstr(target, "/v1/forecast?")) {
+        route = ROUTE_OPENMETEO;
+        if (openmeteo_latency_set)
+            dist = &openmeteo_latency;
+    } else {
+        route = ROUTE_OTHER;
+    }
+
+    memmove(c->in, c->in + consumed, c->in_len - consumed);
+    c->in_len -= consumed;
+    stats[route].requests++;
+
+    if (hang_rate > 0 && drand48() < hang_rate) {
+        stats[route].hung++;
+        c->state = CONN_HUNG;
+        return;
+    }
+
+    if (quota && route != ROUTE_OTHER) {
+        used = key_usage(route, target);
+        exhausted = *used >= quota;
+        if (!exhausted)
+            ++*used;
+    }
+
+    if (route == ROUTE_OTHER) {
+        stats[route].errors++;
+        respond(c, 404, "Not Found", "{\"error\":\"not found\"}", 21, NULL);
+    } else if (exhausted) {
+        stats[route].errors++;
+        if (route == ROUTE_GEOCODE)
+            respond(c, 402, "Payment Required", "{\"error\":\"quota exceeded\"}", 26, used);
+        else
+            respond(c, 429, "Too Many Requests", "{\"error\":\"quota exceeded\"}", 26, used);
+    } else if (error_rate > 0 && drand48() < error_rate) {
+        char err[64];
+        int len = snprintf(err, sizeof(err), "{\"error\":\"injected %d\"}", error_status);
+
+        stats[route].errors++;
+        respond(c, error_status, error_status == 429 ? "Too Many Requests" : "Error", err, len, used);
+    } else if (route == ROUTE_GEOCODE) {
+        body = geocode_body(target, &body_len);
+        stats[route].ok++;
+        respond(c, 200, "OK", body, body_len, used);
+        free(body);
+    } else if (route == ROUTE_OPENMETEO) {
+        stats[route].ok++;
+        respond(c, 200, "OK", openmeteo_full, openmeteo_full_len, used);
+    } else {
+        bool excluded = strstr(target, "exclude=") != NULL;
+
+        stats[route].ok++;
+        respond(c, 200, "OK", excluded ? forecast_excluded : forecast_full, excluded ? forecast_excluded_len : forecast_full_len, used);
+    }
+
+    stats[route].bytes += c->out_len;
+    c->state = CONN_DELAY;
+    c->at = now_ms() + sample_dist(dist);
+}
+
+static void conn_close(int slot) {
+    conn_t *c = conns[slot];
+
+    close(c->fd);
+    free(c->out);
+    free(c);
+    conns[slot] = NULL;
+}
+
+/* Returns false if the connection should be closed. */
+static bool conn_write(conn_t *c) {
+    size_t want = c->out_len - c->out_off;
+    ssize_t n;
+
+    if (drip_bytes && want > drip_bytes)
+        want = drip_bytes;
+
+    n = send(c->fd, c->out + c->out_off, want, MSG_NOSIGNAL);
+    if (n < 0)
+        return errno == EAGAIN || errno == EINTR;
+
+    c->out_off += n;
+    if (c->out_off < c->out_len) {
+        if (drip_bytes)
+            c->at = now_ms() + drip_ms;
+        return true;
+    }
+
+    free(c->out);
+    c->out = NULL;
+    if (c->close_after)
+        return false;
+
+    c->state = CONN_READ;
+    handle_request(c);     /* a pipelined request may be waiting */
+    return true;
+}
+
+static void print_stats(void) {
+    int open = 0;
+
+    for (int i = 0; i < MAX_CONNS; i++)
+        open += conns[i] != NULL;
+
+    printf("conns %lu accepted, %d open", accepted, open);
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        if (!stats[r].requests)
+            continue;
+        printf(" | %s: %lu req, %lu ok, %lu err, %lu hung, %lu KiB",
+               route_names[r], stats[r].requests, stats[r].ok, stats[r].errors, stats[r].hung, stats[r].bytes / 1024);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void on_signal(int sig) {
+    stopping = 1;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-p port] [-f fixtures] [-l dist] [-g dist] [-m dist] [-e rate] [-s status] [-t rate] [-d bytes:ms] [-q quota] [-i secs]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *fixtures = "fixtures";
+    int port = 8089, interval = 5, opt, listener, one = 1;
+    struct sockaddr_in addr;
+    uint64_t next_stats;
+
+    while ((opt = getopt(argc, argv, "p:f:l:g:m:e:s:t:d:q:i:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'f': fixtures = optarg; break;
+        case 'l': if (!parse_dist(optarg, &latency)) usage(argv[0]); break;
+        case 'g': if (!parse_dist(optarg, &geocode_latency)) usage(argv[0]); geocode_latency_set = true; break;
+        case 'm': if (!parse_dist(optarg, &openmeteo_latency)) usage(argv[0]); openmeteo_latency_set = true; break;
+        case 'e': error_rate = atof(optarg); break;
+        case 's': error_status = atoi(optarg); break;
+        case 't': hang_rate = atof(optarg); break;
+        case 'd': if (sscanf(optarg, "%zu:%u", &drip_bytes, &drip_ms) != 2) usage(argv[0]); break;
+        case 'q': quota = strtoul(optarg, NULL, 10); break;
+        case 'i': interval = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    forecast_full = read_file(fixtures, "pirate_full.json", &forecast_full_len);
+    forecast_excluded = read_file(fixtures, "pirate_excluded.json", &forecast_excluded_len);
+    openmeteo_full = read_file(fixtures, "openmeteo_full.json", &openmeteo_full_len);
+    srand48(time(NULL));
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 256) < 0) {
+        perror("listen");
+        return 1;
+    }
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+    printf("listening on 127.0.0.1:%d\n", port);
+    fflush(stdout);
+
+    next_stats = now_ms() + interval * 1000;
+    while (!stopping) {
+        struct pollfd fds[MAX_CONNS + 1];
+        int slots[MAX_CONNS + 1];
+        int count = 0, timeout = 1000;
+        uint64_t now = now_ms();
+
+        fds[count].fd = listener;
+        fds[count].events = POLLIN;
+        slots[count++] = -1;
+
+        for (int i = 0; i < MAX_CONNS; i++) {
+            conn_t *c = conns[i];
+
+            if (!c)
+                continue;
+
+            /* due answers and drip pieces go out on this pass */
+            if ((c->state == CONN_DELAY || (c->state == CONN_WRITE && drip_bytes)) && c->at <= now) {
+                c->state = CONN_WRITE;
+                if (!conn_write(c)) {
+                    conn_close(i);
+                    continue;
+                }
+            }
+
+            fds[count].fd = c->fd;
+            fds[count].events = POLLIN;
+            if (c->state == CONN_WRITE && !drip_bytes)
+                fds[count].events |= POLLOUT;
+            if (c->state == CONN_DELAY || (c->state == CONN_WRITE && drip_bytes))
+                timeout = c->at > now ? (int)(c->at - now) < timeout ? (int)(c->at - now) : timeout : 0;
+            slots[count++] = i;
+        }
+
+        if (poll(fds, count, timeout) < 0 && errno != EINTR)
+            break;
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+
+            while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                int slot;
+
+                for (slot = 0; slot < MAX_CONNS && conns[slot]; slot++)
+                    ;
+                if (slot == MAX_CONNS) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                conns[slot] = calloc(1, sizeof(conn_t));
+                conns[slot]->fd = fd;
+                accepted++;
+            }
+        }
+
+        for (int i = 1; i < count; i++) {
+            conn_t *c = conns[slots[i]];
+
+            if (!c || !fds[i].revents)
+                continue;
+
+            if (fds[i].revents & POLLIN) {
+                ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR) || (n < 0 && c->in_len == sizeof(c->in))) {
+                    conn_close(slots[i]);
+                    continue;
+                }
+                if (n > 0) {
+                    c->in_len += n;
+                    if (c->state == CONN_READ)
+                        handle_request(c);
+                    else if (c->state == CONN_HUNG)
+                        c->in_len = 0;
+                }
+            }
+
+            if ((fds[i].revents & POLLOUT) && c->state == CONN_WRITE && !conn_write(c))
+                conn_close(slots[i]);
+            else if (fds[i].revents & (POLLERR | POLLHUP))
+                conn_close(slots[i]);
+        }
+
+        if (interval > 0 && now_ms() >= next_stats) {
+            print_stats();
+            next_stats = now_ms() + interval * 1000;
+        }
+    }
+
+    print_stats();
+    return 0;
+}
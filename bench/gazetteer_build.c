@@ -0,0 +1,355 @@
+/*
+ * Builds the gazetteer file the module's local geocoder maps (see the
+ * Gazetteer section of main.c) from GeoNames dumps.
+ *
+ *   ./gazetteer_build [-a admin1CodesASCII.txt] [-c countryInfo.txt] [-A]
+ *                     [-p population] -o weather_gazetteer.db cities15000.txt ...
+ *
+ *   -a  region names, keyed "CC.code"; without it places have no region name
+ *   -c  country names; without it the country code is used as the name
+ *   -A  also index each place under its alternate names
+ *   -p  leave out places smaller than this (default 0)
+ *   -o  where to write; the file is written beside it and renamed into place
+ *
+ * The city files are the tab-separated GeoNames "cities" exports
+ * (https://download.geonames.org/export/dump/), or anything in the same
+ * columns.
+ */
+#include "../main.c"
+#include "stub.h"
+
+#define BUILD_POOL_SLOTS (1 << 20)
+
+typedef struct {
+    uint32_t name, region, region_code, country;
+    char country_code[2];
+    int32_t lat, lng;
+    uint32_t population;
+} build_place_t;
+
+typedef struct {
+    uint32_t key;
+    uint32_t place;
+} build_key_t;
+
+static build_place_t *places;
+static size_t place_count, place_size;
+static build_key_t *keys;
+static size_t key_count, key_size;
+
+/* string area, with an open-addressing table of offsets to share repeats */
+static char *pool;
+static size_t pool_len, pool_size;
+static uint32_t *pool_slots;
+static size_t pool_slot_count = BUILD_POOL_SLOTS, pool_used;
+
+static char *country_names[26 * 26];
+static char **region_codes, **region_names;
+static size_t region_count;
+
+static void *grow(void *p, size_t *size, size_t need, size_t elem) {
+    if (need <= *size)
+        return p;
+    *size = *size ? *size * 2 : 1024;
+    if (*size < need)
+        *size = need;
+    if (!(p = realloc(p, *size * elem))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint32_t pool_hash(const char *s) {
+    uint32_t h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void pool_rehash(void) {
+    uint32_t *old = pool_slots;
+    size_t old_count = pool_slot_count;
+
+    pool_slot_count = old ? old_count * 2 : pool_slot_count;
+    pool_slots = calloc(pool_slot_count, sizeof(*pool_slots));
+    if (!pool_slots) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; old && i < old_count; i++) {
+        size_t slot;
+
+        if (!old[i])
+            continue;
+        for (slot = pool_hash(pool + old[i]) & (pool_slot_count - 1); pool_slots[slot]; slot = (slot + 1) & (pool_slot_count - 1))
+            ;
+        pool_slots[slot] = old[i];
+    }
+    free(old);
+}
+
+/* Offset of s in the string area, adding it the first time. Offset 0 is "". */
+static uint32_t pool_add(const char *s) {
+    size_t len = strlen(s), slot;
+
+    if (!len)
+        return 0;
+    if (!pool_slots || (pool_used + 1) * 2 > pool_slot_count)
+        pool_rehash();
+    for (slot = pool_hash(s) & (pool_slot_count - 1); pool_slots[slot]; slot = (slot + 1) & (pool_slot_count - 1)) {
+        if (!strcmp(pool + pool_slots[slot], s))
+            return pool_slots[slot];
+    }
+
+    if (pool_len + len + 1 > UINT32_MAX) {
+        fprintf(stderr, "string area over 4 GiB\n");
+        exit(1);
+    }
+    pool = grow(pool, &pool_size, pool_len + len + 1, 1);
+    memcpy(pool + pool_len, s, len + 1);
+    pool_slots[slot] = pool_len;
+    pool_used++;
+    pool_len += len + 1;
+    return pool_slots[slot];
+}
+
+/* Splits a tab-separated line in place; returns the number of fields. */
+static int split_tabs(char *line, char **fields, int max) {
+    int count = 0;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    while (count < max) {
+        fields[count++] = line;
+        if (!(line = strchr(line, '\t')))
+            break;
+        *line++ = '\0';
+    }
+    return count;
+}
+
+static FILE *open_input(const char *path) {
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return f;
+}
+
+static int country_index(const char *cc) {
+    if (!isupper((unsigned char)cc[0]) || !isupper((unsigned char)cc[1]) || cc[2])
+        return -1;
+    return (cc[0] - 'A') * 26 + (cc[1] - 'A');
+}
+
+static void load_countries(const char *path) {
+    FILE *f = open_input(path);
+    char *line = NULL, *fields[5];
+    size_t size = 0;
+    int i;
+
+    while (getline(&line, &size, f) > 0) {
+        if (line[0] == '#' || split_tabs(line, fields, 5) < 5 || (i = country_index(fields[0])) < 0)
+            continue;
+        free(country_names[i]);
+        country_names[i] = strdup(fields[4]);
+    }
+    free(line);
+    fclose(f);
+}
+
+static int region_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void load_regions(const char *path) {
+    FILE *f = open_input(path);
+    char *line = NULL, *fields[2];
+    size_t size = 0, region_size = 0;
+
+    while (getline(&line, &size, f) > 0) {
+        if (split_tabs(line, fields, 2) < 2)
+            continue;
+        region_codes = grow(region_codes, &region_size, region_count + 1, sizeof(char *));
+        /* name right after the code, so sorting the codes keeps the pairs */
+        region_codes[region_count] = malloc(strlen(fields[0]) + strlen(fields[1]) + 2);
+        strcpy(region_codes[region_count], fields[0]);
+        strcpy(region_codes[region_count] + strlen(fields[0]) + 1, fields[1]);
+        region_count++;
+    }
+    qsort(region_codes, region_count, sizeof(char *), region_cmp);
+    region_names = malloc((region_count + 1) * sizeof(char *));
+    for (size_t i = 0; i < region_count; i++)
+        region_names[i] = region_codes[i] + strlen(region_codes[i]) + 1;
+    free(line);
+    fclose(f);
+}
+
+static const char *region_name(const char *cc, const char *code) {
+    char key[64], *k = key, **found;
+
+    snprintf(key, sizeof(key), "%s.%s", cc, code);
+    found = region_count ? bsearch(&k, region_codes, region_count, sizeof(char *), region_cmp) : NULL;
+    return found ? region_names[found - region_codes] : "";
+}
+
+/* Indexes the place under name unless it already is. */
+static void add_key(const char *name, uint32_t place, size_t first) {
+    char folded[256];
+    uint32_t key;
+
+    if (!gazetteer_fold(name, folded, sizeof(folded)))
+        return;
+    key = pool_add(folded);
+    for (size_t i = first; i < key_count; i++) {
+        if (keys[i].key == key)
+            return;
+    }
+    keys = grow(keys, &key_size, key_count + 1, sizeof(build_key_t));
+    keys[key_count].key = key;
+    keys[key_count].place = place;
+    key_count++;
+}
+
+static void load_cities(const char *path, bool alternates, uint32_t min_population) {
+    FILE *f = open_input(path);
+    char *line = NULL, *fields[19];
+    size_t size = 0;
+
+    while (getline(&line, &size, f) > 0) {
+        build_place_t *place;
+        const char *country;
+        size_t first = key_count;
+        uint32_t id = place_count;
+        int i;
+
+        if (split_tabs(line, fields, 19) < 15 || !*fields[1])
+            continue;
+        if (strtoul(fields[14], NULL, 10) < min_population)
+            continue;
+
+        places = grow(places, &place_size, place_count + 1, sizeof(build_place_t));
+        place = &places[place_count++];
+        memset(place, 0, sizeof(*place));
+        place->name = pool_add(fields[1]);
+        place->lat = (int32_t)lround(strtod(fields[4], NULL) * WEATHER_LOCATION_SCALE);
+        place->lng = (int32_t)lround(strtod(fields[5], NULL) * WEATHER_LOCATION_SCALE);
+        place->population = strtoul(fields[14], NULL, 10);
+        memcpy(place->country_code, fields[8], strlen(fields[8]) >= 2 ? 2 : 0);
+        country = (i = country_index(fields[8])) >= 0 && country_names[i] ? country_names[i] : fields[8];
+        place->country = pool_add(country);
+        place->region = pool_add(region_name(fields[8], fields[10]));
+        place->region_code = pool_add(fields[10]);
+
+        add_key(fields[1], id, first);
+        add_key(fields[2], id, first);
+        if (alternates) {
+            for (char *alt = strtok(fields[3], ","); alt; alt = strtok(NULL, ","))
+                add_key(alt, id, first);
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+static int key_cmp(const void *a, const void *b) {
+    const build_key_t *x = a, *y = b;
+    int c = strcmp(pool + x->key, pool + y->key);
+
+    if (c)
+        return c;
+    if (places[x->place].population != places[y->place].population)
+        return places[x->place].population < places[y->place].population ? 1 : -1;
+    return x->place < y->place ? -1 : x->place > y->place;
+}
+
+static void put_u32(FILE *f, uint32_t v) {
+    unsigned char b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+
+    fwrite(b, 1, sizeof(b), f);
+}
+
+static void write_gazetteer(const char *path) {
+    char tmp[4096];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+    if (!(f = fopen(tmp, "wb"))) {
+        fprintf(stderr, "cannot write %s: %s\n", tmp, strerror(errno));
+        exit(1);
+    }
+
+    fwrite(GAZETTEER_MAGIC, 1, 4, f);
+    put_u32(f, GAZETTEER_VERSION);
+    put_u32(f, place_count);
+    put_u32(f, key_count);
+    put_u32(f, pool_len);
+    for (size_t i = 0; i < place_count; i++) {
+        build_place_t *p = &places[i];
+
+        put_u32(f, p->name);
+        put_u32(f, p->region);
+        put_u32(f, p->region_code);
+        put_u32(f, p->country);
+        fwrite(p->country_code, 1, 2, f);
+        fwrite("\0\0", 1, 2, f);
+        put_u32(f, (uint32_t)p->lat);
+        put_u32(f, (uint32_t)p->lng);
+        put_u32(f, p->population);
+    }
+    for (size_t i = 0; i < key_count; i++) {
+        put_u32(f, keys[i].key);
+        put_u32(f, keys[i].place);
+    }
+    fwrite(pool, 1, pool_len, f);
+
+    if (ferror(f) | fclose(f) || rename(tmp, path) < 0) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        exit(1);
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-a admin1CodesASCII.txt] [-c countryInfo.txt] [-A] [-p population] -o out.db cities.txt ...\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL;
+    bool alternates = false;
+    uint32_t min_population = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:c:Ap:o:")) != -1) {
+        switch (opt) {
+        case 'a': load_regions(optarg); break;
+        case 'c': load_countries(optarg); break;
+        case 'A': alternates = true; break;
+        case 'p': min_population = strtoul(optarg, NULL, 10); break;
+        case 'o': output = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!output || optind >= argc)
+        usage(argv[0]);
+
+    /* offset 0 is the empty string every missing field points at */
+    pool = grow(pool, &pool_size, 1, 1);
+    pool[pool_len++] = '\0';
+
+    for (int i = optind; i < argc; i++)
+        load_cities(argv[i], alternates, min_population);
+    if (place_count > UINT32_MAX - 1 || key_count > UINT32_MAX) {
+        fprintf(stderr, "too many places\n");
+        return 1;
+    }
+
+    qsort(keys, key_count, sizeof(build_key_t), key_cmp);
+    write_gazetteer(output);
+    printf("%s: %zu places under %zu names, %zu bytes of strings\n", output, place_count, key_count, pool_len);
+    return 0;
+}
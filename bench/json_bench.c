@@ -0,0 +1,302 @@
+/*
+ * Compares the module's streaming extractors against the jansson DOM
+ * extraction they replaced, on recorded upstream responses.
+ *
+ *   ./json_bench [iterations]
+ *
+ * For every fixture both paths are checked to agree, then timed.  The
+ * streaming path is fed in the chunk sizes curl typically hands to the
+ * write callback.  Heap use for jansson is counted through its allocator
+ * hooks; the streaming parser allocates nothing.
+ */
+#include "../main.c"
+#include "stub.h"
+
+#include <jansson.h>
+
+#define BENCH_ITERATIONS 2000
+
+static size_t heap_current;
+static size_t heap_peak;
+
+typedef struct {
+    size_t size;
+    max_align_t align[];
+} heap_block_t;
+
+static void *counting_malloc(size_t size) {
+    heap_block_t *block = malloc(sizeof(heap_block_t) + size);
+
+    if (!block)
+        return NULL;
+    block->size = size;
+    heap_current += size;
+    if (heap_current > heap_peak)
+        heap_peak = heap_current;
+    return block->align;
+}
+
+static void counting_free(void *ptr) {
+    heap_block_t *block;
+
+    if (!ptr)
+        return;
+    block = (heap_block_t *)((char *)ptr - offsetof(heap_block_t, align));
+    heap_current -= block->size;
+    free(block);
+}
+
+static char *read_fixture(const char *name, size_t *len) {
+    char path[256];
+    FILE *f;
+    char *buf;
+    long size;
+
+    snprintf(path, sizeof(path), "fixtures/%s", name);
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (fread(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "short read on %s\n", path);
+        exit(1);
+    }
+    buf[size] = '\0';
+    fclose(f);
+    *len = size;
+    return buf;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The extraction main.c did before the streaming parser, kept for comparison. */
+static bool dom_parse_weather(const char *body, weather_record_t *record) {
+    json_error_t error;
+    json_t *root = json_loads(body, 0, &error);
+    json_t *currently, *data, *value;
+    size_t index;
+
+    memset(record, 0, sizeof(*record));
+    if (!root)
+        return false;
+
+    currently = json_object_get(root, "currently");
+    if (!currently) {
+        json_decref(root);
+        return false;
+    }
+
+    if (json_string_value(json_object_get(currently, "summary")))
+        mowgli_strlcpy(record->summary, json_string_value(json_object_get(currently, "summary")), sizeof(record->summary));
+    record->temperature = json_number_value(json_object_get(currently, "temperature"));
+    record->apparent_temperature = json_number_value(json_object_get(currently, "apparentTemperature"));
+    record->humidity = json_number_value(json_object_get(currently, "humidity"));
+    record->wind_speed = json_number_value(json_object_get(currently, "windSpeed"));
+    record->wind_bearing = json_number_value(json_object_get(currently, "windBearing"));
+    record->wind_gust = json_number_value(json_object_get(currently, "windGust"));
+    record->dew_point = json_number_value(json_object_get(currently, "dewPoint"));
+    record->uv_index = json_number_value(json_object_get(currently, "uvIndex"));
+
+    data = json_object_get(json_object_get(root, "daily"), "data");
+    record->sunrise = json_integer_value(json_object_get(json_array_get(data, 0), "sunriseTime"));
+    record->sunset = json_integer_value(json_object_get(json_array_get(data, 0), "sunsetTime"));
+
+    json_array_foreach(data, index, value) {
+        weather_day_t *day;
+
+        if (index >= WEATHER_MAX_DAYS)
+            break;
+        day = &record->days[index];
+        day->time = json_integer_value(json_object_get(value, "time"));
+        if (json_string_value(json_object_get(value, "summary")))
+            mowgli_strlcpy(day->summary, json_string_value(json_object_get(value, "summary")), sizeof(day->summary));
+        day->temp_high = json_number_value(json_object_get(value, "temperatureHigh"));
+        day->temp_low = json_number_value(json_object_get(value, "temperatureLow"));
+        record->day_count = index + 1;
+    }
+
+    json_decref(root);
+    return true;
+}
+
+static int dom_parse_geocode(const char *body, OpenCage *result) {
+    json_error_t error;
+    json_t *root = json_loads(body, 0, &error);
+    json_t *results, *first, *geometry;
+    const char *formatted;
+
+    if (!root)
+        return result->error_code = 2;
+
+    results = json_object_get(root, "results");
+    if (!results) {
+        json_decref(root);
+        return result->error_code = 3;
+    }
+
+    first = json_array_get(results, 0);
+    formatted = json_string_value(json_object_get(first, "formatted"));
+    if (!formatted) {
+        json_decref(root);
+        return result->error_code = 4;
+    }
+
+    geometry = json_object_get(first, "geometry");
+    if (!json_object_get(geometry, "lat") || !json_object_get(geometry, "lng")) {
+        json_decref(root);
+        return result->error_code = 5;
+    }
+
+    snprintf(result->location, sizeof(result->location), "%s", formatted);
+    result->lat = json_number_value(json_object_get(geometry, "lat"));
+    result->lng = json_number_value(json_object_get(geometry, "lng"));
+    json_decref(root);
+    return result->error_code = 0;
+}
+
+static bool stream_parse_weather(const char *body, size_t len, size_t chunk, weather_record_t *record) {
+    static weather_parse_t wp;
+    size_t off;
+    bool ok;
+
+    weather_parse_init(&wp);
+    for (off = 0; off < len; off += chunk)
+        json_stream_feed(&wp.stream, body + off, len - off < chunk ? len - off : chunk);
+    ok = weather_parse_finish(&wp);
+    *record = wp.record;
+    return ok;
+}
+
+static int stream_parse_geocode(const char *body, size_t len, size_t chunk, OpenCage *result) {
+    geocode_parse_t gp;
+    size_t off;
+
+    geocode_parse_init(&gp);
+    for (off = 0; off < len; off += chunk)
+        json_stream_feed(&gp.stream, body + off, len - off < chunk ? len - off : chunk);
+    return geocode_parse_finish(&gp, result);
+}
+
+static bool records_match(const weather_record_t *a, const weather_record_t *b) {
+    if (strcmp(a->summary, b->summary) || a->temperature != b->temperature ||
+        a->apparent_temperature != b->apparent_temperature || a->humidity != b->humidity ||
+        a->wind_speed != b->wind_speed || a->wind_bearing != b->wind_bearing ||
+        a->wind_gust != b->wind_gust || a->dew_point != b->dew_point ||
+        a->uv_index != b->uv_index || a->sunrise != b->sunrise || a->sunset != b->sunset ||
+        a->day_count != b->day_count)
+        return false;
+
+    for (int i = 0; i < a->day_count; i++) {
+        if (a->days[i].time != b->days[i].time || strcmp(a->days[i].summary, b->days[i].summary) ||
+            a->days[i].temp_high != b->days[i].temp_high || a->days[i].temp_low != b->days[i].temp_low)
+            return false;
+    }
+    return true;
+}
+
+static void report(const char *fixture, const char *method, size_t len, int iterations, double elapsed, size_t heap) {
+    double per_op = elapsed / iterations;
+
+    printf("%-22s %-16s %10.0f ns/op %9.1f MB/s %9zu B heap\n",
+           fixture, method, per_op, len / per_op * 1e9 / (1024 * 1024), heap);
+}
+
+static void bench_weather(const char *name, int iterations) {
+    static const size_t chunks[] = { 1024, 16384 };
+    weather_record_t dom, stream;
+    size_t len;
+    char *body = read_fixture(name, &len);
+    double start;
+
+    if (!dom_parse_weather(body, &dom) || !stream_parse_weather(body, len, len, &stream) || !records_match(&dom, &stream)) {
+        fprintf(stderr, "%s: streaming and DOM extraction disagree\n", name);
+        exit(1);
+    }
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        stream_parse_weather(body, len, chunks[c], &stream);
+        if (!records_match(&dom, &stream)) {
+            fprintf(stderr, "%s: chunked (%zu) extraction disagrees\n", name, chunks[c]);
+            exit(1);
+        }
+    }
+
+    heap_peak = heap_current = 0;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        dom_parse_weather(body, &dom);
+    report(name, "jansson", len, iterations, now_ns() - start, heap_peak);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        stream_parse_weather(body, len, len, &stream);
+    report(name, "stream", len, iterations, now_ns() - start, 0);
+
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        char method[32];
+
+        snprintf(method, sizeof(method), "stream/%zuK", chunks[c] / 1024);
+        start = now_ns();
+        for (int i = 0; i < iterations; i++)
+            stream_parse_weather(body, len, chunks[c], &stream);
+        report(name, method, len, iterations, now_ns() - start, 0);
+    }
+
+    free(body);
+}
+
+static void bench_geocode(const char *name, int iterations) {
+    OpenCage dom, stream;
+    size_t len;
+    char *body = read_fixture(name, &len);
+    double start;
+
+    memset(&dom, 0, sizeof(dom));
+    memset(&stream, 0, sizeof(stream));
+    if (dom_parse_geocode(body, &dom) != stream_parse_geocode(body, len, len, &stream) ||
+        (dom.error_code == 0 && (strcmp(dom.location, stream.location) || dom.lat != stream.lat || dom.lng != stream.lng))) {
+        fprintf(stderr, "%s: streaming and DOM extraction disagree\n", name);
+        exit(1);
+    }
+
+    heap_peak = heap_current = 0;
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        dom_parse_geocode(body, &dom);
+    report(name, "jansson", len, iterations, now_ns() - start, heap_peak);
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        stream_parse_geocode(body, len, len, &stream);
+    report(name, "stream", len, iterations, now_ns() - start, 0);
+
+    free(body);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : BENCH_ITERATIONS;
+
+    if (iterations <= 0)
+        iterations = BENCH_ITERATIONS;
+
+    json_set_alloc_funcs(counting_malloc, counting_free);
+
+    printf("%d iterations; streaming parser state is %zu bytes (weather), %zu bytes (geocode)\n\n",
+           iterations, sizeof(weather_parse_t), sizeof(geocode_parse_t));
+
+    bench_weather("pirate_full.json", iterations);
+    bench_weather("pirate_excluded.json", iterations);
+    bench_geocode("opencage_full.json", iterations);
+    bench_geocode("opencage_slim.json", iterations);
+    bench_geocode("opencage_empty.json", iterations);
+
+    return 0;
+}
@@ -0,0 +1,372 @@
+/*
+ * Load generator: drives the module in-process with simulated channels and
+ * users against real HTTP upstreams (normally fake_upstream), and reports
+ * how it holds up.
+ *
+ *   ./load_bench [-c channels] [-u users] [-r rate] [-d secs] [-m w:f:priv]
+ *                [-q fraction] [-k locations] [-g identifies] [-o opencage_url]
+ *                [-p pirate_url] [-n fraction] [-R] [-W] [-G precision] [-j metres]
+ *
+ *   -c  channels the bot sits in (default 10)
+ *   -u  users, each with an account and a saved location (default 100)
+ *   -r  target requests per second (default 50)
+ *   -d  how long to send for; replies are waited on for up to 10s more
+ *   -m  relative weights of !w, !f and private WEATHER (default 50:20:30)
+ *   -q  fraction of requests naming a place instead of using the saved
+ *       location, so they go through geocoding (default 0.5)
+ *   -k  distinct places and saved locations to pick from (default 200)
+ *   -n  fraction of named places that do not exist ("Nowhere 0" to
+ *       "Nowhere 19", which fake_upstream finds nothing for), as someone
+ *       repeating a typo or spamming would send (default 0)
+ *   -g  this many users (at most -u) identify at once with greetings on,
+ *       as after a netsplit, before the requests start
+ *   -R  keep the module's rate limit instead of lifting it
+ *   -W  keep the geocode cache file between runs
+ *   -G  weather cache grid precision in geohash characters (default 6,
+ *       0 for exact lat/long)
+ *   -j  scatter each user's saved lat/long up to this many metres from its
+ *       place, as separate geocodes of one town would be (default 0)
+ *
+ * A user or channel has at most one request outstanding, so each reply can
+ * be matched to its request; a send slot with nobody idle is counted as
+ * saturated rather than queued.  Event-loop stall is the time spent in any
+ * single callback or command handler, i.e. how long the services loop would
+ * have been blocked.
+ */
+#include "../main.c"
+#include "stub.h"
+
+#define LOAD_DRAIN_SECS 10
+#define LOAD_MAX_SAMPLES 1000000
+
+typedef struct {
+    user_t *user;
+    uint64_t sent;      /* ns, 0 when idle */
+    uint64_t identified;    /* ns, until the greeting arrives */
+} load_user_t;
+
+typedef struct {
+    channel_t channel;
+    uint64_t sent;
+} load_channel_t;
+
+static load_user_t *load_users;
+static load_channel_t *load_channels;
+static mowgli_patricia_t *load_targets;   /* reply target -> uint64_t *sent */
+static int user_count = 100, channel_count = 10, place_count = 200;
+static double nowhere_fraction;
+
+static uint64_t *latencies, *stalls, *greet_latencies;
+static size_t latency_count, stall_count, greet_count;
+static unsigned long sent_count, reply_count, error_count, saturated_count, unmatched_count;
+
+static void record(uint64_t *samples, size_t *count, uint64_t value) {
+    if (*count < LOAD_MAX_SAMPLES)
+        samples[(*count)++] = value;
+}
+
+static void on_dispatch(uint64_t ns) {
+    record(stalls, &stall_count, ns);
+}
+
+static void on_reply(const char *target, const char *text) {
+    uint64_t *sent = mowgli_patricia_retrieve(load_targets, target);
+
+    /* a user's greeting comes before any reply to them */
+    if (sent && !*sent) {
+        load_user_t *lu = (load_user_t *)((char *)sent - offsetof(load_user_t, sent));
+
+        if (lu >= load_users && lu < load_users + user_count && lu->identified) {
+            record(greet_latencies, &greet_count, stub_now_ns() - lu->identified);
+            lu->identified = 0;
+            return;
+        }
+    }
+
+    if (!sent || !*sent) {
+        unmatched_count++;
+        return;
+    }
+
+    record(latencies, &latency_count, stub_now_ns() - *sent);
+    *sent = 0;
+    reply_count++;
+
+    /* weather lines start with the location in bold */
+    if (text[0] != '\2')
+        error_count++;
+}
+
+static void place_name(int idx, char *buf, size_t size) {
+    static const char *cities[] = {
+        "Pittsburgh", "New York", "London", "Paris", "Berlin", "Tokyo", "Sydney", "Toronto",
+        "Chicago", "Denver", "Lagos", "Lima", "Oslo", "Cairo", "Mumbai", "Seoul",
+    };
+
+    snprintf(buf, size, "%s %d", cities[idx % 16], idx / 16);
+}
+
+static void send_request(int kind, double query_fraction) {
+    char place[64], line[96];
+    bool named = drand48() < query_fraction;
+    int start, i;
+
+    if (named && drand48() < nowhere_fraction)
+        snprintf(place, sizeof(place), "Nowhere %ld", lrand48() % 20);
+    else if (named)
+        place_name(lrand48() % place_count, place, sizeof(place));
+
+    if (kind == 2) {
+        /* private WEATHER from an idle user */
+        start = lrand48() % user_count;
+        for (i = 0; i < user_count && load_users[(start + i) % user_count].sent; i++)
+            ;
+        if (i == user_count) {
+            saturated_count++;
+            return;
+        }
+
+        load_user_t *lu = &load_users[(start + i) % user_count];
+        sourceinfo_t si = { lu->user, lu->user->myuser, weather };
+        char *parv[1] = { named ? place : NULL };
+        uint64_t begin = stub_now_ns();
+
+        lu->sent = begin;
+        sent_count++;
+        ws_cmd_weather(&si, named ? 1 : 0, parv);
+        on_dispatch(stub_now_ns() - begin);
+        return;
+    }
+
+    /* !w or !f in an idle channel from any user */
+    start = lrand48() % channel_count;
+    for (i = 0; i < channel_count && load_channels[(start + i) % channel_count].sent; i++)
+        ;
+    if (i == channel_count) {
+        saturated_count++;
+        return;
+    }
+
+    load_channel_t *lc = &load_channels[(start + i) % channel_count];
+    snprintf(line, sizeof(line), "%s%s%s", kind == 0 ? "!w" : "!f", named ? " " : "", named ? place : "");
+    hook_cmessage_data_t data = { load_users[lrand48() % user_count].user, &lc->channel, line };
+    uint64_t begin = stub_now_ns();
+
+    lc->sent = begin;
+    sent_count++;
+    on_channel_message(&data);
+    on_dispatch(stub_now_ns() - begin);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_samples(const char *name, uint64_t *samples, size_t count, double unit, const char *unit_name) {
+    if (!count) {
+        printf("%-12s no samples\n", name);
+        return;
+    }
+
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    printf("%-12s p50 %.2f%s  p90 %.2f%s  p99 %.2f%s  max %.2f%s  (%zu samples)\n", name,
+           samples[count / 2] / unit, unit_name, samples[count * 9 / 10] / unit, unit_name,
+           samples[count * 99 / 100] / unit, unit_name, samples[count - 1] / unit, unit_name, count);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-c channels] [-u users] [-r rate] [-d secs] [-m w:f:priv] [-q fraction] [-k locations] [-g identifies] [-o url] [-p url] [-M url] [-n fraction] [-R] [-W] [-w queue] [-G precision] [-j metres]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *opencage = "http://127.0.0.1:8089/geocode/v1/json";
+    const char *pirate = "http://127.0.0.1:8089/forecast";
+    const char *openmeteo = "http://127.0.0.1:8089/v1/forecast";
+    double rate = 50, query_fraction = 0.5;
+    int duration = 30, weights[3] = { 50, 20, 30 }, identifies = 0, opt;
+    bool keep_ratelimit = false, warm = false;
+    int worker_queue = 0;
+    double jitter = 0;
+    uint64_t start, end, next_send, busy = 0;
+
+    while ((opt = getopt(argc, argv, "c:u:r:d:m:q:k:g:o:p:M:n:RWw:G:j:")) != -1) {
+        switch (opt) {
+        case 'c': channel_count = atoi(optarg); break;
+        case 'u': user_count = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'm': if (sscanf(optarg, "%d:%d:%d", &weights[0], &weights[1], &weights[2]) != 3) usage(argv[0]); break;
+        case 'q': query_fraction = atof(optarg); break;
+        case 'k': place_count = atoi(optarg); break;
+        case 'g': identifies = atoi(optarg); break;
+        case 'o': opencage = optarg; break;
+        case 'p': pirate = optarg; break;
+        case 'M': openmeteo = optarg; break;
+        case 'n': nowhere_fraction = atof(optarg); break;
+        case 'R': keep_ratelimit = true; break;
+        case 'W': warm = true; break;
+        case 'w': worker_queue = atoi(optarg); break;
+        case 'G': weather_cache_precision = atoi(optarg); break;
+        case 'j': jitter = atof(optarg) / 111320; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (channel_count <= 0 || user_count <= 0 || rate <= 0 || place_count <= 0 || weights[0] + weights[1] + weights[2] <= 0)
+        usage(argv[0]);
+
+    srand48(time(NULL));
+    latencies = malloc(LOAD_MAX_SAMPLES * sizeof(uint64_t));
+    stalls = malloc(LOAD_MAX_SAMPLES * sizeof(uint64_t));
+    greet_latencies = malloc(LOAD_MAX_SAMPLES * sizeof(uint64_t));
+    load_targets = mowgli_patricia_create(strcasecanon);
+    if (!warm)
+        unlink(GEOCODE_CACHE_FILE);
+
+    weather = service_add("weather", NULL);
+    weather_opencage_url = strdup(opencage);
+    weather_pirate_url = strdup(pirate);
+    weather_openmeteo_url = strdup(openmeteo);
+    if (!keep_ratelimit) {
+        for (int i = 0; i < RATE_LIMIT_LEVELS; i++)
+            rate_limit_settings[i].rate = 0;
+    }
+
+    init_rate_limit();
+    init_fetch_engine();
+    init_fetch_worker();
+    if (worker_queue > 0) {
+        weather_worker_enabled = true;
+        weather_worker_queue = worker_queue;
+        weather_worker_configure(NULL);
+    }
+    init_weather_keys();
+    init_geocode_cache();
+    init_negative_cache();
+    init_weather_templates();
+    init_greet_queue();
+
+    load_users = calloc(user_count, sizeof(load_user_t));
+    for (int i = 0; i < user_count; i++) {
+        char nick[32], place[64], latlong[64];
+
+        snprintf(nick, sizeof(nick), "user%d", i);
+        load_users[i].user = stub_user_add(nick);
+        place_name(i % place_count, place, sizeof(place));
+        snprintf(latlong, sizeof(latlong), "%f,%f", (i % place_count) * 0.37 - 37 + (drand48() * 2 - 1) * jitter,
+            (i % place_count) * 0.91 - 91 + (drand48() * 2 - 1) * jitter);
+        metadata_add(load_users[i].user->myuser, "private:weather:location", place);
+        metadata_add(load_users[i].user->myuser, "private:weather:latlong", latlong);
+        mowgli_patricia_add(load_targets, nick, &load_users[i].sent);
+    }
+
+    /* after the users, so their saved locations are indexed */
+    init_weather_cache();
+
+    load_channels = calloc(channel_count, sizeof(load_channel_t));
+    for (int i = 0; i < channel_count; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "#load%d", i);
+        load_channels[i].channel.name = strdup(name);
+        mowgli_patricia_add(load_targets, name, &load_channels[i].sent);
+    }
+
+    stub_reply_hook = on_reply;
+    stub_dispatch_hook = on_dispatch;
+
+    printf("%d channels, %d users, %.0f req/s for %ds against %s and %s\n", channel_count, user_count, rate, duration, opencage, pirate);
+
+    if (identifies > user_count)
+        identifies = user_count;
+    for (int i = 0; i < identifies; i++) {
+        uint64_t begin = stub_now_ns();
+
+        weather_settings_set_greet(load_users[i].user->myuser, true);
+        load_users[i].identified = begin;
+        on_user_identify(load_users[i].user);
+        on_dispatch(stub_now_ns() - begin);
+    }
+
+    start = stub_now_ns();
+    end = start + (uint64_t)duration * 1000000000;
+    next_send = start;
+    for (;;) {
+        uint64_t now = stub_now_ns(), loop_start;
+        int timeout;
+
+        if (now < end) {
+            while (next_send <= now) {
+                int pick = lrand48() % (weights[0] + weights[1] + weights[2]);
+
+                send_request(pick < weights[0] ? 0 : pick < weights[0] + weights[1] ? 1 : 2, query_fraction);
+                next_send += (uint64_t)(1e9 / rate);
+            }
+        } else if ((reply_count >= sent_count && !greet_order.head) || now >= end + (uint64_t)LOAD_DRAIN_SECS * 1000000000) {
+            break;
+        }
+
+        timeout = now < end ? (int)((next_send - now) / 1000000) : 50;
+        if (timeout > 50)
+            timeout = 50;
+
+        stub_poll(timeout);
+        loop_start = stub_now_ns();
+        stub_run_timers();
+        busy += stub_now_ns() - loop_start;
+    }
+
+    double elapsed = (stub_now_ns() - start) / 1e9;
+    for (size_t i = 0; i < stall_count; i++)
+        busy += stalls[i];
+
+    printf("\nsent %lu (%.1f/s), replies %lu, error replies %lu, unanswered %lu, saturated %lu, unmatched %lu\n",
+           sent_count, sent_count / (double)duration, reply_count, error_count, sent_count - reply_count, saturated_count, unmatched_count);
+    report_samples("reply", latencies, latency_count, 1e6, "ms");
+    if (identifies) {
+        printf("greetings    %zu of %d sent, %u dropped, %u fetches\n", greet_count, identifies, greet_dropped, greet_fetches);
+        report_samples("greeting", greet_latencies, greet_count, 1e6, "ms");
+    }
+    report_samples("loop stall", stalls, stall_count, 1e3, "us");
+    printf("loop busy    %.2f%% of %.1fs\n", 100.0 * busy / 1e9 / elapsed, elapsed);
+
+    printf("\nupstreams:\n");
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++) {
+        weather_upstream_t *u = &weather_upstreams[i];
+
+        printf("  %-14s requests %u  connects %u  reused %u  received %llu KiB\n", u->name, u->requests, u->connects, u->reused,
+               (unsigned long long)u->bytes_received / 1024);
+        printf("  %-14s timeout %ld ms  timed out %u  breaker %s, opened %u, probes %u, refused %u\n", "", weather_upstream_timeout(u),
+               u->curl_errors[CURLE_OPERATION_TIMEDOUT], weather_breaker_names[u->breaker], u->opened, u->probes, u->breaker_rejected);
+    }
+    printf("weather cache  hits %u  misses %u  coalesced %u  shared %u  cells %u\n", weather_cache_hits, weather_cache_misses, weather_cache_coalesced,
+        weather_cache_shared, weather_cells);
+    printf("geocode cache  hits %u  misses %u\n", geocode_cache_hits, geocode_cache_misses);
+    printf("negative cache answered %u  filter skips %u  false positives %u  no results %u\n", negative_cache_hits, negative_cache_skips,
+        negative_cache_false_positives, negative_cache_failures[NEGATIVE_NO_RESULTS]);
+    printf("hedging        armed %u  failovers %u\n", weather_hedge_armed, weather_hedge_failovers);
+    for (int i = 0; i < WEATHER_PROVIDER_COUNT; i++) {
+        weather_provider_t *p = &weather_providers[i];
+
+        printf("  %-14s requests %u  failed %u  hedges %u  wins %u  p50 %.0f ms  p90 %.0f ms\n", p->name, p->requests, p->failures,
+               p->hedges, p->wins, weather_provider_percentile(p, 50) / 1000.0, weather_provider_percentile(p, 90) / 1000.0);
+    }
+    if (worker_queue > 0)
+        printf("fetch worker   sent %u  answered %u  refused %u  rerun %u  restarts %u\n", weather_worker.sent, weather_worker.completed,
+               weather_worker.refused, weather_worker.rerun, weather_worker.restarts);
+
+    stub_reply_hook = NULL;
+    deinit_rate_limit();
+    deinit_fetch_engine();
+    deinit_fetch_worker();
+    deinit_weather_keys();
+    deinit_greet_queue();
+    deinit_geocode_cache();
+    deinit_weather_cache();
+    deinit_negative_cache();
+    deinit_weather_templates();
+    if (!warm)
+        unlink(GEOCODE_CACHE_FILE);
+    return 0;
+}
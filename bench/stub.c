@@ -0,0 +1,773 @@
+/*
+ * Implementations behind bench/atheme.h.  Everything is in-process:
+ * messages are recorded instead of sent, and timers and pollables only run
+ * when the driver calls stub_run_timers() or stub_poll().
+ */
+#include "atheme.h"
+#include "stub.h"
+
+#include <poll.h>
+#include <sys/wait.h>
+
+mowgli_eventloop_t *base_eventloop;
+static ircd_t stub_ircd;
+ircd_t *ircd = &stub_ircd;
+
+bool stub_verbose;
+char stub_last_reply[8192];
+unsigned long stub_replies;
+void (*stub_reply_hook)(const char *target, const char *text);
+void (*stub_dispatch_hook)(uint64_t ns);
+
+uint64_t stub_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void slog(unsigned int level, const char *fmt, ...) {
+    va_list args;
+
+    if (!stub_verbose)
+        return;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+/* lists */
+mowgli_node_t *mowgli_node_create(void) {
+    return calloc(1, sizeof(mowgli_node_t));
+}
+
+void mowgli_node_free(mowgli_node_t *n) {
+    free(n);
+}
+
+void mowgli_node_add(void *data, mowgli_node_t *n, mowgli_list_t *l) {
+    n->data = data;
+    n->next = NULL;
+    n->prev = l->tail;
+    if (l->tail)
+        l->tail->next = n;
+    else
+        l->head = n;
+    l->tail = n;
+    l->count++;
+}
+
+void mowgli_node_add_head(void *data, mowgli_node_t *n, mowgli_list_t *l) {
+    n->data = data;
+    n->prev = NULL;
+    n->next = l->head;
+    if (l->head)
+        l->head->prev = n;
+    else
+        l->tail = n;
+    l->head = n;
+    l->count++;
+}
+
+void mowgli_node_add_before(void *data, mowgli_node_t *n, mowgli_list_t *l, mowgli_node_t *before) {
+    if (!before) {
+        mowgli_node_add(data, n, l);
+        return;
+    }
+    if (!before->prev) {
+        mowgli_node_add_head(data, n, l);
+        return;
+    }
+    n->data = data;
+    n->prev = before->prev;
+    n->next = before;
+    before->prev->next = n;
+    before->prev = n;
+    l->count++;
+}
+
+void mowgli_node_delete(mowgli_node_t *n, mowgli_list_t *l) {
+    if (n->prev)
+        n->prev->next = n->next;
+    else
+        l->head = n->next;
+    if (n->next)
+        n->next->prev = n->prev;
+    else
+        l->tail = n->prev;
+    n->next = n->prev = NULL;
+    l->count--;
+}
+
+/* patricia */
+#define STUB_BUCKETS 1024
+
+typedef struct stub_leaf_ {
+    struct stub_leaf_ *next;
+    char *key;
+    void *data;
+} stub_leaf_t;
+
+struct mowgli_patricia_ {
+    void (*canon)(char *key);
+    stub_leaf_t *buckets[STUB_BUCKETS];
+    unsigned int count;
+};
+
+static unsigned int stub_hash(const char *key) {
+    unsigned int h = 2166136261u;
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    return h % STUB_BUCKETS;
+}
+
+static char *stub_canon(mowgli_patricia_t *dict, const char *key) {
+    char *ckey = strdup(key);
+    if (dict->canon)
+        dict->canon(ckey);
+    return ckey;
+}
+
+mowgli_patricia_t *mowgli_patricia_create(void (*canonize_cb)(char *key)) {
+    mowgli_patricia_t *dict = calloc(1, sizeof(mowgli_patricia_t));
+    dict->canon = canonize_cb;
+    return dict;
+}
+
+static stub_leaf_t **stub_find(mowgli_patricia_t *dict, const char *ckey) {
+    stub_leaf_t **leaf = &dict->buckets[stub_hash(ckey)];
+    while (*leaf && strcmp((*leaf)->key, ckey))
+        leaf = &(*leaf)->next;
+    return leaf;
+}
+
+bool mowgli_patricia_add(mowgli_patricia_t *dict, const char *key, void *data) {
+    char *ckey = stub_canon(dict, key);
+    stub_leaf_t **slot = stub_find(dict, ckey);
+
+    if (*slot) {
+        free(ckey);
+        return false;
+    }
+
+    *slot = calloc(1, sizeof(stub_leaf_t));
+    (*slot)->key = ckey;
+    (*slot)->data = data;
+    dict->count++;
+    return true;
+}
+
+void *mowgli_patricia_retrieve(mowgli_patricia_t *dict, const char *key) {
+    char *ckey = stub_canon(dict, key);
+    stub_leaf_t *leaf = *stub_find(dict, ckey);
+    free(ckey);
+    return leaf ? leaf->data : NULL;
+}
+
+void *mowgli_patricia_delete(mowgli_patricia_t *dict, const char *key) {
+    char *ckey = stub_canon(dict, key);
+    stub_leaf_t **slot = stub_find(dict, ckey);
+    stub_leaf_t *leaf = *slot;
+    void *data = NULL;
+
+    free(ckey);
+    if (leaf) {
+        *slot = leaf->next;
+        data = leaf->data;
+        free(leaf->key);
+        free(leaf);
+        dict->count--;
+    }
+    return data;
+}
+
+void mowgli_patricia_destroy(mowgli_patricia_t *dict, void (*destroy_cb)(const char *key, void *data, void *privdata), void *privdata) {
+    for (int i = 0; i < STUB_BUCKETS; i++) {
+        stub_leaf_t *leaf = dict->buckets[i], *next;
+        for (; leaf; leaf = next) {
+            next = leaf->next;
+            if (destroy_cb)
+                destroy_cb(leaf->key, leaf->data, privdata);
+            free(leaf->key);
+            free(leaf);
+        }
+    }
+    free(dict);
+}
+
+unsigned int mowgli_patricia_size(mowgli_patricia_t *dict) {
+    return dict->count;
+}
+
+/* The next leaf is found before the current one is handed out, so the
+ * current element may be deleted during iteration like with mowgli. */
+static void stub_iter_advance(mowgli_patricia_t *dict, mowgli_patricia_iteration_state_t *state) {
+    stub_leaf_t *next = state->pspare[1];
+
+    state->pspare[0] = next;
+    if (next && next->next) {
+        state->pspare[1] = next->next;
+        return;
+    }
+
+    state->pspare[1] = NULL;
+    while (++state->ispare[0] < STUB_BUCKETS) {
+        if (dict->buckets[state->ispare[0]]) {
+            state->pspare[1] = dict->buckets[state->ispare[0]];
+            return;
+        }
+    }
+}
+
+void mowgli_patricia_foreach_start(mowgli_patricia_t *dict, mowgli_patricia_iteration_state_t *state) {
+    memset(state, 0, sizeof(*state));
+    state->ispare[0] = -1;
+    stub_iter_advance(dict, state);
+    stub_iter_advance(dict, state);
+}
+
+void *mowgli_patricia_foreach_cur(mowgli_patricia_t *dict, mowgli_patricia_iteration_state_t *state) {
+    stub_leaf_t *leaf = state->pspare[0];
+    return leaf ? leaf->data : NULL;
+}
+
+void mowgli_patricia_foreach_next(mowgli_patricia_t *dict, mowgli_patricia_iteration_state_t *state) {
+    stub_iter_advance(dict, state);
+}
+
+void strcasecanon(char *str) {
+    for (; *str; str++)
+        *str = tolower((unsigned char)*str);
+}
+
+size_t mowgli_strlcpy(char *dest, const char *src, size_t size) {
+    size_t len = strlen(src);
+
+    if (size) {
+        size_t n = len >= size ? size - 1 : len;
+        memcpy(dest, src, n);
+        dest[n] = '\0';
+    }
+    return len;
+}
+
+size_t mowgli_strlcat(char *dest, const char *src, size_t size) {
+    size_t dlen = strnlen(dest, size);
+
+    if (dlen == size)
+        return size + strlen(src);
+    return dlen + mowgli_strlcpy(dest + dlen, src, size - dlen);
+}
+
+int irccasecmp(const char *s1, const char *s2) {
+    return strcasecmp(s1, s2);
+}
+
+/* event loop */
+struct mowgli_eventloop_timer_ {
+    mowgli_event_dispatch_func_t *func;
+    void *arg;
+    time_t frequency;
+    time_t deadline;
+    bool once;
+    mowgli_node_t node;
+};
+
+static mowgli_list_t stub_timers;
+static void stub_reap_children(void);
+time_t stub_now;
+
+static mowgli_eventloop_timer_t *stub_timer_add(mowgli_event_dispatch_func_t *func, void *arg, time_t when, bool once) {
+    mowgli_eventloop_timer_t *timer = calloc(1, sizeof(*timer));
+
+    timer->func = func;
+    timer->arg = arg;
+    timer->frequency = when;
+    timer->deadline = CURRTIME + when;
+    timer->once = once;
+    mowgli_node_add(timer, &timer->node, &stub_timers);
+    return timer;
+}
+
+mowgli_eventloop_timer_t *mowgli_timer_add(mowgli_eventloop_t *eventloop, const char *name, mowgli_event_dispatch_func_t *func, void *arg, time_t when) {
+    return stub_timer_add(func, arg, when, false);
+}
+
+mowgli_eventloop_timer_t *mowgli_timer_add_once(mowgli_eventloop_t *eventloop, const char *name, mowgli_event_dispatch_func_t *func, void *arg, time_t when) {
+    return stub_timer_add(func, arg, when, true);
+}
+
+void mowgli_timer_destroy(mowgli_eventloop_t *eventloop, mowgli_eventloop_timer_t *timer) {
+    if (!timer)
+        return;
+    mowgli_node_delete(&timer->node, &stub_timers);
+    free(timer);
+}
+
+/* Runs every timer that is due, after reaping finished children; returns
+ * how many timers ran.  The scan restarts after each callback since it may
+ * add or destroy timers. */
+int stub_run_timers(void) {
+    mowgli_node_t *n;
+    int ran = 0;
+
+    stub_reap_children();
+restart:
+    MOWGLI_ITER_FOREACH(n, stub_timers.head) {
+        mowgli_eventloop_timer_t *timer = n->data;
+
+        if (timer->deadline > CURRTIME)
+            continue;
+
+        uint64_t start = stub_now_ns();
+
+        ran++;
+        if (timer->once) {
+            mowgli_node_delete(&timer->node, &stub_timers);
+            timer->func(timer->arg);
+            free(timer);
+        } else {
+            timer->deadline = CURRTIME + timer->frequency;
+            timer->func(timer->arg);
+        }
+        if (stub_dispatch_hook)
+            stub_dispatch_hook(stub_now_ns() - start);
+        goto restart;
+    }
+    return ran;
+}
+
+typedef struct {
+    mowgli_eventloop_pollable_t pollable;
+    mowgli_node_t node;
+} stub_pollable_t;
+
+static mowgli_list_t stub_pollables;
+
+mowgli_eventloop_pollable_t *mowgli_pollable_create(mowgli_eventloop_t *eventloop, int fd, void *userdata) {
+    stub_pollable_t *sp = calloc(1, sizeof(*sp));
+
+    sp->pollable.fd = fd;
+    sp->pollable.userdata = userdata;
+    mowgli_node_add(sp, &sp->node, &stub_pollables);
+    return &sp->pollable;
+}
+
+void mowgli_pollable_destroy(mowgli_eventloop_t *eventloop, mowgli_eventloop_pollable_t *pollable) {
+    stub_pollable_t *sp = (stub_pollable_t *)pollable;
+
+    mowgli_node_delete(&sp->node, &stub_pollables);
+    free(sp);
+}
+
+void mowgli_pollable_setselect(mowgli_eventloop_t *eventloop, mowgli_eventloop_pollable_t *pollable, mowgli_eventloop_io_dir_t dir, mowgli_eventloop_io_cb_t *event_function) {
+    if (dir == MOWGLI_EVENTLOOP_IO_READ)
+        pollable->read_function = event_function;
+    else
+        pollable->write_function = event_function;
+}
+
+mowgli_eventloop_pollable_t *mowgli_eventloop_io_pollable(mowgli_eventloop_io_t *io) {
+    return io;
+}
+
+/* Waits up to timeout_ms for pollable events and dispatches them; returns
+ * how many callbacks ran.  Timers are left to stub_run_timers(). */
+int stub_poll(int timeout_ms) {
+    struct pollfd fds[1024];
+    mowgli_eventloop_pollable_t *owners[1024];
+    mowgli_node_t *n;
+    int count = 0, ran = 0;
+
+    MOWGLI_ITER_FOREACH(n, stub_pollables.head) {
+        stub_pollable_t *sp = n->data;
+
+        if (sp->pollable.fd < 0 || (!sp->pollable.read_function && !sp->pollable.write_function))
+            continue;
+        if (count == (int)(sizeof(fds) / sizeof(fds[0])))
+            break;
+        fds[count].fd = sp->pollable.fd;
+        fds[count].events = (sp->pollable.read_function ? POLLIN : 0) | (sp->pollable.write_function ? POLLOUT : 0);
+        fds[count].revents = 0;
+        owners[count++] = &sp->pollable;
+    }
+
+    if (poll(fds, count, timeout_ms) <= 0)
+        return 0;
+
+    for (int i = 0; i < count; i++) {
+        mowgli_eventloop_pollable_t *pollable = owners[i];
+        uint64_t start;
+
+        if (!fds[i].revents)
+            continue;
+
+        /* an earlier callback may have unregistered it; pollables are only
+         * freed from timers, so the pointer itself is still good */
+        start = stub_now_ns();
+        if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && pollable->read_function && pollable->fd == fds[i].fd) {
+            pollable->read_function(base_eventloop, pollable, MOWGLI_EVENTLOOP_IO_READ, pollable->userdata);
+            ran++;
+        }
+        if ((fds[i].revents & (POLLOUT | POLLHUP | POLLERR)) && pollable->write_function && pollable->fd == fds[i].fd) {
+            pollable->write_function(base_eventloop, pollable, MOWGLI_EVENTLOOP_IO_WRITE, pollable->userdata);
+            ran++;
+        }
+        if (stub_dispatch_hook)
+            stub_dispatch_hook(stub_now_ns() - start);
+    }
+    return ran;
+}
+
+time_t mowgli_eventloop_get_time(mowgli_eventloop_t *eventloop) {
+    return stub_now ? stub_now : time(NULL);
+}
+
+/* configuration: defaults are applied, nothing is parsed */
+void add_uint_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, unsigned int *var, unsigned int min, unsigned int max, unsigned int def) {
+    *var = def;
+}
+
+void add_bool_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, bool *var, bool def) {
+    *var = def;
+}
+
+void add_dupstr_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, char **var, const char *def) {
+    *var = def ? strdup(def) : NULL;
+}
+
+void add_duration_conf_item(const char *name, mowgli_list_t *conflist, unsigned int flags, unsigned int *var, const char *defunit, unsigned int def) {
+    *var = def;
+}
+
+void add_conf_item(const char *name, mowgli_list_t *conflist, int (*handler)(mowgli_config_file_entry_t *)) {
+}
+
+void del_conf_item(const char *name, mowgli_list_t *conflist) {
+}
+
+void conf_report_warning(mowgli_config_file_entry_t *ce, const char *fmt, ...) {
+}
+
+/* metadata and private data, kept on the myuser */
+typedef struct {
+    metadata_t md;
+    mowgli_node_t node;
+} stub_metadata_t;
+
+metadata_t *metadata_find(void *target, const char *name) {
+    myuser_t *mu = target;
+    mowgli_node_t *n;
+
+    if (!mu)
+        return NULL;
+
+    MOWGLI_ITER_FOREACH(n, mu->metadata.head) {
+        stub_metadata_t *smd = n->data;
+        if (!strcmp(smd->md.name, name))
+            return &smd->md;
+    }
+    return NULL;
+}
+
+metadata_t *metadata_add(void *target, const char *name, const char *value) {
+    myuser_t *mu = target;
+    stub_metadata_t *smd;
+
+    metadata_delete(target, name);
+    smd = calloc(1, sizeof(*smd));
+    smd->md.name = strdup(name);
+    smd->md.value = strdup(value);
+    mowgli_node_add(smd, &smd->node, &mu->metadata);
+    return &smd->md;
+}
+
+void metadata_delete(void *target, const char *name) {
+    myuser_t *mu = target;
+    stub_metadata_t *smd = (stub_metadata_t *)metadata_find(target, name);
+
+    if (!smd)
+        return;
+    mowgli_node_delete(&smd->node, &mu->metadata);
+    free(smd->md.name);
+    free(smd->md.value);
+    free(smd);
+}
+
+typedef struct {
+    char *key;
+    void *data;
+    mowgli_node_t node;
+} stub_privdata_t;
+
+static stub_privdata_t *stub_privdata_find(myuser_t *mu, const char *key) {
+    mowgli_node_t *n;
+
+    MOWGLI_ITER_FOREACH(n, mu->privatedata.head) {
+        stub_privdata_t *pd = n->data;
+        if (!strcmp(pd->key, key))
+            return pd;
+    }
+    return NULL;
+}
+
+void *privatedata_get(void *target, const char *key) {
+    stub_privdata_t *pd = stub_privdata_find(target, key);
+    return pd ? pd->data : NULL;
+}
+
+void privatedata_set(void *target, const char *key, void *data) {
+    myuser_t *mu = target;
+    stub_privdata_t *pd = stub_privdata_find(mu, key);
+
+    if (!pd) {
+        pd = calloc(1, sizeof(*pd));
+        pd->key = strdup(key);
+        mowgli_node_add(pd, &pd->node, &mu->privatedata);
+    }
+    pd->data = data;
+}
+
+void *privatedata_delete(void *target, const char *key) {
+    myuser_t *mu = target;
+    stub_privdata_t *pd = stub_privdata_find(mu, key);
+    void *data;
+
+    if (!pd)
+        return NULL;
+    data = pd->data;
+    mowgli_node_delete(&pd->node, &mu->privatedata);
+    free(pd->key);
+    free(pd);
+    return data;
+}
+
+/* output is recorded, the last line is kept for inspection */
+static void stub_record(const char *target, const char *fmt, va_list args) {
+    vsnprintf(stub_last_reply, sizeof(stub_last_reply), fmt, args);
+    stub_replies++;
+    if (stub_verbose)
+        fprintf(stderr, "-> %s: %s\n", target, stub_last_reply);
+    if (stub_reply_hook)
+        stub_reply_hook(target, stub_last_reply);
+}
+
+void msg(const char *from, const char *target, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    stub_record(target, fmt, args);
+    va_end(args);
+}
+
+void notice(const char *from, const char *target, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    stub_record(target, fmt, args);
+    va_end(args);
+}
+
+void command_fail(sourceinfo_t *si, cmd_faultcode_t code, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    stub_record(si && si->su ? si->su->nick : "", fmt, args);
+    va_end(args);
+}
+
+void command_success_nodata(sourceinfo_t *si, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    stub_record(si && si->su ? si->su->nick : "", fmt, args);
+    va_end(args);
+}
+
+/* users and channels: "bench" always exists, drivers may add more */
+static myuser_t stub_myuser = { .ent = { "bench" } };
+struct me me = { .connected = true };
+
+static user_t stub_user = { .nick = "bench", .user = "bench", .host = "bench.example", .vhost = "bench.example", .ip = "127.0.0.1", .myuser = &stub_myuser };
+static mowgli_patricia_t *stub_users;
+
+myuser_t *stub_account(void) {
+    return &stub_myuser;
+}
+
+user_t *stub_client(void) {
+    return &stub_user;
+}
+
+/* Adds an identified user whose account has the same name, on its own host. */
+user_t *stub_user_add(const char *nick) {
+    user_t *u = calloc(1, sizeof(user_t));
+    myuser_t *mu = calloc(1, sizeof(myuser_t));
+    char host[HOSTLEN];
+
+    if (!stub_users)
+        stub_users = mowgli_patricia_create(strcasecanon);
+
+    mowgli_strlcpy(mu->ent.name, nick, sizeof(mu->ent.name));
+    u->nick = strdup(nick);
+    u->user = u->nick;
+    snprintf(host, sizeof(host), "%s.bench.example", nick);
+    u->host = strdup(host);
+    u->vhost = u->host;
+    u->ip = "127.0.0.1";
+    u->myuser = mu;
+    mowgli_patricia_add(stub_users, nick, u);
+    return u;
+}
+
+void join(const char *chan, const char *nick) {
+}
+
+void part(const char *chan, const char *nick) {
+}
+
+/* Children are reaped from stub_run_timers(), standing in for SIGCHLD. */
+typedef struct {
+    pid_t pid;
+    void (*cb)(pid_t pid, int status, void *data);
+    void *data;
+    mowgli_node_t node;
+} stub_child_t;
+
+static mowgli_list_t stub_children;
+
+void childproc_add(pid_t pid, const char *desc, void (*cb)(pid_t pid, int status, void *data), void *data) {
+    stub_child_t *child = calloc(1, sizeof(*child));
+
+    child->pid = pid;
+    child->cb = cb;
+    child->data = data;
+    mowgli_node_add(child, &child->node, &stub_children);
+}
+
+void childproc_delete_all(void (*cb)(pid_t pid, int status, void *data)) {
+    mowgli_node_t *n, *tn;
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, stub_children.head) {
+        stub_child_t *child = n->data;
+
+        if (child->cb == cb) {
+            mowgli_node_delete(&child->node, &stub_children);
+            free(child);
+        }
+    }
+}
+
+static void stub_reap_children(void) {
+    mowgli_node_t *n, *tn;
+    int status;
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, stub_children.head) {
+        stub_child_t *child = n->data;
+
+        if (waitpid(child->pid, &status, WNOHANG) != child->pid)
+            continue;
+        mowgli_node_delete(&child->node, &stub_children);
+        child->cb(child->pid, status, child->data);
+        free(child);
+    }
+}
+
+channel_t *channel_find(const char *name) {
+    return NULL;
+}
+
+chanuser_t *chanuser_find(channel_t *chan, user_t *user) {
+    return NULL;
+}
+
+user_t *user_find_named(const char *nick) {
+    if (!strcasecmp(nick, stub_user.nick))
+        return &stub_user;
+    return stub_users ? mowgli_patricia_retrieve(stub_users, nick) : NULL;
+}
+
+/* accounts are those of the users added by stub_user_add() */
+void myentity_foreach_start(myentity_iteration_state_t *state, myentity_type_t type) {
+    state->type = type;
+    if (stub_users)
+        mowgli_patricia_foreach_start(stub_users, &state->st);
+}
+
+myentity_t *myentity_foreach_cur(myentity_iteration_state_t *state) {
+    user_t *u = stub_users ? mowgli_patricia_foreach_cur(stub_users, &state->st) : NULL;
+
+    return u ? entity(u->myuser) : NULL;
+}
+
+void myentity_foreach_next(myentity_iteration_state_t *state) {
+    if (stub_users)
+        mowgli_patricia_foreach_next(stub_users, &state->st);
+}
+
+myuser_t *myuser_find(const char *name) {
+    user_t *u;
+
+    if (!strcasecmp(name, stub_myuser.ent.name))
+        return &stub_myuser;
+    u = stub_users ? mowgli_patricia_retrieve(stub_users, name) : NULL;
+    return u ? u->myuser : NULL;
+}
+
+mychan_t *mychan_find(const char *name) {
+    return NULL;
+}
+
+bool chanacs_user_has_flag(mychan_t *mychan, user_t *u, unsigned int level) {
+    return false;
+}
+
+bool has_priv(sourceinfo_t *si, const char *priv) {
+    return true;
+}
+
+/* services and hooks */
+service_t *service_add(const char *name, void (*handler)(sourceinfo_t *si, int parc, char *parv[])) {
+    service_t *sptr = calloc(1, sizeof(service_t));
+    sptr->nick = strdup("Weather");
+    sptr->disp = sptr->nick;
+    return sptr;
+}
+
+void service_delete(service_t *sptr) {
+    free(sptr->nick);
+    free(sptr);
+}
+
+void service_bind_command(service_t *sptr, command_t *cmd) {
+}
+
+void service_unbind_command(service_t *sptr, command_t *cmd) {
+}
+
+void help_display(sourceinfo_t *si, service_t *service, const char *command, mowgli_patricia_t *list) {
+}
+
+void hook_add_event(const char *name) {
+}
+
+void hook_add_channel_message(void (*func)(hook_cmessage_data_t *data)) {
+}
+
+void hook_del_channel_message(void (*func)(hook_cmessage_data_t *data)) {
+}
+
+void hook_add_user_identify(void (*func)(user_t *u)) {
+}
+
+void hook_del_user_identify(void (*func)(user_t *u)) {
+}
+
+void hook_add_myuser_delete(void (*func)(myuser_t *mu)) {
+}
+
+void hook_del_myuser_delete(void (*func)(myuser_t *mu)) {
+}
+
+void hook_add_config_ready(void (*func)(void *unused)) {
+}
+
+void hook_del_config_ready(void (*func)(void *unused)) {
+}
@@ -0,0 +1,24 @@
+/* Hooks into the stub services runtime for the bench drivers. */
+#ifndef WEATHER_BENCH_STUB_H
+#define WEATHER_BENCH_STUB_H
+
+#include <ctype.h>
+
+extern bool stub_verbose;
+extern char stub_last_reply[8192];
+extern unsigned long stub_replies;
+extern time_t stub_now;
+
+/* called for every line sent to a user or channel */
+extern void (*stub_reply_hook)(const char *target, const char *text);
+/* called with the duration of every timer or pollable callback */
+extern void (*stub_dispatch_hook)(uint64_t ns);
+
+uint64_t stub_now_ns(void);
+int stub_run_timers(void);
+int stub_poll(int timeout_ms);
+myuser_t *stub_account(void);
+user_t *stub_client(void);
+user_t *stub_user_add(const char *nick);
+
+#endif
@@ -0,0 +1,349 @@
+/*
+ * Throughput and latency of the module's hot paths, run against the
+ * recorded fixtures so numbers can be compared between changes.
+ *
+ *   ./weather_bench [-n samples] [-z gazetteer] [benchmark ...]
+ *
+ * The gazetteer lookups use gazetteer_sample.db, which make builds from the
+ * sample in fixtures/, unless -z names another file built by
+ * gazetteer_build, such as one from a full GeoNames dump.  With the sample,
+ * a few lookups are first checked against the answers they must give.
+ *
+ * Every sample times a batch of calls; cheap functions use large batches
+ * so clock reads do not dominate.  Latency percentiles are per call.
+ */
+#include "../main.c"
+#include "stub.h"
+
+#define BENCH_SAMPLES 20000
+#define BENCH_CHUNK 16384      /* CURL_MAX_WRITE_SIZE, what curl hands the write callback */
+#define BENCH_GAZETTEER "gazetteer_sample.db"
+#define BENCH_QUERIES 4096
+
+typedef struct {
+    const char *name;
+    int batch;
+    void (*run)(int batch);
+} bench_t;
+
+static char *pirate_body, *opencage_body;
+static size_t pirate_len, opencage_len;
+static weather_record_t bench_record;
+static char bench_line[OUTPUT_SIZE];
+static size_t bench_line_len;
+static volatile size_t bench_sink;
+static char *gazetteer_exact[BENCH_QUERIES], *gazetteer_prefix[BENCH_QUERIES], *gazetteer_miss[BENCH_QUERIES];
+
+static char *read_fixture(const char *name, size_t *len) {
+    char path[256];
+    FILE *f;
+    char *buf;
+    long size;
+
+    snprintf(path, sizeof(path), "fixtures/%s", name);
+    if (!(f = fopen(path, "rb"))) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (fread(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "short read on %s\n", path);
+        exit(1);
+    }
+    buf[size] = '\0';
+    fclose(f);
+    *len = size;
+    return buf;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_parse_weather(int batch) {
+    static weather_parse_t wp;
+
+    for (int i = 0; i < batch; i++) {
+        weather_parse_init(&wp);
+        for (size_t off = 0; off < pirate_len; off += BENCH_CHUNK)
+            json_stream_feed(&wp.stream, pirate_body + off, pirate_len - off < BENCH_CHUNK ? pirate_len - off : BENCH_CHUNK);
+        bench_sink += weather_parse_finish(&wp);
+    }
+}
+
+static void run_parse_geocode(int batch) {
+    geocode_parse_t gp;
+    OpenCage result;
+
+    for (int i = 0; i < batch; i++) {
+        geocode_parse_init(&gp);
+        json_stream_feed(&gp.stream, opencage_body, opencage_len);
+        bench_sink += geocode_parse_finish(&gp, &result);
+    }
+}
+
+static void run_format_temp(int batch) {
+    char buf[64];
+
+    for (int i = 0; i < batch; i++) {
+        double f = (i % 140) - 20;
+        bench_sink += (size_t)format_temp(i & 1 ? "H" : "F/C", f, (f - 32) * 5 / 9, buf, sizeof(buf));
+    }
+}
+
+static void run_wind_direction(int batch) {
+    for (int i = 0; i < batch; i++)
+        bench_sink += (size_t)wind_direction(i % 360);
+}
+
+/* Includes copying the line back in, since remove_colors works in place. */
+static void run_remove_colors(int batch) {
+    char buf[OUTPUT_SIZE];
+
+    for (int i = 0; i < batch; i++) {
+        memcpy(buf, bench_line, bench_line_len + 1);
+        remove_colors(buf);
+        bench_sink += buf[0];
+    }
+}
+
+static void run_render(int batch, int forecast, bool colors) {
+    char buf[OUTPUT_SIZE];
+
+    for (int i = 0; i < batch; i++)
+        bench_sink += render_weather_data(&bench_record, "New York, United States of America", forecast, colors, buf, sizeof(buf));
+}
+
+static void run_render_weather(int batch) {
+    run_render(batch, 0, true);
+}
+
+static void run_render_plain(int batch) {
+    run_render(batch, 0, false);
+}
+
+static void run_render_forecast(int batch) {
+    run_render(batch, 1, true);
+}
+
+/* Lines through the channel message hook that are not weather requests. */
+static const char *const chat_lines[] = {
+    "hey, anyone around?",
+    "lol",
+    "I think the build broke again after the last merge",
+    "https://example.com/some/link",
+    ":)",
+    "what's the weather like over there",
+    "brb",
+    "ok",
+};
+
+static const char *const miss_lines[] = {
+    "!seen somebody",
+    "!whatever",
+    "!wx London",
+    "!forecasting",
+    "!a-very-long-command-that-is-not-a-trigger",
+    "!",
+};
+
+static user_t bench_user = { .nick = "bench", .user = "bench", .host = "bench.example" };
+static channel_t bench_channel = { .name = "#bench" };
+
+static void run_dispatch(int batch, const char *const *lines, size_t count) {
+    hook_cmessage_data_t data = { .u = &bench_user, .c = &bench_channel };
+
+    for (int i = 0; i < batch; i++) {
+        data.msg = (char *)lines[i % count];
+        on_channel_message(&data);
+    }
+    bench_sink += batch;
+}
+
+static void run_dispatch_chat(int batch) {
+    run_dispatch(batch, chat_lines, sizeof(chat_lines) / sizeof(chat_lines[0]));
+}
+
+static void run_dispatch_miss(int batch) {
+    run_dispatch(batch, miss_lines, sizeof(miss_lines) / sizeof(miss_lines[0]));
+}
+
+static void run_gazetteer(int batch, char *const *queries) {
+    OpenCage result;
+
+    for (int i = 0; i < batch; i++)
+        bench_sink += gazetteer_lookup(queries[i % BENCH_QUERIES], &result);
+}
+
+static void run_gazetteer_exact(int batch) {
+    run_gazetteer(batch, gazetteer_exact);
+}
+
+static void run_gazetteer_prefix(int batch) {
+    run_gazetteer(batch, gazetteer_prefix);
+}
+
+static void run_gazetteer_miss(int batch) {
+    run_gazetteer(batch, gazetteer_miss);
+}
+
+/* Queries spread over the whole index: its names, their first five bytes, and names it lacks. */
+static bool gazetteer_setup(const char *path) {
+    gazetteer_file = strdup(path);
+    gazetteer_configure(NULL);
+    if (!gazetteer.map)
+        return false;
+
+    for (int i = 0; i < BENCH_QUERIES; i++) {
+        const char *key = gazetteer_key((uint32_t)((uint64_t)i * gazetteer.key_count / BENCH_QUERIES));
+        size_t len = strlen(key);
+
+        gazetteer_exact[i] = strdup(key);
+        gazetteer_prefix[i] = strndup(key, len > 5 ? 5 : len);
+        gazetteer_miss[i] = malloc(len + 3);
+        snprintf(gazetteer_miss[i], len + 3, "%sqx", key);
+    }
+    return true;
+}
+
+/* Answers the sample gazetteer must give; NULL where OpenCage should be asked. */
+static const struct {
+    const char *query;
+    const char *location;
+} gazetteer_cases[] = {
+    { "Paris", "Paris, Île-de-France, France" },
+    { "Paris,_TX", "Paris, Texas, United States" },
+    { "Texas_City", "Texas City, Texas, United States" },
+    { "Texas_Ci", "Texas City, Texas, United States" },
+    { "Texas", NULL },
+    { "California", NULL },
+    { "France", NULL },
+};
+
+static bool gazetteer_check(void) {
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(gazetteer_cases) / sizeof(gazetteer_cases[0]); i++) {
+        OpenCage result = { "", 0, 0, 0 };
+        bool found = gazetteer_lookup(gazetteer_cases[i].query, &result);
+
+        if (found != !!gazetteer_cases[i].location || (found && strcmp(result.location, gazetteer_cases[i].location))) {
+            fprintf(stderr, "gazetteer: %s gave \"%s\", expected \"%s\"\n", gazetteer_cases[i].query,
+                found ? result.location : "(no answer)", gazetteer_cases[i].location ? gazetteer_cases[i].location : "(no answer)");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static const bench_t benches[] = {
+    { "parse_weather", 1, run_parse_weather },
+    { "parse_geocode", 1, run_parse_geocode },
+    { "format_temp", 64, run_format_temp },
+    { "wind_direction", 256, run_wind_direction },
+    { "remove_colors", 4, run_remove_colors },
+    { "render_weather", 1, run_render_weather },
+    { "render_plain", 1, run_render_plain },
+    { "render_forecast", 1, run_render_forecast },
+    { "dispatch_chat", 256, run_dispatch_chat },
+    { "dispatch_miss", 64, run_dispatch_miss },
+    { "gazetteer_exact", 16, run_gazetteer_exact },
+    { "gazetteer_prefix", 16, run_gazetteer_prefix },
+    { "gazetteer_miss", 16, run_gazetteer_miss },
+};
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *sorted, int count, double p) {
+    int idx = (int)(p / 100 * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void run_bench(const bench_t *b, int samples) {
+    uint64_t *times = malloc(samples * sizeof(uint64_t));
+    uint64_t total = 0;
+
+    /* warm caches and branch predictors */
+    b->run(b->batch * 100);
+
+    for (int i = 0; i < samples; i++) {
+        uint64_t start = now_ns();
+        b->run(b->batch);
+        times[i] = now_ns() - start;
+        total += times[i];
+    }
+    qsort(times, samples, sizeof(uint64_t), compare_u64);
+
+    printf("%-16s %12.0f %9.1f %9.1f %9.1f %9.1f %10.1f\n", b->name,
+           (double)samples * b->batch / (total / 1e9),
+           percentile(times, samples, 50) / b->batch, percentile(times, samples, 90) / b->batch,
+           percentile(times, samples, 99) / b->batch, percentile(times, samples, 99.9) / b->batch,
+           (double)times[samples - 1] / b->batch);
+    free(times);
+}
+
+int main(int argc, char *argv[]) {
+    const char *gazetteer_path = BENCH_GAZETTEER;
+    int samples = BENCH_SAMPLES;
+    bool have_gazetteer;
+    int first = 1;
+
+    while (first + 1 < argc && argv[first][0] == '-') {
+        if (!strcmp(argv[first], "-n")) {
+            samples = atoi(argv[first + 1]);
+            if (samples <= 0)
+                samples = BENCH_SAMPLES;
+        } else if (!strcmp(argv[first], "-z")) {
+            gazetteer_path = argv[first + 1];
+        } else {
+            break;
+        }
+        first += 2;
+    }
+
+    pirate_body = read_fixture("pirate_full.json", &pirate_len);
+    opencage_body = read_fixture("opencage_full.json", &opencage_len);
+    if (!parse_weather_data(pirate_body, &bench_record) || parse_geocode_data(opencage_body, &(OpenCage){ 0 }) != 0) {
+        fprintf(stderr, "fixtures did not parse\n");
+        return 1;
+    }
+
+    weather = service_add("weather", NULL);
+    init_weather_templates();
+    init_triggers();
+    bench_line_len = render_weather_data(&bench_record, "New York, United States of America", 0, true, bench_line, sizeof(bench_line));
+    have_gazetteer = gazetteer_setup(gazetteer_path);
+    if (have_gazetteer && !strcmp(gazetteer_path, BENCH_GAZETTEER) && !gazetteer_check())
+        return 1;
+
+    printf("%d samples; latency in ns per call\n", samples);
+    printf("%-16s %12s %9s %9s %9s %9s %10s\n", "benchmark", "ops/s", "p50", "p90", "p99", "p99.9", "max");
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        bool wanted = first >= argc;
+
+        for (int j = first; j < argc && !wanted; j++)
+            wanted = !strcmp(argv[j], benches[i].name);
+        if (wanted && !have_gazetteer && !strncmp(benches[i].name, "gazetteer_", 10))
+            printf("%-16s skipped, no gazetteer at %s\n", benches[i].name, gazetteer_path);
+        else if (wanted)
+            run_bench(&benches[i], samples);
+    }
+    if (have_gazetteer)
+        printf("gazetteer %s: %u places under %u names; %u hits, %u prefix hits, %u misses\n", gazetteer_path,
+            gazetteer.place_count, gazetteer.key_count, gazetteer_hits, gazetteer_prefix_hits, gazetteer_misses);
+
+    deinit_gazetteer();
+    deinit_triggers();
+    deinit_weather_templates();
+    service_delete(weather);
+    return 0;
+}
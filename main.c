@@ -1,17 +1,42 @@
 #include "atheme.h"
 #include <curl/curl.h>
-#include <jansson.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdbool.h>
-
-#define OPENCAGE_URL "https://api.opencagedata.com/geocode/v1/json?q=%s&key=%s&language=en&pretty=1"
+#include <stddef.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#define OPENCAGE_URL "https://api.opencagedata.com/geocode/v1/json"
+#define OPENCAGE_QUERY "%s?q=%s&key=%s&language=en&limit=1&no_annotations=1"
 #define OPENCAGE_KEY "OPENCAGE_API_KEY_GOES_HERE"
 
 #define PIRATE_URL "https://api.pirateweather.net/forecast"
 #define PIRATE_KEY "PIRATEWEATHER_API_KEY_GOES_HERE"
+/* blocks of the forecast we never render */
+#define PIRATE_EXCLUDE "minutely,hourly,alerts,flags"
+
+/* asked for as a hedge when PirateWeather is slow; needs no key */
+#define OPENMETEO_URL "https://api.open-meteo.com/v1/forecast"
+#define OPENMETEO_KEY "none"
+#define OPENMETEO_QUERY "%s?latitude=%f&longitude=%f" \
+    "&current=temperature_2m,apparent_temperature,relative_humidity_2m,dew_point_2m,wind_speed_10m,wind_direction_10m,wind_gusts_10m,weather_code,uv_index" \
+    "&daily=weather_code,temperature_2m_max,temperature_2m_min,sunrise,sunset" \
+    "&temperature_unit=fahrenheit&wind_speed_unit=mph&timeformat=unixtime&timezone=auto&forecast_days=8"
 
 #define OUTPUT_SIZE 7000
 #define FORECAST_SIZE 7000
@@ -26,46 +51,14 @@ DECLARE_MODULE_V1
     VENDOR_STRING
 );
 
-void split_command_location(const char *input, char *command, char *location) {
-    const char *space = strchr(input, ' ');
-    if (space) {
-        size_t command_len = space - input;
-        strncpy(command, input, command_len);
-        command[command_len] = '\0';
-
-        strcpy(location, space + 1);
-    } else {
-        // If there's no space, the whole input is the command and location is empty
-        strcpy(command, input);
-        location[0] = '\0';
-    }
-}
-
-
-
 service_t *weather;
 
 
-typedef struct {
-    time_t last_request_time;
-    int hit_count;
-} weather_service_ratelimit_t;
-
-
-typedef struct {
-    int hitvalue;
-} weather_service_setlimit_t;
-
 typedef struct {
         char *channel;
         char *requester;
 } channel_info_t;
 
-static weather_service_setlimit_t set_limit;
-void rate_limit_free(const char *key, void *data, void *privdata)
-	{
-	free(data);
-}
 void channel_info_free(const char *key, void *data, void *privdata)
         {
         channel_info_t *ci = data;
@@ -73,15 +66,8 @@ void channel_info_free(const char *key, void *data, void *privdata)
 	free(ci->requester);
 	free(ci);
 }
-// Hash table to store rate limits for users
-mowgli_patricia_t *rate_limit_table;
 mowgli_patricia_t *channel_table;
 
-// Function to initialize the rate limit table
-void init_rate_limit() {
-    rate_limit_table = mowgli_patricia_create(strcasecanon);
-}
-
 void init_channel_table() {
     channel_table = mowgli_patricia_create(strcasecanon);
 }
@@ -89,43 +75,378 @@ void init_channel_table() {
 
 
 
-bool check_rate_limit(sourceinfo_t *si) {
-    if (!rate_limit_table) {
-        slog(LG_DEBUG, "Rate limit table is not initialized.\n");
-        return false;
+/*
+ * Request statistics.
+ *
+ * Every stage of a request records its duration into a fixed-bucket
+ * histogram: four buckets per power of two microseconds, so recording is a
+ * couple of shifts and percentiles are within 25% of the true value.
+ */
+#define WEATHER_HIST_BUCKETS 128
+
+typedef enum {
+    WEATHER_STAGE_RATELIMIT,
+    WEATHER_STAGE_GEOCODE,
+    WEATHER_STAGE_WEATHER,
+    WEATHER_STAGE_DNS,
+    WEATHER_STAGE_CONNECT,
+    WEATHER_STAGE_TLS,
+    WEATHER_STAGE_TRANSFER,
+    WEATHER_STAGE_PARSE,
+    WEATHER_STAGE_RENDER,
+    WEATHER_STAGE_DELIVERY,
+    WEATHER_STAGE_TOTAL,
+    WEATHER_STAGE_COUNT
+} weather_stage_t;
+
+static const char *weather_stage_names[WEATHER_STAGE_COUNT] = {
+    "ratelimit", "geocode", "weather", "dns", "connect", "tls", "transfer", "parse", "render", "delivery", "total"
+};
+
+typedef struct {
+    uint32_t buckets[WEATHER_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;       /* microseconds */
+    uint64_t max;
+} weather_hist_t;
+
+static weather_hist_t weather_stage_hist[WEATHER_STAGE_COUNT];
+
+typedef enum {
+    WEATHER_COMMAND_WEATHER,
+    WEATHER_COMMAND_FORECAST,
+    WEATHER_COMMAND_CHANNEL_WEATHER,
+    WEATHER_COMMAND_CHANNEL_FORECAST,
+    WEATHER_COMMAND_SETWEATHER,
+    WEATHER_COMMAND_GREET,
+    WEATHER_COMMAND_COUNT
+} weather_command_t;
+
+static const char *weather_command_names[WEATHER_COMMAND_COUNT] = {
+    "WEATHER", "FORECAST", "!w", "!f", "SETWEATHER", "greet"
+};
+
+static unsigned int weather_command_counts[WEATHER_COMMAND_COUNT];
+
+static inline uint64_t weather_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline unsigned int weather_hist_bucket(uint64_t us) {
+    unsigned int e, idx;
+
+    if (us < 4)
+        return us;
+
+    e = 63 - __builtin_clzll(us);
+    idx = 4 * (e - 1) + ((us >> (e - 2)) & 3);
+    return idx < WEATHER_HIST_BUCKETS ? idx : WEATHER_HIST_BUCKETS - 1;
+}
+
+/* Largest value that lands in a bucket. */
+static uint64_t weather_hist_bucket_max(unsigned int idx) {
+    if (idx < 4)
+        return idx;
+    return ((uint64_t)(4 + idx % 4 + 1) << (idx / 4 - 1)) - 1;
+}
+
+static void weather_hist_add(weather_hist_t *hist, uint64_t us) {
+    hist->buckets[weather_hist_bucket(us)]++;
+    hist->count++;
+    hist->sum += us;
+    if (us > hist->max)
+        hist->max = us;
+}
+
+static uint64_t weather_hist_percentile(const weather_hist_t *hist, double p) {
+    uint64_t rank = (uint64_t)ceil(p / 100 * hist->count), seen = 0;
+
+    if (!hist->count)
+        return 0;
+
+    for (unsigned int i = 0; i < WEATHER_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = weather_hist_bucket_max(i);
+            return upper < hist->max ? upper : hist->max;
+        }
     }
+    return hist->max;
+}
 
-    weather_service_ratelimit_t *rate_limit = mowgli_patricia_retrieve(rate_limit_table, si->su->nick);
-    time_t current_time = time(NULL);
+/*
+ * A rolling latency window is two histograms, the one filling and the last
+ * full one, so a percentile always covers between one and two windows.
+ */
+static void weather_window_add(weather_hist_t window[2], uint64_t size, uint64_t us) {
+    if (window[0].count >= size) {
+        window[1] = window[0];
+        memset(&window[0], 0, sizeof(window[0]));
+    }
+    weather_hist_add(&window[0], us);
+}
 
-    if (rate_limit) {
-        double time_diff = difftime(current_time, rate_limit->last_request_time);
-        if (time_diff < RATE_LIMIT_INTERVAL / set_limit.hitvalue) {
-            rate_limit->hit_count++;
-            slog(LG_DEBUG, "New rate limit entry added for user: %s (count %d)", si->su->nick, rate_limit->hit_count);
-            if (rate_limit->hit_count > set_limit.hitvalue) {
-                command_fail(si, fault_toomany, "You are making requests too quickly. Please wait before trying again.");
-                return false;
-            }
-        } else {
-            rate_limit->hit_count = 1;
+static uint64_t weather_window_percentile(const weather_hist_t window[2], double p) {
+    weather_hist_t both = window[0];
+
+    for (unsigned int i = 0; i < WEATHER_HIST_BUCKETS; i++)
+        both.buckets[i] += window[1].buckets[i];
+    both.count += window[1].count;
+    if (window[1].max > both.max)
+        both.max = window[1].max;
+    return weather_hist_percentile(&both, p);
+}
+
+static inline void weather_stats_record(weather_stage_t stage, uint64_t start_us) {
+    weather_hist_add(&weather_stage_hist[stage], weather_now_us() - start_us);
+}
+
+/*
+ * Rate limiting.
+ *
+ * A request has to find a token in every bucket that applies to it: the
+ * requester's account, their host, the channel it was made in and one
+ * global bucket.  Each level refills at its own rate up to its own burst,
+ * so changing nick or reconnecting no longer resets anything.
+ *
+ * Buckets live in one table keyed by level and name.  A bucket that has
+ * refilled completely is no different from a new one, so it is reclaimed
+ * by a timer wheel once that time comes; the entry count is also capped,
+ * evicting the least recently used bucket first.
+ */
+#define RATE_LIMIT_WHEEL_SLOTS 64
+#define RATE_LIMIT_WHEEL_TICK 1
+#define RATE_LIMIT_MAX_ENTRIES 50000
+
+typedef enum {
+    RATE_LIMIT_ACCOUNT,
+    RATE_LIMIT_HOST,
+    RATE_LIMIT_CHANNEL,
+    RATE_LIMIT_GLOBAL,
+    RATE_LIMIT_LEVELS
+} rate_limit_level_t;
+
+typedef struct {
+    const char *name;
+    char prefix;
+    unsigned int rate;      /* tokens per RATE_LIMIT_INTERVAL, 0 = unlimited */
+    unsigned int burst;
+    unsigned int rejected;
+} rate_limit_setting_t;
+
+static rate_limit_setting_t rate_limit_settings[RATE_LIMIT_LEVELS] = {
+    [RATE_LIMIT_ACCOUNT] = { "account", 'a', 10, 10 },
+    [RATE_LIMIT_HOST] = { "host", 'h', 20, 20 },
+    [RATE_LIMIT_CHANNEL] = { "channel", 'c', 30, 10 },
+    [RATE_LIMIT_GLOBAL] = { "global", 'g', 600, 100 },
+};
+
+typedef struct {
+    char *key;
+    rate_limit_level_t level;
+    double tokens;
+    uint64_t updated;       /* us, weather_now_us() */
+    uint64_t expires;       /* when the bucket will be full again */
+    unsigned int slot;
+    mowgli_node_t wheel_node;
+    mowgli_node_t lru_node;
+} rate_limit_bucket_t;
+
+static mowgli_patricia_t *rate_limit_table;
+static mowgli_list_t rate_limit_wheel[RATE_LIMIT_WHEEL_SLOTS];
+static mowgli_list_t rate_limit_lru;      /* most recently used first */
+static unsigned int rate_limit_wheel_pos;
+static mowgli_eventloop_timer_t *rate_limit_timer;
+static rate_limit_bucket_t rate_limit_global = { .key = "global", .level = RATE_LIMIT_GLOBAL };
+static unsigned int rate_limit_max = RATE_LIMIT_MAX_ENTRIES;
+static unsigned int rate_limit_evictions;
+
+static void rate_limit_remove(rate_limit_bucket_t *bucket) {
+    mowgli_patricia_delete(rate_limit_table, bucket->key);
+    mowgli_node_delete(&bucket->wheel_node, &rate_limit_wheel[bucket->slot]);
+    mowgli_node_delete(&bucket->lru_node, &rate_limit_lru);
+    free(bucket->key);
+    free(bucket);
+}
+
+static void rate_limit_schedule(rate_limit_bucket_t *bucket, uint64_t now) {
+    uint64_t ticks = 1;
+
+    if (bucket->expires > now)
+        ticks = (bucket->expires - now) / (RATE_LIMIT_WHEEL_TICK * 1000000ULL) + 1;
+    if (ticks >= RATE_LIMIT_WHEEL_SLOTS)
+        ticks = RATE_LIMIT_WHEEL_SLOTS - 1;
+
+    bucket->slot = (rate_limit_wheel_pos + ticks) % RATE_LIMIT_WHEEL_SLOTS;
+    mowgli_node_add(bucket, &bucket->wheel_node, &rate_limit_wheel[bucket->slot]);
+}
+
+/*
+ * Advances the wheel one slot.  Buckets used since they were slotted only
+ * had their expiry moved, so they are put back further along instead.
+ */
+static void rate_limit_tick(void *arg) {
+    mowgli_node_t *n, *tn;
+    uint64_t now = weather_now_us();
+    mowgli_list_t *slot;
+
+    rate_limit_wheel_pos = (rate_limit_wheel_pos + 1) % RATE_LIMIT_WHEEL_SLOTS;
+    slot = &rate_limit_wheel[rate_limit_wheel_pos];
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, slot->head) {
+        rate_limit_bucket_t *bucket = n->data;
+
+        if (bucket->expires <= now) {
+            rate_limit_remove(bucket);
+            continue;
         }
-        rate_limit->last_request_time = current_time;
-    } else {
-        rate_limit = malloc(sizeof(weather_service_ratelimit_t));
-        if (!rate_limit) {
-            slog(LG_DEBUG, "Failed to allocate memory for rate limit.\n");
-            return false;
+        mowgli_node_delete(&bucket->wheel_node, slot);
+        rate_limit_schedule(bucket, now);
+    }
+}
+
+static rate_limit_bucket_t *rate_limit_bucket(rate_limit_level_t level, const char *name, uint64_t now) {
+    char key[BUFSIZE];
+    rate_limit_bucket_t *bucket;
+
+    if (level == RATE_LIMIT_GLOBAL)
+        return &rate_limit_global;
+
+    snprintf(key, sizeof(key), "%c:%s", rate_limit_settings[level].prefix, name);
+    bucket = mowgli_patricia_retrieve(rate_limit_table, key);
+    if (bucket) {
+        mowgli_node_delete(&bucket->lru_node, &rate_limit_lru);
+        mowgli_node_add_head(bucket, &bucket->lru_node, &rate_limit_lru);
+        return bucket;
+    }
+
+    bucket = calloc(1, sizeof(rate_limit_bucket_t));
+    if (!bucket)
+        return NULL;
+
+    bucket->key = strdup(key);
+    bucket->level = level;
+    bucket->tokens = rate_limit_settings[level].burst;
+    bucket->updated = now;
+    bucket->expires = now;
+    mowgli_patricia_add(rate_limit_table, bucket->key, bucket);
+    mowgli_node_add_head(bucket, &bucket->lru_node, &rate_limit_lru);
+    rate_limit_schedule(bucket, now);
+    return bucket;
+}
+
+/* Evicts down to the cap; only once a request is done with its buckets. */
+static void rate_limit_trim(void) {
+    while (rate_limit_max && MOWGLI_LIST_LENGTH(&rate_limit_lru) > rate_limit_max) {
+        rate_limit_remove(rate_limit_lru.tail->data);
+        rate_limit_evictions++;
+    }
+}
+
+static void rate_limit_refill(rate_limit_bucket_t *bucket, uint64_t now) {
+    const rate_limit_setting_t *setting = &rate_limit_settings[bucket->level];
+
+    bucket->tokens += (double)(now - bucket->updated) * setting->rate / (RATE_LIMIT_INTERVAL * 1e6);
+    if (bucket->tokens > setting->burst)
+        bucket->tokens = setting->burst;
+    bucket->updated = now;
+}
+
+static void rate_limit_take(rate_limit_bucket_t *bucket, uint64_t now) {
+    const rate_limit_setting_t *setting = &rate_limit_settings[bucket->level];
+
+    bucket->tokens -= 1;
+    bucket->expires = now + (uint64_t)((setting->burst - bucket->tokens) * RATE_LIMIT_INTERVAL * 1e6 / setting->rate);
+}
+
+/*
+ * Takes a token from every bucket that applies, or from none of them.
+ * Returns the level that refused the request, or RATE_LIMIT_LEVELS.
+ */
+static rate_limit_level_t rate_limit_allow(user_t *u, myuser_t *mu, channel_t *c) {
+    rate_limit_bucket_t *buckets[RATE_LIMIT_LEVELS];
+    const char *names[RATE_LIMIT_LEVELS] = {
+        [RATE_LIMIT_ACCOUNT] = mu ? entity(mu)->name : NULL,
+        [RATE_LIMIT_HOST] = u ? u->host : NULL,
+        [RATE_LIMIT_CHANNEL] = c ? c->name : NULL,
+        [RATE_LIMIT_GLOBAL] = "global",
+    };
+    rate_limit_level_t refused = RATE_LIMIT_LEVELS;
+    uint64_t now = weather_now_us();
+    int count = 0;
+
+    for (int level = 0; level < RATE_LIMIT_LEVELS; level++) {
+        rate_limit_bucket_t *bucket;
+
+        if (!names[level] || !rate_limit_settings[level].rate)
+            continue;
+
+        bucket = rate_limit_bucket(level, names[level], now);
+        if (!bucket)
+            continue;
+
+        rate_limit_refill(bucket, now);
+        if (bucket->tokens < 1) {
+            rate_limit_settings[level].rejected++;
+            slog(LG_DEBUG, "weather: rate limited %s (%s)", names[level], rate_limit_settings[level].name);
+            refused = level;
+            break;
         }
-        rate_limit->last_request_time = current_time;
-        rate_limit->hit_count = 1;
-        mowgli_patricia_add(rate_limit_table, si->su->nick, rate_limit);
-        slog(LG_DEBUG, "New rate limit entry added for user: %s (count %d)", si->su->nick, rate_limit->hit_count);
+        buckets[count++] = bucket;
+    }
+
+    if (refused == RATE_LIMIT_LEVELS) {
+        for (int i = 0; i < count; i++)
+            rate_limit_take(buckets[i], now);
     }
 
+    /* not before: evicting could free a bucket collected above */
+    rate_limit_trim();
+    return refused;
+}
+
+/* Returns NULL if the request may go ahead, otherwise why not. */
+static const char *rate_limit_check(user_t *u, myuser_t *mu, channel_t *c) {
+    uint64_t start = weather_now_us();
+    rate_limit_level_t level = rate_limit_allow(u, mu, c);
+
+    weather_stats_record(WEATHER_STAGE_RATELIMIT, start);
+    if (level == RATE_LIMIT_LEVELS)
+        return NULL;
+    if (level == RATE_LIMIT_CHANNEL || level == RATE_LIMIT_GLOBAL)
+        return "Too many weather requests right now. Please wait before trying again.";
+    return "You are making requests too quickly. Please wait before trying again.";
+}
+
+bool check_rate_limit(sourceinfo_t *si) {
+    const char *error = rate_limit_check(si->su, si->smu, NULL);
+
+    if (error) {
+        command_fail(si, fault_toomany, "%s", error);
+        return false;
+    }
     return true;
 }
 
+void init_rate_limit(void) {
+    rate_limit_table = mowgli_patricia_create(strcasecanon);
+    rate_limit_global.tokens = rate_limit_settings[RATE_LIMIT_GLOBAL].burst;
+    rate_limit_global.updated = weather_now_us();
+    rate_limit_timer = mowgli_timer_add(base_eventloop, "rate_limit_tick", rate_limit_tick, NULL, RATE_LIMIT_WHEEL_TICK);
+}
+
+void deinit_rate_limit(void) {
+    mowgli_node_t *n, *tn;
+
+    mowgli_timer_destroy(base_eventloop, rate_limit_timer);
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, rate_limit_lru.head)
+        rate_limit_remove(n->data);
+    mowgli_patricia_destroy(rate_limit_table, NULL, NULL);
+}
+
 
 
 static void on_channel_message(hook_cmessage_data_t *data);
@@ -136,11 +457,18 @@ static void ws_cmd_setweather(sourceinfo_t *si, int parc, char *parv[]);
 static void ws_cmd_setgreet(sourceinfo_t *si, int parc, char *parv[]);
 static void ws_cmd_setcolors(sourceinfo_t *si, int parc, char *parv[]);
 static void ws_cmd_setratelimit(sourceinfo_t *si, int parc, char *parv[]);
+static void ws_cmd_stats(sourceinfo_t *si, int parc, char *parv[]);
+static void ws_cmd_triggers(sourceinfo_t *si, int parc, char *parv[]);
 static void ws_cmd_info(sourceinfo_t *si, int parc, char *parv[]);
 static void ws_cmd_cycle(sourceinfo_t *si, int parc, char *parv[]);
 static void ws_cmd_join(sourceinfo_t *si, int parc, char *parv[]);
-static char *fetch_weather_data(const char *location, const char *latlong, int forecast);
+static void ws_cmd_part(sourceinfo_t *si, int parc, char *parv[]);
+static void ws_cmd_cachestats(sourceinfo_t *si, int parc, char *parv[]);
+static void ws_cmd_upstreams(sourceinfo_t *si, int parc, char *parv[]);
 static void on_user_identify(user_t *u);
+static void weather_greet_stats(sourceinfo_t *si);
+static void weather_providers_show(sourceinfo_t *si);
+static void weather_worker_show(sourceinfo_t *si);
 
 void remove_colors(char *str) {
     char *src = str, *dst = str;
@@ -168,24 +496,26 @@ void remove_colors(char *str) {
 
 
 
-const char* format_temp(const char *displaymode, double f, double c, char *buffer, size_t buffer_size) {
-    char color[4];
-
+const char *temp_color(double f) {
     if (f > 100) {
-        strcpy(color, "04");  // Red
+        return "04";  // Red
     } else if (f > 85) {
-        strcpy(color, "07");  // Orange
+        return "07";  // Orange
     } else if (f > 75) {
-        strcpy(color, "08");  // Yellow
+        return "08";  // Yellow
     } else if (f > 60) {
-        strcpy(color, "09");  // Light Green
+        return "09";  // Light Green
     } else if (f > 40) {
-        strcpy(color, "11");  // Cyan
+        return "11";  // Cyan
     } else if (f > 10) {
-        strcpy(color, "12");  // Light Blue
+        return "12";  // Light Blue
     } else {
-        strcpy(color, "15");  // Light Grey
+        return "15";  // Light Grey
     }
+}
+
+const char* format_temp(const char *displaymode, double f, double c, char *buffer, size_t buffer_size) {
+    const char *color = temp_color(f);
 
     char f_str[10], c_str[10];
     snprintf(f_str, sizeof(f_str), "%.1f", f);
@@ -214,9 +544,14 @@ command_t ws_setweather = { "SETWEATHER", N_("Sets the default weather location
 command_t ws_setgreet = { "SETGREET", N_("Enables or disables weather greeting on identify."), AC_AUTHENTICATED, 1, ws_cmd_setgreet, { .path = "weather/setgreet" } };
 command_t ws_setcolors = { "SETCOLORS", N_("Enables or disables weather colors output."), AC_AUTHENTICATED, 1, ws_cmd_setcolors, { .path = "weather/setcolors" } };
 command_t ws_help = { "HELP", N_("Displays contextual help information."), AC_NONE, 1, ws_cmd_help, { .path = "help" } };
-command_t ws_setratelimit = { "SETRATELIMIT", N_("Sets the rate limit for weather commands."), PRIV_ADMIN, 20, ws_cmd_setratelimit, { .path = "weather/setratelimit" } };
+command_t ws_setratelimit = { "SETRATELIMIT", N_("Sets the rate limit for weather commands."), PRIV_ADMIN, 3, ws_cmd_setratelimit, { .path = "weather/setratelimit" } };
+command_t ws_triggers = { "TRIGGERS", N_("Shows or sets the channel triggers."), AC_NONE, 2, ws_cmd_triggers, { .path = "weather/triggers" } };
+command_t ws_stats = { "STATS", N_("Shows request latency and error statistics."), PRIV_ADMIN, 1, ws_cmd_stats, { .path = "weather/stats" } };
 command_t ws_cycle = { "CYCLE", N_("Forces re-join of weather to stored channels."), PRIV_ADMIN, 20, ws_cmd_cycle, { .path = "weather/cycle" } };
+command_t ws_cachestats = { "CACHESTATS", N_("Shows weather and geocode cache statistics."), PRIV_ADMIN, 1, ws_cmd_cachestats, { .path = "weather/cachestats" } };
+command_t ws_upstreams = { "UPSTREAMS", N_("Shows connection statistics for the upstream APIs."), PRIV_ADMIN, 1, ws_cmd_upstreams, { .path = "weather/upstreams" } };
 command_t ws_join = { "JOIN", N_("Weather joins the channel.."), AC_NONE, 1, ws_cmd_join, { .path = "weather/join" } };
+command_t ws_part = { "PART", N_("Weather leaves the channel."), AC_NONE, 1, ws_cmd_part, { .path = "weather/part" } };
 
 typedef struct {
     char *memory;
@@ -225,7 +560,7 @@ typedef struct {
 
 typedef struct {
     char location[100];
-    char latlong[100];
+    double lat, lng;
     int error_code;
 } OpenCage;
 
@@ -237,13 +572,6 @@ void replace_spaces_with_underscores(char *str) {
     }
 }
 
-struct tm* convert_to_eastern_time(time_t rawtime) {
-    struct tm *timeinfo = gmtime(&rawtime);
-    timeinfo->tm_hour -= 5; // Adjust for Eastern Time (UTC-5)
-    mktime(timeinfo);       // Normalize the time structure
-    return timeinfo;
-}
-
 const char* format_uv(double uv, char** color) {
     if (uv <= 2.9) {
         *color = "\00303"; // Green
@@ -276,25 +604,407 @@ const char* wind_direction(int angle) {
     return directions[idx];
 }
 
-size_t weather_write_callback(void *ptr, size_t size, size_t nmemb, void *data) {
-    size_t real_size = size * nmemb;
-    MemoryStruct *mem = (MemoryStruct *)data;
+/*
+ * Streaming JSON extraction.
+ *
+ * A push tokenizer fed with the body in whatever pieces curl hands over, so
+ * a response is never buffered or turned into a DOM.  It only remembers the
+ * path to the current value (member keys and array indexes) and the text of
+ * the current key or scalar.  Scalars are reported to a value callback; an
+ * enter callback is asked before each object or array is opened and can
+ * skip it, in which case it is scanned for brackets and quotes only.
+ */
+#define JSON_STREAM_DEPTH 16
+#define JSON_STREAM_KEYLEN 32
+#define JSON_STREAM_TEXTLEN 512
+
+typedef enum {
+    JSON_STREAM_STRING,
+    JSON_STREAM_NUMBER,
+    JSON_STREAM_TRUE,
+    JSON_STREAM_FALSE,
+    JSON_STREAM_NULL
+} json_stream_kind_t;
 
-    char *ptr_realloc = realloc(mem->memory, mem->size + real_size + 1);
-    if (ptr_realloc == NULL) {
-        slog(LG_DEBUG, "Not enough memory (realloc returned NULL)\n");
-        return 0;
+typedef struct {
+    bool array;
+    unsigned int index;                 /* arrays: current element */
+    char key[JSON_STREAM_KEYLEN];       /* objects: current member */
+} json_stream_frame_t;
+
+typedef struct json_stream_ json_stream_t;
+
+struct json_stream_ {
+    int state;
+    int depth;                          /* containers open and tracked */
+    int skip_depth;                     /* nesting inside a skipped container */
+    bool in_key;
+    bool truncated;
+    unsigned int codepoint;
+    unsigned int surrogate;
+    int hexdigits;
+    size_t textlen;
+    json_stream_frame_t frames[JSON_STREAM_DEPTH];
+    char text[JSON_STREAM_TEXTLEN];
+
+    /* called with depth/frames describing where the container sits */
+    bool (*enter)(json_stream_t *js);
+    void (*value)(json_stream_t *js, json_stream_kind_t kind, const char *text, size_t len);
+    void *privdata;
+};
+
+enum {
+    JS_VALUE,
+    JS_ARRAY_FIRST,
+    JS_OBJECT_FIRST,
+    JS_KEY,
+    JS_COLON,
+    JS_AFTER_VALUE,
+    JS_STRING,
+    JS_ESCAPE,
+    JS_UNICODE,
+    JS_NUMBER,
+    JS_LITERAL,
+    JS_SKIP,
+    JS_SKIP_STRING,
+    JS_SKIP_ESCAPE,
+    JS_DONE,
+    JS_ERROR
+};
+
+void json_stream_init(json_stream_t *js, bool (*enter)(json_stream_t *), void (*value)(json_stream_t *, json_stream_kind_t, const char *, size_t), void *privdata) {
+    memset(js, 0, sizeof(*js));
+    js->state = JS_VALUE;
+    js->enter = enter;
+    js->value = value;
+    js->privdata = privdata;
+}
+
+/* Key of the member at the given nesting level, or "" inside an array. */
+static inline const char *json_stream_key(const json_stream_t *js, int level) {
+    return js->frames[level].array ? "" : js->frames[level].key;
+}
+
+static inline void json_stream_text_add(json_stream_t *js, const char *s, size_t len) {
+    size_t room = sizeof(js->text) - 1 - js->textlen;
+
+    if (len > room) {
+        len = room;
+        js->truncated = true;
     }
+    memcpy(js->text + js->textlen, s, len);
+    js->textlen += len;
+}
 
-    mem->memory = ptr_realloc;
-    memcpy(&(mem->memory[mem->size]), ptr, real_size);
-    mem->size += real_size;
-    mem->memory[mem->size] = 0;
+static void json_stream_text_utf8(json_stream_t *js, unsigned int cp) {
+    char b[4];
+    size_t n;
+
+    if (cp < 0x80) {
+        b[0] = cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        b[0] = 0xc0 | (cp >> 6);
+        b[1] = 0x80 | (cp & 0x3f);
+        n = 2;
+    } else if (cp < 0x10000) {
+        b[0] = 0xe0 | (cp >> 12);
+        b[1] = 0x80 | ((cp >> 6) & 0x3f);
+        b[2] = 0x80 | (cp & 0x3f);
+        n = 3;
+    } else {
+        b[0] = 0xf0 | (cp >> 18);
+        b[1] = 0x80 | ((cp >> 12) & 0x3f);
+        b[2] = 0x80 | ((cp >> 6) & 0x3f);
+        b[3] = 0x80 | (cp & 0x3f);
+        n = 4;
+    }
+    json_stream_text_add(js, b, n);
+}
 
-    return real_size;
+/* A high surrogate not followed by its low half becomes U+FFFD. */
+static void json_stream_unpaired(json_stream_t *js) {
+    if (js->surrogate)
+        json_stream_text_utf8(js, 0xfffd);
+    js->surrogate = 0;
+}
+
+static void json_stream_after_value(json_stream_t *js) {
+    js->state = js->depth ? JS_AFTER_VALUE : JS_DONE;
+}
+
+static void json_stream_emit(json_stream_t *js, json_stream_kind_t kind) {
+    js->text[js->textlen] = '\0';
+    if (js->value && js->depth > 0)
+        js->value(js, kind, js->text, js->textlen);
+    json_stream_after_value(js);
+}
+
+static void json_stream_open(json_stream_t *js, bool array) {
+    if (js->depth >= JSON_STREAM_DEPTH || (js->enter && !js->enter(js))) {
+        js->skip_depth = 1;
+        js->state = JS_SKIP;
+        return;
+    }
+
+    json_stream_frame_t *frame = &js->frames[js->depth++];
+    frame->array = array;
+    frame->index = 0;
+    frame->key[0] = '\0';
+    js->state = array ? JS_ARRAY_FIRST : JS_OBJECT_FIRST;
+}
+
+static void json_stream_close(json_stream_t *js, char c) {
+    if (js->depth == 0 || js->frames[js->depth - 1].array != (c == ']')) {
+        js->state = JS_ERROR;
+        return;
+    }
+    js->depth--;
+    json_stream_after_value(js);
+}
+
+static bool json_stream_is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/* Starts a value at c; returns false if c cannot begin one. */
+static bool json_stream_begin_value(json_stream_t *js, char c) {
+    js->textlen = 0;
+    js->truncated = false;
+
+    switch (c) {
+    case '{':
+    case '[':
+        json_stream_open(js, c == '[');
+        return true;
+    case '"':
+        js->in_key = false;
+        js->state = JS_STRING;
+        return true;
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        js->text[js->textlen++] = c;
+        js->state = JS_NUMBER;
+        return true;
+    case 't':
+    case 'f':
+    case 'n':
+        js->text[js->textlen++] = c;
+        js->state = JS_LITERAL;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Feeds the next piece of the document.  Returns false once it is invalid. */
+bool json_stream_feed(json_stream_t *js, const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+
+    while (p < end) {
+        char c = *p;
+
+        switch (js->state) {
+        case JS_VALUE:
+        case JS_ARRAY_FIRST:
+            if (json_stream_is_space(c))
+                break;
+            if (c == ']' && js->state == JS_ARRAY_FIRST) {
+                json_stream_close(js, c);
+                break;
+            }
+            if (!json_stream_begin_value(js, c))
+                js->state = JS_ERROR;
+            break;
+
+        case JS_OBJECT_FIRST:
+        case JS_KEY:
+            if (json_stream_is_space(c))
+                break;
+            if (c == '}' && js->state == JS_OBJECT_FIRST) {
+                json_stream_close(js, c);
+            } else if (c == '"') {
+                js->textlen = 0;
+                js->truncated = false;
+                js->in_key = true;
+                js->state = JS_STRING;
+            } else {
+                js->state = JS_ERROR;
+            }
+            break;
+
+        case JS_COLON:
+            if (json_stream_is_space(c))
+                break;
+            js->state = c == ':' ? JS_VALUE : JS_ERROR;
+            break;
+
+        case JS_AFTER_VALUE:
+            if (json_stream_is_space(c))
+                break;
+            if (c == ',') {
+                json_stream_frame_t *frame = &js->frames[js->depth - 1];
+                if (frame->array) {
+                    frame->index++;
+                    js->state = JS_VALUE;
+                } else {
+                    js->state = JS_KEY;
+                }
+            } else if (c == '}' || c == ']') {
+                json_stream_close(js, c);
+            } else {
+                js->state = JS_ERROR;
+            }
+            break;
+
+        case JS_STRING: {
+            const char *run = p;
+
+            while (p < end && *p != '"' && *p != '\\')
+                p++;
+            if (p > run || (p < end && *p == '"'))
+                json_stream_unpaired(js);
+            json_stream_text_add(js, run, p - run);
+            if (p == end)
+                return true;
+
+            if (*p == '\\') {
+                js->state = JS_ESCAPE;
+            } else if (js->in_key) {
+                js->text[js->textlen] = '\0';
+                mowgli_strlcpy(js->frames[js->depth - 1].key, js->text, JSON_STREAM_KEYLEN);
+                js->state = JS_COLON;
+            } else {
+                json_stream_emit(js, JSON_STREAM_STRING);
+            }
+            break;
+        }
+
+        case JS_ESCAPE:
+            js->state = JS_STRING;
+            if (c != 'u')
+                json_stream_unpaired(js);
+            switch (c) {
+            case 'b': json_stream_text_add(js, "\b", 1); break;
+            case 'f': json_stream_text_add(js, "\f", 1); break;
+            case 'n': json_stream_text_add(js, "\n", 1); break;
+            case 'r': json_stream_text_add(js, "\r", 1); break;
+            case 't': json_stream_text_add(js, "\t", 1); break;
+            case 'u':
+                js->codepoint = 0;
+                js->hexdigits = 0;
+                js->state = JS_UNICODE;
+                break;
+            default:
+                json_stream_text_add(js, &c, 1);
+                break;
+            }
+            break;
+
+        case JS_UNICODE:
+            if (c >= '0' && c <= '9')
+                js->codepoint = (js->codepoint << 4) | (c - '0');
+            else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                js->codepoint = (js->codepoint << 4) | ((c | 0x20) - 'a' + 10);
+            else {
+                js->state = JS_ERROR;
+                break;
+            }
+
+            if (++js->hexdigits < 4)
+                break;
+
+            js->state = JS_STRING;
+            if (js->codepoint >= 0xd800 && js->codepoint <= 0xdbff) {
+                json_stream_unpaired(js);
+                js->surrogate = js->codepoint;
+            } else if (js->codepoint >= 0xdc00 && js->codepoint <= 0xdfff) {
+                json_stream_text_utf8(js, js->surrogate ? 0x10000 + ((js->surrogate - 0xd800) << 10) + (js->codepoint - 0xdc00) : 0xfffd);
+                js->surrogate = 0;
+            } else {
+                json_stream_unpaired(js);
+                json_stream_text_utf8(js, js->codepoint);
+            }
+            break;
+
+        case JS_NUMBER:
+            if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+                json_stream_text_add(js, &c, 1);
+                break;
+            }
+            json_stream_emit(js, JSON_STREAM_NUMBER);
+            continue;   /* c belongs to whatever follows the number */
+
+        case JS_LITERAL:
+            if (c >= 'a' && c <= 'z') {
+                json_stream_text_add(js, &c, 1);
+                break;
+            }
+            js->text[js->textlen] = '\0';
+            if (!strcmp(js->text, "true"))
+                json_stream_emit(js, JSON_STREAM_TRUE);
+            else if (!strcmp(js->text, "false"))
+                json_stream_emit(js, JSON_STREAM_FALSE);
+            else if (!strcmp(js->text, "null"))
+                json_stream_emit(js, JSON_STREAM_NULL);
+            else
+                js->state = JS_ERROR;
+            continue;
+
+        case JS_SKIP:
+            while (p < end && *p != '"' && *p != '{' && *p != '}' && *p != '[' && *p != ']')
+                p++;
+            if (p == end)
+                return true;
+
+            if (*p == '"') {
+                js->state = JS_SKIP_STRING;
+            } else if (*p == '{' || *p == '[') {
+                js->skip_depth++;
+            } else if (--js->skip_depth == 0) {
+                json_stream_after_value(js);
+            }
+            break;
+
+        case JS_SKIP_STRING:
+            while (p < end && *p != '"' && *p != '\\')
+                p++;
+            if (p == end)
+                return true;
+            js->state = *p == '\\' ? JS_SKIP_ESCAPE : JS_SKIP;
+            break;
+
+        case JS_SKIP_ESCAPE:
+            js->state = JS_SKIP_STRING;
+            break;
+
+        case JS_DONE:
+            if (!json_stream_is_space(c))
+                js->state = JS_ERROR;
+            break;
+
+        case JS_ERROR:
+        default:
+            return false;
+        }
+
+        p++;
+    }
+
+    return js->state != JS_ERROR;
 }
 
-size_t opencage_write_callback(void *ptr, size_t size, size_t nmemb, void *data) {
+/* Ends the document; true if it was complete and valid. */
+bool json_stream_finish(json_stream_t *js) {
+    /* a bare number at the top level has no terminator */
+    if (js->state == JS_NUMBER && js->depth == 0)
+        json_stream_emit(js, JSON_STREAM_NUMBER);
+
+    return js->state == JS_DONE;
+}
+
+size_t weather_write_callback(void *ptr, size_t size, size_t nmemb, void *data) {
     size_t real_size = size * nmemb;
     MemoryStruct *mem = (MemoryStruct *)data;
 
@@ -312,797 +1022,7129 @@ size_t opencage_write_callback(void *ptr, size_t size, size_t nmemb, void *data)
     return real_size;
 }
 
-OpenCage fetch_geocode_data(const char *city) {
-    CURL *curl;
-    CURLcode res;
-    MemoryStruct chunk;
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+/*
+ * Asynchronous fetch engine.
+ *
+ * Every upstream request is an easy handle on one curl multi handle.  curl
+ * tells us which sockets it wants watched and when it next needs a timeout
+ * serviced; both are mapped onto the services event loop, so command
+ * handlers only queue a fetch and return.  When a transfer finishes the
+ * fetch's callback is run with the buffered body.
+ */
+typedef struct weather_fetch_ weather_fetch_t;
+typedef struct weather_api_key_ weather_api_key_t;
+typedef void (*weather_fetch_cb_t)(weather_fetch_t *fetch, CURLcode res);
+
+/*
+ * Millisecond alarms.  mowgli timers tick in whole seconds, too coarse for
+ * a hedge that should go out a few hundred milliseconds into a request.
+ * Pending alarms are kept in order and one timerfd in the event loop is
+ * armed for the earliest; without timerfd a second timer stands in.  The
+ * curl multi handle's timeouts run on these too.
+ */
+typedef struct {
+    uint64_t due;               /* weather_now_us() */
+    void (*fn)(void *arg);
+    void *arg;
+    mowgli_node_t node;
+} weather_alarm_t;
+
+static mowgli_list_t weather_alarms;        /* earliest first */
+#ifdef __linux__
+static int weather_alarm_fd = -1;
+static mowgli_eventloop_pollable_t *weather_alarm_pollable;
+#endif
+static mowgli_eventloop_timer_t *weather_alarm_timer;
+static void weather_alarm_timeout(void *arg);
+
+static void weather_alarm_arm(void) {
+    uint64_t delay = 0, now = weather_now_us();
+
+    if (weather_alarms.head) {
+        weather_alarm_t *first = weather_alarms.head->data;
+
+        /* zero would disarm the timerfd */
+        delay = first->due > now ? first->due - now : 1;
+    }
 
-    if (!chunk.memory) {
-        slog(LG_DEBUG, "Memory allocation failed\n");
-        OpenCage result = {"Memory allocation failed!", "", 1};
-        return result;
+#ifdef __linux__
+    struct itimerspec its = { { 0, 0 }, { delay / 1000000, (delay % 1000000) * 1000 } };
+
+    if (weather_alarm_fd >= 0) {
+        timerfd_settime(weather_alarm_fd, 0, &its, NULL);
+        return;
     }
+#endif
+    if (weather_alarm_timer)
+        mowgli_timer_destroy(base_eventloop, weather_alarm_timer);
+    weather_alarm_timer = NULL;
+    if (weather_alarms.head)
+        weather_alarm_timer = mowgli_timer_add_once(base_eventloop, "weather_alarm_run", weather_alarm_timeout, NULL, (delay + 999999) / 1000000);
+}
 
-    OpenCage result = {"", "", 0};
-    char url[256];
+static void weather_alarm_run(void) {
+    uint64_t now = weather_now_us();
 
-    curl_global_init(CURL_GLOBAL_ALL);
+    while (weather_alarms.head) {
+        weather_alarm_t *alarm = weather_alarms.head->data;
 
-    snprintf(url, sizeof(url), OPENCAGE_URL, city, OPENCAGE_KEY);
-    if (DEBUG_MODE) {
-         slog(LG_DEBUG, url);
-    }
-    curl = curl_easy_init();
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, opencage_write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            strncpy(result.location, "Failed to perform request!", sizeof(result.location));
-            strncpy(result.latlong, "Failed to perform request!", sizeof(result.latlong));
-            result.error_code = res;
-            curl_easy_cleanup(curl);
-            free(chunk.memory);
-            curl_global_cleanup();
-            return result;
-        }
-        curl_easy_cleanup(curl);
-    } else {
-        strncpy(result.location, "curl_easy_init failed!", sizeof(result.location));
-        strncpy(result.latlong, "curl_easy_init failed!", sizeof(result.latlong));
-        result.error_code = 1;
-        free(chunk.memory);
-        curl_global_cleanup();
-        return result;
+        if (alarm->due > now)
+            break;
+        mowgli_node_delete(&alarm->node, &weather_alarms);
+        alarm->fn(alarm->arg);
+        free(alarm);
     }
+    weather_alarm_arm();
+}
 
-    json_t *root;
-    json_error_t error;
+#ifdef __linux__
+static void weather_alarm_io(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io, mowgli_eventloop_io_dir_t dir, void *userdata) {
+    uint64_t expirations;
 
-    root = json_loads(chunk.memory, 0, &error);
-    if (!root) {
-        strncpy(result.location, "Failed to parse JSON!", sizeof(result.location));
-        strncpy(result.latlong, "Failed to parse JSON!", sizeof(result.latlong));
-        result.error_code = 2;
-        free(chunk.memory);
-        curl_global_cleanup();
-        return result;
-    }
+    if (read(weather_alarm_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        slog(LG_DEBUG, "weather: reading the alarm timerfd failed: %s", strerror(errno));
+    weather_alarm_run();
+}
+#endif
 
-    json_t *results = json_object_get(root, "results");
-    if (!results) {
-        strncpy(result.location, "No results found in json!", sizeof(result.location));
-        strncpy(result.latlong, "No results found", sizeof(result.latlong));
-        result.error_code = 3;
-        json_decref(root);
-        free(chunk.memory);
-        curl_global_cleanup();
-        return result;
-    }
+static void weather_alarm_timeout(void *arg) {
+    weather_alarm_timer = NULL;
+    weather_alarm_run();
+}
+
+/* Calls fn(arg) after delay_us, unless cancelled first. */
+static weather_alarm_t *weather_alarm_add(uint64_t delay_us, void (*fn)(void *), void *arg) {
+    weather_alarm_t *alarm = calloc(1, sizeof(weather_alarm_t));
+    mowgli_node_t *n;
+
+    if (!alarm)
+        return NULL;
+    alarm->due = weather_now_us() + delay_us;
+    alarm->fn = fn;
+    alarm->arg = arg;
+
+    /* delays are much alike, so the new one usually belongs near the end */
+    for (n = weather_alarms.tail; n && ((weather_alarm_t *)n->data)->due > alarm->due; n = n->prev)
+        ;
+    mowgli_node_add_before(alarm, &alarm->node, &weather_alarms, n ? n->next : weather_alarms.head);
+    if (weather_alarms.head == &alarm->node)
+        weather_alarm_arm();
+    return alarm;
+}
 
-    json_t *first_result = json_array_get(results, 0);
+static void weather_alarm_cancel(weather_alarm_t *alarm) {
+    bool first = weather_alarms.head == &alarm->node;
+
+    mowgli_node_delete(&alarm->node, &weather_alarms);
+    free(alarm);
+    if (first)
+        weather_alarm_arm();
+}
 
-    const char *locationf = json_string_value(json_object_get(first_result, "formatted"));
-    if (!locationf) {
-        strncpy(result.location, "No location formatted found", sizeof(result.location));
-        strncpy(result.latlong, "No location formatted found", sizeof(result.latlong));
-        result.error_code = 4;
-        json_decref(root);
-        free(chunk.memory);
-        curl_global_cleanup();
-        return result;
+static void init_weather_alarms(void) {
+#ifdef __linux__
+    weather_alarm_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (weather_alarm_fd < 0) {
+        slog(LG_ERROR, "weather: timerfd_create failed: %s", strerror(errno));
+        return;
     }
+    weather_alarm_pollable = mowgli_pollable_create(base_eventloop, weather_alarm_fd, NULL);
+    mowgli_pollable_setselect(base_eventloop, weather_alarm_pollable, MOWGLI_EVENTLOOP_IO_READ, weather_alarm_io);
+#endif
+}
 
-    json_t *geometry = json_object_get(first_result, "geometry");
-    json_t *lat = json_object_get(geometry, "lat");
-    json_t *lng = json_object_get(geometry, "lng");
+static void deinit_weather_alarms(void) {
+    mowgli_node_t *n, *tn;
 
-    if (!lat || !lng) {
-        strncpy(result.location, "No latlong data found!", sizeof(result.location));
-        strncpy(result.latlong, "No latelong data found!", sizeof(result.latlong));
-        result.error_code = 5;
-        json_decref(root);
-        free(chunk.memory);
-        curl_global_cleanup();
-        return result;
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, weather_alarms.head) {
+        mowgli_node_delete(n, &weather_alarms);
+        free(n->data);
     }
+#ifdef __linux__
+    if (weather_alarm_pollable) {
+        mowgli_pollable_setselect(base_eventloop, weather_alarm_pollable, MOWGLI_EVENTLOOP_IO_READ, NULL);
+        mowgli_pollable_destroy(base_eventloop, weather_alarm_pollable);
+        weather_alarm_pollable = NULL;
+    }
+    if (weather_alarm_fd >= 0)
+        close(weather_alarm_fd);
+    weather_alarm_fd = -1;
+#endif
+    weather_alarm_arm();
+}
 
-    double latitude = json_number_value(lat);
-    double longitude = json_number_value(lng);
+/*
+ * Upstream hosts.  Each keeps a few idle easy handles so a fetch starts
+ * from a configured handle, and all of them share one DNS and TLS session
+ * cache; the multi handle keeps the connections themselves alive and
+ * multiplexes HTTP/2 streams over them.
+ */
+#define WEATHER_POOL_SIZE 4
+
+typedef enum {
+    WEATHER_UPSTREAM_OPENCAGE,
+    WEATHER_UPSTREAM_PIRATE,
+    WEATHER_UPSTREAM_OPENMETEO,
+    WEATHER_UPSTREAM_COUNT
+} weather_upstream_id_t;
+
+typedef enum {
+    WEATHER_BREAKER_CLOSED,
+    WEATHER_BREAKER_HALF_OPEN,  /* one probe may go out */
+    WEATHER_BREAKER_OPEN,
+} weather_breaker_state_t;
 
-    snprintf(result.location, sizeof(result.location), "%s", locationf);
-    snprintf(result.latlong, sizeof(result.latlong), "%f,%f", latitude, longitude);
+typedef struct {
+    const char *name;
+    mowgli_list_t idle;
+    unsigned int requests;
+    unsigned int reused;          /* served over an existing connection */
+    unsigned int connects;        /* needed a new connection */
+    curl_off_t bytes_received;    /* body bytes on the wire */
+    curl_off_t bytes_decoded;     /* body bytes after decompression */
+    unsigned int curl_errors[CURL_LAST];
+    unsigned int http_errors;     /* completed with a 4xx or 5xx status */
+    unsigned int cancelled;       /* given up on, e.g. after a hedge won */
+    const char *default_key;
+    char *conf_keys;              /* space separated, from atheme.conf */
+    mowgli_list_t keys;
+    unsigned int per_day;         /* per key, 0 = unknown until the provider says */
+    unsigned int per_second;      /* per key, 0 = no limit */
+    unsigned int budget_rejected; /* no key had budget left */
+    unsigned int reserve_rejected; /* background requests refused to keep a reserve */
+    weather_hist_t latency[2];    /* transfer times, this window and the last */
+    weather_breaker_state_t breaker;
+    unsigned int failures;        /* in a row */
+    unsigned int cooldown;        /* seconds the breaker stays open this time */
+    time_t open_until;
+    time_t breaker_changed;
+    bool probing;                 /* the half-open probe is out */
+    unsigned int opened;
+    unsigned int probes;
+    unsigned int breaker_rejected; /* refused at once while open */
+} weather_upstream_t;
+
+static weather_upstream_t weather_upstreams[WEATHER_UPSTREAM_COUNT] = {
+    [WEATHER_UPSTREAM_OPENCAGE] = { .name = "OpenCage", .default_key = OPENCAGE_KEY },
+    [WEATHER_UPSTREAM_PIRATE] = { .name = "PirateWeather", .default_key = PIRATE_KEY },
+    [WEATHER_UPSTREAM_OPENMETEO] = { .name = "Open-Meteo", .default_key = OPENMETEO_KEY },
+};
+
+static CURLSH *weather_share;
+
+/* Base URLs can be pointed elsewhere from atheme.conf, e.g. at a local
+ * stand-in for load testing. */
+static char *weather_opencage_url;
+static char *weather_pirate_url;
+
+static const char *opencage_url(void) {
+    return weather_opencage_url ? weather_opencage_url : OPENCAGE_URL;
+}
+
+static const char *pirate_url(void) {
+    return weather_pirate_url ? weather_pirate_url : PIRATE_URL;
+}
 
-    json_decref(root);
+/*
+ * API key pool.
+ *
+ * Each upstream can have several keys, listed in atheme.conf, and each key
+ * is budgeted against the provider's per-second and per-day limits.  A
+ * request goes out on the key with the most of its day left.  The count is
+ * ours until the provider says otherwise: RateLimit headers on a response
+ * overwrite it, and a 402/429 parks the key until its reset.
+ *
+ * When the keys of an upstream are down to the reserve, requests nobody is
+ * waiting for (greetings) are refused so the rest goes to users who asked.
+ */
+#define WEATHER_KEY_RESERVE 10      /* percent of the daily budget */
+
+struct weather_api_key_ {
+    char *key;
+    weather_upstream_t *upstream;
+    unsigned int used;              /* since the last reset */
+    unsigned int limit;             /* per day as last reported, 0 = use the configured one */
+    time_t reset;                   /* when used goes back to 0 */
+    time_t second;
+    unsigned int second_used;
+    time_t blocked_until;
+    unsigned int requests;
+    unsigned int inflight;
+    bool retired;                   /* dropped from the configuration */
+    mowgli_node_t node;
+};
+
+static unsigned int weather_key_reserve = WEATHER_KEY_RESERVE;
+
+static time_t weather_next_midnight(time_t now) {
+    return now - now % 86400 + 86400;
+}
 
-    free(chunk.memory);
+static unsigned int weather_key_limit(const weather_api_key_t *key) {
+    return key->limit ? key->limit : key->upstream->per_day;
+}
 
-    curl_global_cleanup();
+static void weather_key_roll(weather_api_key_t *key, time_t now) {
+    if (now < key->reset)
+        return;
 
-    return result;
+    key->used = 0;
+    key->reset = weather_next_midnight(now);
 }
 
-static void ws_cmd_help(sourceinfo_t *si, int parc, char *parv[])
-{
-    bool is_admin = has_priv(si, PRIV_ADMIN);
-    char *command = parv[0];
+/* Requests left today, or UINT_MAX if the key has no known daily limit. */
+static unsigned int weather_key_remaining(weather_api_key_t *key, time_t now) {
+    unsigned int limit = weather_key_limit(key);
 
-    if (!command) {
-        command_success_nodata(si, _("***** \2%s Help\2 *****"), si->service->nick);
-        command_success_nodata(si, _("\2%s\2 provides weather information and related commands, using"), si->service->nick);
-        command_success_nodata(si, _("OpenCage and PirateWeather as sources."));
-        command_success_nodata(si, " ");
-        command_success_nodata(si, _("For more information on a command, type:"));
-        command_success_nodata(si, "\2/%s%s HELP <command>\2", (ircd->uses_rcommand == false) ? "msg " : "", weather->disp);
-        command_success_nodata(si, " ");
-        command_success_nodata(si, "The following commands are available:");
-        command_success_nodata(si, "\2FORECAST\2       Fetches forecast data for a location.");
-        command_success_nodata(si, "\2HELP\2           Displays contextual help information.");
-        command_success_nodata(si, "\2INFO\2           Displays user-specific weather settings information.");
-        command_success_nodata(si, "\2JOIN\2           %s will join channel.", si->service->nick);
-        command_success_nodata(si, "\2SETCOLORS\2      Enables or disables weather colors output.");
-        command_success_nodata(si, "\2SETGREET\2       Enables or disables weather greeting on identify.");
-        command_success_nodata(si, "\2SETWEATHER\2     Sets the default weather location for the user.");
-        if (is_admin) {
-        command_success_nodata(si, "\2SETRATELIMIT\2   Sets the global rate limit for the service.");
-        command_success_nodata(si, "\2CYCLE\2          Forces %s to join stored channels.", si->service->nick);
+    weather_key_roll(key, now);
+    if (!limit)
+        return UINT_MAX;
+    return key->used < limit ? limit - key->used : 0;
+}
+
+static weather_api_key_t *weather_key_create(weather_upstream_t *upstream, const char *name) {
+    weather_api_key_t *key = calloc(1, sizeof(weather_api_key_t));
+
+    if (!key)
+        return NULL;
+    key->key = strdup(name);
+    key->upstream = upstream;
+    key->reset = weather_next_midnight(CURRTIME);
+    mowgli_node_add(key, &key->node, &upstream->keys);
+    return key;
+}
+
+static void weather_key_free(weather_api_key_t *key) {
+    free(key->key);
+    free(key);
+}
+
+/*
+ * Rebuilds the key lists from the configuration.  Keys that are still
+ * listed keep their counts; with none listed the compiled-in key is used.
+ */
+static void weather_keys_configure(void *unused) {
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++) {
+        weather_upstream_t *upstream = &weather_upstreams[i];
+        mowgli_list_t old = upstream->keys;
+        mowgli_node_t *n, *tn;
+        char *list, *name, *save;
+
+        memset(&upstream->keys, 0, sizeof(upstream->keys));
+        list = strdup(upstream->conf_keys && *upstream->conf_keys ? upstream->conf_keys : upstream->default_key);
+        for (name = strtok_r(list, " ,", &save); name; name = strtok_r(NULL, " ,", &save)) {
+            weather_api_key_t *key = NULL;
+
+            MOWGLI_ITER_FOREACH(n, old.head) {
+                if (!strcmp(((weather_api_key_t *)n->data)->key, name)) {
+                    key = n->data;
+                    break;
+                }
+            }
+
+            if (key) {
+                mowgli_node_delete(&key->node, &old);
+                mowgli_node_add(key, &key->node, &upstream->keys);
+            } else {
+                weather_key_create(upstream, name);
+            }
         }
-        command_success_nodata(si, "\2WEATHER\2        Fetches weather data for a location.");
-        command_success_nodata(si, " ");
-        command_success_nodata(si, "\2W\2 and \2F\2 shortcuts for are also available for the weather and forecast.");
-        command_success_nodata(si, " ");
-        command_success_nodata(si, _("***** \2End of Help\2 *****"));
+        free(list);
+
+        /* whatever is left was removed from the configuration */
+        MOWGLI_ITER_FOREACH_SAFE(n, tn, old.head) {
+            weather_api_key_t *key = n->data;
+
+            /* requests still out on it free it when they finish */
+            mowgli_node_delete(&key->node, &old);
+            if (key->inflight)
+                key->retired = true;
+            else
+                weather_key_free(key);
+        }
+    }
+}
+
+/*
+ * Picks the key with the most budget left that may be used this second.
+ * Returns NULL with a reason if there is none, or if this is a background
+ * request and the upstream is down to its reserve.
+ */
+static weather_api_key_t *weather_key_pick(weather_upstream_id_t id, bool background, const char **error) {
+    weather_upstream_t *upstream = &weather_upstreams[id];
+    weather_api_key_t *best = NULL;
+    unsigned int best_remaining = 0;
+    unsigned long long total_limit = 0, total_remaining = 0;
+    time_t now = CURRTIME;
+    mowgli_node_t *n;
+
+    MOWGLI_ITER_FOREACH(n, upstream->keys.head) {
+        weather_api_key_t *key = n->data;
+        unsigned int remaining = weather_key_remaining(key, now);
+
+        if (weather_key_limit(key)) {
+            total_limit += weather_key_limit(key);
+            total_remaining += remaining;
+        }
+
+        if (key->blocked_until > now || !remaining)
+            continue;
+        if (upstream->per_second && key->second == now && key->second_used >= upstream->per_second)
+            continue;
+        if (!best || remaining > best_remaining || (remaining == best_remaining && key->second_used < best->second_used)) {
+            best = key;
+            best_remaining = remaining;
+        }
+    }
+
+    if (!best) {
+        upstream->budget_rejected++;
+        *error = _("The weather service has used up its API quota. Please try again later.");
+        return NULL;
+    }
+
+    if (background && total_limit && total_remaining * 100 < total_limit * weather_key_reserve) {
+        upstream->reserve_rejected++;
+        *error = _("The weather service is low on API quota.");
+        return NULL;
+    }
+
+    return best;
+}
+
+/* Counts a request that is about to go out on the key. */
+static void weather_key_charge(weather_api_key_t *key) {
+    time_t now = CURRTIME;
+
+    weather_key_roll(key, now);
+    if (key->second != now) {
+        key->second = now;
+        key->second_used = 0;
+    }
+    key->second_used++;
+    key->used++;
+    key->requests++;
+    key->inflight++;
+}
+
+/* Header values a response may carry about the key it was made with. */
+typedef struct {
+    long limit;
+    long remaining;
+    long reset;
+    long retry_after;
+} weather_key_headers_t;
+
+static void weather_key_headers_init(weather_key_headers_t *h) {
+    h->limit = h->remaining = h->reset = h->retry_after = -1;
+}
+
+/* Picks out RateLimit-* / X-RateLimit-* and Retry-After; anything else is ignored. */
+static void weather_key_parse_header(weather_key_headers_t *h, const char *line, size_t len) {
+    static const struct {
+        const char *name;
+        size_t offset;
+    } fields[] = {
+        { "ratelimit-limit", offsetof(weather_key_headers_t, limit) },
+        { "ratelimit-remaining", offsetof(weather_key_headers_t, remaining) },
+        { "ratelimit-reset", offsetof(weather_key_headers_t, reset) },
+        { "retry-after", offsetof(weather_key_headers_t, retry_after) },
+    };
+    const char *colon = memchr(line, ':', len);
+    size_t name_len;
+
+    if (!colon)
+        return;
+    if (len > 2 && !strncasecmp(line, "x-", 2)) {
+        line += 2;
+        len -= 2;
+    }
+    name_len = colon - line;
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (strlen(fields[i].name) == name_len && !strncasecmp(line, fields[i].name, name_len)) {
+            char value[32];
+            size_t value_len = line + len - (colon + 1);
+
+            if (value_len >= sizeof(value))
+                value_len = sizeof(value) - 1;
+            memcpy(value, colon + 1, value_len);
+            value[value_len] = '\0';
+            *(long *)((char *)h + fields[i].offset) = strtol(value, NULL, 10);
+            return;
+        }
+    }
+}
+
+/* Settles a finished request against its key. */
+static void weather_key_complete(weather_api_key_t *key, const weather_key_headers_t *h, long status) {
+    time_t now = CURRTIME;
+
+    key->inflight--;
+    if (key->retired) {
+        if (!key->inflight)
+            weather_key_free(key);
         return;
     }
 
-    help_display(si, si->service, command, si->service->commands);
+    /* reset is either a timestamp or seconds from now, depending on the provider */
+    if (h->reset > 0)
+        key->reset = h->reset > 1000000000 ? h->reset : now + h->reset;
+    if (h->limit > 0)
+        key->limit = h->limit;
+    if (h->remaining >= 0 && weather_key_limit(key))
+        key->used = weather_key_limit(key) > (unsigned long)h->remaining ? weather_key_limit(key) - h->remaining : 0;
+
+    if (status == 402 || (status == 429 && h->remaining == 0)) {
+        key->blocked_until = key->reset;
+        slog(LG_INFO, "weather: %s key ...%s is out of quota until %ld", key->upstream->name,
+             key->key + (strlen(key->key) > 4 ? strlen(key->key) - 4 : 0), (long)key->reset);
+    } else if (status == 429) {
+        key->blocked_until = now + (h->retry_after > 0 ? h->retry_after : 1);
+    }
 }
 
-static void ws_cmd_info(sourceinfo_t *si, int parc, char *parv[])
-{
-    const char *latlong = NULL;
-    const char *location = NULL;
-    const char *greet = NULL;
-    const char *colors = NULL;
-    metadata_t *md;
+static void init_weather_keys(void) {
+    add_dupstr_conf_item("OPENCAGE_KEYS", &weather->conf_table, 0, &weather_upstreams[WEATHER_UPSTREAM_OPENCAGE].conf_keys, NULL);
+    add_uint_conf_item("OPENCAGE_DAILY_LIMIT", &weather->conf_table, 0, &weather_upstreams[WEATHER_UPSTREAM_OPENCAGE].per_day, 0, UINT_MAX, 0);
+    add_uint_conf_item("OPENCAGE_SECOND_LIMIT", &weather->conf_table, 0, &weather_upstreams[WEATHER_UPSTREAM_OPENCAGE].per_second, 0, UINT_MAX, 0);
+    add_dupstr_conf_item("PIRATE_KEYS", &weather->conf_table, 0, &weather_upstreams[WEATHER_UPSTREAM_PIRATE].conf_keys, NULL);
+    add_uint_conf_item("PIRATE_DAILY_LIMIT", &weather->conf_table, 0, &weather_upstreams[WEATHER_UPSTREAM_PIRATE].per_day, 0, UINT_MAX, 0);
+    add_uint_conf_item("PIRATE_SECOND_LIMIT", &weather->conf_table, 0, &weather_upstreams[WEATHER_UPSTREAM_PIRATE].per_second, 0, UINT_MAX, 0);
+    add_uint_conf_item("KEY_RESERVE", &weather->conf_table, 0, &weather_key_reserve, 0, 100, WEATHER_KEY_RESERVE);
+    hook_add_event("config_ready");
+    hook_add_config_ready(weather_keys_configure);
+    weather_keys_configure(NULL);
+}
 
-    join("#XYZ", "Weather");
-    md = metadata_find(si->smu, "private:weather:location");
-    if (md)
-        location = md->value;
+/* Must run after the fetch engine is gone, so no request holds a key. */
+static void deinit_weather_keys(void) {
+    hook_del_config_ready(weather_keys_configure);
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++) {
+        weather_upstream_t *upstream = &weather_upstreams[i];
+        mowgli_node_t *n, *tn;
+
+        MOWGLI_ITER_FOREACH_SAFE(n, tn, upstream->keys.head) {
+            weather_api_key_t *key = n->data;
+
+            mowgli_node_delete(n, &upstream->keys);
+            weather_key_free(key);
+        }
+        free(upstream->conf_keys);
+        upstream->conf_keys = NULL;
+    }
+    del_conf_item("OPENCAGE_KEYS", &weather->conf_table);
+    del_conf_item("OPENCAGE_DAILY_LIMIT", &weather->conf_table);
+    del_conf_item("OPENCAGE_SECOND_LIMIT", &weather->conf_table);
+    del_conf_item("PIRATE_KEYS", &weather->conf_table);
+    del_conf_item("PIRATE_DAILY_LIMIT", &weather->conf_table);
+    del_conf_item("PIRATE_SECOND_LIMIT", &weather->conf_table);
+    del_conf_item("KEY_RESERVE", &weather->conf_table);
+}
+
+/* What a finished transfer reports about itself, wherever it ran. */
+typedef struct {
+    long status;
+    long connects;
+    curl_off_t received;        /* body bytes on the wire */
+    curl_off_t dns, connect, tls, total;    /* us from the start of the transfer */
+} weather_fetch_info_t;
+
+struct weather_fetch_ {
+    CURL *curl;                 /* NULL while the fetch worker has it */
+    uint32_t job;               /* fetch worker job id */
+    char *url;                  /* kept for worker jobs, to rerun them here */
+    weather_upstream_t *upstream;
+    long timeout_ms;
+    bool probe;                 /* sent while the breaker was half open */
+    weather_api_key_t *key;
+    weather_key_headers_t headers;
+    weather_fetch_info_t info;
+    json_stream_t *stream;      /* body goes here instead of chunk if set */
+    size_t bytes;
+    uint64_t parse_us;          /* time spent tokenizing the body */
+    MemoryStruct chunk;
+    char errbuf[CURL_ERROR_SIZE];
+    weather_fetch_cb_t callback;
+    void *privdata;
+    mowgli_node_t node;
+};
+
+static CURLM *weather_multi;
+static weather_alarm_t *weather_multi_alarm;
+static mowgli_list_t weather_fetches;
+static bool weather_fetch_shutdown;
+static const char *weather_fetch_error;    /* why the last weather_fetch_submit() failed */
+
+typedef enum {
+    WEATHER_WORKER_OFF,         /* not running; fetch in process */
+    WEATHER_WORKER_QUEUED,
+    WEATHER_WORKER_FULL,
+} weather_worker_status_t;
+
+static weather_worker_status_t weather_worker_submit(weather_fetch_t *fetch, const char *url);
+static void weather_worker_forget(weather_fetch_t *fetch, bool cancel);
+
+/*
+ * Pollables curl has finished with.  mowgli may still dispatch events for
+ * them later in the same loop iteration, so they are only unregistered when
+ * curl removes the socket and freed from a timer afterwards.
+ */
+static mowgli_list_t weather_dead_pollables;
+static mowgli_eventloop_timer_t *weather_reap_timer;
+
+static void weather_reap_pollables(void *arg) {
+    mowgli_node_t *n, *tn;
+
+    weather_reap_timer = NULL;
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, weather_dead_pollables.head) {
+        mowgli_eventloop_pollable_t *pollable = n->data;
+
+        mowgli_node_delete(n, &weather_dead_pollables);
+        mowgli_node_free(n);
+        mowgli_pollable_destroy(base_eventloop, pollable);
+    }
+}
 
-    md = metadata_find(si->smu, "private:weather:latlong");
-    if (md)
-        latlong = md->value;
+/* Unregisters a pollable at once and frees it after the current loop iteration. */
+static void weather_pollable_retire(mowgli_eventloop_pollable_t *pollable) {
+    mowgli_pollable_setselect(base_eventloop, pollable, MOWGLI_EVENTLOOP_IO_READ, NULL);
+    mowgli_pollable_setselect(base_eventloop, pollable, MOWGLI_EVENTLOOP_IO_WRITE, NULL);
 
-    md = metadata_find(si->smu, "private:weather:greet");
-    if (md)
-        greet = md->value;
+    /* already unregistered; don't let the later destroy touch a reused fd */
+    pollable->fd = -1;
+    mowgli_node_add(pollable, mowgli_node_create(), &weather_dead_pollables);
+    if (!weather_reap_timer)
+        weather_reap_timer = mowgli_timer_add_once(base_eventloop, "weather_reap_pollables", weather_reap_pollables, NULL, 0);
+}
 
-    md = metadata_find(si->smu, "private:weather:colors");
-    if (md)
-        colors = md->value;
+/* Feeds the body to the fetch's JSON stream, or buffers it if it has none. */
+static size_t fetch_write_callback(void *ptr, size_t size, size_t nmemb, void *data) {
+    weather_fetch_t *fetch = data;
+    size_t real_size = size * nmemb;
 
-    command_success_nodata(si, "Weather information for \2%s:\2", entity(si->smu)->name);
-    if (location)
-        command_success_nodata(si, " Default location: %s", location);
-    else
-        command_success_nodata(si, " Default location: Not set");
+    fetch->bytes += real_size;
+    if (!fetch->stream)
+        return weather_write_callback(ptr, size, nmemb, &fetch->chunk);
 
-    if (latlong)
-        command_success_nodata(si, "Default lat, long: %s", latlong);
-    else
-        command_success_nodata(si, "Default lat, long: Not set");
+    /* a broken document is reported by the stream when the fetch completes */
+    uint64_t start = weather_now_us();
+    json_stream_feed(fetch->stream, ptr, real_size);
+    fetch->parse_us += weather_now_us() - start;
+    return real_size;
+}
+
+static size_t fetch_header_callback(char *buffer, size_t size, size_t nitems, void *data) {
+    weather_fetch_t *fetch = data;
+
+    weather_key_parse_header(&fetch->headers, buffer, size * nitems);
+    return size * nitems;
+}
+
+static CURL *weather_upstream_get_handle(weather_upstream_t *upstream) {
+    CURL *curl;
+
+    if (upstream->idle.head) {
+        mowgli_node_t *n = upstream->idle.head;
+
+        curl = n->data;
+        mowgli_node_delete(n, &upstream->idle);
+        mowgli_node_free(n);
+        return curl;
+    }
+
+    curl = curl_easy_init();
+    if (!curl)
+        return NULL;
+
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_SHARE, weather_share);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fetch_write_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, fetch_header_callback);
+    /* "" offers every encoding this libcurl can decode (gzip, brotli, ...) */
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    return curl;
+}
+
+static void weather_upstream_put_handle(weather_upstream_t *upstream, CURL *curl) {
+    if (weather_fetch_shutdown || MOWGLI_LIST_LENGTH(&upstream->idle) >= WEATHER_POOL_SIZE) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+
+    /* nothing in an idle handle may point at a freed fetch */
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+    mowgli_node_add(curl, mowgli_node_create(), &upstream->idle);
+}
+
+static void weather_fetch_info(CURL *curl, weather_fetch_info_t *info) {
+    memset(info, 0, sizeof(*info));
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &info->status);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &info->connects);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &info->received);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &info->dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &info->connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &info->tls);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &info->total);
+}
+
+/*
+ * Timeouts and circuit breakers.
+ *
+ * A request gets a total timeout of WEATHER_TIMEOUT_FACTOR times its
+ * upstream's recent p99 transfer time, kept between fetch_timeout_min and
+ * fetch_timeout_max, and the maximum until there are enough samples.  Only
+ * completed transfers are sampled, so requests that hang do not drag the
+ * limit up after them.
+ *
+ * After breaker_failures transport errors or 5xx answers in a row an
+ * upstream's breaker opens, and requests to it fail at once for
+ * breaker_cooldown: forecasts go to the next provider, and stale ones are
+ * served within the grace.  Then the breaker is half open and one request
+ * goes out as a probe, with the maximum timeout so that an upstream that
+ * has only got slower gets back in and its new latency is learnt.  If it
+ * works the breaker closes; if not it opens again for twice as long, up to
+ * WEATHER_BREAKER_COOLDOWN_MAX.
+ */
+#define WEATHER_TIMEOUT_FACTOR 3
+#define WEATHER_TIMEOUT_MIN 2               /* seconds */
+#define WEATHER_TIMEOUT_MAX 20
+#define WEATHER_TIMEOUT_WINDOW 500          /* samples per latency window */
+#define WEATHER_TIMEOUT_MIN_SAMPLES 20
+#define WEATHER_CONNECT_TIMEOUT 5000        /* ms, at most */
+#define WEATHER_BREAKER_FAILURES 5
+#define WEATHER_BREAKER_COOLDOWN 30
+#define WEATHER_BREAKER_COOLDOWN_MAX 600
+
+static const char *weather_breaker_names[] = { "closed", "half open", "open" };
+
+static unsigned int weather_timeout_min = WEATHER_TIMEOUT_MIN;
+static unsigned int weather_timeout_max = WEATHER_TIMEOUT_MAX;
+static unsigned int weather_breaker_failures = WEATHER_BREAKER_FAILURES;
+static unsigned int weather_breaker_cooldown = WEATHER_BREAKER_COOLDOWN;
+
+static long weather_upstream_timeout(const weather_upstream_t *upstream) {
+    uint64_t ms;
+
+    if (upstream->latency[0].count + upstream->latency[1].count < WEATHER_TIMEOUT_MIN_SAMPLES)
+        return weather_timeout_max * 1000L;
+    ms = weather_window_percentile(upstream->latency, 99) * WEATHER_TIMEOUT_FACTOR / 1000;
+    if (ms > weather_timeout_max * 1000ULL)
+        ms = weather_timeout_max * 1000ULL;
+    if (ms < weather_timeout_min * 1000ULL)
+        ms = weather_timeout_min * 1000ULL;
+    return (long)ms;
+}
+
+static void weather_breaker_set(weather_upstream_t *upstream, weather_breaker_state_t state) {
+    slog(LG_INFO, "weather: %s circuit breaker %s -> %s", upstream->name, weather_breaker_names[upstream->breaker], weather_breaker_names[state]);
+    upstream->breaker = state;
+    upstream->breaker_changed = CURRTIME;
+}
+
+static void weather_breaker_open(weather_upstream_t *upstream, unsigned int cooldown) {
+    upstream->cooldown = cooldown;
+    upstream->open_until = CURRTIME + cooldown;
+    upstream->opened++;
+    weather_breaker_set(upstream, WEATHER_BREAKER_OPEN);
+}
+
+/* Whether a request may go to the upstream now; the half-open probe is marked on the fetch. */
+static bool weather_breaker_admit(weather_upstream_t *upstream, weather_fetch_t *fetch) {
+    if (upstream->breaker == WEATHER_BREAKER_OPEN && upstream->open_until <= CURRTIME)
+        weather_breaker_set(upstream, WEATHER_BREAKER_HALF_OPEN);
+    if (upstream->breaker == WEATHER_BREAKER_CLOSED)
+        return true;
+
+    /* a probe that was cancelled leaves the next request to probe */
+    if (upstream->breaker == WEATHER_BREAKER_HALF_OPEN && !upstream->probing) {
+        upstream->probing = fetch->probe = true;
+        upstream->probes++;
+        fetch->timeout_ms = weather_timeout_max * 1000L;
+        return true;
+    }
+    upstream->breaker_rejected++;
+    return false;
+}
 
-    if (greet && !strcasecmp(greet, "ON"))
-        command_success_nodata(si, "    Greet setting: Enabled");
+/* Counts a finished transfer towards its upstream's timeout and breaker. */
+static void weather_breaker_settle(weather_fetch_t *fetch, CURLcode res) {
+    weather_upstream_t *upstream = fetch->upstream;
+    bool failed = res != CURLE_OK || fetch->info.status >= 500;
+
+    if (res == CURLE_OK)
+        weather_window_add(upstream->latency, WEATHER_TIMEOUT_WINDOW, fetch->info.total);
+
+    /* everything is aborted at unload, which says nothing about the upstream */
+    if (weather_fetch_shutdown)
+        return;
+
+    if (fetch->probe) {
+        unsigned int cooldown = upstream->cooldown * 2;
+
+        upstream->probing = fetch->probe = false;
+        if (!failed) {
+            upstream->failures = 0;
+            weather_breaker_set(upstream, WEATHER_BREAKER_CLOSED);
+            return;
+        }
+        if (cooldown > WEATHER_BREAKER_COOLDOWN_MAX)
+            cooldown = WEATHER_BREAKER_COOLDOWN_MAX;
+        weather_breaker_open(upstream, cooldown > weather_breaker_cooldown ? cooldown : weather_breaker_cooldown);
+        return;
+    }
+
+    if (!failed) {
+        upstream->failures = 0;
+    } else if (++upstream->failures >= weather_breaker_failures && weather_breaker_failures &&
+               upstream->breaker == WEATHER_BREAKER_CLOSED) {
+        weather_breaker_open(upstream, weather_breaker_cooldown);
+    }
+}
+
+static void weather_breaker_show(sourceinfo_t *si, const weather_upstream_t *upstream) {
+    uint64_t samples = upstream->latency[0].count + upstream->latency[1].count;
+    char state[64];
+    size_t len;
+
+    if (upstream->breaker == WEATHER_BREAKER_OPEN)
+        len = snprintf(state, sizeof(state), "open for %lds more", (long)(upstream->open_until > CURRTIME ? upstream->open_until - CURRTIME : 0));
     else
-        command_success_nodata(si, "    Greet setting: %s", greet);
+        len = snprintf(state, sizeof(state), "%s", weather_breaker_names[upstream->breaker]);
+    if (upstream->breaker_changed && len < sizeof(state))
+        snprintf(state + len, sizeof(state) - len, ", changed %lds ago", (long)(CURRTIME - upstream->breaker_changed));
+
+    command_success_nodata(si, "  Timeout: %ld ms (p99 %.0f ms over %llu transfers)  Breaker: %s, %u failures in a row",
+        weather_upstream_timeout(upstream), weather_window_percentile(upstream->latency, 99) / 1000.0, (unsigned long long)samples,
+        state, upstream->failures);
+    if (upstream->opened)
+        command_success_nodata(si, "  Breaker opened %u times, %u probes, %u requests refused while open",
+            upstream->opened, upstream->probes, upstream->breaker_rejected);
+}
+
+static void weather_upstream_account(weather_fetch_t *fetch, CURLcode res) {
+    weather_upstream_t *upstream = fetch->upstream;
+    long connects = fetch->info.connects;
+    curl_off_t dns = fetch->info.dns, connect = fetch->info.connect, tls = fetch->info.tls, total = fetch->info.total;
 
-    if (greet && !strcasecmp(greet, "ON"))
-        command_success_nodata(si, "    Greet setting: Enabled");
+    weather_breaker_settle(fetch, res);
+    upstream->requests++;
+    if (connects > 0)
+        upstream->connects++;
     else
-        command_success_nodata(si, "    Greet setting: %s", greet);
+        upstream->reused++;
 
-    if (colors && !strcasecmp(colors, "ON"))
-        command_success_nodata(si, "    Colors setting: Enabled");
+    if (res != CURLE_OK) {
+        if (res < CURL_LAST)
+            upstream->curl_errors[res]++;
+    } else if (fetch->info.status >= 400) {
+        upstream->http_errors++;
+    }
+
+    /* curl's timings are microseconds from the start of the transfer */
+    if (connects > 0) {
+        weather_hist_add(&weather_stage_hist[WEATHER_STAGE_DNS], dns);
+        weather_hist_add(&weather_stage_hist[WEATHER_STAGE_CONNECT], connect > dns ? connect - dns : 0);
+        if (tls > 0)
+            weather_hist_add(&weather_stage_hist[WEATHER_STAGE_TLS], tls > connect ? tls - connect : 0);
+    }
+    if (res == CURLE_OK) {
+        curl_off_t ready = tls > connect ? tls : connect;
+
+        weather_hist_add(&weather_stage_hist[WEATHER_STAGE_TRANSFER], total > ready ? total - ready : 0);
+        if (fetch->stream)
+            weather_hist_add(&weather_stage_hist[WEATHER_STAGE_PARSE], fetch->parse_us);
+    }
+
+    /* the download counter is taken before content decoding */
+    upstream->bytes_received += fetch->info.received;
+    upstream->bytes_decoded += fetch->bytes;
+}
+
+static void weather_fetch_free(weather_fetch_t *fetch) {
+    /* a probe that never finished leaves the next request to probe */
+    if (fetch->probe)
+        fetch->upstream->probing = false;
+    if (fetch->curl)
+        weather_upstream_put_handle(fetch->upstream, fetch->curl);
+    free(fetch->url);
+    free(fetch->chunk.memory);
+    free(fetch);
+}
+
+/* For a worker job, fetch->info and the parse state are already filled in. */
+static void weather_fetch_finish(weather_fetch_t *fetch, CURLcode res) {
+    if (fetch->curl) {
+        curl_multi_remove_handle(weather_multi, fetch->curl);
+        weather_fetch_info(fetch->curl, &fetch->info);
+    } else {
+        weather_worker_forget(fetch, false);
+    }
+    mowgli_node_delete(&fetch->node, &weather_fetches);
+
+    weather_upstream_account(fetch, res);
+    if (fetch->key)
+        weather_key_complete(fetch->key, &fetch->headers, fetch->info.status);
+    if (fetch->callback)
+        fetch->callback(fetch, res);
+
+    weather_fetch_free(fetch);
+}
+
+/* Drops a fetch nobody is waiting for any more; its callback is not called. */
+static void weather_fetch_cancel(weather_fetch_t *fetch) {
+    if (fetch->curl)
+        curl_multi_remove_handle(weather_multi, fetch->curl);
     else
-        command_success_nodata(si, "    Colors setting: %s", greet);
+        weather_worker_forget(fetch, true);
+    mowgli_node_delete(&fetch->node, &weather_fetches);
 
+    fetch->upstream->cancelled++;
+    if (fetch->key)
+        weather_key_complete(fetch->key, &fetch->headers, 0);
+
+    weather_fetch_free(fetch);
 }
 
-static void ws_cmd_weather(sourceinfo_t *si, int parc, char *parv[])
-{
-    const char *templocation = parv[0];
-    char *weather_data;
-    if (!check_rate_limit(si)) {
-        // Rate limit check failed
+static void weather_multi_check_info(void) {
+    CURLMsg *message;
+    int pending;
+
+    while ((message = curl_multi_info_read(weather_multi, &pending)) != NULL) {
+        weather_fetch_t *fetch = NULL;
+        CURLcode res;
+
+        if (message->msg != CURLMSG_DONE)
+            continue;
+
+        /* message is invalidated once the handle leaves the multi */
+        res = message->data.result;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&fetch);
+        if (fetch)
+            weather_fetch_finish(fetch, res);
+    }
+}
+
+static void weather_multi_io(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io, mowgli_eventloop_io_dir_t dir, void *userdata) {
+    mowgli_eventloop_pollable_t *pollable = mowgli_eventloop_io_pollable(io);
+    int running;
+
+    curl_multi_socket_action(weather_multi, pollable->fd, dir == MOWGLI_EVENTLOOP_IO_READ ? CURL_CSELECT_IN : CURL_CSELECT_OUT, &running);
+    weather_multi_check_info();
+}
+
+static int weather_multi_socket_cb(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    mowgli_eventloop_pollable_t *pollable = socketp;
+
+    if (what == CURL_POLL_REMOVE) {
+        if (pollable) {
+            curl_multi_assign(weather_multi, s, NULL);
+            weather_pollable_retire(pollable);
+        }
+        return 0;
+    }
+
+    if (!pollable) {
+        pollable = mowgli_pollable_create(base_eventloop, s, NULL);
+        curl_multi_assign(weather_multi, s, pollable);
+    }
+
+    mowgli_pollable_setselect(base_eventloop, pollable, MOWGLI_EVENTLOOP_IO_READ, (what & CURL_POLL_IN) ? weather_multi_io : NULL);
+    mowgli_pollable_setselect(base_eventloop, pollable, MOWGLI_EVENTLOOP_IO_WRITE, (what & CURL_POLL_OUT) ? weather_multi_io : NULL);
+    return 0;
+}
+
+static void weather_multi_timeout(void *arg) {
+    int running;
+
+    weather_multi_alarm = NULL;
+    curl_multi_socket_action(weather_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    weather_multi_check_info();
+}
+
+static int weather_multi_timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+    if (weather_multi_alarm) {
+        weather_alarm_cancel(weather_multi_alarm);
+        weather_multi_alarm = NULL;
+    }
+
+    if (timeout_ms >= 0)
+        weather_multi_alarm = weather_alarm_add((uint64_t)timeout_ms * 1000, weather_multi_timeout, NULL);
+
+    return 0;
+}
+
+static bool init_fetch_engine(void) {
+    add_duration_conf_item("FETCH_TIMEOUT_MIN", &weather->conf_table, 0, &weather_timeout_min, "s", WEATHER_TIMEOUT_MIN);
+    add_duration_conf_item("FETCH_TIMEOUT_MAX", &weather->conf_table, 0, &weather_timeout_max, "s", WEATHER_TIMEOUT_MAX);
+    add_uint_conf_item("BREAKER_FAILURES", &weather->conf_table, 0, &weather_breaker_failures, 0, 1000, WEATHER_BREAKER_FAILURES);
+    add_duration_conf_item("BREAKER_COOLDOWN", &weather->conf_table, 0, &weather_breaker_cooldown, "s", WEATHER_BREAKER_COOLDOWN);
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    weather_multi = curl_multi_init();
+    if (!weather_multi) {
+        slog(LG_ERROR, "weather: curl_multi_init failed");
+        return false;
+    }
+
+    curl_multi_setopt(weather_multi, CURLMOPT_SOCKETFUNCTION, weather_multi_socket_cb);
+    curl_multi_setopt(weather_multi, CURLMOPT_TIMERFUNCTION, weather_multi_timer_cb);
+    curl_multi_setopt(weather_multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+
+    /* services are single threaded, so the share needs no lock callbacks */
+    weather_share = curl_share_init();
+    if (weather_share) {
+        curl_share_setopt(weather_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(weather_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    init_weather_alarms();
+    return true;
+}
+
+static void deinit_fetch_engine(void) {
+    mowgli_node_t *n, *tn;
+
+    /*
+     * Abandon anything still in flight.  Callbacks still run so they can
+     * release their requests, but nothing new can be submitted and no
+     * replies go out.
+     */
+    weather_fetch_shutdown = true;
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, weather_fetches.head) {
+        weather_fetch_finish(n->data, CURLE_ABORTED_BY_CALLBACK);
+    }
+    del_conf_item("FETCH_TIMEOUT_MIN", &weather->conf_table);
+    del_conf_item("FETCH_TIMEOUT_MAX", &weather->conf_table);
+    del_conf_item("BREAKER_FAILURES", &weather->conf_table);
+    del_conf_item("BREAKER_COOLDOWN", &weather->conf_table);
+
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++) {
+        MOWGLI_ITER_FOREACH_SAFE(n, tn, weather_upstreams[i].idle.head) {
+            curl_easy_cleanup(n->data);
+            mowgli_node_delete(n, &weather_upstreams[i].idle);
+            mowgli_node_free(n);
+        }
+    }
+
+    curl_multi_cleanup(weather_multi);
+    weather_multi = NULL;
+    if (weather_share) {
+        curl_share_cleanup(weather_share);
+        weather_share = NULL;
+    }
+
+    if (weather_multi_alarm) {
+        weather_alarm_cancel(weather_multi_alarm);
+        weather_multi_alarm = NULL;
+    }
+    deinit_weather_alarms();
+
+    if (weather_reap_timer) {
+        mowgli_timer_destroy(base_eventloop, weather_reap_timer);
+        weather_reap_timer = NULL;
+    }
+    weather_reap_pollables(NULL);
+
+    curl_global_cleanup();
+}
+
+/* Puts the transfer on a multi handle; the fetch worker runs its jobs with this too. */
+static bool weather_fetch_start(CURLM *multi, weather_fetch_t *fetch, const char *url) {
+    fetch->curl = weather_upstream_get_handle(fetch->upstream);
+    if (!fetch->curl) {
+        slog(LG_DEBUG, "curl_easy_init failed!");
+        return false;
+    }
+
+    curl_easy_setopt(fetch->curl, CURLOPT_URL, url);
+    curl_easy_setopt(fetch->curl, CURLOPT_WRITEDATA, (void *)fetch);
+    curl_easy_setopt(fetch->curl, CURLOPT_HEADERDATA, (void *)fetch);
+    curl_easy_setopt(fetch->curl, CURLOPT_ERRORBUFFER, fetch->errbuf);
+    curl_easy_setopt(fetch->curl, CURLOPT_PRIVATE, (void *)fetch);
+    curl_easy_setopt(fetch->curl, CURLOPT_TIMEOUT_MS, fetch->timeout_ms);
+    curl_easy_setopt(fetch->curl, CURLOPT_CONNECTTIMEOUT_MS, fetch->timeout_ms < WEATHER_CONNECT_TIMEOUT ? fetch->timeout_ms : (long)WEATHER_CONNECT_TIMEOUT);
+
+    if (curl_multi_add_handle(multi, fetch->curl) != CURLM_OK) {
+        weather_upstream_put_handle(fetch->upstream, fetch->curl);
+        fetch->curl = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Starts a request made with key, which must come from weather_key_pick().
+ * On failure weather_fetch_error says why.
+ */
+static weather_fetch_t *weather_fetch_submit(weather_api_key_t *key, const char *url, json_stream_t *stream, weather_fetch_cb_t callback, void *privdata) {
+    weather_fetch_error = "curl_easy_init failed!";
+    if (weather_fetch_shutdown)
+        return NULL;
+
+    weather_fetch_t *fetch = calloc(1, sizeof(weather_fetch_t));
+    if (!fetch) {
+        slog(LG_DEBUG, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    fetch->stream = stream;
+    fetch->callback = callback;
+    fetch->privdata = privdata;
+    fetch->upstream = key->upstream;
+    fetch->timeout_ms = weather_upstream_timeout(fetch->upstream);
+    weather_key_headers_init(&fetch->headers);
+
+    if (!weather_breaker_admit(fetch->upstream, fetch)) {
+        weather_fetch_error = _("The weather service is not responding. Please try again shortly.");
+        weather_fetch_free(fetch);
+        return NULL;
+    }
+
+    if (DEBUG_MODE) {
+        slog(LG_DEBUG, "%s", url);
+    }
+
+    switch (weather_worker_submit(fetch, url)) {
+    case WEATHER_WORKER_QUEUED:
+        break;
+    case WEATHER_WORKER_FULL:
+        weather_fetch_error = _("Too many requests in progress, please try again shortly.");
+        weather_fetch_free(fetch);
+        return NULL;
+    case WEATHER_WORKER_OFF:
+        if (!weather_fetch_start(weather_multi, fetch, url)) {
+            weather_fetch_free(fetch);
+            return NULL;
+        }
+        break;
+    }
+    mowgli_node_add(fetch, &fetch->node, &weather_fetches);
+
+    fetch->key = key;
+    weather_key_charge(key);
+    return fetch;
+}
+
+/* One line per key; only the end of each key is shown. */
+static void weather_keys_show(sourceinfo_t *si, weather_upstream_t *upstream) {
+    time_t now = CURRTIME;
+    mowgli_node_t *n;
+
+    MOWGLI_ITER_FOREACH(n, upstream->keys.head) {
+        weather_api_key_t *key = n->data;
+        size_t len = strlen(key->key);
+        unsigned int remaining = weather_key_remaining(key, now);
+        char budget[64] = "no known daily limit";
+
+        if (remaining != UINT_MAX)
+            snprintf(budget, sizeof(budget), "%u of %u left for %ldm", remaining, weather_key_limit(key), (long)(key->reset - now) / 60);
+        command_success_nodata(si, "  Key ...%s: %u requests, %u today, %s, %u in flight%s", key->key + (len > 4 ? len - 4 : 0),
+            key->requests, key->used, budget, key->inflight, key->blocked_until > now ? ", blocked" : "");
+    }
+    if (upstream->budget_rejected || upstream->reserve_rejected)
+        command_success_nodata(si, "  Refused: %u out of quota, %u background requests held back for the reserve",
+            upstream->budget_rejected, upstream->reserve_rejected);
+}
+
+static void ws_cmd_upstreams(sourceinfo_t *si, int parc, char *parv[]) {
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++) {
+        weather_upstream_t *upstream = &weather_upstreams[i];
+        curl_off_t saved = upstream->bytes_decoded - upstream->bytes_received;
+
+        command_success_nodata(si, "\2%s:\2 %u requests, %u cancelled, %u reused connections, %u new connections, %zu idle handles", upstream->name,
+            upstream->requests, upstream->cancelled, upstream->reused, upstream->connects, MOWGLI_LIST_LENGTH(&upstream->idle));
+        command_success_nodata(si, "  Received: %lld bytes  Decoded: %lld bytes  Saved by compression: %lld bytes",
+            (long long)upstream->bytes_received, (long long)upstream->bytes_decoded, (long long)(saved > 0 ? saved : 0));
+        weather_breaker_show(si, upstream);
+        weather_keys_show(si, upstream);
+    }
+    weather_worker_show(si);
+}
+static void ws_cmd_stats(sourceinfo_t *si, int parc, char *parv[]) {
+    char line[BUFSIZE];
+    size_t len;
+
+    command_success_nodata(si, "\2%-10s %8s %9s %9s %9s %9s\2", "Stage", "Count", "p50 ms", "p90 ms", "p99 ms", "Max ms");
+    for (int i = 0; i < WEATHER_STAGE_COUNT; i++) {
+        const weather_hist_t *hist = &weather_stage_hist[i];
+
+        if (!hist->count)
+            continue;
+        command_success_nodata(si, "%-10s %8llu %9.2f %9.2f %9.2f %9.2f", weather_stage_names[i], (unsigned long long)hist->count,
+            weather_hist_percentile(hist, 50) / 1000.0, weather_hist_percentile(hist, 90) / 1000.0,
+            weather_hist_percentile(hist, 99) / 1000.0, hist->max / 1000.0);
+    }
+
+    len = snprintf(line, sizeof(line), "\2Requests:\2");
+    for (int i = 0; i < WEATHER_COMMAND_COUNT && len < sizeof(line); i++)
+        len += snprintf(line + len, sizeof(line) - len, " %s %u", weather_command_names[i], weather_command_counts[i]);
+    command_success_nodata(si, "%s", line);
+
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++) {
+        weather_upstream_t *upstream = &weather_upstreams[i];
+
+        len = snprintf(line, sizeof(line), "\2%s errors:\2 HTTP %u", upstream->name, upstream->http_errors);
+        for (int code = 1; code < CURL_LAST && len < sizeof(line); code++) {
+            if (upstream->curl_errors[code])
+                len += snprintf(line + len, sizeof(line) - len, ", %s (%d) %u", curl_easy_strerror(code), code, upstream->curl_errors[code]);
+        }
+        command_success_nodata(si, "%s", line);
+    }
+    weather_providers_show(si);
+    weather_greet_stats(si);
+}
+
+/*
+ * Periodic dump of the same numbers in Prometheus text format, for a node
+ * exporter textfile collector or similar.  Off unless stats_file is set.
+ */
+#define WEATHER_STATS_INTERVAL 60
+
+static char *weather_stats_file;
+static unsigned int weather_stats_interval = WEATHER_STATS_INTERVAL;
+static mowgli_eventloop_timer_t *weather_stats_timer;
+
+static void weather_stats_write_hist(FILE *f, const char *stage, const weather_hist_t *hist) {
+    uint64_t cumulative = 0;
+
+    /* one bound per power of two, stopping once every sample is covered */
+    for (unsigned int i = 0; i < WEATHER_HIST_BUCKETS; i++) {
+        cumulative += hist->buckets[i];
+        if (i % 4 == 3) {
+            fprintf(f, "weather_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage,
+                (weather_hist_bucket_max(i) + 1) / 1e6, (unsigned long long)cumulative);
+            if (cumulative == hist->count && weather_hist_bucket_max(i) >= hist->max)
+                break;
+        }
+    }
+    fprintf(f, "weather_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage, (unsigned long long)hist->count);
+    fprintf(f, "weather_stage_duration_seconds_sum{stage=\"%s\"} %g\n", stage, hist->sum / 1e6);
+    fprintf(f, "weather_stage_duration_seconds_count{stage=\"%s\"} %llu\n", stage, (unsigned long long)hist->count);
+}
+
+static void weather_stats_dump(void *arg) {
+    char path[BUFSIZE], tmp[BUFSIZE + 4];
+    FILE *f;
+
+    if (!weather_stats_file)
+        return;
+
+    if (weather_stats_file[0] == '/')
+        mowgli_strlcpy(path, weather_stats_file, sizeof(path));
+    else
+        snprintf(path, sizeof(path), "%s/%s", DATADIR, weather_stats_file);
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+    f = fopen(tmp, "w");
+    if (!f) {
+        slog(LG_ERROR, "weather: cannot write %s: %s", tmp, strerror(errno));
         return;
     }
 
-    if((si->smu == NULL) && templocation == NULL) {
-        command_fail(si, fault_needmoreparams, _("No location was requested or use SETWEATHER to set default location."));
-        return;
+    fprintf(f, "# HELP weather_stage_duration_seconds Time spent in each stage of a request.\n");
+    fprintf(f, "# TYPE weather_stage_duration_seconds histogram\n");
+    for (int i = 0; i < WEATHER_STAGE_COUNT; i++)
+        weather_stats_write_hist(f, weather_stage_names[i], &weather_stage_hist[i]);
+
+    fprintf(f, "# HELP weather_requests_total Requests by command.\n");
+    fprintf(f, "# TYPE weather_requests_total counter\n");
+    for (int i = 0; i < WEATHER_COMMAND_COUNT; i++)
+        fprintf(f, "weather_requests_total{command=\"%s\"} %u\n", weather_command_names[i], weather_command_counts[i]);
+
+    fprintf(f, "# HELP weather_upstream_requests_total Requests made to each upstream API.\n");
+    fprintf(f, "# TYPE weather_upstream_requests_total counter\n");
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++)
+        fprintf(f, "weather_upstream_requests_total{upstream=\"%s\"} %u\n", weather_upstreams[i].name, weather_upstreams[i].requests);
+
+    fprintf(f, "# HELP weather_upstream_errors_total Failed upstream requests by curl code, or \"http\" for 4xx/5xx answers.\n");
+    fprintf(f, "# TYPE weather_upstream_errors_total counter\n");
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++) {
+        weather_upstream_t *upstream = &weather_upstreams[i];
+
+        fprintf(f, "weather_upstream_errors_total{upstream=\"%s\",code=\"http\"} %u\n", upstream->name, upstream->http_errors);
+        for (int code = 1; code < CURL_LAST; code++) {
+            if (upstream->curl_errors[code])
+                fprintf(f, "weather_upstream_errors_total{upstream=\"%s\",code=\"%d\"} %u\n", upstream->name, code, upstream->curl_errors[code]);
+        }
+    }
+
+    fprintf(f, "# HELP weather_upstream_timeout_seconds Total timeout the next request to each upstream gets.\n");
+    fprintf(f, "# TYPE weather_upstream_timeout_seconds gauge\n");
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++)
+        fprintf(f, "weather_upstream_timeout_seconds{upstream=\"%s\"} %g\n", weather_upstreams[i].name, weather_upstream_timeout(&weather_upstreams[i]) / 1e3);
+
+    fprintf(f, "# HELP weather_upstream_breaker_state Circuit breaker of each upstream: 0 closed, 1 half open, 2 open.\n");
+    fprintf(f, "# TYPE weather_upstream_breaker_state gauge\n");
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++)
+        fprintf(f, "weather_upstream_breaker_state{upstream=\"%s\"} %d\n", weather_upstreams[i].name, (int)weather_upstreams[i].breaker);
+
+    fprintf(f, "# HELP weather_upstream_breaker_opened_total Times each upstream's circuit breaker has opened.\n");
+    fprintf(f, "# TYPE weather_upstream_breaker_opened_total counter\n");
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++)
+        fprintf(f, "weather_upstream_breaker_opened_total{upstream=\"%s\"} %u\n", weather_upstreams[i].name, weather_upstreams[i].opened);
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        slog(LG_ERROR, "weather: cannot write %s: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* (Re)starts the dump timer from the current configuration. */
+static void weather_stats_configure(void *unused) {
+    if (weather_stats_timer) {
+        mowgli_timer_destroy(base_eventloop, weather_stats_timer);
+        weather_stats_timer = NULL;
+    }
+
+    if (weather_stats_file && weather_stats_interval > 0)
+        weather_stats_timer = mowgli_timer_add(base_eventloop, "weather_stats_dump", weather_stats_dump, NULL, weather_stats_interval);
+}
+
+static void init_weather_stats(void) {
+    add_dupstr_conf_item("STATS_FILE", &weather->conf_table, 0, &weather_stats_file, NULL);
+    add_duration_conf_item("STATS_INTERVAL", &weather->conf_table, 0, &weather_stats_interval, "s", WEATHER_STATS_INTERVAL);
+    hook_add_event("config_ready");
+    hook_add_config_ready(weather_stats_configure);
+    weather_stats_configure(NULL);
+}
+
+static void deinit_weather_stats(void) {
+    hook_del_config_ready(weather_stats_configure);
+    if (weather_stats_timer)
+        mowgli_timer_destroy(base_eventloop, weather_stats_timer);
+    weather_stats_timer = NULL;
+    del_conf_item("STATS_FILE", &weather->conf_table);
+    del_conf_item("STATS_INTERVAL", &weather->conf_table);
+    free(weather_stats_file);
+    weather_stats_file = NULL;
+}
+
+
+/*
+ * OpenCage extraction.  Only results[0].formatted and
+ * results[0].geometry are looked at.
+ */
+typedef struct {
+    json_stream_t stream;
+    bool have_results;
+    bool have_formatted;
+    bool have_lat;
+    bool have_lng;
+    char formatted[100];
+    double lat;
+    double lng;
+} geocode_parse_t;
+
+static bool geocode_parse_enter(json_stream_t *js) {
+    geocode_parse_t *gp = js->privdata;
+
+    switch (js->depth) {
+    case 0:
+        return true;
+    case 1:
+        if (strcmp(js->frames[0].key, "results"))
+            return false;
+        gp->have_results = true;
+        return true;
+    case 2:
+        return js->frames[1].array && js->frames[1].index == 0;
+    case 3:
+        return !strcmp(js->frames[2].key, "geometry");
+    default:
+        return false;
+    }
+}
+
+static void geocode_parse_value(json_stream_t *js, json_stream_kind_t kind, const char *text, size_t len) {
+    geocode_parse_t *gp = js->privdata;
+
+    if (js->depth == 3 && !strcmp(js->frames[2].key, "formatted") && kind == JSON_STREAM_STRING) {
+        mowgli_strlcpy(gp->formatted, text, sizeof(gp->formatted));
+        gp->have_formatted = true;
+    } else if (js->depth == 4 && kind == JSON_STREAM_NUMBER) {
+        if (!strcmp(js->frames[3].key, "lat")) {
+            gp->lat = strtod(text, NULL);
+            gp->have_lat = true;
+        } else if (!strcmp(js->frames[3].key, "lng")) {
+            gp->lng = strtod(text, NULL);
+            gp->have_lng = true;
+        }
+    }
+}
+
+void geocode_parse_init(geocode_parse_t *gp) {
+    memset(gp, 0, sizeof(*gp));
+    json_stream_init(&gp->stream, geocode_parse_enter, geocode_parse_value, gp);
+}
+
+int geocode_parse_finish(geocode_parse_t *gp, OpenCage *result) {
+    if (!json_stream_finish(&gp->stream)) {
+        strncpy(result->location, "Failed to parse JSON!", sizeof(result->location));
+        result->error_code = 2;
+        return result->error_code;
+    }
+
+    if (!gp->have_results) {
+        strncpy(result->location, "No results found in json!", sizeof(result->location));
+        result->error_code = 3;
+        return result->error_code;
+    }
+
+    if (!gp->have_formatted) {
+        strncpy(result->location, "No location formatted found", sizeof(result->location));
+        result->error_code = 4;
+        return result->error_code;
+    }
+
+    if (!gp->have_lat || !gp->have_lng) {
+        strncpy(result->location, "No latlong data found!", sizeof(result->location));
+        result->error_code = 5;
+        return result->error_code;
+    }
+
+    snprintf(result->location, sizeof(result->location), "%s", gp->formatted);
+    result->lat = gp->lat;
+    result->lng = gp->lng;
+
+    result->error_code = 0;
+    return result->error_code;
+}
+
+int parse_geocode_data(const char *body, OpenCage *result) {
+    geocode_parse_t gp;
+
+    geocode_parse_init(&gp);
+    json_stream_feed(&gp.stream, body, strlen(body));
+    return geocode_parse_finish(&gp, result);
+}
+
+/*
+ * Locations.
+ *
+ * Thousands of accounts share a few hundred places, so each place is kept
+ * once.  Formatted names are interned with a reference count, and a
+ * lat/long is registered once, snapped to the microdegree grid the APIs are
+ * asked at, under a small integer ID.  Jobs, account settings, the caches
+ * and the greeting queue hold IDs, and what the weather cache, refresh-ahead
+ * and the greeting queue keep per place hangs off the record, so finding it
+ * is an index into the table rather than a string lookup.  ID 0 is no place.
+ */
+#define WEATHER_LOCATION_SCALE 1000000.0    /* microdegrees, as "%f" prints them */
+
+typedef struct weather_cache_entry_ weather_cache_entry_t;
+typedef struct greet_group_ greet_group_t;
+
+typedef struct {
+    unsigned int refs;
+    int32_t lat_e6, lng_e6;
+    double lat, lng;
+    weather_cache_entry_t *cache;   /* forecast for the place, if any */
+    unsigned int cell;              /* grid cell it shares a forecast with, held unless itself */
+    unsigned int cell_precision;    /* the weather_cache_precision cell was found at */
+    unsigned int cell_members;      /* locations whose cell this is */
+    greet_group_t *greet;           /* greetings waiting on it, if any */
+    unsigned int accounts;          /* accounts that saved it with SETWEATHER */
+    unsigned int demand;            /* requests, halved every refresh round */
+} weather_location_t;
+
+typedef struct {
+    unsigned int refs;
+    char name[];
+} weather_interned_t;
+
+static mowgli_patricia_t *weather_strings;
+static weather_location_t **weather_locations;     /* by ID */
+static unsigned int weather_locations_size;
+static unsigned int weather_locations_count;
+static unsigned int weather_locations_hint;         /* no free ID below this */
+static unsigned int *weather_location_index;        /* open addressing by lat/long, 0 empty */
+static unsigned int weather_location_index_size;
+static unsigned int weather_cells;                  /* locations that are some location's cell */
+
+static const char *weather_intern(const char *s) {
+    weather_interned_t *interned;
+    size_t len;
+
+    if (!weather_strings)
+        weather_strings = mowgli_patricia_create(NULL);
+    if ((interned = mowgli_patricia_retrieve(weather_strings, s))) {
+        interned->refs++;
+        return interned->name;
+    }
+
+    len = strlen(s);
+    interned = malloc(sizeof(*interned) + len + 1);
+    if (!interned)
+        return NULL;
+    interned->refs = 1;
+    memcpy(interned->name, s, len + 1);
+    mowgli_patricia_add(weather_strings, interned->name, interned);
+    return interned->name;
+}
+
+/* Another reference to a name that is already interned. */
+static const char *weather_intern_dup(const char *s) {
+    if (s)
+        ((weather_interned_t *)(s - offsetof(weather_interned_t, name)))->refs++;
+    return s;
+}
+
+static void weather_unintern(const char *s) {
+    weather_interned_t *interned;
+
+    if (!s)
+        return;
+    interned = (weather_interned_t *)(s - offsetof(weather_interned_t, name));
+    if (--interned->refs > 0)
+        return;
+    mowgli_patricia_delete(weather_strings, interned->name);
+    free(interned);
+}
+
+static inline weather_location_t *weather_location(unsigned int id) {
+    return id && id < weather_locations_size ? weather_locations[id] : NULL;
+}
+
+static unsigned int weather_location_slot(int32_t lat_e6, int32_t lng_e6) {
+    uint64_t key = (uint64_t)(uint32_t)lat_e6 << 32 | (uint32_t)lng_e6;
+
+    return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (weather_location_index_size - 1);
+}
+
+static bool weather_location_index_grow(void) {
+    unsigned int size = weather_location_index_size ? weather_location_index_size * 2 : 256;
+    unsigned int *index = calloc(size, sizeof(*index)), *old = weather_location_index;
+    unsigned int old_size = weather_location_index_size;
+
+    if (!index)
+        return false;
+    weather_location_index = index;
+    weather_location_index_size = size;
+    for (unsigned int i = 0; i < old_size; i++) {
+        weather_location_t *loc = weather_location(old[i]);
+        unsigned int slot;
+
+        if (!loc)
+            continue;
+        for (slot = weather_location_slot(loc->lat_e6, loc->lng_e6); index[slot]; slot = (slot + 1) & (size - 1))
+            ;
+        index[slot] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* A reference to the place at lat/long, registering it if it is new; 0 if out of memory. */
+static unsigned int weather_location_get(double lat, double lng) {
+    int32_t lat_e6 = (int32_t)lround(lat * WEATHER_LOCATION_SCALE), lng_e6 = (int32_t)lround(lng * WEATHER_LOCATION_SCALE);
+    weather_location_t *loc;
+    unsigned int slot, id;
+
+    if (weather_location_index_size) {
+        for (slot = weather_location_slot(lat_e6, lng_e6); (id = weather_location_index[slot]); slot = (slot + 1) & (weather_location_index_size - 1)) {
+            loc = weather_locations[id];
+            if (loc->lat_e6 == lat_e6 && loc->lng_e6 == lng_e6) {
+                loc->refs++;
+                return id;
+            }
+        }
+    }
+
+    if ((weather_locations_count + 1) * 2 > weather_location_index_size && !weather_location_index_grow())
+        return 0;
+
+    for (id = weather_locations_hint ? weather_locations_hint : 1; id < weather_locations_size && weather_locations[id]; id++)
+        ;
+    if (id >= weather_locations_size) {
+        unsigned int size = weather_locations_size ? weather_locations_size * 2 : 256;
+        weather_location_t **grown = realloc(weather_locations, size * sizeof(*grown));
+
+        if (!grown)
+            return 0;
+        memset(grown + weather_locations_size, 0, (size - weather_locations_size) * sizeof(*grown));
+        weather_locations = grown;
+        weather_locations_size = size;
+    }
+
+    loc = calloc(1, sizeof(*loc));
+    if (!loc)
+        return 0;
+    loc->refs = 1;
+    loc->lat_e6 = lat_e6;
+    loc->lng_e6 = lng_e6;
+    loc->lat = lat_e6 / WEATHER_LOCATION_SCALE;
+    loc->lng = lng_e6 / WEATHER_LOCATION_SCALE;
+    weather_locations[id] = loc;
+    weather_locations_count++;
+    weather_locations_hint = id + 1;
+
+    for (slot = weather_location_slot(lat_e6, lng_e6); weather_location_index[slot]; slot = (slot + 1) & (weather_location_index_size - 1))
+        ;
+    weather_location_index[slot] = id;
+    return id;
+}
+
+static void weather_location_unref(unsigned int id);
+
+/* Forgets which grid cell the location was put in. */
+static void weather_location_uncell(weather_location_t *loc, unsigned int id) {
+    weather_location_t *cell = weather_location(loc->cell);
+
+    if (!cell)
+        return;
+    if (--cell->cell_members == 0)
+        weather_cells--;
+    if (loc->cell != id)
+        weather_location_unref(loc->cell);
+    loc->cell = 0;
+}
+
+static unsigned int weather_location_ref(unsigned int id) {
+    weather_location_t *loc = weather_location(id);
+
+    if (loc)
+        loc->refs++;
+    return id;
+}
+
+static void weather_location_unref(unsigned int id) {
+    weather_location_t *loc = weather_location(id);
+    unsigned int mask = weather_location_index_size - 1, slot, next, home;
+
+    if (!loc || --loc->refs > 0)
+        return;
+    weather_location_uncell(loc, id);
+
+    /* take it out of the index, moving later entries of the run back into the hole */
+    for (slot = weather_location_slot(loc->lat_e6, loc->lng_e6); weather_location_index[slot] != id; slot = (slot + 1) & mask)
+        ;
+    for (next = (slot + 1) & mask; weather_location_index[next]; next = (next + 1) & mask) {
+        weather_location_t *other = weather_locations[weather_location_index[next]];
+
+        home = weather_location_slot(other->lat_e6, other->lng_e6);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            weather_location_index[slot] = weather_location_index[next];
+            slot = next;
+        }
+    }
+    weather_location_index[slot] = 0;
+
+    weather_locations[id] = NULL;
+    weather_locations_count--;
+    if (id < weather_locations_hint)
+        weather_locations_hint = id;
+    free(loc);
+}
+
+/* The lat/long as the APIs and the account metadata take it. */
+static void weather_location_latlong(unsigned int id, char *buf, size_t size) {
+    weather_location_t *loc = weather_location(id);
+
+    snprintf(buf, size, "%f,%f", loc ? loc->lat : 0.0, loc ? loc->lng : 0.0);
+}
+
+/* Runs last; anything still holding a place or name has leaked it. */
+static void weather_interned_destroy_cb(const char *key, void *data, void *privdata) {
+    free(data);
+}
+
+static void deinit_weather_locations(void) {
+    if (weather_locations_count)
+        slog(LG_DEBUG, "weather: %u locations still referenced at unload", weather_locations_count);
+    for (unsigned int id = 1; id < weather_locations_size; id++)
+        free(weather_locations[id]);
+    free(weather_locations);
+    free(weather_location_index);
+    weather_locations = NULL;
+    weather_location_index = NULL;
+    weather_locations_size = weather_locations_count = weather_locations_hint = weather_location_index_size = 0;
+    if (weather_strings)
+        mowgli_patricia_destroy(weather_strings, weather_interned_destroy_cb, NULL);
+    weather_strings = NULL;
+}
+
+/*
+ * A weather request from a user.  It owns everything needed to finish the
+ * request after the handler has returned: where the reply goes, the output
+ * options, and the location as it is resolved.
+ */
+typedef enum {
+    WEATHER_REPLY_USER,
+    WEATHER_REPLY_CHANNEL
+} weather_reply_kind_t;
+
+typedef struct weather_record_ weather_record_t;
+
+typedef struct weather_job_ {
+    weather_reply_kind_t reply_kind;
+    char target[CHANNELLEN + 1];
+    char account[NICKLEN + 1];
+    bool setweather;
+    bool colors;
+    bool background;            /* nobody asked, e.g. a greeting */
+    int forecast;
+    char query[256];
+    const char *location;       /* interned */
+    unsigned int loc;
+    geocode_parse_t geocode;
+    uint64_t started;           /* weather_now_us() at creation */
+    uint64_t stage_started;     /* start of the geocode or weather stage */
+    /* if set, gets the record (NULL on failure) instead of a reply being sent */
+    void (*done)(struct weather_job_ *job, const weather_record_t *record);
+    void *privdata;
+    mowgli_node_t node;
+} weather_job_t;
+
+static weather_job_t *weather_job_create(weather_reply_kind_t reply_kind, const char *target) {
+    weather_job_t *job = calloc(1, sizeof(weather_job_t));
+    if (!job) {
+        slog(LG_DEBUG, "Memory allocation failed\n");
+        return NULL;
+    }
+
+    job->reply_kind = reply_kind;
+    job->colors = true;
+    job->started = weather_now_us();
+    mowgli_strlcpy(job->target, target, sizeof(job->target));
+    return job;
+}
+
+/* Sends a finished line; it must already be plain if the requester has colors off. */
+static void weather_job_send(weather_job_t *job, const char *buf) {
+    if (weather_fetch_shutdown || job->done)
+        return;
+
+    if (job->reply_kind == WEATHER_REPLY_CHANNEL) {
+        msg(weather->nick, job->target, "%s", buf);
+    } else if (user_find_named(job->target)) {
+        /* the requester may have quit while we were waiting */
+        notice(weather->nick, job->target, "%s", buf);
+    }
+}
+
+static void weather_job_destroy(weather_job_t *job) {
+    weather_unintern(job->location);
+    weather_location_unref(job->loc);
+    free(job);
+}
+
+/* Releases a job that ends without a record; an error reply counts towards the total. */
+static void weather_job_free(weather_job_t *job) {
+    if (job->done)
+        job->done(job, NULL);
+    else
+        weather_stats_record(WEATHER_STAGE_TOTAL, job->started);
+    weather_job_destroy(job);
+}
+
+static void weather_job_reply(weather_job_t *job, const char *fmt, ...) {
+    char buf[OUTPUT_SIZE];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (!job->colors) {
+        remove_colors(buf);
+    }
+
+    weather_job_send(job, buf);
+}
+
+static void fetch_weather_data(weather_job_t *job);
+static void greet_queue(user_t *u, const char *location, unsigned int loc);
+static void saved_location_add(unsigned int loc);
+static void saved_location_del(unsigned int loc);
+
+/*
+ * Geocode cache.
+ *
+ * Place names practically never move, so successful OpenCage lookups are
+ * kept for a long time, keyed by the normalized query.  The cache is
+ * bounded: the least recently used entry is dropped when it is full.  It is
+ * persisted to a small binary file which is loaded at module init and
+ * rewritten by a timer whenever it has changed.  The file is loaded before
+ * the configuration is, so the size is enforced again on every rehash.
+ *
+ * File layout, all integers little-endian:
+ *   "WXGC" u32 version u32 count
+ *   count * { u16 len, query, u16 len, location, u64 lat, u64 lng, u64 expires }
+ * lat and lng are the IEEE-754 bit patterns of the doubles.
+ */
+#define GEOCODE_CACHE_FILE DATADIR "/weather_geocode.db"
+#define GEOCODE_CACHE_MAGIC "WXGC"
+#define GEOCODE_CACHE_VERSION 1
+#define GEOCODE_CACHE_FLUSH_INTERVAL 300
+#define GEOCODE_CACHE_SIZE 10000
+#define GEOCODE_CACHE_TTL (30 * 86400)
+
+typedef struct {
+    char *query;
+    const char *location;       /* interned */
+    unsigned int loc;
+    time_t expires;
+    mowgli_node_t node;
+} geocode_cache_entry_t;
+
+static mowgli_patricia_t *geocode_cache;
+static mowgli_list_t geocode_cache_lru;   /* most recently used first */
+static unsigned int geocode_cache_ttl = GEOCODE_CACHE_TTL;
+static unsigned int geocode_cache_max = GEOCODE_CACHE_SIZE;
+static bool geocode_cache_dirty;
+static mowgli_eventloop_timer_t *geocode_cache_timer;
+static unsigned int geocode_cache_hits;
+static unsigned int geocode_cache_misses;
+
+static void geocode_cache_entry_free(geocode_cache_entry_t *entry) {
+    free(entry->query);
+    weather_unintern(entry->location);
+    weather_location_unref(entry->loc);
+    free(entry);
+}
+
+static void geocode_cache_remove(geocode_cache_entry_t *entry) {
+    mowgli_patricia_delete(geocode_cache, entry->query);
+    mowgli_node_delete(&entry->node, &geocode_cache_lru);
+    geocode_cache_entry_free(entry);
+    geocode_cache_dirty = true;
+}
+
+static void geocode_cache_store(const char *query, const char *location, double lat, double lng, time_t expires) {
+    geocode_cache_entry_t *entry = mowgli_patricia_retrieve(geocode_cache, query);
+
+    if (entry)
+        geocode_cache_remove(entry);
+
+    if (geocode_cache_max == 0 || expires <= CURRTIME)
+        return;
+
+    while (MOWGLI_LIST_LENGTH(&geocode_cache_lru) >= geocode_cache_max)
+        geocode_cache_remove(geocode_cache_lru.tail->data);
+
+    entry = calloc(1, sizeof(geocode_cache_entry_t));
+    if (!entry)
+        return;
+
+    entry->query = strdup(query);
+    entry->location = weather_intern(location);
+    entry->loc = weather_location_get(lat, lng);
+    entry->expires = expires;
+    if (!entry->query || !entry->location || !entry->loc) {
+        geocode_cache_entry_free(entry);
+        return;
+    }
+
+    mowgli_patricia_add(geocode_cache, entry->query, entry);
+    mowgli_node_add_head(entry, &entry->node, &geocode_cache_lru);
+    geocode_cache_dirty = true;
+}
+
+static bool geocode_cache_lookup(const char *query, OpenCage *result) {
+    geocode_cache_entry_t *entry = mowgli_patricia_retrieve(geocode_cache, query);
+
+    if (entry && entry->expires <= CURRTIME) {
+        geocode_cache_remove(entry);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        geocode_cache_misses++;
+        return false;
+    }
+
+    geocode_cache_hits++;
+    mowgli_node_delete(&entry->node, &geocode_cache_lru);
+    mowgli_node_add_head(entry, &entry->node, &geocode_cache_lru);
+
+    snprintf(result->location, sizeof(result->location), "%s", entry->location);
+    result->lat = weather_location(entry->loc)->lat;
+    result->lng = weather_location(entry->loc)->lng;
+    result->error_code = 0;
+    return true;
+}
+
+static void write_u16(FILE *f, uint16_t v) {
+    unsigned char b[2] = { v & 0xff, (v >> 8) & 0xff };
+    fwrite(b, 1, sizeof(b), f);
+}
+
+static void write_u32(FILE *f, uint32_t v) {
+    unsigned char b[4];
+    for (int i = 0; i < 4; i++)
+        b[i] = (v >> (8 * i)) & 0xff;
+    fwrite(b, 1, sizeof(b), f);
+}
+
+static void write_u64(FILE *f, uint64_t v) {
+    unsigned char b[8];
+    for (int i = 0; i < 8; i++)
+        b[i] = (v >> (8 * i)) & 0xff;
+    fwrite(b, 1, sizeof(b), f);
+}
+
+static void write_str(FILE *f, const char *s) {
+    size_t len = strlen(s);
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+    write_u16(f, len);
+    fwrite(s, 1, len, f);
+}
+
+static void write_double(FILE *f, double d) {
+    uint64_t v;
+    memcpy(&v, &d, sizeof(v));
+    write_u64(f, v);
+}
+
+/* Bounds-checked reader over a file image; ok drops to false on overrun. */
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    bool ok;
+} weather_reader_t;
+
+static const unsigned char *read_bytes(weather_reader_t *r, size_t len) {
+    const unsigned char *p = r->p;
+    if (!r->ok || (size_t)(r->end - r->p) < len) {
+        r->ok = false;
+        return NULL;
+    }
+    r->p += len;
+    return p;
+}
+
+static uint16_t read_u16(weather_reader_t *r) {
+    const unsigned char *b = read_bytes(r, 2);
+    return b ? (uint16_t)(b[0] | (b[1] << 8)) : 0;
+}
+
+static uint32_t read_u32(weather_reader_t *r) {
+    const unsigned char *b = read_bytes(r, 4);
+    uint32_t v = 0;
+    for (int i = 0; b && i < 4; i++)
+        v |= (uint32_t)b[i] << (8 * i);
+    return v;
+}
+
+static uint64_t read_u64(weather_reader_t *r) {
+    const unsigned char *b = read_bytes(r, 8);
+    uint64_t v = 0;
+    for (int i = 0; b && i < 8; i++)
+        v |= (uint64_t)b[i] << (8 * i);
+    return v;
+}
+
+static double read_double(weather_reader_t *r) {
+    uint64_t v = read_u64(r);
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+/* Copies a length-prefixed string into buf, truncating if needed. */
+static bool read_str(weather_reader_t *r, char *buf, size_t size) {
+    uint16_t len = read_u16(r);
+    const unsigned char *s = read_bytes(r, len);
+    if (!s)
+        return false;
+    if (len >= size)
+        len = size - 1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return true;
+}
+
+static void save_geocode_cache(void) {
+    char tmpname[BUFSIZE];
+    FILE *file;
+    mowgli_node_t *n;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.new", GEOCODE_CACHE_FILE);
+    file = fopen(tmpname, "wb");
+    if (file == NULL) {
+        slog(LG_ERROR, "weather: cannot write %s: %s", tmpname, strerror(errno));
+        return;
+    }
+
+    fwrite(GEOCODE_CACHE_MAGIC, 1, 4, file);
+    write_u32(file, GEOCODE_CACHE_VERSION);
+    write_u32(file, MOWGLI_LIST_LENGTH(&geocode_cache_lru));
+
+    /* least recently used first, so a reload rebuilds the same order */
+    for (n = geocode_cache_lru.tail; n != NULL; n = n->prev) {
+        geocode_cache_entry_t *entry = n->data;
+
+        write_str(file, entry->query);
+        write_str(file, entry->location);
+        write_double(file, weather_location(entry->loc)->lat);
+        write_double(file, weather_location(entry->loc)->lng);
+        write_u64(file, (uint64_t)entry->expires);
+    }
+
+    if (ferror(file) | fclose(file)) {
+        slog(LG_ERROR, "weather: failed writing %s", tmpname);
+        unlink(tmpname);
+        return;
+    }
+
+    if (rename(tmpname, GEOCODE_CACHE_FILE) < 0) {
+        slog(LG_ERROR, "weather: cannot rename %s: %s", tmpname, strerror(errno));
+        unlink(tmpname);
+        return;
+    }
+
+    geocode_cache_dirty = false;
+    slog(LG_DEBUG, "weather: saved %zu geocode cache entries (%u hits, %u misses)", MOWGLI_LIST_LENGTH(&geocode_cache_lru), geocode_cache_hits, geocode_cache_misses);
+}
+
+static void load_geocode_cache(void) {
+    FILE *file = fopen(GEOCODE_CACHE_FILE, "rb");
+    unsigned char *image;
+    long size;
+
+    if (file == NULL)
+        return;
+
+    if (fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) < 0) {
+        fclose(file);
+        return;
+    }
+
+    image = malloc(size ? size : 1);
+    if (!image || fread(image, 1, size, file) != (size_t)size) {
+        slog(LG_ERROR, "weather: cannot read %s", GEOCODE_CACHE_FILE);
+        free(image);
+        fclose(file);
+        return;
+    }
+    fclose(file);
+
+    weather_reader_t r = { image, image + size, true };
+    const unsigned char *magic = read_bytes(&r, 4);
+    uint32_t version = read_u32(&r);
+    uint32_t count = read_u32(&r);
+
+    if (!magic || memcmp(magic, GEOCODE_CACHE_MAGIC, 4) || version != GEOCODE_CACHE_VERSION) {
+        slog(LG_ERROR, "weather: ignoring %s: unknown format", GEOCODE_CACHE_FILE);
+        free(image);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count && r.ok; i++) {
+        char query[256], location[256];
+        double lat, lng;
+        time_t expires;
+
+        read_str(&r, query, sizeof(query));
+        read_str(&r, location, sizeof(location));
+        lat = read_double(&r);
+        lng = read_double(&r);
+        expires = (time_t)read_u64(&r);
+
+        if (r.ok)
+            geocode_cache_store(query, location, lat, lng, expires);
+    }
+
+    if (!r.ok)
+        slog(LG_ERROR, "weather: %s is truncated", GEOCODE_CACHE_FILE);
+
+    free(image);
+    geocode_cache_dirty = false;
+    slog(LG_DEBUG, "weather: loaded %zu geocode cache entries", MOWGLI_LIST_LENGTH(&geocode_cache_lru));
+}
+
+static void geocode_cache_flush(void *arg) {
+    if (geocode_cache_dirty)
+        save_geocode_cache();
+}
+
+/* Drops the least recently used entries beyond a smaller geocode_cache_size. */
+static void geocode_cache_configure(void *unused) {
+    while (geocode_cache_lru.tail && MOWGLI_LIST_LENGTH(&geocode_cache_lru) > geocode_cache_max)
+        geocode_cache_remove(geocode_cache_lru.tail->data);
+}
+
+static void init_geocode_cache(void) {
+    geocode_cache = mowgli_patricia_create(strcasecanon);
+    load_geocode_cache();
+    hook_add_event("config_ready");
+    hook_add_config_ready(geocode_cache_configure);
+    geocode_cache_timer = mowgli_timer_add(base_eventloop, "geocode_cache_flush", geocode_cache_flush, NULL, GEOCODE_CACHE_FLUSH_INTERVAL);
+}
+
+static void deinit_geocode_cache(void) {
+    mowgli_node_t *n, *tn;
+
+    hook_del_config_ready(geocode_cache_configure);
+    mowgli_timer_destroy(base_eventloop, geocode_cache_timer);
+    geocode_cache_flush(NULL);
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, geocode_cache_lru.head) {
+        geocode_cache_entry_t *entry = n->data;
+
+        mowgli_node_delete(n, &geocode_cache_lru);
+        geocode_cache_entry_free(entry);
+    }
+    mowgli_patricia_destroy(geocode_cache, NULL, NULL);
+}
+
+/*
+ * Gazetteer.
+ *
+ * An optional local geocoder: a file of populated places, built by
+ * bench/gazetteer_build from a GeoNames dump, mapped read-only and searched
+ * where it lies.  A place name is answered from it when one place clearly
+ * stands out; only the rest go to OpenCage.  A rehash picks up a rebuilt
+ * file; the builder renames it into place, so the old mapping stays valid
+ * until it is swapped.
+ *
+ * File layout, all integers little-endian:
+ *   "WXGZ" u32 version u32 place_count u32 key_count u32 strings_size
+ *   place_count * { u32 name, u32 region, u32 region_code, u32 country,
+ *                   u8 country_code[2], u16 0, i32 lat, i32 lng, u32 population }
+ *   key_count * { u32 key, u32 place }
+ *   strings_size bytes of NUL-terminated strings
+ * Strings are offsets into the string area; lat and lng are microdegrees.
+ * Keys are folded names (see gazetteer_fold) sorted bytewise and then by
+ * falling population, so a run of equal keys starts with the biggest place
+ * of that name.
+ *
+ * A query is "name[, qualifier...]", where every qualifier has to match a
+ * place's country code, country, region or region code.  The most populous
+ * place left must have GAZETTEER_DOMINANCE times the population of the next
+ * one.  A name with no exact match is tried as a prefix of at least
+ * GAZETTEER_PREFIX_MIN bytes that ends mid-word, if it starts no more than
+ * GAZETTEER_SCAN keys.  A name that is a region or country in the file is
+ * never answered here, since it means the area rather than a town in it.
+ */
+#define GAZETTEER_MAGIC "WXGZ"
+#define GAZETTEER_VERSION 1
+#define GAZETTEER_HEADER_SIZE 20
+#define GAZETTEER_PLACE_SIZE 32
+#define GAZETTEER_KEY_SIZE 8
+#define GAZETTEER_DOMINANCE 10
+#define GAZETTEER_PREFIX_MIN 4
+#define GAZETTEER_SCAN 256
+#define GAZETTEER_QUALIFIERS 3
+#define GAZETTEER_NONE UINT32_MAX
+
+typedef struct {
+    const unsigned char *map;
+    size_t size;
+    uint32_t place_count;
+    uint32_t key_count;
+    uint32_t strings_size;
+    const unsigned char *places;
+    const unsigned char *keys;
+    const char *strings;
+    dev_t dev;                  /* to tell a rebuilt file on rehash */
+    ino_t ino;
+    time_t mtime;
+    mowgli_patricia_t *areas;   /* folded region and country names */
+} gazetteer_t;
+
+typedef struct {
+    const char *name;
+    const char *region;
+    const char *region_code;
+    const char *country;
+    char country_code[3];
+    double lat, lng;
+    uint32_t population;
+} gazetteer_place_t;
+
+static gazetteer_t gazetteer;
+static char *gazetteer_file;
+static unsigned int gazetteer_hits;
+static unsigned int gazetteer_prefix_hits;
+static unsigned int gazetteer_misses;
+
+static inline uint32_t gazetteer_u32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline const char *gazetteer_str(uint32_t offset) {
+    return offset < gazetteer.strings_size ? gazetteer.strings + offset : "";
+}
+
+static inline const char *gazetteer_key(uint32_t i) {
+    return gazetteer_str(gazetteer_u32(gazetteer.keys + (size_t)i * GAZETTEER_KEY_SIZE));
+}
+
+static inline uint32_t gazetteer_key_place(uint32_t i) {
+    return gazetteer_u32(gazetteer.keys + (size_t)i * GAZETTEER_KEY_SIZE + 4);
+}
+
+static void gazetteer_place(uint32_t i, gazetteer_place_t *place) {
+    const unsigned char *p = gazetteer.places + (size_t)i * GAZETTEER_PLACE_SIZE;
+
+    place->name = gazetteer_str(gazetteer_u32(p));
+    place->region = gazetteer_str(gazetteer_u32(p + 4));
+    place->region_code = gazetteer_str(gazetteer_u32(p + 8));
+    place->country = gazetteer_str(gazetteer_u32(p + 12));
+    place->country_code[0] = p[16];
+    place->country_code[1] = p[17];
+    place->country_code[2] = '\0';
+    place->lat = (int32_t)gazetteer_u32(p + 20) / WEATHER_LOCATION_SCALE;
+    place->lng = (int32_t)gazetteer_u32(p + 24) / WEATHER_LOCATION_SCALE;
+    place->population = gazetteer_u32(p + 28);
+}
+
+/*
+ * Folds a name or query for matching: ASCII lowercased, '_' (which the
+ * commands put for spaces) as a space, runs of spaces as one, trimmed.
+ * Other bytes, UTF-8 included, are kept as they are.
+ */
+static size_t gazetteer_fold(const char *s, char *buf, size_t size) {
+    size_t len = 0;
+    bool space = false;
+
+    for (; *s && len + 1 < size; s++) {
+        unsigned char c = *s == '_' ? ' ' : (unsigned char)*s;
+
+        if (isspace(c)) {
+            space = len > 0;
+            continue;
+        }
+        if (space && len + 2 < size)
+            buf[len++] = ' ';
+        space = false;
+        buf[len++] = c < 0x80 ? tolower(c) : c;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static bool gazetteer_qualifies(uint32_t i, char *const *qualifiers, int count) {
+    gazetteer_place_t place;
+
+    if (!count)
+        return true;
+    gazetteer_place(i, &place);
+    for (int q = 0; q < count; q++) {
+        if (strcasecmp(qualifiers[q], place.country_code) && strcasecmp(qualifiers[q], place.country) &&
+            (!*place.region || strcasecmp(qualifiers[q], place.region)) &&
+            (!*place.region_code || strcasecmp(qualifiers[q], place.region_code)))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Looks through the keys equal to name, or starting with it, for the place
+ * to answer with.  Returns 1 with it in *best, 0 if there is no candidate,
+ * or -1 if there is no clear winner.
+ */
+static int gazetteer_search(const char *name, size_t len, bool prefix, char *const *qualifiers, int count, uint32_t *best) {
+    uint32_t lo = 0, hi = gazetteer.key_count, second = GAZETTEER_NONE, best_population = 0, second_population = 0;
+    unsigned int scanned = 0;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(gazetteer_key(mid), name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *best = GAZETTEER_NONE;
+    for (uint32_t i = lo; i < gazetteer.key_count; i++) {
+        uint32_t place = gazetteer_key_place(i), population;
+
+        if (prefix ? strncmp(gazetteer_key(i), name, len) : strcmp(gazetteer_key(i), name))
+            break;
+        if (++scanned > GAZETTEER_SCAN)
+            return -1;
+        /* only a word cut short: "Texas" is not short for "Texas City" */
+        if (prefix && gazetteer_key(i)[len] == ' ')
+            continue;
+        if (place >= gazetteer.place_count || place == *best || place == second || !gazetteer_qualifies(place, qualifiers, count))
+            continue;
+
+        population = gazetteer_u32(gazetteer.places + (size_t)place * GAZETTEER_PLACE_SIZE + 28);
+        if (*best == GAZETTEER_NONE || population > best_population) {
+            second = *best;
+            second_population = best_population;
+            *best = place;
+            best_population = population;
+        } else if (second == GAZETTEER_NONE || population > second_population) {
+            second = place;
+            second_population = population;
+        }
+        /* equal keys come biggest first, so the first two decide */
+        if (!prefix && second != GAZETTEER_NONE)
+            break;
+    }
+
+    if (*best == GAZETTEER_NONE)
+        return 0;
+    if (second == GAZETTEER_NONE)
+        return 1;
+    return best_population > second_population && best_population / GAZETTEER_DOMINANCE >= second_population ? 1 : -1;
+}
+
+/* Answers query from the gazetteer if it names one place clearly enough. */
+static bool gazetteer_lookup(const char *query, OpenCage *result) {
+    char folded[256], *qualifiers[GAZETTEER_QUALIFIERS], *name, *comma;
+    gazetteer_place_t place;
+    int count = 0, found;
+    uint32_t best;
+    size_t len;
+
+    if (!gazetteer.map)
+        return false;
+
+    gazetteer_fold(query, folded, sizeof(folded));
+    name = folded;
+    for (char *s = folded; (comma = strchr(s, ',')); s = comma + 1) {
+        *comma = '\0';
+        if (count == GAZETTEER_QUALIFIERS)
+            goto miss;
+        qualifiers[count] = comma + 1;
+        while (*qualifiers[count] == ' ')
+            qualifiers[count]++;
+        count++;
+    }
+    for (int q = 0; q <= count; q++) {
+        char *part = q ? qualifiers[q - 1] : name;
+
+        for (len = strlen(part); len > 0 && part[len - 1] == ' '; len--)
+            part[len - 1] = '\0';
+        if (!len)
+            goto miss;
+    }
+
+    /* a state or country asked for as a whole is left to OpenCage */
+    if (gazetteer.areas && mowgli_patricia_retrieve(gazetteer.areas, name))
+        goto miss;
+
+    len = strlen(name);
+    found = gazetteer_search(name, len, false, qualifiers, count, &best);
+    if (found == 1) {
+        gazetteer_hits++;
+    } else if (found == 0 && len >= GAZETTEER_PREFIX_MIN && gazetteer_search(name, len, true, qualifiers, count, &best) == 1) {
+        gazetteer_prefix_hits++;
+    } else {
+        goto miss;
+    }
+
+    gazetteer_place(best, &place);
+    if (*place.region && strcmp(place.region, place.name))
+        snprintf(result->location, sizeof(result->location), "%s, %s, %s", place.name, place.region, place.country);
+    else
+        snprintf(result->location, sizeof(result->location), "%s, %s", place.name, place.country);
+    result->lat = place.lat;
+    result->lng = place.lng;
+    result->error_code = 0;
+    return true;
+
+miss:
+    gazetteer_misses++;
+    return false;
+}
+
+static void gazetteer_unmap(void) {
+    if (gazetteer.areas)
+        mowgli_patricia_destroy(gazetteer.areas, NULL, NULL);
+    if (gazetteer.map)
+        munmap((void *)gazetteer.map, gazetteer.size);
+    memset(&gazetteer, 0, sizeof(gazetteer));
+}
+
+/* Collects the region and country names of the mapped file, so they are not taken for towns. */
+static void gazetteer_index_areas(void) {
+    char folded[256];
+
+    gazetteer.areas = mowgli_patricia_create(NULL);
+    for (uint32_t i = 0; i < gazetteer.place_count; i++) {
+        gazetteer_place_t place;
+        const char *names[2];
+
+        gazetteer_place(i, &place);
+        names[0] = place.region;
+        names[1] = place.country;
+        for (int j = 0; j < 2; j++) {
+            if (gazetteer_fold(names[j], folded, sizeof(folded)) && !mowgli_patricia_retrieve(gazetteer.areas, folded))
+                mowgli_patricia_add(gazetteer.areas, folded, (void *)names[j]);
+        }
+    }
+}
+
+/* Maps and checks the file at path, replacing the current one only if it is good. */
+static bool gazetteer_map(const char *path, const struct stat *st) {
+    const unsigned char *map;
+    gazetteer_t g = { 0 };
+    int fd;
+
+    if (st->st_size < GAZETTEER_HEADER_SIZE) {
+        slog(LG_ERROR, "weather: ignoring gazetteer %s: too short", path);
+        return false;
+    }
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        slog(LG_ERROR, "weather: cannot open gazetteer %s: %s", path, strerror(errno));
+        return false;
+    }
+    map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        slog(LG_ERROR, "weather: cannot map gazetteer %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    g.map = map;
+    g.size = st->st_size;
+    g.place_count = gazetteer_u32(map + 8);
+    g.key_count = gazetteer_u32(map + 12);
+    g.strings_size = gazetteer_u32(map + 16);
+    g.places = map + GAZETTEER_HEADER_SIZE;
+    g.keys = g.places + (size_t)g.place_count * GAZETTEER_PLACE_SIZE;
+    g.strings = (const char *)g.keys + (size_t)g.key_count * GAZETTEER_KEY_SIZE;
+    g.dev = st->st_dev;
+    g.ino = st->st_ino;
+    g.mtime = st->st_mtime;
+
+    if (memcmp(map, GAZETTEER_MAGIC, 4) || gazetteer_u32(map + 4) != GAZETTEER_VERSION ||
+        GAZETTEER_HEADER_SIZE + (uint64_t)g.place_count * GAZETTEER_PLACE_SIZE + (uint64_t)g.key_count * GAZETTEER_KEY_SIZE + g.strings_size != g.size ||
+        !g.strings_size || g.strings[g.strings_size - 1] != '\0') {
+        slog(LG_ERROR, "weather: ignoring gazetteer %s: unknown format or truncated", path);
+        munmap((void *)map, g.size);
+        return false;
+    }
+
+    /* binary searches touch a few scattered pages each */
+    madvise((void *)map, g.size, MADV_RANDOM);
+    gazetteer_unmap();
+    gazetteer = g;
+    gazetteer_index_areas();
+    slog(LG_INFO, "weather: gazetteer %s: %u places under %u names", path, g.place_count, g.key_count);
+    return true;
+}
+
+static void gazetteer_configure(void *unused) {
+    char path[BUFSIZE];
+    struct stat st;
+
+    if (!gazetteer_file) {
+        gazetteer_unmap();
+        return;
+    }
+
+    if (gazetteer_file[0] == '/')
+        mowgli_strlcpy(path, gazetteer_file, sizeof(path));
+    else
+        snprintf(path, sizeof(path), "%s/%s", DATADIR, gazetteer_file);
+
+    if (stat(path, &st) < 0) {
+        slog(LG_ERROR, "weather: cannot find gazetteer %s: %s", path, strerror(errno));
+        return;
+    }
+    if (gazetteer.map && st.st_dev == gazetteer.dev && st.st_ino == gazetteer.ino && st.st_mtime == gazetteer.mtime && (size_t)st.st_size == gazetteer.size)
+        return;
+    gazetteer_map(path, &st);
+}
+
+static void gazetteer_show(sourceinfo_t *si) {
+    if (gazetteer.map)
+        command_success_nodata(si, "\2Gazetteer:\2 %u places under %u names", gazetteer.place_count, gazetteer.key_count);
+    else
+        command_success_nodata(si, "\2Gazetteer:\2 off");
+    command_success_nodata(si, "  Hits: %u  Prefix hits: %u  Misses: %u", gazetteer_hits, gazetteer_prefix_hits, gazetteer_misses);
+}
+
+static void init_gazetteer(void) {
+    add_dupstr_conf_item("GAZETTEER", &weather->conf_table, 0, &gazetteer_file, NULL);
+    hook_add_event("config_ready");
+    hook_add_config_ready(gazetteer_configure);
+}
+
+static void deinit_gazetteer(void) {
+    hook_del_config_ready(gazetteer_configure);
+    del_conf_item("GAZETTEER", &weather->conf_table);
+    free(gazetteer_file);
+    gazetteer_file = NULL;
+    gazetteer_unmap();
+}
+
+/*
+ * Account settings.
+ *
+ * What an account has chosen with SETWEATHER, SETGREET and SETCOLORS is
+ * decoded once from its metadata into a small record kept as module
+ * private data on the myuser_t, so a request looks up one pointer rather
+ * than several metadata strings.  The SET commands change the record and
+ * write the metadata back, which stays the persistent copy.  The saved
+ * location is held as an interned name and a location ID.
+ */
+#define WEATHER_SETTINGS_KEY "weather:settings"
+
+#define WEATHER_SETTING_GREET       0x01
+#define WEATHER_SETTING_COLORS      0x02
+#define WEATHER_SETTING_LOCATION    0x04    /* location, lat and lng are set */
+
+typedef struct {
+    unsigned int flags;
+    const char *location;       /* interned */
+    unsigned int loc;
+} weather_settings_t;
+
+/* The account's settings, decoded from its metadata on first use. */
+static weather_settings_t *weather_settings(myuser_t *mu) {
+    weather_settings_t *settings = privatedata_get(mu, WEATHER_SETTINGS_KEY);
+    metadata_t *md, *latlong;
+    double lat, lng;
+
+    if (settings)
+        return settings;
+    settings = calloc(1, sizeof(*settings));
+    if (!settings)
+        return NULL;
+
+    md = metadata_find(mu, "private:weather:greet");
+    if (md && md->value && !strcasecmp(md->value, "ON"))
+        settings->flags |= WEATHER_SETTING_GREET;
+    md = metadata_find(mu, "private:weather:colors");
+    if (!md || !md->value || strcasecmp(md->value, "OFF"))
+        settings->flags |= WEATHER_SETTING_COLORS;
+
+    md = metadata_find(mu, "private:weather:location");
+    latlong = metadata_find(mu, "private:weather:latlong");
+    if (md && md->value && latlong && latlong->value && sscanf(latlong->value, "%lf,%lf", &lat, &lng) == 2 &&
+        (settings->location = weather_intern(md->value)) && (settings->loc = weather_location_get(lat, lng))) {
+        settings->flags |= WEATHER_SETTING_LOCATION;
+        saved_location_add(settings->loc);
+    }
+
+    privatedata_set(mu, WEATHER_SETTINGS_KEY, settings);
+    return settings;
+}
+
+static void weather_settings_set_greet(myuser_t *mu, bool on) {
+    weather_settings_t *settings = weather_settings(mu);
+
+    if (on)
+        metadata_add(mu, "private:weather:greet", "ON");
+    else
+        metadata_delete(mu, "private:weather:greet");
+    if (settings)
+        settings->flags = on ? settings->flags | WEATHER_SETTING_GREET : settings->flags & ~WEATHER_SETTING_GREET;
+}
+
+static void weather_settings_set_colors(myuser_t *mu, bool on) {
+    weather_settings_t *settings = weather_settings(mu);
+
+    metadata_add(mu, "private:weather:colors", on ? "ON" : "OFF");
+    if (settings)
+        settings->flags = on ? settings->flags | WEATHER_SETTING_COLORS : settings->flags & ~WEATHER_SETTING_COLORS;
+}
+
+/* Also moves the account between saved locations for refresh-ahead. */
+static void weather_settings_set_location(myuser_t *mu, const char *location, double lat, double lng) {
+    weather_settings_t *settings = weather_settings(mu);
+    char latlong[64];
+
+    if (!settings)
+        return;
+    if (settings->flags & WEATHER_SETTING_LOCATION)
+        saved_location_del(settings->loc);
+    weather_unintern(settings->location);
+    weather_location_unref(settings->loc);
+    settings->flags &= ~WEATHER_SETTING_LOCATION;
+
+    settings->location = weather_intern(location);
+    settings->loc = weather_location_get(lat, lng);
+    weather_location_latlong(settings->loc, latlong, sizeof(latlong));
+    metadata_add(mu, "private:weather:location", location);
+    metadata_add(mu, "private:weather:latlong", latlong);
+    if (settings->location && settings->loc) {
+        settings->flags |= WEATHER_SETTING_LOCATION;
+        saved_location_add(settings->loc);
+    }
+}
+
+static void weather_settings_free(weather_settings_t *settings) {
+    weather_unintern(settings->location);
+    weather_location_unref(settings->loc);
+    free(settings);
+}
+
+/* Drops the record of an account that is going away. */
+static void weather_settings_forget(myuser_t *mu) {
+    weather_settings_t *settings = privatedata_delete(mu, WEATHER_SETTINGS_KEY);
+
+    if (settings)
+        weather_settings_free(settings);
+}
+
+static void deinit_weather_settings(void) {
+    myentity_iteration_state_t state;
+    myentity_t *mt;
+
+    MYENTITY_FOREACH_T(mt, &state, ENT_USER) {
+        weather_settings_forget(user(mt));
+    }
+}
+
+/*
+ * Negative cache.
+ *
+ * A failed lookup is remembered apart from the successes, keyed by the
+ * folded query ("g:" for place names, "w:" and the cell's lat/long for
+ * forecasts), so asking again does not go back to the network.  Each kind
+ * of failure has its own policy: the first failure is held for the base
+ * time and every repeat doubles it up to the cap.  The count of repeats is
+ * kept for as long as the cap after the hold ends, then forgotten; a
+ * success forgets it at once.  Quota and key errors are left to the keys.
+ *
+ * Most queries have never failed, so a small Bloom filter is checked
+ * first and only a hit looks in the tree.  Bits are not cleared as entries
+ * go; the sweep rebuilds the filter once enough have gone.
+ */
+#define NEGATIVE_CACHE_SIZE 10000
+#define NEGATIVE_CACHE_SWEEP_INTERVAL 60
+#define NEGATIVE_FILTER_BITS (1 << 16)
+#define NEGATIVE_FILTER_HASHES 4
+
+typedef enum {
+    NEGATIVE_NO_RESULTS,
+    NEGATIVE_PARSE,
+    NEGATIVE_HTTP_4XX,
+    NEGATIVE_HTTP_5XX,
+    NEGATIVE_TRANSPORT,
+    NEGATIVE_CLASS_COUNT
+} negative_class_t;
+
+static const struct {
+    const char *name;
+    unsigned int ttl;           /* seconds held after the first failure */
+    unsigned int max;
+} negative_policies[NEGATIVE_CLASS_COUNT] = {
+    [NEGATIVE_NO_RESULTS] = { "no results", 300, 86400 },
+    [NEGATIVE_PARSE]      = { "parse", 30, 900 },
+    [NEGATIVE_HTTP_4XX]   = { "HTTP 4xx", 120, 3600 },
+    [NEGATIVE_HTTP_5XX]   = { "HTTP 5xx", 15, 600 },
+    [NEGATIVE_TRANSPORT]  = { "transport", 5, 300 },
+};
+
+typedef struct {
+    char *key;
+    char *message;              /* the reply the failure got */
+    int code;                   /* and its OpenCage error_code */
+    negative_class_t class;
+    unsigned int strikes;
+    time_t until;               /* answered from here until then */
+    time_t forget;              /* strikes are kept until then */
+    mowgli_node_t node;
+} negative_cache_entry_t;
+
+static mowgli_patricia_t *negative_cache;
+static mowgli_list_t negative_cache_lru;   /* most recently failed first */
+static unsigned int negative_cache_max = NEGATIVE_CACHE_SIZE;
+static mowgli_eventloop_timer_t *negative_cache_timer;
+static uint8_t negative_filter[NEGATIVE_FILTER_BITS / 8];
+static unsigned int negative_filter_stale;  /* entries gone since the last rebuild */
+static unsigned int negative_cache_hits;
+static unsigned int negative_cache_skips;   /* turned away by the filter alone */
+static unsigned int negative_cache_false_positives;
+static unsigned int negative_cache_failures[NEGATIVE_CLASS_COUNT];
+
+/* Two halves of one FNV-1a hash make the filter's probes. */
+static uint64_t negative_filter_hash(const char *key) {
+    uint64_t h = 14695981039346656037ull;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 1099511628211ull;
+    return h;
+}
+
+static void negative_filter_add(const char *key) {
+    uint64_t h = negative_filter_hash(key);
+    uint32_t a = h, b = (h >> 32) | 1;
+
+    for (int i = 0; i < NEGATIVE_FILTER_HASHES; i++, a += b)
+        negative_filter[(a % NEGATIVE_FILTER_BITS) / 8] |= 1 << (a % 8);
+}
+
+static bool negative_filter_test(const char *key) {
+    uint64_t h = negative_filter_hash(key);
+    uint32_t a = h, b = (h >> 32) | 1;
+
+    for (int i = 0; i < NEGATIVE_FILTER_HASHES; i++, a += b) {
+        if (!(negative_filter[(a % NEGATIVE_FILTER_BITS) / 8] & (1 << (a % 8))))
+            return false;
+    }
+    return true;
+}
+
+static void negative_filter_rebuild(void) {
+    mowgli_node_t *n;
+
+    memset(negative_filter, 0, sizeof(negative_filter));
+    MOWGLI_ITER_FOREACH(n, negative_cache_lru.head) {
+        negative_cache_entry_t *entry = n->data;
+
+        negative_filter_add(entry->key);
+    }
+    negative_filter_stale = 0;
+}
+
+/* The key for a place name or a cell's lat/long, tagged by kind. */
+static void negative_cache_key(char kind, const char *query, char *buf, size_t size) {
+    buf[0] = kind;
+    buf[1] = ':';
+    gazetteer_fold(query, buf + 2, size - 2);
+}
+
+/* What a failed request says about the query, or -1 if nothing. */
+static int negative_cache_class(CURLcode res, long status, negative_class_t otherwise) {
+    if (res != CURLE_OK)
+        return NEGATIVE_TRANSPORT;
+    if (status == 401 || status == 402 || status == 403 || status == 429)
+        return -1;
+    if (status >= 500)
+        return NEGATIVE_HTTP_5XX;
+    if (status >= 400)
+        return NEGATIVE_HTTP_4XX;
+    return otherwise;
+}
+
+static void negative_cache_remove(negative_cache_entry_t *entry) {
+    mowgli_patricia_delete(negative_cache, entry->key);
+    mowgli_node_delete(&entry->node, &negative_cache_lru);
+    free(entry->key);
+    free(entry->message);
+    free(entry);
+    negative_filter_stale++;
+}
+
+static negative_cache_entry_t *negative_cache_find(const char *key) {
+    negative_cache_entry_t *entry;
+
+    if (!negative_filter_test(key)) {
+        negative_cache_skips++;
+        return NULL;
+    }
+    if (!(entry = mowgli_patricia_retrieve(negative_cache, key)))
+        negative_cache_false_positives++;
+    return entry;
+}
+
+/* The failure to answer key with, while it is being held. */
+static negative_cache_entry_t *negative_cache_lookup(const char *key) {
+    negative_cache_entry_t *entry = negative_cache_find(key);
+
+    if (!entry || entry->until <= CURRTIME)
+        return NULL;
+    negative_cache_hits++;
+    return entry;
+}
+
+static void negative_cache_store(const char *key, negative_class_t class, int code, const char *message) {
+    negative_cache_entry_t *entry = negative_cache_find(key);
+    unsigned int ttl;
+    char *copy;
+
+    negative_cache_failures[class]++;
+    if (negative_cache_max == 0 || !(copy = strdup(message)))
+        return;
+
+    if (entry) {
+        mowgli_node_delete(&entry->node, &negative_cache_lru);
+        free(entry->message);
+    } else {
+        while (MOWGLI_LIST_LENGTH(&negative_cache_lru) >= negative_cache_max)
+            negative_cache_remove(negative_cache_lru.tail->data);
+        if (!(entry = calloc(1, sizeof(negative_cache_entry_t))) || !(entry->key = strdup(key))) {
+            free(entry);
+            free(copy);
+            return;
+        }
+        mowgli_patricia_add(negative_cache, entry->key, entry);
+        negative_filter_add(entry->key);
+    }
+
+    entry->message = copy;
+    entry->code = code;
+    entry->class = class;
+    if (entry->strikes < 16)
+        entry->strikes++;
+    ttl = negative_policies[class].ttl << (entry->strikes - 1);
+    if (ttl > negative_policies[class].max)
+        ttl = negative_policies[class].max;
+    entry->until = CURRTIME + ttl;
+    entry->forget = entry->until + negative_policies[class].max;
+    mowgli_node_add_head(entry, &entry->node, &negative_cache_lru);
+    slog(LG_DEBUG, "weather: holding %s for %us after %s failure %u", key, ttl, negative_policies[class].name, entry->strikes);
+}
+
+/* A success starts the backoff over. */
+static void negative_cache_clear(const char *key) {
+    negative_cache_entry_t *entry;
+
+    if (negative_filter_test(key) && (entry = mowgli_patricia_retrieve(negative_cache, key)))
+        negative_cache_remove(entry);
+}
+
+static void negative_cache_sweep(void *arg) {
+    mowgli_node_t *n, *tn;
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, negative_cache_lru.head) {
+        negative_cache_entry_t *entry = n->data;
+
+        if (entry->forget <= CURRTIME)
+            negative_cache_remove(entry);
+    }
+    if (negative_filter_stale > MOWGLI_LIST_LENGTH(&negative_cache_lru) / 2)
+        negative_filter_rebuild();
+}
+
+static void negative_cache_show(sourceinfo_t *si) {
+    command_success_nodata(si, "\2Negative cache:\2 %zu entries", MOWGLI_LIST_LENGTH(&negative_cache_lru));
+    command_success_nodata(si, "  Answered: %u  Filter skips: %u  False positives: %u", negative_cache_hits, negative_cache_skips,
+        negative_cache_false_positives);
+    command_success_nodata(si, "  Failures: %s %u, %s %u, %s %u, %s %u, %s %u",
+        negative_policies[NEGATIVE_NO_RESULTS].name, negative_cache_failures[NEGATIVE_NO_RESULTS],
+        negative_policies[NEGATIVE_PARSE].name, negative_cache_failures[NEGATIVE_PARSE],
+        negative_policies[NEGATIVE_HTTP_4XX].name, negative_cache_failures[NEGATIVE_HTTP_4XX],
+        negative_policies[NEGATIVE_HTTP_5XX].name, negative_cache_failures[NEGATIVE_HTTP_5XX],
+        negative_policies[NEGATIVE_TRANSPORT].name, negative_cache_failures[NEGATIVE_TRANSPORT]);
+}
+
+static void init_negative_cache(void) {
+    add_uint_conf_item("NEGATIVE_CACHE_SIZE", &weather->conf_table, 0, &negative_cache_max, 0, 1000000, NEGATIVE_CACHE_SIZE);
+    negative_cache = mowgli_patricia_create(NULL);
+    negative_cache_timer = mowgli_timer_add(base_eventloop, "negative_cache_sweep", negative_cache_sweep, NULL, NEGATIVE_CACHE_SWEEP_INTERVAL);
+}
+
+static void deinit_negative_cache(void) {
+    mowgli_timer_destroy(base_eventloop, negative_cache_timer);
+    del_conf_item("NEGATIVE_CACHE_SIZE", &weather->conf_table);
+    while (negative_cache_lru.head)
+        negative_cache_remove(negative_cache_lru.head->data);
+    mowgli_patricia_destroy(negative_cache, NULL, NULL);
+}
+
+static void geocode_complete(weather_job_t *job, const OpenCage *result) {
+    weather_stats_record(WEATHER_STAGE_GEOCODE, job->stage_started);
+    slog(LG_DEBUG, "%s", result->location);
+    if (result->error_code != 0) {
+        if (job->setweather)
+            weather_job_reply(job, "\2Error:\2 %s", result->location);
+        else
+            weather_job_reply(job, "Error: %s", result->location);
+        weather_job_free(job);
+        return;
+    }
+
+    if (job->setweather) {
+        myuser_t *mu = myuser_find(job->account);
+
+        if (mu) {
+            weather_settings_set_location(mu, result->location, result->lat, result->lng);
+            weather_job_reply(job, "The following location was set \2%s\2", result->location);
+        }
+        weather_job_free(job);
+        return;
+    }
+
+    job->location = weather_intern(result->location);
+    job->loc = weather_location_get(result->lat, result->lng);
+    if (!job->location || !job->loc) {
+        weather_job_reply(job, "%s", _("Failed to fetch weather data."));
+        weather_job_free(job);
+        return;
+    }
+    fetch_weather_data(job);
+}
+
+static void geocode_fetch_done(weather_fetch_t *fetch, CURLcode res) {
+    weather_job_t *job = fetch->privdata;
+    OpenCage result = { "", 0, 0, 0 };
+    char key[260];
+    int class;
+
+    negative_cache_key('g', job->query, key, sizeof(key));
+    if (res != CURLE_OK) {
+        slog(LG_DEBUG, "Failed to perform request: %s", curl_easy_strerror(res));
+        strncpy(result.location, "Failed to perform request!", sizeof(result.location));
+        result.error_code = res;
+    } else if (geocode_parse_finish(&job->geocode, &result) == 0) {
+        geocode_cache_store(job->query, result.location, job->geocode.lat, job->geocode.lng, CURRTIME + geocode_cache_ttl);
+        negative_cache_clear(key);
+    }
+
+    /* a document without results is as broken as one that does not parse */
+    class = negative_cache_class(res, fetch->info.status, result.error_code <= 3 ? NEGATIVE_PARSE : NEGATIVE_NO_RESULTS);
+    if (result.error_code != 0 && class >= 0)
+        negative_cache_store(key, class, result.error_code, result.location);
+
+    geocode_complete(job, &result);
+}
+
+/* Resolves city for the job and carries on with the weather fetch, or
+ * stores the result when the job is a SETWEATHER. */
+void fetch_geocode_data(weather_job_t *job, const char *city) {
+    char url[256];
+    OpenCage result = { "", 0, 0, 0 };
+    negative_cache_entry_t *negative;
+    weather_api_key_t *key;
+    const char *error;
+    char query[260];
+
+    job->stage_started = weather_now_us();
+    if (gazetteer_lookup(city, &result) || geocode_cache_lookup(city, &result)) {
+        geocode_complete(job, &result);
+        return;
+    }
+
+    negative_cache_key('g', city, query, sizeof(query));
+    if ((negative = negative_cache_lookup(query))) {
+        mowgli_strlcpy(result.location, negative->message, sizeof(result.location));
+        result.error_code = negative->code;
+        geocode_complete(job, &result);
+        return;
+    }
+
+    key = weather_key_pick(WEATHER_UPSTREAM_OPENCAGE, job->background, &error);
+    if (!key) {
+        if (!job->background)
+            weather_job_reply(job, "Error: %s", error);
+        weather_job_free(job);
+        return;
+    }
+
+    mowgli_strlcpy(job->query, city, sizeof(job->query));
+    snprintf(url, sizeof(url), OPENCAGE_QUERY, opencage_url(), city, key->key);
+    geocode_parse_init(&job->geocode);
+    if (!weather_fetch_submit(key, url, &job->geocode.stream, geocode_fetch_done, job)) {
+        weather_job_reply(job, "Error: %s", weather_fetch_error);
+        weather_job_free(job);
+    }
+}
+
+static void ws_cmd_help(sourceinfo_t *si, int parc, char *parv[])
+{
+    bool is_admin = has_priv(si, PRIV_ADMIN);
+    char *command = parv[0];
+
+    if (!command) {
+        command_success_nodata(si, _("***** \2%s Help\2 *****"), si->service->nick);
+        command_success_nodata(si, _("\2%s\2 provides weather information and related commands, using"), si->service->nick);
+        command_success_nodata(si, _("OpenCage and PirateWeather as sources."));
+        command_success_nodata(si, " ");
+        command_success_nodata(si, _("For more information on a command, type:"));
+        command_success_nodata(si, "\2/%s%s HELP <command>\2", (ircd->uses_rcommand == false) ? "msg " : "", weather->disp);
+        command_success_nodata(si, " ");
+        command_success_nodata(si, "The following commands are available:");
+        command_success_nodata(si, "\2FORECAST\2       Fetches forecast data for a location.");
+        command_success_nodata(si, "\2HELP\2           Displays contextual help information.");
+        command_success_nodata(si, "\2INFO\2           Displays user-specific weather settings information.");
+        command_success_nodata(si, "\2JOIN\2           %s will join channel.", si->service->nick);
+        command_success_nodata(si, "\2PART\2           %s will leave channel.", si->service->nick);
+        command_success_nodata(si, "\2SETCOLORS\2      Enables or disables weather colors output.");
+        command_success_nodata(si, "\2SETGREET\2       Enables or disables weather greeting on identify.");
+        command_success_nodata(si, "\2SETWEATHER\2     Sets the default weather location for the user.");
+        command_success_nodata(si, "\2TRIGGERS\2       Shows or sets the channel triggers.");
+        if (is_admin) {
+        command_success_nodata(si, "\2SETRATELIMIT\2   Shows or sets the rate limits for the service.");
+        command_success_nodata(si, "\2STATS\2          Shows request latency and error statistics.");
+        command_success_nodata(si, "\2CYCLE\2          Forces %s to join stored channels, or shows how far it got.", si->service->nick);
+        command_success_nodata(si, "\2CACHESTATS\2     Shows weather and geocode cache statistics.");
+        command_success_nodata(si, "\2UPSTREAMS\2      Shows connection statistics for the upstream APIs.");
+        }
+        command_success_nodata(si, "\2WEATHER\2        Fetches weather data for a location.");
+        command_success_nodata(si, " ");
+        command_success_nodata(si, "\2W\2 and \2F\2 shortcuts for are also available for the weather and forecast.");
+        command_success_nodata(si, " ");
+        command_success_nodata(si, _("***** \2End of Help\2 *****"));
+        return;
+    }
+
+    help_display(si, si->service, command, si->service->commands);
+}
+
+static void ws_cmd_info(sourceinfo_t *si, int parc, char *parv[])
+{
+    weather_settings_t *settings = weather_settings(si->smu);
+    char latlong[64];
+
+    join("#XYZ", "Weather");
+    if (!settings) {
+        command_fail(si, fault_nosuch_target, _("Failed to read your weather settings."));
+        return;
+    }
+
+    command_success_nodata(si, "Weather information for \2%s:\2", entity(si->smu)->name);
+    if (settings->flags & WEATHER_SETTING_LOCATION) {
+        weather_location_latlong(settings->loc, latlong, sizeof(latlong));
+        command_success_nodata(si, " Default location: %s", settings->location);
+        command_success_nodata(si, "Default lat, long: %s", latlong);
+    } else {
+        command_success_nodata(si, " Default location: Not set");
+        command_success_nodata(si, "Default lat, long: Not set");
+    }
+
+    command_success_nodata(si, "    Greet setting: %s", settings->flags & WEATHER_SETTING_GREET ? "Enabled" : "Disabled");
+    command_success_nodata(si, "    Colors setting: %s", settings->flags & WEATHER_SETTING_COLORS ? "Enabled" : "Disabled");
+}
+
+/*
+ * Queues a weather or forecast request for the reply target.  With no
+ * location the user's saved one is used.  Returns false with the reason in
+ * error when nothing could be queued.
+ */
+static bool weather_request(weather_reply_kind_t reply_kind, const char *target, myuser_t *mu, const char *templocation, int forecast, bool background, const char **error) {
+    weather_settings_t *settings = mu ? weather_settings(mu) : NULL;
+    weather_job_t *job;
+
+    if (templocation && *templocation == '\0')
+        templocation = NULL;
+
+    if (!templocation) {
+        if (!settings || !(settings->flags & WEATHER_SETTING_LOCATION)) {
+            *error = _("No location was requested or use SETWEATHER to set default location.");
+            return false;
+        }
+
+        job = weather_job_create(reply_kind, target);
+        if (!job) {
+            *error = _("Failed to fetch weather data.");
+            return false;
+        }
+        job->location = weather_intern_dup(settings->location);
+        job->loc = weather_location_ref(settings->loc);
+    } else {
+        job = weather_job_create(reply_kind, target);
+        if (!job) {
+            *error = _("Failed to fetch weather data.");
+            return false;
+        }
+    }
+
+    job->forecast = forecast;
+    job->background = background;
+
+    if (settings && !(settings->flags & WEATHER_SETTING_COLORS))
+        job->colors = false;
+
+    if (templocation) {
+        char location[256];
+
+        snprintf(location, sizeof(location), "%s", templocation);
+        slog(LG_DEBUG, "%s %s", location, templocation);
+        replace_spaces_with_underscores(location);
+        fetch_geocode_data(job, location);
+    } else {
+        fetch_weather_data(job);
+    }
+
+    return true;
+}
+
+static void ws_cmd_weather(sourceinfo_t *si, int parc, char *parv[])
+{
+    const char *error;
+
+    if (!check_rate_limit(si)) {
+        // Rate limit check failed
+        return;
+    }
+
+    weather_command_counts[WEATHER_COMMAND_WEATHER]++;
+    if (!weather_request(WEATHER_REPLY_USER, si->su->nick, si->smu, parv[0], 0, false, &error)) {
+        command_fail(si, fault_needmoreparams, "%s", error);
+    }
+}
+
+static void ws_cmd_forecast(sourceinfo_t *si, int parc, char *parv[])
+{
+    const char *error;
+
+    if (!check_rate_limit(si)) {
+        // Rate limit check failed
+        return;
+    }
+
+    weather_command_counts[WEATHER_COMMAND_FORECAST]++;
+    if (!weather_request(WEATHER_REPLY_USER, si->su->nick, si->smu, parv[0], 1, false, &error)) {
+        command_fail(si, fault_needmoreparams, "%s", error);
+    }
+}
+
+static void ws_cmd_setweather(sourceinfo_t *si, int parc, char *parv[])
+{
+    const char *templocation = parv[0];
+    char location[256];
+    weather_job_t *job;
+    if (!check_rate_limit(si)) {
+        // Rate limit check failed
+        return;
+    }
+
+    if (!templocation) {
+        command_fail(si, fault_needmoreparams, _("Usage: SETWEATHER <location>"));
+        return;
+    }
+    snprintf(location, sizeof(location), "%s", templocation);
+    replace_spaces_with_underscores(location);
+
+    weather_command_counts[WEATHER_COMMAND_SETWEATHER]++;
+    job = weather_job_create(WEATHER_REPLY_USER, si->su->nick);
+    if (job) {
+        job->setweather = true;
+        mowgli_strlcpy(job->account, entity(si->smu)->name, sizeof(job->account));
+        fetch_geocode_data(job, location);
+    }
+
+    /* a saved location greets by default; colors are on unless turned off */
+    weather_settings_t *settings = weather_settings(si->smu);
+    if (settings && !(settings->flags & WEATHER_SETTING_GREET))
+        weather_settings_set_greet(si->smu, true);
+}
+
+static void ws_cmd_setgreet(sourceinfo_t *si, int parc, char *parv[])
+{
+    const char *option = parv[0];
+
+    if (!option) {
+        command_fail(si, fault_needmoreparams, _("Usage: SETGREET <ON|OFF>"));
+        return;
+    }
+
+    if (strcasecmp(option, "ON") == 0) {
+        weather_settings_set_greet(si->smu, true);
+        command_success_nodata(si, _("Weather greeting enabled."));
+    } else if (strcasecmp(option, "OFF") == 0) {
+        weather_settings_set_greet(si->smu, false);
+        command_success_nodata(si, _("Weather greeting disabled."));
+    } else {
+        command_fail(si, fault_badparams, _("Usage: SETGREET <ON|OFF>"));
+    }
+}
+
+static void ws_cmd_setcolors(sourceinfo_t *si, int parc, char *parv[])
+{
+    const char *option = parv[0];
+
+    if (!option) {
+        command_fail(si, fault_needmoreparams, _("Usage: SETCOLOR <ON|OFF>"));
+        return;
+    }
+
+    if (strcasecmp(option, "ON") == 0) {
+        weather_settings_set_colors(si->smu, true);
+        command_success_nodata(si, _("Weather colors enabled."));
+    } else if (strcasecmp(option, "OFF") == 0) {
+        weather_settings_set_colors(si->smu, false);
+        command_success_nodata(si, _("Weather colors disabled."));
+    } else {
+        command_fail(si, fault_badparams, _("Usage: SETCOLORS <ON|OFF>"));
+    }
+}
+
+static void on_user_identify(user_t *u)
+{
+    weather_settings_t *settings = weather_settings(u->myuser);
+
+    /* greet is on but let's not assume a location is set */
+    if (!settings || (settings->flags & (WEATHER_SETTING_GREET | WEATHER_SETTING_LOCATION)) != (WEATHER_SETTING_GREET | WEATHER_SETTING_LOCATION))
+        return;
+
+    weather_command_counts[WEATHER_COMMAND_GREET]++;
+    greet_queue(u, settings->location, settings->loc);
+}
+
+
+static void ws_cmd_setratelimit(sourceinfo_t *si, int parc, char *parv[]) {
+    const char *level_name = parv[0], *rate = parv[1], *burst_value = parc > 2 ? parv[2] : NULL;
+    int level;
+
+    // Ensure the command is issued by a priv_admin
+    if (!has_priv(si, PRIV_ADMIN)) {
+        command_fail(si, fault_noprivs, _("You do not have the required privileges to use this command."));
+        return;
+    }
+
+    if (!level_name) {
+        for (level = 0; level < RATE_LIMIT_LEVELS; level++) {
+            const rate_limit_setting_t *setting = &rate_limit_settings[level];
+
+            if (setting->rate)
+                command_success_nodata(si, "\2%-8s\2 %u per minute, burst %u, %u rejected", setting->name, setting->rate, setting->burst, setting->rejected);
+            else
+                command_success_nodata(si, "\2%-8s\2 unlimited, %u rejected", setting->name, setting->rejected);
+        }
+        command_success_nodata(si, "%zu buckets (limit %u), %u evicted", (size_t)MOWGLI_LIST_LENGTH(&rate_limit_lru), rate_limit_max, rate_limit_evictions);
+        return;
+    }
+
+    /* a bare number keeps its old meaning: the limit for each user */
+    if (isdigit((unsigned char)level_name[0])) {
+        level = -1;
+        burst_value = rate;
+        rate = level_name;
+    } else {
+        for (level = 0; level < RATE_LIMIT_LEVELS; level++) {
+            if (!strcasecmp(level_name, rate_limit_settings[level].name))
+                break;
+        }
+        if (level == RATE_LIMIT_LEVELS || !rate) {
+            command_fail(si, fault_needmoreparams, _("Usage: SETRATELIMIT [ACCOUNT|HOST|CHANNEL|GLOBAL] <per minute> [burst]"));
+            return;
+        }
+    }
+
+    char *endptr;
+    errno = 0;
+    long the_limit = strtol(rate, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || the_limit < 0 || the_limit > INT_MAX) {
+        command_fail(si, fault_badparams, _("Invalid rate limit value. Please provide a positive integer."));
+        return;
+    }
+    long burst = the_limit;
+    if (burst_value) {
+        errno = 0;
+        burst = strtol(burst_value, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || burst < 1 || burst > INT_MAX) {
+            command_fail(si, fault_badparams, _("Invalid burst value. Please provide a positive integer."));
+            return;
+        }
+    }
+
+    for (int i = 0; i < RATE_LIMIT_LEVELS; i++) {
+        if (i == level || (level < 0 && (i == RATE_LIMIT_ACCOUNT || i == RATE_LIMIT_HOST))) {
+            rate_limit_settings[i].rate = the_limit;
+            rate_limit_settings[i].burst = burst;
+            if (the_limit)
+                command_success_nodata(si, "Rate limit for %s is now %ld hits per minute, burst %ld", rate_limit_settings[i].name, the_limit, burst);
+            else
+                command_success_nodata(si, "Rate limit for %s is now off", rate_limit_settings[i].name);
+        }
+    }
+}
+
+
+
+/*
+ * The parts of a PirateWeather response that make up a reply.  Records are
+ * self-contained so they can be cached and rendered for any requester.
+ */
+#define WEATHER_MAX_DAYS 8
+
+typedef struct {
+    time_t time;
+    char summary[64];
+    double temp_high;
+    double temp_low;
+} weather_day_t;
+
+struct weather_record_ {
+    char summary[64];
+    double temperature;
+    double apparent_temperature;
+    double humidity;
+    double wind_speed;
+    double wind_bearing;
+    double wind_gust;
+    double dew_point;
+    double uv_index;
+    time_t sunrise;
+    time_t sunset;
+    char timezone[48];      /* zoneinfo name of the location, if given */
+    int32_t utc_offset;     /* seconds east of UTC, for when the zone is unknown */
+    int day_count;
+    weather_day_t days[WEATHER_MAX_DAYS];
+};
+
+/*
+ * PirateWeather extraction.  Only "currently" and the first
+ * WEATHER_MAX_DAYS entries of "daily.data" are opened; minutely, hourly,
+ * alerts and flags are skipped without being tokenized.
+ */
+typedef struct {
+    json_stream_t stream;
+    weather_record_t record;
+    bool have_currently;
+} weather_parse_t;
+
+static bool weather_parse_enter(json_stream_t *js) {
+    weather_parse_t *wp = js->privdata;
+
+    switch (js->depth) {
+    case 0:
+        return true;
+    case 1:
+        if (!strcmp(js->frames[0].key, "currently")) {
+            wp->have_currently = true;
+            return true;
+        }
+        return !strcmp(js->frames[0].key, "daily");
+    case 2:
+        return !strcmp(js->frames[0].key, "daily") && !strcmp(js->frames[1].key, "data");
+    case 3:
+        return js->frames[2].index < WEATHER_MAX_DAYS;
+    default:
+        return false;
+    }
+}
+
+static void weather_parse_value(json_stream_t *js, json_stream_kind_t kind, const char *text, size_t len) {
+    weather_parse_t *wp = js->privdata;
+    weather_record_t *record = &wp->record;
+    const char *key = json_stream_key(js, js->depth - 1);
+    double number = kind == JSON_STREAM_NUMBER ? strtod(text, NULL) : 0;
+
+    if (js->depth == 1) {
+        if (!strcmp(key, "timezone")) {
+            if (kind == JSON_STREAM_STRING)
+                mowgli_strlcpy(record->timezone, text, sizeof(record->timezone));
+        } else if (!strcmp(key, "offset")) {
+            record->utc_offset = (int32_t)lround(number * 3600);
+        }
+    } else if (js->depth == 2 && !strcmp(js->frames[0].key, "currently")) {
+        if (!strcmp(key, "summary")) {
+            if (kind == JSON_STREAM_STRING)
+                mowgli_strlcpy(record->summary, text, sizeof(record->summary));
+        } else if (!strcmp(key, "temperature")) {
+            record->temperature = number;
+        } else if (!strcmp(key, "apparentTemperature")) {
+            record->apparent_temperature = number;
+        } else if (!strcmp(key, "humidity")) {
+            record->humidity = number;
+        } else if (!strcmp(key, "windSpeed")) {
+            record->wind_speed = number;
+        } else if (!strcmp(key, "windBearing")) {
+            record->wind_bearing = number;
+        } else if (!strcmp(key, "windGust")) {
+            record->wind_gust = number;
+        } else if (!strcmp(key, "dewPoint")) {
+            record->dew_point = number;
+        } else if (!strcmp(key, "uvIndex")) {
+            record->uv_index = number;
+        }
+    } else if (js->depth == 4) {
+        /* daily.data[index].key */
+        unsigned int index = js->frames[2].index;
+        weather_day_t *day = &record->days[index];
+
+        if ((int)index >= record->day_count)
+            record->day_count = index + 1;
+
+        if (!strcmp(key, "time")) {
+            day->time = (time_t)number;
+        } else if (!strcmp(key, "summary")) {
+            if (kind == JSON_STREAM_STRING)
+                mowgli_strlcpy(day->summary, text, sizeof(day->summary));
+        } else if (!strcmp(key, "temperatureHigh")) {
+            day->temp_high = number;
+        } else if (!strcmp(key, "temperatureLow")) {
+            day->temp_low = number;
+        } else if (index == 0 && !strcmp(key, "sunriseTime")) {
+            record->sunrise = (time_t)number;
+        } else if (index == 0 && !strcmp(key, "sunsetTime")) {
+            record->sunset = (time_t)number;
+        }
+    }
+}
+
+void weather_parse_init(weather_parse_t *wp) {
+    memset(&wp->record, 0, sizeof(wp->record));
+    wp->have_currently = false;
+    json_stream_init(&wp->stream, weather_parse_enter, weather_parse_value, wp);
+}
+
+bool weather_parse_finish(weather_parse_t *wp) {
+    if (!json_stream_finish(&wp->stream)) {
+        slog(LG_DEBUG, "Error parsing JSON data");
+        return false;
+    }
+
+    if (!wp->have_currently) {
+        slog(LG_DEBUG, "Error retrieving 'currently' from JSON data.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool parse_weather_data(const char *body, weather_record_t *record) {
+    weather_parse_t wp;
+    bool ok;
+
+    weather_parse_init(&wp);
+    json_stream_feed(&wp.stream, body, strlen(body));
+    ok = weather_parse_finish(&wp);
+    *record = wp.record;
+    return ok;
+}
+
+/*
+ * Open-Meteo extraction, into the same record as PirateWeather.  Units are
+ * asked for in Fahrenheit and mph to match; humidity comes as a percentage
+ * and the summary as a WMO weather code.
+ */
+static const char *openmeteo_summary(int code) {
+    switch (code) {
+    case 0: return "Clear";
+    case 1: return "Mostly Clear";
+    case 2: return "Partly Cloudy";
+    case 3: return "Overcast";
+    case 45: case 48: return "Fog";
+    case 51: case 53: case 55: return "Drizzle";
+    case 56: case 57: return "Freezing Drizzle";
+    case 61: return "Light Rain";
+    case 63: return "Rain";
+    case 65: return "Heavy Rain";
+    case 66: case 67: return "Freezing Rain";
+    case 71: return "Light Snow";
+    case 73: return "Snow";
+    case 75: return "Heavy Snow";
+    case 77: return "Snow Grains";
+    case 80: case 81: case 82: return "Rain Showers";
+    case 85: case 86: return "Snow Showers";
+    case 95: return "Thunderstorm";
+    case 96: case 99: return "Thunderstorm with Hail";
+    default: return "";
+    }
+}
+
+static bool openmeteo_parse_enter(json_stream_t *js) {
+    weather_parse_t *wp = js->privdata;
+
+    switch (js->depth) {
+    case 0:
+        return true;
+    case 1:
+        if (!strcmp(js->frames[0].key, "current")) {
+            wp->have_currently = true;
+            return true;
+        }
+        return !strcmp(js->frames[0].key, "daily");
+    case 2:
+        /* daily is an object of arrays, one entry per day */
+        return !strcmp(js->frames[0].key, "daily");
+    default:
+        return false;
+    }
+}
+
+static void openmeteo_parse_value(json_stream_t *js, json_stream_kind_t kind, const char *text, size_t len) {
+    weather_parse_t *wp = js->privdata;
+    weather_record_t *record = &wp->record;
+    double number = kind == JSON_STREAM_NUMBER ? strtod(text, NULL) : 0;
+
+    if (js->depth == 1 && kind == JSON_STREAM_STRING && !strcmp(js->frames[0].key, "timezone")) {
+        mowgli_strlcpy(record->timezone, text, sizeof(record->timezone));
+        return;
+    }
+    if (kind != JSON_STREAM_NUMBER)
+        return;
+
+    if (js->depth == 1 && !strcmp(js->frames[0].key, "utc_offset_seconds")) {
+        record->utc_offset = (int32_t)number;
+    } else if (js->depth == 2 && !strcmp(js->frames[0].key, "current")) {
+        const char *key = js->frames[1].key;
+
+        if (!strcmp(key, "weather_code")) {
+            mowgli_strlcpy(record->summary, openmeteo_summary((int)number), sizeof(record->summary));
+        } else if (!strcmp(key, "temperature_2m")) {
+            record->temperature = number;
+        } else if (!strcmp(key, "apparent_temperature")) {
+            record->apparent_temperature = number;
+        } else if (!strcmp(key, "relative_humidity_2m")) {
+            record->humidity = number / 100;
+        } else if (!strcmp(key, "wind_speed_10m")) {
+            record->wind_speed = number;
+        } else if (!strcmp(key, "wind_direction_10m")) {
+            record->wind_bearing = number;
+        } else if (!strcmp(key, "wind_gusts_10m")) {
+            record->wind_gust = number;
+        } else if (!strcmp(key, "dew_point_2m")) {
+            record->dew_point = number;
+        } else if (!strcmp(key, "uv_index")) {
+            record->uv_index = number;
+        }
+    } else if (js->depth == 3 && !strcmp(js->frames[0].key, "daily")) {
+        /* daily.key[index] */
+        const char *key = js->frames[1].key;
+        unsigned int index = js->frames[2].index;
+        weather_day_t *day;
+
+        if (index >= WEATHER_MAX_DAYS)
+            return;
+        day = &record->days[index];
+        if ((int)index >= record->day_count)
+            record->day_count = index + 1;
+
+        if (!strcmp(key, "time")) {
+            day->time = (time_t)number;
+        } else if (!strcmp(key, "weather_code")) {
+            mowgli_strlcpy(day->summary, openmeteo_summary((int)number), sizeof(day->summary));
+        } else if (!strcmp(key, "temperature_2m_max")) {
+            day->temp_high = number;
+        } else if (!strcmp(key, "temperature_2m_min")) {
+            day->temp_low = number;
+        } else if (index == 0 && !strcmp(key, "sunrise")) {
+            record->sunrise = (time_t)number;
+        } else if (index == 0 && !strcmp(key, "sunset")) {
+            record->sunset = (time_t)number;
+        }
+    }
+}
+
+void openmeteo_parse_init(weather_parse_t *wp) {
+    memset(&wp->record, 0, sizeof(wp->record));
+    wp->have_currently = false;
+    json_stream_init(&wp->stream, openmeteo_parse_enter, openmeteo_parse_value, wp);
+}
+
+bool parse_openmeteo_data(const char *body, weather_record_t *record) {
+    weather_parse_t wp;
+    bool ok;
+
+    openmeteo_parse_init(&wp);
+    json_stream_feed(&wp.stream, body, strlen(body));
+    ok = weather_parse_finish(&wp);
+    *record = wp.record;
+    return ok;
+}
+
+/*
+ * Weather providers.
+ *
+ * A provider builds the request for a lat/long on its upstream and
+ * extracts the answer into a weather_record_t, so the cache does not care
+ * which one answered.  They are tried in order: the first with quota
+ * left is the primary, and the next one is the hedge.
+ *
+ * A user-facing fetch that the primary has not answered by the
+ * hedge_percentile of its recent latency goes to the hedge as well, and
+ * whichever answers first is used.  One that fails while the hedge is
+ * still pending goes to the hedge at once.
+ */
+#define WEATHER_HEDGE_PERCENTILE 90
+#define WEATHER_HEDGE_MIN_SAMPLES 20
+#define WEATHER_HEDGE_DEFAULT_DELAY 1000000     /* us, until there are enough samples */
+#define WEATHER_HEDGE_MIN_DELAY 20000
+#define WEATHER_HEDGE_WINDOW 1000               /* samples per latency window */
+
+typedef enum {
+    WEATHER_PROVIDER_PIRATE,
+    WEATHER_PROVIDER_OPENMETEO,
+    WEATHER_PROVIDER_COUNT
+} weather_provider_id_t;
+
+typedef struct {
+    const char *name;
+    weather_upstream_id_t upstream;
+    void (*url)(const weather_api_key_t *key, const weather_location_t *loc, char *buf, size_t size);
+    void (*parse_init)(weather_parse_t *wp);
+    weather_hist_t latency[2];      /* this window and the last, successful fetches */
+    unsigned int requests;
+    unsigned int failures;
+    unsigned int hedges;            /* requests sent as the hedge */
+    unsigned int wins;              /* races with another provider won */
+} weather_provider_t;
+
+static unsigned int weather_hedge_percentile = WEATHER_HEDGE_PERCENTILE;
+static unsigned int weather_hedge_armed;       /* fetches that could have been hedged */
+static unsigned int weather_hedge_failovers;   /* hedges sent early because the primary failed */
+
+static char *weather_openmeteo_url;
+
+static void pirate_weather_url(const weather_api_key_t *key, const weather_location_t *loc, char *buf, size_t size) {
+    snprintf(buf, size, "%s/%s/%f,%f?exclude=%s", pirate_url(), key->key, loc->lat, loc->lng, PIRATE_EXCLUDE);
+}
+
+static void openmeteo_weather_url(const weather_api_key_t *key, const weather_location_t *loc, char *buf, size_t size) {
+    snprintf(buf, size, OPENMETEO_QUERY, weather_openmeteo_url ? weather_openmeteo_url : OPENMETEO_URL, loc->lat, loc->lng);
+}
+
+static weather_provider_t weather_providers[WEATHER_PROVIDER_COUNT] = {
+    [WEATHER_PROVIDER_PIRATE] = { "PirateWeather", WEATHER_UPSTREAM_PIRATE, pirate_weather_url, weather_parse_init },
+    [WEATHER_PROVIDER_OPENMETEO] = { "Open-Meteo", WEATHER_UPSTREAM_OPENMETEO, openmeteo_weather_url, openmeteo_parse_init },
+};
+
+static void weather_provider_sample(weather_provider_t *provider, uint64_t us) {
+    weather_window_add(provider->latency, WEATHER_HEDGE_WINDOW, us);
+}
+
+/* The provider's latency at percentile p over the last two windows. */
+static uint64_t weather_provider_percentile(const weather_provider_t *provider, double p) {
+    return weather_window_percentile(provider->latency, p);
+}
+
+static uint64_t weather_provider_hedge_delay(const weather_provider_t *provider) {
+    uint64_t delay;
+
+    if (provider->latency[0].count + provider->latency[1].count < WEATHER_HEDGE_MIN_SAMPLES)
+        return WEATHER_HEDGE_DEFAULT_DELAY;
+    delay = weather_provider_percentile(provider, weather_hedge_percentile);
+    return delay > WEATHER_HEDGE_MIN_DELAY ? delay : WEATHER_HEDGE_MIN_DELAY;
+}
+
+static void weather_providers_show(sourceinfo_t *si) {
+    unsigned int hedged = 0;
+
+    for (int i = 0; i < WEATHER_PROVIDER_COUNT; i++)
+        hedged += weather_providers[i].hedges;
+
+    command_success_nodata(si, "\2Hedging:\2 %s, %u of %u fetches hedged (%.1f%%), %u after a failure",
+        weather_hedge_percentile ? "on" : "off", hedged, weather_hedge_armed,
+        weather_hedge_armed ? 100.0 * hedged / weather_hedge_armed : 0.0, weather_hedge_failovers);
+    for (int i = 0; i < WEATHER_PROVIDER_COUNT; i++) {
+        const weather_provider_t *provider = &weather_providers[i];
+
+        command_success_nodata(si, "  %s: %u requests, %u failed, %u as hedge, %u races won, p50 %.0f ms, p90 %.0f ms, hedges after %.0f ms",
+            provider->name, provider->requests, provider->failures, provider->hedges, provider->wins,
+            weather_provider_percentile(provider, 50) / 1000.0, weather_provider_percentile(provider, 90) / 1000.0,
+            weather_provider_hedge_delay(provider) / 1000.0);
+    }
+}
+
+/*
+ * Fetch worker.
+ *
+ * With fetch_worker on, transfers, TLS, decompression and JSON parsing
+ * move out of the services process into a helper forked from it.  Jobs go
+ * to the helper over a socketpair as small binary frames carrying the URL
+ * and which parser to run.  It answers each with the transfer statistics,
+ * the rate limit headers and the parser's fixed-layout result (the
+ * weather_record_t, or the geocode fields), which is copied straight into
+ * the parse state the fetch was submitted with; callers cannot tell the
+ * difference.  The helper is the same image, so the layouts match.
+ *
+ * The helper runs every job it has at once.  At most fetch_worker_queue
+ * jobs are handed to it; past that new fetches are refused rather than
+ * queued without bound.  If it dies its jobs are rerun in process and it
+ * is forked again after a delay that grows while it keeps dying; until
+ * then fetches run in process as they do with the worker off.
+ */
+#define WEATHER_WORKER_SLOTS 1024           /* most jobs the queue can be set to */
+#define WEATHER_WORKER_QUEUE 128
+#define WEATHER_WORKER_FRAME_MAX 65536
+#define WEATHER_WORKER_RESTART_MAX 60       /* seconds between restarts, at most */
+#define WEATHER_WORKER_STABLE 60            /* uptime that resets the restart delay */
+
+typedef enum {
+    WEATHER_FRAME_JOB,          /* weather_worker_job_t, then the URL */
+    WEATHER_FRAME_CANCEL,
+    WEATHER_FRAME_RESULT,       /* weather_worker_result_t, then the parser's result */
+} weather_frame_type_t;
+
+typedef struct {
+    uint32_t len;               /* bytes after the header */
+    uint32_t job;
+    uint32_t type;
+} weather_frame_t;
+
+typedef struct {
+    uint32_t parser;
+    uint32_t upstream;
+    uint32_t timeout_ms;
+} weather_worker_job_t;
+
+typedef struct {
+    int32_t res;                /* CURLcode */
+    bool parsed;                /* the document was complete and valid */
+    weather_fetch_info_t info;
+    weather_key_headers_t headers;
+    uint64_t bytes;
+    uint64_t parse_us;
+} weather_worker_result_t;
+
+/* The parsers a job can ask for, told apart by their enter callback. */
+typedef struct {
+    bool (*enter)(json_stream_t *js);
+    json_stream_t *(*init)(void *state);
+    size_t offset;              /* the result: everything after the stream */
+    size_t size;                /* of the whole parse state */
+} weather_worker_parser_t;
+
+static json_stream_t *weather_worker_init_geocode(void *state) {
+    geocode_parse_init(state);
+    return &((geocode_parse_t *)state)->stream;
+}
+
+static json_stream_t *weather_worker_init_pirate(void *state) {
+    weather_parse_init(state);
+    return &((weather_parse_t *)state)->stream;
+}
+
+static json_stream_t *weather_worker_init_openmeteo(void *state) {
+    openmeteo_parse_init(state);
+    return &((weather_parse_t *)state)->stream;
+}
+
+static const weather_worker_parser_t weather_worker_parsers[] = {
+    { geocode_parse_enter, weather_worker_init_geocode, offsetof(geocode_parse_t, have_results), sizeof(geocode_parse_t) },
+    { weather_parse_enter, weather_worker_init_pirate, offsetof(weather_parse_t, record), sizeof(weather_parse_t) },
+    { openmeteo_parse_enter, weather_worker_init_openmeteo, offsetof(weather_parse_t, record), sizeof(weather_parse_t) },
+};
+#define WEATHER_WORKER_PARSERS (sizeof(weather_worker_parsers) / sizeof(weather_worker_parsers[0]))
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} weather_worker_buf_t;
+
+static bool weather_worker_buf_add(weather_worker_buf_t *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->size) {
+        size_t size = buf->size ? buf->size : 4096;
+        char *grown;
+
+        while (size < buf->len + len)
+            size *= 2;
+        if (!(grown = realloc(buf->data, size)))
+            return false;
+        buf->data = grown;
+        buf->size = size;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+static void weather_worker_buf_consume(weather_worker_buf_t *buf, size_t len) {
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+}
+
+/* Queues a whole frame or, if the buffer cannot grow, nothing at all. */
+static bool weather_worker_frame(weather_worker_buf_t *buf, weather_frame_type_t type, uint32_t job,
+                                 const void *head, size_t head_len, const void *body, size_t body_len) {
+    weather_frame_t frame = { (uint32_t)(head_len + body_len), job, type };
+    size_t len = buf->len;
+
+    if (weather_worker_buf_add(buf, &frame, sizeof(frame)) &&
+        (!head_len || weather_worker_buf_add(buf, head, head_len)) &&
+        (!body_len || weather_worker_buf_add(buf, body, body_len)))
+        return true;
+
+    /* a header without its body would put the reader out of step */
+    buf->len = len;
+    return false;
+}
+
+/*
+ * The helper process.  It has its own multi handle and waits on it with
+ * the socket as an extra descriptor; it never returns to the services
+ * event loop and leaves with _exit() when services closes the socket.
+ */
+typedef struct {
+    weather_fetch_t fetch;
+    const weather_worker_parser_t *parser;
+    void *state;
+} weather_worker_task_t;
+
+static void weather_worker_close_fds(int keep) {
+    long max = sysconf(_SC_OPEN_MAX);
+    DIR *dir = opendir("/proc/self/fd");
+
+    if (dir) {
+        struct dirent *de;
+        int fds[1024], count = 0;
+
+        /* collect first; closing while reading the directory would close its fd */
+        while ((de = readdir(dir)) && count < (int)(sizeof(fds) / sizeof(fds[0]))) {
+            int fd = atoi(de->d_name);
+
+            if (fd > 2 && fd != keep && fd != dirfd(dir))
+                fds[count++] = fd;
+        }
+        closedir(dir);
+        for (int i = 0; i < count; i++)
+            close(fds[i]);
+        if (count < (int)(sizeof(fds) / sizeof(fds[0])))
+            return;
+    }
+    for (long fd = 3; fd < (max > 0 ? max : 1024); fd++)
+        if (fd != keep)
+            close((int)fd);
+}
+
+static bool weather_worker_write_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, data, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void weather_worker_task_done(int fd, weather_worker_task_t *task, CURLcode res, weather_worker_buf_t *out) {
+    weather_fetch_t *fetch = &task->fetch;
+    weather_worker_result_t result;
+
+    memset(&result, 0, sizeof(result));
+    result.res = res;
+    if (fetch->curl)
+        weather_fetch_info(fetch->curl, &result.info);
+    result.headers = fetch->headers;
+    result.bytes = fetch->bytes;
+    result.parse_us = fetch->parse_us;
+    result.parsed = res == CURLE_OK && json_stream_finish(fetch->stream);
+
+    out->len = 0;
+    if (!weather_worker_frame(out, WEATHER_FRAME_RESULT, fetch->job, &result, sizeof(result),
+                              (char *)task->state + task->parser->offset, task->parser->size - task->parser->offset) ||
+        !weather_worker_write_all(fd, out->data, out->len))
+        _exit(1);
+}
+
+static void weather_worker_task_free(CURLM *multi, weather_worker_task_t *task) {
+    if (task->fetch.curl) {
+        curl_multi_remove_handle(multi, task->fetch.curl);
+        weather_upstream_put_handle(task->fetch.upstream, task->fetch.curl);
+    }
+    free(task->state);
+    free(task);
+}
+
+static void weather_worker_handle(int fd, CURLM *multi, mowgli_list_t *tasks, const weather_frame_t *frame, const char *body, weather_worker_buf_t *out) {
+    weather_worker_task_t *task;
+    weather_worker_job_t job;
+    mowgli_node_t *n;
+    char url[1024];
+    size_t url_len;
+
+    if (frame->type == WEATHER_FRAME_CANCEL) {
+        MOWGLI_ITER_FOREACH(n, tasks->head) {
+            task = n->data;
+            if (task->fetch.job == frame->job) {
+                mowgli_node_delete(&task->fetch.node, tasks);
+                weather_worker_task_free(multi, task);
+                break;
+            }
+        }
+        return;
+    }
+
+    if (frame->type != WEATHER_FRAME_JOB || frame->len < sizeof(job))
+        _exit(1);
+    memcpy(&job, body, sizeof(job));
+    url_len = frame->len - sizeof(job);
+    if (job.parser >= WEATHER_WORKER_PARSERS || job.upstream >= WEATHER_UPSTREAM_COUNT || url_len >= sizeof(url))
+        _exit(1);
+    memcpy(url, body + sizeof(job), url_len);
+    url[url_len] = '\0';
+
+    task = calloc(1, sizeof(*task));
+    if (task)
+        task->state = malloc(weather_worker_parsers[job.parser].size);
+    if (!task || !task->state)
+        _exit(1);
+    task->parser = &weather_worker_parsers[job.parser];
+    task->fetch.job = frame->job;
+    task->fetch.upstream = &weather_upstreams[job.upstream];
+    task->fetch.timeout_ms = job.timeout_ms;
+    task->fetch.stream = task->parser->init(task->state);
+    weather_key_headers_init(&task->fetch.headers);
+
+    if (!weather_fetch_start(multi, &task->fetch, url)) {
+        weather_worker_task_done(fd, task, CURLE_FAILED_INIT, out);
+        weather_worker_task_free(multi, task);
+        return;
+    }
+    mowgli_node_add(task, &task->fetch.node, tasks);
+}
+
+static void weather_worker_main(int fd) {
+    weather_worker_buf_t in = { NULL, 0, 0 }, out = { NULL, 0, 0 };
+    mowgli_list_t tasks = { NULL, NULL, 0 };
+    CURLM *multi;
+
+    weather_worker_close_fds(fd);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    /* start clean: nothing inherited from the services side is touched */
+    multi = curl_multi_init();
+    weather_share = curl_share_init();
+    if (!multi || !weather_share)
+        _exit(1);
+    curl_share_setopt(weather_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(weather_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    for (int i = 0; i < WEATHER_UPSTREAM_COUNT; i++)
+        memset(&weather_upstreams[i].idle, 0, sizeof(weather_upstreams[i].idle));
+
+    for (;;) {
+        struct curl_waitfd wait = { fd, CURL_WAIT_POLLIN, 0 };
+        CURLMsg *message;
+        int running, pending;
+
+        curl_multi_wait(multi, &wait, 1, 1000, NULL);
+
+        if (wait.revents) {
+            char chunk[16384];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+
+            if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+                _exit(0);
+            if (n > 0 && !weather_worker_buf_add(&in, chunk, n))
+                _exit(1);
+
+            while (in.len >= sizeof(weather_frame_t)) {
+                weather_frame_t frame;
+
+                memcpy(&frame, in.data, sizeof(frame));
+                if (frame.len > WEATHER_WORKER_FRAME_MAX)
+                    _exit(1);
+                if (in.len < sizeof(frame) + frame.len)
+                    break;
+                weather_worker_handle(fd, multi, &tasks, &frame, in.data + sizeof(frame), &out);
+                weather_worker_buf_consume(&in, sizeof(frame) + frame.len);
+            }
+        }
+
+        curl_multi_perform(multi, &running);
+        while ((message = curl_multi_info_read(multi, &pending)) != NULL) {
+            weather_fetch_t *fetch = NULL;
+
+            if (message->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&fetch);
+            if (!fetch)
+                continue;
+            weather_worker_task_done(fd, (weather_worker_task_t *)fetch, message->data.result, &out);
+            mowgli_node_delete(&fetch->node, &tasks);
+            weather_worker_task_free(multi, (weather_worker_task_t *)fetch);
+        }
+    }
+}
+
+/* The services side. */
+static bool weather_worker_enabled;
+static unsigned int weather_worker_queue = WEATHER_WORKER_QUEUE;
+
+static struct {
+    pid_t pid;
+    int fd;
+    mowgli_eventloop_pollable_t *pollable;
+    time_t started;
+    weather_worker_buf_t in, out;
+    weather_fetch_t *jobs[WEATHER_WORKER_SLOTS];
+    uint32_t next_job;
+    unsigned int inflight;
+    unsigned int restart_delay;
+    mowgli_eventloop_timer_t *restart_timer;
+    /* counters */
+    unsigned int sent, completed, refused, restarts, rerun;
+} weather_worker = { .fd = -1 };
+
+static void weather_worker_io(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io, mowgli_eventloop_io_dir_t dir, void *userdata);
+static void weather_worker_spawn(void *arg);
+
+static void weather_worker_flush(void) {
+    while (weather_worker.out.len) {
+        ssize_t n = send(weather_worker.fd, weather_worker.out.data, weather_worker.out.len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        weather_worker_buf_consume(&weather_worker.out, n);
+    }
+
+    /* the helper is slow to read: finish the write from the event loop */
+    mowgli_pollable_setselect(base_eventloop, weather_worker.pollable, MOWGLI_EVENTLOOP_IO_WRITE,
+                              weather_worker.out.len ? weather_worker_io : NULL);
+}
+
+/*
+ * Tears down the connection to the helper and reruns its jobs in process.
+ * With restart set, a new helper is forked after the restart delay.
+ */
+static void weather_worker_stop(const char *reason, bool restart) {
+    if (weather_worker.fd < 0)
+        return;
+
+    slog(LG_INFO, "weather: fetch worker (pid %d) stopped: %s", (int)weather_worker.pid, reason);
+    weather_pollable_retire(weather_worker.pollable);
+    weather_worker.pollable = NULL;
+    close(weather_worker.fd);
+    weather_worker.fd = -1;
+    if (weather_worker.pid > 0)
+        kill(weather_worker.pid, SIGTERM);
+    weather_worker.pid = 0;
+    weather_worker.in.len = weather_worker.out.len = 0;
+
+    for (int i = 0; i < WEATHER_WORKER_SLOTS; i++) {
+        weather_fetch_t *fetch = weather_worker.jobs[i];
+
+        if (!fetch)
+            continue;
+        weather_worker.jobs[i] = NULL;
+        weather_worker.inflight--;
+        weather_worker.rerun++;
+        if (!weather_fetch_shutdown && weather_fetch_start(weather_multi, fetch, fetch->url))
+            continue;
+        /* finish looks in the slots, so the fetch is already out of them */
+        weather_fetch_finish(fetch, CURLE_FAILED_INIT);
+    }
+
+    if (!restart || weather_fetch_shutdown || !weather_worker_enabled)
+        return;
+
+    if (CURRTIME - weather_worker.started >= WEATHER_WORKER_STABLE)
+        weather_worker.restart_delay = 1;
+    else if (weather_worker.restart_delay < WEATHER_WORKER_RESTART_MAX)
+        weather_worker.restart_delay = weather_worker.restart_delay ? weather_worker.restart_delay * 2 : 1;
+    if (weather_worker.restart_delay > WEATHER_WORKER_RESTART_MAX)
+        weather_worker.restart_delay = WEATHER_WORKER_RESTART_MAX;
+    if (!weather_worker.restart_timer)
+        weather_worker.restart_timer = mowgli_timer_add_once(base_eventloop, "weather_worker_spawn", weather_worker_spawn, NULL,
+                                                             weather_worker.restart_delay);
+}
+
+static void weather_worker_result(const weather_frame_t *frame, const char *body) {
+    weather_fetch_t *fetch = weather_worker.jobs[frame->job % WEATHER_WORKER_SLOTS];
+    const weather_worker_parser_t *parser;
+    weather_worker_result_t result;
+
+    /* a job cancelled after the helper finished it */
+    if (!fetch || fetch->job != frame->job)
+        return;
+
+    for (parser = weather_worker_parsers; parser->enter != fetch->stream->enter; parser++)
+        ;
+    if (frame->len != sizeof(result) + parser->size - parser->offset) {
+        weather_worker_stop("bad result frame", true);
+        return;
+    }
+
+    memcpy(&result, body, sizeof(result));
+    memcpy((char *)fetch->stream->privdata + parser->offset, body + sizeof(result), parser->size - parser->offset);
+    fetch->stream->state = result.parsed ? JS_DONE : JS_ERROR;
+    fetch->info = result.info;
+    fetch->headers = result.headers;
+    fetch->bytes = result.bytes;
+    fetch->parse_us = result.parse_us;
+    if (result.res != CURLE_OK)
+        mowgli_strlcpy(fetch->errbuf, curl_easy_strerror(result.res), sizeof(fetch->errbuf));
+
+    weather_worker.completed++;
+    weather_fetch_finish(fetch, (CURLcode)result.res);
+}
+
+static void weather_worker_read(void) {
+    for (;;) {
+        char chunk[16384];
+        ssize_t n = recv(weather_worker.fd, chunk, sizeof(chunk), 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            weather_worker_stop(n == 0 ? "connection closed" : strerror(errno), true);
+            return;
+        }
+        if (!weather_worker_buf_add(&weather_worker.in, chunk, n)) {
+            weather_worker_stop("out of memory", true);
+            return;
+        }
+    }
+
+    while (weather_worker.in.len >= sizeof(weather_frame_t)) {
+        weather_frame_t frame;
+
+        memcpy(&frame, weather_worker.in.data, sizeof(frame));
+        if (frame.type != WEATHER_FRAME_RESULT || frame.len > WEATHER_WORKER_FRAME_MAX) {
+            weather_worker_stop("bad frame", true);
+            return;
+        }
+        if (weather_worker.in.len < sizeof(frame) + frame.len)
+            break;
+        weather_worker_result(&frame, weather_worker.in.data + sizeof(frame));
+        if (weather_worker.fd < 0)
+            return;
+        weather_worker_buf_consume(&weather_worker.in, sizeof(frame) + frame.len);
+    }
+}
+
+static void weather_worker_io(mowgli_eventloop_t *eventloop, mowgli_eventloop_io_t *io, mowgli_eventloop_io_dir_t dir, void *userdata) {
+    if (dir == MOWGLI_EVENTLOOP_IO_WRITE)
+        weather_worker_flush();
+    else
+        weather_worker_read();
+}
+
+static void weather_worker_exited(pid_t pid, int status, void *data) {
+    /* one we stopped ourselves has been dealt with already */
+    if (pid != weather_worker.pid)
+        return;
+
+    if (WIFSIGNALED(status))
+        slog(LG_ERROR, "weather: fetch worker (pid %d) killed by signal %d", (int)pid, WTERMSIG(status));
+    else
+        slog(LG_ERROR, "weather: fetch worker (pid %d) exited with status %d", (int)pid, WEXITSTATUS(status));
+    weather_worker.pid = 0;
+    weather_worker_stop("exited", true);
+}
+
+static void weather_worker_spawn(void *arg) {
+    int fds[2];
+    pid_t pid;
+
+    weather_worker.restart_timer = NULL;
+    if (weather_worker.fd >= 0 || !weather_worker_enabled || weather_fetch_shutdown)
+        return;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        slog(LG_ERROR, "weather: cannot start the fetch worker: socketpair: %s", strerror(errno));
+        return;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        slog(LG_ERROR, "weather: cannot start the fetch worker: fork: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        weather_worker_main(fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    weather_worker.pid = pid;
+    weather_worker.fd = fds[0];
+    weather_worker.started = CURRTIME;
+    weather_worker.pollable = mowgli_pollable_create(base_eventloop, fds[0], NULL);
+    mowgli_pollable_setselect(base_eventloop, weather_worker.pollable, MOWGLI_EVENTLOOP_IO_READ, weather_worker_io);
+    childproc_add(pid, "weather fetch worker", weather_worker_exited, NULL);
+    if (weather_worker.restart_delay)
+        weather_worker.restarts++;
+    slog(LG_INFO, "weather: fetch worker started as pid %d", (int)pid);
+}
+
+static weather_worker_status_t weather_worker_submit(weather_fetch_t *fetch, const char *url) {
+    weather_worker_job_t job;
+    uint32_t id;
+    size_t i;
+
+    if (weather_worker.fd < 0 || !fetch->stream)
+        return WEATHER_WORKER_OFF;
+    for (i = 0; i < WEATHER_WORKER_PARSERS && weather_worker_parsers[i].enter != fetch->stream->enter; i++)
+        ;
+    if (i == WEATHER_WORKER_PARSERS)
+        return WEATHER_WORKER_OFF;
+
+    if (weather_worker.inflight >= weather_worker_queue) {
+        weather_worker.refused++;
+        return WEATHER_WORKER_FULL;
+    }
+
+    /* ids run on; the slot is the id modulo the table, skipping busy ones */
+    do {
+        id = ++weather_worker.next_job;
+    } while (!id || weather_worker.jobs[id % WEATHER_WORKER_SLOTS]);
+
+    job.parser = i;
+    job.upstream = fetch->upstream - weather_upstreams;
+    job.timeout_ms = fetch->timeout_ms;
+    fetch->url = strdup(url);
+    if (!fetch->url || !weather_worker_frame(&weather_worker.out, WEATHER_FRAME_JOB, id, &job, sizeof(job), url, strlen(url))) {
+        free(fetch->url);
+        fetch->url = NULL;
+        return WEATHER_WORKER_OFF;
+    }
+
+    fetch->job = id;
+    weather_worker.jobs[id % WEATHER_WORKER_SLOTS] = fetch;
+    weather_worker.inflight++;
+    weather_worker.sent++;
+    weather_worker_flush();
+    return WEATHER_WORKER_QUEUED;
+}
+
+/* Takes a finished or cancelled job out of the table; a cancelled one is called off in the helper too. */
+static void weather_worker_forget(weather_fetch_t *fetch, bool cancel) {
+    uint32_t slot = fetch->job % WEATHER_WORKER_SLOTS;
+
+    if (!fetch->job || weather_worker.jobs[slot] != fetch)
+        return;
+    weather_worker.jobs[slot] = NULL;
+    weather_worker.inflight--;
+    if (cancel && weather_worker.fd >= 0 && weather_worker_frame(&weather_worker.out, WEATHER_FRAME_CANCEL, fetch->job, NULL, 0, NULL, 0))
+        weather_worker_flush();
+}
+
+static void weather_worker_show(sourceinfo_t *si) {
+    if (weather_worker.fd >= 0)
+        command_success_nodata(si, "\2Fetch worker:\2 pid %d, up %lds, %u of %u jobs in flight", (int)weather_worker.pid,
+            (long)(CURRTIME - weather_worker.started), weather_worker.inflight, weather_worker_queue);
+    else if (weather_worker.restart_timer)
+        command_success_nodata(si, "\2Fetch worker:\2 restarting (delay %us), fetching in process", weather_worker.restart_delay);
+    else
+        command_success_nodata(si, "\2Fetch worker:\2 off, fetching in process");
+    if (weather_worker.sent)
+        command_success_nodata(si, "  Jobs: %u sent, %u answered, %u refused while full, %u rerun in process, %u restarts",
+            weather_worker.sent, weather_worker.completed, weather_worker.refused, weather_worker.rerun, weather_worker.restarts);
+}
+
+static void weather_worker_configure(void *unused) {
+    if (weather_worker_enabled && weather_worker.fd < 0 && !weather_worker.restart_timer)
+        weather_worker_spawn(NULL);
+    else if (!weather_worker_enabled && weather_worker.fd >= 0)
+        weather_worker_stop("turned off", false);
+}
+
+static void init_fetch_worker(void) {
+    add_bool_conf_item("FETCH_WORKER", &weather->conf_table, 0, &weather_worker_enabled, false);
+    add_uint_conf_item("FETCH_WORKER_QUEUE", &weather->conf_table, 0, &weather_worker_queue, 1, WEATHER_WORKER_SLOTS, WEATHER_WORKER_QUEUE);
+    hook_add_event("config_ready");
+    hook_add_config_ready(weather_worker_configure);
+}
+
+/* After deinit_fetch_engine(), which has already finished every job. */
+static void deinit_fetch_worker(void) {
+    hook_del_config_ready(weather_worker_configure);
+    del_conf_item("FETCH_WORKER", &weather->conf_table);
+    del_conf_item("FETCH_WORKER_QUEUE", &weather->conf_table);
+
+    if (weather_worker.restart_timer) {
+        mowgli_timer_destroy(base_eventloop, weather_worker.restart_timer);
+        weather_worker.restart_timer = NULL;
+    }
+    childproc_delete_all(weather_worker_exited);
+    weather_worker_stop("module unloaded", false);
+    if (weather_reap_timer) {
+        mowgli_timer_destroy(base_eventloop, weather_reap_timer);
+        weather_reap_timer = NULL;
+    }
+    weather_reap_pollables(NULL);
+    free(weather_worker.in.data);
+    free(weather_worker.out.data);
+    memset(&weather_worker.in, 0, sizeof(weather_worker.in));
+    memset(&weather_worker.out, 0, sizeof(weather_worker.out));
+}
+
+/*
+ * Time zones.
+ *
+ * Sunrise, sunset and day names are shown in the local time of the
+ * location, using the zone name the provider sends with the forecast.
+ * Each zone is read from the system zoneinfo the first time it is seen
+ * and kept; local times are then worked out from its transition table
+ * (and the POSIX rule that follows the last transition) without touching
+ * TZ, tzset() or the C library's own zone state.  A zone that cannot be
+ * loaded falls back to the fixed UTC offset in the response.
+ */
+#define WEATHER_ZONEINFO_DIR "/usr/share/zoneinfo"
+#define WEATHER_ZONE_MAX 1024           /* zones kept, loaded or not */
+#define WEATHER_ZONE_FILE_MAX 65536
+
+typedef struct {
+    int32_t offset;                     /* seconds east of UTC */
+    char abbr[8];
+} weather_zone_type_t;
+
+typedef struct {
+    char kind;                          /* 'M' month.week.day, 'J' 1-365 without leap day, 'N' 0-365 */
+    int month, week, day;
+    int32_t time;                       /* local seconds after midnight */
+} weather_zone_date_t;
+
+typedef struct {
+    weather_zone_type_t std, dst;
+    bool has_dst;
+    weather_zone_date_t start, end;
+} weather_zone_rule_t;
+
+typedef struct {
+    bool loaded;                        /* false: the name is remembered as unknown */
+    size_t count;                       /* transitions */
+    int64_t *transitions;
+    uint8_t *transition_types;
+    size_t type_count;
+    weather_zone_type_t *types;
+    bool has_rule;
+    weather_zone_rule_t rule;
+} weather_zone_t;
+
+static mowgli_patricia_t *weather_zones;
+static unsigned int weather_zones_loaded;
+static unsigned int weather_zones_unknown;
+
+static const char *const weather_weekdays[7] = { "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday" };
+
+/* Days from 1970-01-01 to the given civil date. */
+static int64_t weather_days_from_civil(int64_t y, int m, int d) {
+    int64_t era, yoe, doy;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static bool weather_is_leap(int64_t y) {
+    return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+static int64_t weather_floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b < 0);
+}
+
+/* The UTC time a rule date falls on in year y, given the offset in force before it. */
+static int64_t weather_zone_date_time(const weather_zone_date_t *date, int64_t y, int32_t offset) {
+    static const int month_days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    int64_t day;
+
+    switch (date->kind) {
+    case 'J':
+        day = weather_days_from_civil(y, 1, 1) + date->day - 1 + (weather_is_leap(y) && date->day >= 60);
+        break;
+    case 'N':
+        day = weather_days_from_civil(y, 1, 1) + date->day;
+        break;
+    default: {
+        int64_t first = weather_days_from_civil(y, date->month, 1);
+        int length = month_days[date->month - 1] + (date->month == 2 && weather_is_leap(y));
+        int wday = (int)((first % 7 + 11) % 7);         /* 1970-01-01 was a Thursday */
+        int mday = 1 + (date->day - wday + 7) % 7 + (date->week - 1) * 7;
+
+        while (mday > length)
+            mday -= 7;
+        day = first + mday - 1;
+        break;
+    }
+    }
+    return day * 86400 + date->time - offset;
+}
+
+static const weather_zone_type_t *weather_zone_rule_type(const weather_zone_rule_t *rule, int64_t t) {
+    int64_t y, start, end;
+    time_t local;
+    struct tm tm;
+
+    if (!rule->has_dst)
+        return &rule->std;
+
+    /* the year as seen from standard time; close enough at the new year */
+    local = (time_t)(t + rule->std.offset);
+    gmtime_r(&local, &tm);
+    y = tm.tm_year + 1900;
+
+    start = weather_zone_date_time(&rule->start, y, rule->std.offset);
+    end = weather_zone_date_time(&rule->end, y, rule->dst.offset);
+    if (start < end)
+        return t >= start && t < end ? &rule->dst : &rule->std;
+    return t >= end && t < start ? &rule->std : &rule->dst;
+}
+
+/* The local time type in force at t. */
+static const weather_zone_type_t *weather_zone_type(const weather_zone_t *zone, int64_t t) {
+    size_t lo = 0, hi = zone->count;
+
+    if (!zone->count || t < zone->transitions[0])
+        return zone->has_rule && !zone->count ? weather_zone_rule_type(&zone->rule, t) : &zone->types[0];
+    if (t >= zone->transitions[zone->count - 1] && zone->has_rule)
+        return weather_zone_rule_type(&zone->rule, t);
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (zone->transitions[mid] <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &zone->types[zone->transition_types[lo]];
+}
+
+/*
+ * POSIX TZ rule parsing, for the footer of version 2+ zoneinfo files,
+ * e.g. "EST5EDT,M3.2.0,M11.1.0" or "<+0330>-3:30".
+ */
+static const char *weather_zone_parse_abbr(const char *p, char *abbr, size_t size) {
+    const char *start, *end;
+
+    if (*p == '<') {
+        start = ++p;
+        while (*p && *p != '>')
+            p++;
+        if (*p != '>')
+            return NULL;
+        end = p++;
+    } else {
+        start = p;
+        while (isalpha((unsigned char)*p))
+            p++;
+        end = p;
+    }
+    if (end - start < 3 || (size_t)(end - start) >= size)
+        return NULL;
+    memcpy(abbr, start, end - start);
+    abbr[end - start] = '\0';
+    return p;
+}
+
+/* [+-]hh[:mm[:ss]] into seconds. */
+static const char *weather_zone_parse_time(const char *p, int32_t *seconds) {
+    int sign = 1, part = 0;
+    int32_t value = 0;
+
+    if (*p == '+' || *p == '-')
+        sign = *p++ == '-' ? -1 : 1;
+    if (!isdigit((unsigned char)*p))
+        return NULL;
+    for (int scale = 3600; scale >= 1 && isdigit((unsigned char)*p); scale /= 60) {
+        part = 0;
+        while (isdigit((unsigned char)*p))
+            part = part * 10 + (*p++ - '0');
+        if (part > 167)
+            return NULL;
+        value += part * scale;
+        if (*p != ':' || scale == 1)
+            break;
+        p++;
+    }
+    *seconds = sign * value;
+    return p;
+}
+
+static const char *weather_zone_parse_date(const char *p, weather_zone_date_t *date) {
+    char *end;
+
+    memset(date, 0, sizeof(*date));
+    if (*p == 'M') {
+        date->kind = 'M';
+        date->month = (int)strtol(p + 1, &end, 10);
+        if (*end != '.')
+            return NULL;
+        date->week = (int)strtol(end + 1, &end, 10);
+        if (*end != '.')
+            return NULL;
+        date->day = (int)strtol(end + 1, &end, 10);
+        if (date->month < 1 || date->month > 12 || date->week < 1 || date->week > 5 || date->day < 0 || date->day > 6)
+            return NULL;
+    } else {
+        date->kind = *p == 'J' ? 'J' : 'N';
+        if (*p == 'J')
+            p++;
+        if (!isdigit((unsigned char)*p))
+            return NULL;
+        date->day = (int)strtol(p, &end, 10);
+        if (date->day > 365 || (date->kind == 'J' && date->day < 1))
+            return NULL;
+    }
+    p = end;
+    date->time = 7200;
+    if (*p == '/')
+        p = weather_zone_parse_time(p + 1, &date->time);
+    return p;
+}
+
+static bool weather_zone_parse_rule(const char *p, weather_zone_rule_t *rule) {
+    int32_t offset;
+
+    memset(rule, 0, sizeof(*rule));
+    if (!(p = weather_zone_parse_abbr(p, rule->std.abbr, sizeof(rule->std.abbr))) ||
+        !(p = weather_zone_parse_time(p, &offset)))
+        return false;
+    rule->std.offset = -offset;         /* POSIX offsets count west of UTC */
+    if (!*p)
+        return true;
+
+    if (!(p = weather_zone_parse_abbr(p, rule->dst.abbr, sizeof(rule->dst.abbr))))
+        return false;
+    rule->dst.offset = rule->std.offset + 3600;
+    if (*p && *p != ',') {
+        if (!(p = weather_zone_parse_time(p, &offset)))
+            return false;
+        rule->dst.offset = -offset;
+    }
+    rule->has_dst = true;
+
+    /* a DST name without dates means the US rules */
+    if (!*p) {
+        rule->start = (weather_zone_date_t){ 'M', 3, 2, 0, 7200 };
+        rule->end = (weather_zone_date_t){ 'M', 11, 1, 0, 7200 };
+        return true;
+    }
+    if (*p != ',' || !(p = weather_zone_parse_date(p + 1, &rule->start)) ||
+        *p != ',' || !(p = weather_zone_parse_date(p + 1, &rule->end)))
+        return false;
+    return !*p;
+}
+
+static uint32_t weather_zone_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Reads a TZif file (RFC 8536), preferring the 64-bit block and its footer rule. */
+static bool weather_zone_parse(weather_zone_t *zone, const unsigned char *data, size_t len) {
+    const unsigned char *p = data, *end = data + len;
+    uint32_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt;
+    const unsigned char *types, *chars;
+    size_t timesize = 4;
+
+    for (;;) {
+        size_t block;
+
+        if (end - p < 44 || memcmp(p, "TZif", 4))
+            return false;
+        isutcnt = weather_zone_be32(p + 20);
+        isstdcnt = weather_zone_be32(p + 24);
+        leapcnt = weather_zone_be32(p + 28);
+        timecnt = weather_zone_be32(p + 32);
+        typecnt = weather_zone_be32(p + 36);
+        charcnt = weather_zone_be32(p + 40);
+        if (typecnt == 0 || typecnt > 256 || charcnt == 0 || timecnt > 65536 || leapcnt > 65536 || charcnt > 65536)
+            return false;
+        block = (size_t)timecnt * (timesize + 1) + (size_t)typecnt * 6 + charcnt + (size_t)leapcnt * (timesize + 4) + isstdcnt + isutcnt;
+        if ((size_t)(end - p - 44) < block)
+            return false;
+        if (timesize == 4 && p[4] >= '2') {
+            p += 44 + block;
+            timesize = 8;
+            continue;
+        }
+        p += 44;
+        break;
+    }
+
+    zone->count = timecnt;
+    zone->type_count = typecnt;
+    zone->transitions = calloc(timecnt ? timecnt : 1, sizeof(*zone->transitions));
+    zone->transition_types = calloc(timecnt ? timecnt : 1, 1);
+    zone->types = calloc(typecnt, sizeof(*zone->types));
+    if (!zone->transitions || !zone->transition_types || !zone->types)
+        return false;
+
+    for (uint32_t i = 0; i < timecnt; i++, p += timesize) {
+        uint64_t value = timesize == 8 ? (uint64_t)weather_zone_be32(p) << 32 | weather_zone_be32(p + 4) : weather_zone_be32(p);
+
+        zone->transitions[i] = timesize == 8 ? (int64_t)value : (int64_t)(int32_t)value;
+    }
+    memcpy(zone->transition_types, p, timecnt);
+    for (uint32_t i = 0; i < timecnt; i++)
+        if (zone->transition_types[i] >= typecnt)
+            return false;
+    p += timecnt;
+
+    types = p;
+    chars = p + typecnt * 6;
+    for (uint32_t i = 0; i < typecnt; i++) {
+        uint8_t index = types[i * 6 + 5];
+
+        zone->types[i].offset = (int32_t)weather_zone_be32(&types[i * 6]);
+        if (index < charcnt) {
+            size_t room = charcnt - index;
+
+            mowgli_strlcpy(zone->types[i].abbr, (const char *)chars + index,
+                           room < sizeof(zone->types[i].abbr) ? room : sizeof(zone->types[i].abbr));
+        }
+    }
+    p = chars + charcnt + (size_t)leapcnt * (timesize + 4) + isstdcnt + isutcnt;
+
+    /* version 2+ footer: "\n<POSIX TZ>\n" */
+    if (timesize == 8 && p < end && *p == '\n') {
+        const unsigned char *nl = memchr(p + 1, '\n', end - p - 1);
+        char footer[64];
+
+        if (nl && nl - p - 1 > 0 && (size_t)(nl - p - 1) < sizeof(footer)) {
+            memcpy(footer, p + 1, nl - p - 1);
+            footer[nl - p - 1] = '\0';
+            zone->has_rule = weather_zone_parse_rule(footer, &zone->rule);
+        }
+    }
+    return true;
+}
+
+/* Zone names come from the upstream response, so only plain relative paths are read. */
+static bool weather_zone_name_valid(const char *name) {
+    if (!*name || *name == '/' || *name == '.')
+        return false;
+    for (const char *p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && !strchr("/_-+", *p))
+            return false;
+        if (*p == '/' && (p[1] == '.' || p[1] == '/'))
+            return false;
+    }
+    return true;
+}
+
+static void weather_zone_free(weather_zone_t *zone) {
+    free(zone->transitions);
+    free(zone->transition_types);
+    free(zone->types);
+    free(zone);
+}
+
+static bool weather_zone_load(weather_zone_t *zone, const char *name) {
+    const char *dir = getenv("TZDIR");
+    char path[BUFSIZE];
+    unsigned char *data;
+    struct stat st;
+    ssize_t got;
+    bool ok;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir && *dir ? dir : WEATHER_ZONEINFO_DIR, name);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > WEATHER_ZONE_FILE_MAX || !(data = malloc(st.st_size + 1))) {
+        close(fd);
+        return false;
+    }
+    got = read(fd, data, st.st_size);
+    close(fd);
+
+    ok = got == st.st_size && weather_zone_parse(zone, data, got);
+    free(data);
+    return ok;
+}
+
+/* The cached zone for a name, reading it on first use; NULL if it is unknown. */
+static const weather_zone_t *weather_zone_find(const char *name) {
+    weather_zone_t *zone;
+
+    if (!name[0] || !weather_zone_name_valid(name))
+        return NULL;
+    if (!weather_zones)
+        weather_zones = mowgli_patricia_create(NULL);
+    if ((zone = mowgli_patricia_retrieve(weather_zones, name)))
+        return zone->loaded ? zone : NULL;
+    if (mowgli_patricia_size(weather_zones) >= WEATHER_ZONE_MAX)
+        return NULL;
+
+    zone = calloc(1, sizeof(*zone));
+    if (!zone)
+        return NULL;
+    zone->loaded = weather_zone_load(zone, name);
+    if (!zone->loaded) {
+        slog(LG_DEBUG, "weather: no usable zoneinfo for %s, using the fixed offset", name);
+        free(zone->transitions);
+        free(zone->transition_types);
+        free(zone->types);
+        memset(zone, 0, sizeof(*zone));
+        weather_zones_unknown++;
+    } else {
+        weather_zones_loaded++;
+    }
+    mowgli_patricia_add(weather_zones, name, zone);
+    return zone->loaded ? zone : NULL;
+}
+
+/*
+ * Breaks t down into local time for the zone, or for the fixed offset
+ * when there is no zone, and gives the abbreviation in force.
+ */
+static void weather_zone_localtime(const weather_zone_t *zone, int32_t offset, time_t t, struct tm *tm, char *abbr, size_t abbrlen) {
+    time_t local;
+
+    if (zone) {
+        const weather_zone_type_t *type = weather_zone_type(zone, t);
+
+        offset = type->offset;
+        mowgli_strlcpy(abbr, type->abbr, abbrlen);
+    } else if (offset % 3600) {
+        snprintf(abbr, abbrlen, "UTC%c%d:%02d", offset < 0 ? '-' : '+', abs(offset) / 3600, abs(offset) % 3600 / 60);
+    } else if (offset) {
+        snprintf(abbr, abbrlen, "UTC%+d", offset / 3600);
+    } else {
+        mowgli_strlcpy(abbr, "UTC", abbrlen);
+    }
+
+    local = t + offset;
+    gmtime_r(&local, tm);
+}
+
+/* The local day number of t, to tell calendar days apart. */
+static int64_t weather_zone_day(const weather_zone_t *zone, int32_t offset, time_t t) {
+    if (zone)
+        offset = weather_zone_type(zone, t)->offset;
+    return weather_floor_div((int64_t)t + offset, 86400);
+}
+
+static void weather_zone_destroy_cb(const char *key, void *data, void *privdata) {
+    weather_zone_free(data);
+}
+
+static void deinit_weather_zones(void) {
+    if (weather_zones)
+        mowgli_patricia_destroy(weather_zones, weather_zone_destroy_cb, NULL);
+    weather_zones = NULL;
+    weather_zones_loaded = weather_zones_unknown = 0;
+}
+
+/*
+ * Reply templates.
+ *
+ * The reply layout is compiled once into a list of ops: literal text,
+ * record fields with a unit, color spans, and conditional blocks.  The
+ * renderer walks the ops once and writes straight into the caller's buffer,
+ * emitting either the colored or the plain variant so no remove_colors()
+ * pass is needed afterwards.
+ *
+ * Template syntax:
+ *   {field} or {field:unit}   a record field, e.g. {temperature:c}
+ *   {color:field}             start a color picked from the field's value
+ *   {color:NN}                start a fixed mIRC color
+ *   {/color}                  end a color span
+ *   {if:field} ... {/if}      only render the block if the text field is set
+ *   {b} {u} {i} {o}           bold, underline, italic, reset
+ *   {{                        a literal {
+ *
+ * The weather and forecast templates render the daily entries through
+ * their day template with {days} or {days:N}, where N limits how many
+ * entries are looked at.
+ */
+#define WEATHER_TEMPLATE_MAX_OPS 128
+#define WEATHER_TEMPLATE_MAX_NESTING 8
+
+#define WEATHER_FORMAT_DEFAULT "{b}{location}{b} :: {if:summary}{summary} {/if}" \
+    "{color:temperature}{temperature:f}F/{temperature:c}C{/color}" \
+    " | {b}Feels Like{b}: {color:feels_like}{feels_like:f}F/{feels_like:c}C{/color}" \
+    " | {b}Humidity{b}: {humidity}%" \
+    " | {b}Wind{b}: {wind_speed:mph}mph/{wind_speed:kmh}km/h {wind_bearing} {b}Gust{b}: {wind_gust:mph}mph/{wind_gust:kmh}km/h" \
+    " | {b}Dew{b}: {dew_point}°" \
+    " | {b}UV Index{b}: {uv_index} {b}Risk{b}: {color:uv_index}{uv_index:risk}{o}" \
+    " | {b}Sunrise{b}: {sunrise} {b}Sunset{b}: {sunset}" \
+    "{days:3}"
+#define WEATHER_DAY_FORMAT_DEFAULT " | {b}{day}{b}: {summary}" \
+    " {color:low}{b}↓{b}{low:f}F/{low:c}C{/color} {color:high}{b}↑{b}{high:f}F/{high:c}C{/color}"
+#define FORECAST_FORMAT_DEFAULT "{b}{location}{b} :: Forecast{days}"
+#define FORECAST_DAY_FORMAT_DEFAULT " | {b}{day:long}{b}: {summary}" \
+    " {color:low}{b}↓{b}{low:f}F/{low:c}C{/color} {color:high}{b}↑{b}{high:f}F/{high:c}C{/color}"
+
+typedef enum {
+    WEATHER_FIELD_LOCATION,
+    WEATHER_FIELD_SUMMARY,
+    WEATHER_FIELD_TEMPERATURE,
+    WEATHER_FIELD_FEELS_LIKE,
+    WEATHER_FIELD_HUMIDITY,
+    WEATHER_FIELD_WIND_SPEED,
+    WEATHER_FIELD_WIND_GUST,
+    WEATHER_FIELD_WIND_BEARING,
+    WEATHER_FIELD_DEW_POINT,
+    WEATHER_FIELD_UV_INDEX,
+    WEATHER_FIELD_SUNRISE,
+    WEATHER_FIELD_SUNSET,
+    WEATHER_FIELD_DAYS,
+    WEATHER_FIELD_DAY,
+    WEATHER_FIELD_LOW,
+    WEATHER_FIELD_HIGH
+} weather_field_t;
+
+typedef enum {
+    WEATHER_UNIT_NONE,
+    WEATHER_UNIT_F,
+    WEATHER_UNIT_C,
+    WEATHER_UNIT_F0,
+    WEATHER_UNIT_C0,
+    WEATHER_UNIT_MPH,
+    WEATHER_UNIT_KMH,
+    WEATHER_UNIT_PERCENT,
+    WEATHER_UNIT_COMPASS,
+    WEATHER_UNIT_DEGREES,
+    WEATHER_UNIT_VALUE,
+    WEATHER_UNIT_RISK,
+    WEATHER_UNIT_12H,
+    WEATHER_UNIT_24H,
+    WEATHER_UNIT_SHORT,
+    WEATHER_UNIT_LONG
+} weather_unit_t;
+
+/* What a field holds, which decides its units and color scale. */
+typedef enum {
+    WEATHER_KIND_TEXT,
+    WEATHER_KIND_TEMP,
+    WEATHER_KIND_SPEED,
+    WEATHER_KIND_RATIO,
+    WEATHER_KIND_BEARING,
+    WEATHER_KIND_UV,
+    WEATHER_KIND_TIME,
+    WEATHER_KIND_DATE,
+    WEATHER_KIND_DAYS
+} weather_kind_t;
+
+typedef struct {
+    const char *name;
+    weather_field_t field;
+    weather_kind_t kind;
+    weather_unit_t unit;        /* default */
+    bool day;                   /* valid in day templates rather than top level */
+} weather_field_info_t;
+
+static const weather_field_info_t weather_fields[] = {
+    { "location", WEATHER_FIELD_LOCATION, WEATHER_KIND_TEXT, WEATHER_UNIT_NONE, false },
+    { "summary", WEATHER_FIELD_SUMMARY, WEATHER_KIND_TEXT, WEATHER_UNIT_NONE, false },
+    { "temperature", WEATHER_FIELD_TEMPERATURE, WEATHER_KIND_TEMP, WEATHER_UNIT_F, false },
+    { "feels_like", WEATHER_FIELD_FEELS_LIKE, WEATHER_KIND_TEMP, WEATHER_UNIT_F, false },
+    { "humidity", WEATHER_FIELD_HUMIDITY, WEATHER_KIND_RATIO, WEATHER_UNIT_PERCENT, false },
+    { "wind_speed", WEATHER_FIELD_WIND_SPEED, WEATHER_KIND_SPEED, WEATHER_UNIT_MPH, false },
+    { "wind_gust", WEATHER_FIELD_WIND_GUST, WEATHER_KIND_SPEED, WEATHER_UNIT_MPH, false },
+    { "wind_bearing", WEATHER_FIELD_WIND_BEARING, WEATHER_KIND_BEARING, WEATHER_UNIT_COMPASS, false },
+    { "dew_point", WEATHER_FIELD_DEW_POINT, WEATHER_KIND_TEMP, WEATHER_UNIT_F0, false },
+    { "uv_index", WEATHER_FIELD_UV_INDEX, WEATHER_KIND_UV, WEATHER_UNIT_VALUE, false },
+    { "sunrise", WEATHER_FIELD_SUNRISE, WEATHER_KIND_TIME, WEATHER_UNIT_12H, false },
+    { "sunset", WEATHER_FIELD_SUNSET, WEATHER_KIND_TIME, WEATHER_UNIT_12H, false },
+    { "days", WEATHER_FIELD_DAYS, WEATHER_KIND_DAYS, WEATHER_UNIT_NONE, false },
+    { "day", WEATHER_FIELD_DAY, WEATHER_KIND_DATE, WEATHER_UNIT_SHORT, true },
+    { "summary", WEATHER_FIELD_SUMMARY, WEATHER_KIND_TEXT, WEATHER_UNIT_NONE, true },
+    { "low", WEATHER_FIELD_LOW, WEATHER_KIND_TEMP, WEATHER_UNIT_F, true },
+    { "high", WEATHER_FIELD_HIGH, WEATHER_KIND_TEMP, WEATHER_UNIT_F, true },
+};
+
+typedef struct {
+    const char *name;
+    weather_kind_t kind;
+    weather_unit_t unit;
+} weather_unit_info_t;
+
+static const weather_unit_info_t weather_units[] = {
+    { "f", WEATHER_KIND_TEMP, WEATHER_UNIT_F },
+    { "c", WEATHER_KIND_TEMP, WEATHER_UNIT_C },
+    { "f0", WEATHER_KIND_TEMP, WEATHER_UNIT_F0 },
+    { "c0", WEATHER_KIND_TEMP, WEATHER_UNIT_C0 },
+    { "mph", WEATHER_KIND_SPEED, WEATHER_UNIT_MPH },
+    { "kmh", WEATHER_KIND_SPEED, WEATHER_UNIT_KMH },
+    { "pct", WEATHER_KIND_RATIO, WEATHER_UNIT_PERCENT },
+    { "compass", WEATHER_KIND_BEARING, WEATHER_UNIT_COMPASS },
+    { "deg", WEATHER_KIND_BEARING, WEATHER_UNIT_DEGREES },
+    { "value", WEATHER_KIND_UV, WEATHER_UNIT_VALUE },
+    { "risk", WEATHER_KIND_UV, WEATHER_UNIT_RISK },
+    { "12h", WEATHER_KIND_TIME, WEATHER_UNIT_12H },
+    { "24h", WEATHER_KIND_TIME, WEATHER_UNIT_24H },
+    { "short", WEATHER_KIND_DATE, WEATHER_UNIT_SHORT },
+    { "long", WEATHER_KIND_DATE, WEATHER_UNIT_LONG },
+};
+
+typedef enum {
+    WEATHER_OP_LITERAL,
+    WEATHER_OP_FIELD,
+    WEATHER_OP_COLOR,
+    WEATHER_OP_COLOR_END,
+    WEATHER_OP_IF
+} weather_op_kind_t;
+
+typedef struct {
+    weather_op_kind_t kind;
+    weather_field_t field;
+    weather_kind_t field_kind;
+    weather_unit_t unit;
+    int arg;            /* IF: index of the op after the block; DAYS: entries to look at; COLOR: fixed color or -1 */
+    char *text;         /* LITERAL, as written */
+    size_t len;
+    char *plain;        /* LITERAL, with color codes removed */
+    size_t plain_len;
+} weather_op_t;
+
+typedef struct weather_template_ {
+    weather_op_t *ops;
+    int count;
+    struct weather_template_ *day;  /* renders {days} */
+} weather_template_t;
+
+typedef enum {
+    WEATHER_TEMPLATE_WEATHER,
+    WEATHER_TEMPLATE_WEATHER_DAY,
+    WEATHER_TEMPLATE_FORECAST,
+    WEATHER_TEMPLATE_FORECAST_DAY,
+    WEATHER_TEMPLATE_COUNT
+} weather_template_id_t;
+
+typedef struct {
+    const char *conf_name;
+    const char *fallback;
+    bool day;
+    char *source;       /* from atheme.conf, may be NULL */
+    weather_template_t *compiled;
+} weather_template_slot_t;
+
+static weather_template_slot_t weather_templates[WEATHER_TEMPLATE_COUNT] = {
+    [WEATHER_TEMPLATE_WEATHER] = { "WEATHER_FORMAT", WEATHER_FORMAT_DEFAULT, false },
+    [WEATHER_TEMPLATE_WEATHER_DAY] = { "WEATHER_DAY_FORMAT", WEATHER_DAY_FORMAT_DEFAULT, true },
+    [WEATHER_TEMPLATE_FORECAST] = { "FORECAST_FORMAT", FORECAST_FORMAT_DEFAULT, false },
+    [WEATHER_TEMPLATE_FORECAST_DAY] = { "FORECAST_DAY_FORMAT", FORECAST_DAY_FORMAT_DEFAULT, true },
+};
+
+static void weather_template_free(weather_template_t *tmpl) {
+    if (!tmpl)
+        return;
+
+    for (int i = 0; i < tmpl->count; i++) {
+        free(tmpl->ops[i].text);
+        free(tmpl->ops[i].plain);
+    }
+    free(tmpl->ops);
+    free(tmpl);
+}
+
+static weather_op_t *weather_template_add_op(weather_template_t *tmpl, weather_op_kind_t kind) {
+    weather_op_t *op;
+
+    if (tmpl->count >= WEATHER_TEMPLATE_MAX_OPS)
+        return NULL;
+
+    op = &tmpl->ops[tmpl->count++];
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    op->arg = -1;
+    return op;
+}
+
+static bool weather_template_flush(weather_template_t *tmpl, char *literal, size_t *len) {
+    weather_op_t *op;
+
+    if (*len == 0)
+        return true;
+
+    literal[*len] = '\0';
+    *len = 0;
+    if (!(op = weather_template_add_op(tmpl, WEATHER_OP_LITERAL)))
+        return false;
+
+    op->text = strdup(literal);
+    op->len = strlen(op->text);
+    op->plain = strdup(literal);
+    remove_colors(op->plain);
+    op->plain_len = strlen(op->plain);
+    return true;
+}
+
+static const weather_field_info_t *weather_field_lookup(const char *name, bool day) {
+    for (size_t i = 0; i < sizeof(weather_fields) / sizeof(weather_fields[0]); i++) {
+        if (weather_fields[i].day == day && !strcmp(weather_fields[i].name, name))
+            return &weather_fields[i];
+    }
+    return NULL;
+}
+
+/* Compiles a template; on failure returns NULL and describes why in err. */
+static weather_template_t *weather_template_compile(const char *source, bool day, char *err, size_t errlen) {
+    weather_template_t *tmpl = calloc(1, sizeof(weather_template_t));
+    char *literal = malloc(strlen(source) + 1);
+    size_t literal_len = 0;
+    int ifs[WEATHER_TEMPLATE_MAX_NESTING];
+    int if_depth = 0;
+    const char *p = source;
+
+    if (!tmpl || !literal || !(tmpl->ops = calloc(WEATHER_TEMPLATE_MAX_OPS, sizeof(weather_op_t)))) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+
+    while (*p) {
+        char token[64], *arg;
+        const char *end;
+        const weather_field_info_t *info;
+        weather_op_t *op;
+
+        if (*p != '{') {
+            literal[literal_len++] = *p++;
+            continue;
+        }
+        if (p[1] == '{') {
+            literal[literal_len++] = '{';
+            p += 2;
+            continue;
+        }
+
+        end = strchr(p, '}');
+        if (!end || (size_t)(end - p - 1) >= sizeof(token)) {
+            snprintf(err, errlen, "unterminated or overlong placeholder at offset %d", (int)(p - source));
+            goto fail;
+        }
+        memcpy(token, p + 1, end - p - 1);
+        token[end - p - 1] = '\0';
+        p = end + 1;
+
+        if ((arg = strchr(token, ':')))
+            *arg++ = '\0';
+
+        /* formatting codes are part of the surrounding literal */
+        if (!arg && strlen(token) == 1 && strchr("buio", token[0])) {
+            literal[literal_len++] = token[0] == 'b' ? '\2' : token[0] == 'u' ? '\37' : token[0] == 'i' ? '\35' : '\17';
+            continue;
+        }
+
+        if (!weather_template_flush(tmpl, literal, &literal_len))
+            goto toolong;
+
+        if (!strcmp(token, "/if")) {
+            if (if_depth == 0) {
+                snprintf(err, errlen, "{/if} without {if}");
+                goto fail;
+            }
+            tmpl->ops[ifs[--if_depth]].arg = tmpl->count;
+            continue;
+        }
+
+        if (!strcmp(token, "/color")) {
+            if (!weather_template_add_op(tmpl, WEATHER_OP_COLOR_END))
+                goto toolong;
+            continue;
+        }
+
+        if (!strcmp(token, "color") && arg && isdigit((unsigned char)arg[0])) {
+            if (!(op = weather_template_add_op(tmpl, WEATHER_OP_COLOR)))
+                goto toolong;
+            op->arg = atoi(arg) % 100;
+            continue;
+        }
+
+        if (!strcmp(token, "if") || !strcmp(token, "color")) {
+            weather_op_kind_t kind = token[0] == 'i' ? WEATHER_OP_IF : WEATHER_OP_COLOR;
+
+            if (!arg || !(info = weather_field_lookup(arg, day))) {
+                snprintf(err, errlen, "{%s} needs a field", token);
+                goto fail;
+            }
+            if (kind == WEATHER_OP_COLOR && info->kind != WEATHER_KIND_TEMP && info->kind != WEATHER_KIND_UV) {
+                snprintf(err, errlen, "%s has no color scale", arg);
+                goto fail;
+            }
+            if (kind == WEATHER_OP_IF && info->kind != WEATHER_KIND_TEXT) {
+                snprintf(err, errlen, "{if} only tests text fields, not %s", arg);
+                goto fail;
+            }
+            if (kind == WEATHER_OP_IF && if_depth == WEATHER_TEMPLATE_MAX_NESTING) {
+                snprintf(err, errlen, "{if} nested too deeply");
+                goto fail;
+            }
+            if (!(op = weather_template_add_op(tmpl, kind)))
+                goto toolong;
+            op->field = info->field;
+            op->field_kind = info->kind;
+            if (kind == WEATHER_OP_IF)
+                ifs[if_depth++] = tmpl->count - 1;
+            continue;
+        }
+
+        if (!(info = weather_field_lookup(token, day))) {
+            snprintf(err, errlen, "unknown field %s", token);
+            goto fail;
+        }
+        if (!(op = weather_template_add_op(tmpl, WEATHER_OP_FIELD)))
+            goto toolong;
+        op->field = info->field;
+        op->field_kind = info->kind;
+        op->unit = info->unit;
+
+        if (arg && info->kind == WEATHER_KIND_DAYS) {
+            op->arg = atoi(arg);
+        } else if (arg) {
+            size_t i;
+
+            for (i = 0; i < sizeof(weather_units) / sizeof(weather_units[0]); i++) {
+                if (weather_units[i].kind == info->kind && !strcmp(weather_units[i].name, arg))
+                    break;
+            }
+            if (i == sizeof(weather_units) / sizeof(weather_units[0])) {
+                snprintf(err, errlen, "unknown unit %s for %s", arg, token);
+                goto fail;
+            }
+            op->unit = weather_units[i].unit;
+        }
+    }
+
+    if (if_depth) {
+        snprintf(err, errlen, "{if} without {/if}");
+        goto fail;
+    }
+    if (!weather_template_flush(tmpl, literal, &literal_len))
+        goto toolong;
+
+    free(literal);
+    return tmpl;
+
+toolong:
+    snprintf(err, errlen, "more than %d parts", WEATHER_TEMPLATE_MAX_OPS);
+fail:
+    free(literal);
+    weather_template_free(tmpl);
+    return NULL;
+}
+
+/* Compiles every template from atheme.conf, keeping the default for any that fail. */
+static void weather_templates_compile(void *unused) {
+    char err[128];
+
+    for (int i = 0; i < WEATHER_TEMPLATE_COUNT; i++) {
+        weather_template_slot_t *slot = &weather_templates[i];
+        weather_template_t *tmpl = NULL;
+
+        if (slot->source) {
+            tmpl = weather_template_compile(slot->source, slot->day, err, sizeof(err));
+            if (!tmpl)
+                slog(LG_ERROR, "weather: %s: %s, using the default", slot->conf_name, err);
+        }
+        if (!tmpl)
+            tmpl = weather_template_compile(slot->fallback, slot->day, err, sizeof(err));
+
+        weather_template_free(slot->compiled);
+        slot->compiled = tmpl;
+    }
+
+    weather_templates[WEATHER_TEMPLATE_WEATHER].compiled->day = weather_templates[WEATHER_TEMPLATE_WEATHER_DAY].compiled;
+    weather_templates[WEATHER_TEMPLATE_FORECAST].compiled->day = weather_templates[WEATHER_TEMPLATE_FORECAST_DAY].compiled;
+}
+
+static void init_weather_templates(void) {
+    for (int i = 0; i < WEATHER_TEMPLATE_COUNT; i++)
+        add_dupstr_conf_item(weather_templates[i].conf_name, &weather->conf_table, 0, &weather_templates[i].source, NULL);
+
+    weather_templates_compile(NULL);
+    hook_add_event("config_ready");
+    hook_add_config_ready(weather_templates_compile);
+}
+
+static void deinit_weather_templates(void) {
+    hook_del_config_ready(weather_templates_compile);
+
+    for (int i = 0; i < WEATHER_TEMPLATE_COUNT; i++) {
+        del_conf_item(weather_templates[i].conf_name, &weather->conf_table);
+        free(weather_templates[i].source);
+        weather_templates[i].source = NULL;
+        weather_template_free(weather_templates[i].compiled);
+        weather_templates[i].compiled = NULL;
+    }
+}
+
+/* Output position in the caller's buffer; text past the end is dropped. */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    bool colors;
+} weather_writer_t;
+
+static inline void weather_write(weather_writer_t *w, const char *s, size_t n) {
+    if (n > w->size - 1 - w->len)
+        n = w->size - 1 - w->len;
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+static void weather_write_fmt(weather_writer_t *w, const char *fmt, ...) {
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(w->buf + w->len, w->size - w->len, fmt, args);
+    va_end(args);
+
+    if (n > 0)
+        w->len += (size_t)n < w->size - 1 - w->len ? (size_t)n : w->size - 1 - w->len;
+}
+
+/* Copies text from upstream, dropping color codes in plain mode. */
+static void weather_write_text(weather_writer_t *w, const char *s) {
+    const char *color;
+
+    if (w->colors) {
+        weather_write(w, s, strlen(s));
+        return;
+    }
+
+    while ((color = strchr(s, '\3'))) {
+        weather_write(w, s, color - s);
+        s = color + 1;
+        if (isdigit((unsigned char)*s)) s++;
+        if (isdigit((unsigned char)*s)) s++;
+        if (*s == ',') {
+            s++;
+            if (isdigit((unsigned char)*s)) s++;
+            if (isdigit((unsigned char)*s)) s++;
+        }
+    }
+    weather_write(w, s, strlen(s));
+}
+
+typedef struct {
+    const weather_record_t *record;
+    const char *location;
+    const weather_day_t *day;
+    const weather_zone_t *zone;
+    int64_t today;      /* local day number, to leave out today's entry; 0 until needed */
+} weather_render_t;
+
+static double weather_field_value(const weather_render_t *r, weather_field_t field) {
+    switch (field) {
+    case WEATHER_FIELD_TEMPERATURE: return r->record->temperature;
+    case WEATHER_FIELD_FEELS_LIKE: return r->record->apparent_temperature;
+    case WEATHER_FIELD_HUMIDITY: return r->record->humidity;
+    case WEATHER_FIELD_WIND_SPEED: return r->record->wind_speed;
+    case WEATHER_FIELD_WIND_GUST: return r->record->wind_gust;
+    case WEATHER_FIELD_WIND_BEARING: return r->record->wind_bearing;
+    case WEATHER_FIELD_DEW_POINT: return r->record->dew_point;
+    case WEATHER_FIELD_UV_INDEX: return r->record->uv_index;
+    case WEATHER_FIELD_SUNRISE: return r->record->sunrise;
+    case WEATHER_FIELD_SUNSET: return r->record->sunset;
+    case WEATHER_FIELD_DAY: return r->day->time;
+    case WEATHER_FIELD_LOW: return r->day->temp_low;
+    case WEATHER_FIELD_HIGH: return r->day->temp_high;
+    default: return 0;
+    }
+}
+
+static const char *weather_field_text(const weather_render_t *r, weather_field_t field) {
+    if (field == WEATHER_FIELD_LOCATION)
+        return r->location;
+    return r->day ? r->day->summary : r->record->summary;
+}
+
+static void weather_render_ops(weather_writer_t *w, const weather_template_t *tmpl, weather_render_t *r);
+
+static void weather_render_days(weather_writer_t *w, const weather_template_t *tmpl, weather_render_t *r, int limit) {
+    if (!tmpl)
+        return;
+
+    if (!r->today)
+        r->today = weather_zone_day(r->zone, r->record->utc_offset, time(NULL));
+
+    for (int i = 0; i < r->record->day_count && (limit < 0 || i < limit); i++) {
+        if (weather_zone_day(r->zone, r->record->utc_offset, r->record->days[i].time) == r->today)
+            continue;
+
+        r->day = &r->record->days[i];
+        weather_render_ops(w, tmpl, r);
+        r->day = NULL;
+    }
+}
+
+static void weather_render_field(weather_writer_t *w, const weather_op_t *op, const weather_template_t *tmpl, weather_render_t *r) {
+    double value = weather_field_value(r, op->field);
+    char abbr[16];
+    struct tm tm;
+    char *color;
+
+    switch (op->unit) {
+    case WEATHER_UNIT_F:
+        weather_write_fmt(w, "%.1f", value);
+        return;
+    case WEATHER_UNIT_C:
+        weather_write_fmt(w, "%.1f", (value - 32) * 5 / 9);
+        return;
+    case WEATHER_UNIT_F0:
+        weather_write_fmt(w, "%.0f", value);
+        return;
+    case WEATHER_UNIT_C0:
+        weather_write_fmt(w, "%.0f", (value - 32) * 5 / 9);
+        return;
+    case WEATHER_UNIT_MPH:
+        weather_write_fmt(w, "%.1f", value);
+        return;
+    case WEATHER_UNIT_KMH:
+        weather_write_fmt(w, "%.1f", value * 1.60934);
+        return;
+    case WEATHER_UNIT_PERCENT:
+        weather_write_fmt(w, "%.0f", value * 100);
+        return;
+    case WEATHER_UNIT_COMPASS:
+        weather_write_text(w, wind_direction((int)value));
+        return;
+    case WEATHER_UNIT_DEGREES:
+        weather_write_fmt(w, "%.0f", value);
+        return;
+    case WEATHER_UNIT_VALUE:
+        weather_write_fmt(w, "%.1f", value);
+        return;
+    case WEATHER_UNIT_RISK:
+        weather_write_text(w, format_uv(value, &color));
+        return;
+    case WEATHER_UNIT_12H:
+    case WEATHER_UNIT_24H:
+        weather_zone_localtime(r->zone, r->record->utc_offset, (time_t)value, &tm, abbr, sizeof(abbr));
+        if (op->unit == WEATHER_UNIT_12H)
+            weather_write_fmt(w, "%02d:%02d %s %s", tm.tm_hour % 12 ? tm.tm_hour % 12 : 12, tm.tm_min, tm.tm_hour < 12 ? "AM" : "PM", abbr);
+        else
+            weather_write_fmt(w, "%02d:%02d %s", tm.tm_hour, tm.tm_min, abbr);
+        return;
+    case WEATHER_UNIT_SHORT:
+    case WEATHER_UNIT_LONG:
+        weather_zone_localtime(r->zone, r->record->utc_offset, (time_t)value, &tm, abbr, sizeof(abbr));
+        if (op->unit == WEATHER_UNIT_SHORT)
+            weather_write(w, weather_weekdays[tm.tm_wday], 3);
+        else
+            weather_write_text(w, weather_weekdays[tm.tm_wday]);
+        return;
+    case WEATHER_UNIT_NONE:
+        if (op->field == WEATHER_FIELD_DAYS)
+            weather_render_days(w, tmpl->day, r, op->arg);
+        else
+            weather_write_text(w, weather_field_text(r, op->field));
+        return;
+    }
+}
+
+static void weather_render_ops(weather_writer_t *w, const weather_template_t *tmpl, weather_render_t *r) {
+    for (int i = 0; i < tmpl->count; i++) {
+        const weather_op_t *op = &tmpl->ops[i];
+        char *color;
+
+        switch (op->kind) {
+        case WEATHER_OP_LITERAL:
+            if (w->colors)
+                weather_write(w, op->text, op->len);
+            else
+                weather_write(w, op->plain, op->plain_len);
+            break;
+        case WEATHER_OP_FIELD:
+            weather_render_field(w, op, tmpl, r);
+            break;
+        case WEATHER_OP_COLOR:
+            if (!w->colors)
+                break;
+            if (op->arg >= 0) {
+                weather_write_fmt(w, "\003%02d", op->arg);
+            } else if (op->field_kind == WEATHER_KIND_UV) {
+                format_uv(weather_field_value(r, op->field), &color);
+                weather_write(w, color, strlen(color));
+            } else {
+                weather_write(w, "\003", 1);
+                weather_write(w, temp_color(weather_field_value(r, op->field)), 2);
+            }
+            break;
+        case WEATHER_OP_COLOR_END:
+            if (w->colors)
+                weather_write(w, "\003", 1);
+            break;
+        case WEATHER_OP_IF:
+            if (op->field_kind == WEATHER_KIND_TEXT && !weather_field_text(r, op->field)[0])
+                i = op->arg - 1;
+            break;
+        }
+    }
+}
+
+/* Builds the reply line for a weather record into the caller's buffer and returns its length. */
+size_t render_weather_data(const weather_record_t *record, const char *location, int forecast, bool colors, char *output, size_t output_size) {
+    const weather_template_t *tmpl = weather_templates[forecast ? WEATHER_TEMPLATE_FORECAST : WEATHER_TEMPLATE_WEATHER].compiled;
+    weather_writer_t w = { output, output_size, 0, colors };
+    weather_render_t r = { record, location, NULL, weather_zone_find(record->timezone), 0 };
+
+    if (!output_size)
+        return 0;
+
+    weather_render_ops(&w, tmpl, &r);
+    output[w.len] = '\0';
+    return w.len;
+}
+
+/*
+ * Weather cache.
+ *
+ * Parsed records are kept in memory for a short time keyed by the grid
+ * cell the lat/long falls in: a geohash cell of weather_cache_precision
+ * characters, whose centre is what the forecast is fetched for.  Geocodes
+ * a few hundred metres apart thus share one forecast, while the reply still
+ * names the place the user asked for.  Precision 0 keys on the exact
+ * lat/long.  While a fetch for a cell is in flight, later requests for it
+ * wait on that entry instead of starting their own, and all of them are
+ * answered when it lands.
+ *
+ * An entry past its TTL but within the grace period is still served at
+ * once, and refreshed in the background for the next request.  Entries
+ * for saved locations that are being asked for are refreshed ahead of
+ * expiry, so bare !w/WEATHER calls rarely wait on the API at all.
+ */
+#define WEATHER_CACHE_TTL 300
+#define WEATHER_CACHE_PURGE_INTERVAL 60
+#define WEATHER_CACHE_GRACE 600
+#define WEATHER_REFRESH_INTERVAL 60
+#define WEATHER_REFRESH_COUNT 50
+#define WEATHER_CACHE_PRECISION 6       /* geohash characters, about 1.2 x 0.6 km */
+#define WEATHER_CACHE_PRECISION_MAX 9   /* about 5 m, near the microdegree grid */
+
+/* One provider's fetch for an entry. */
+typedef struct {
+    weather_cache_entry_t *entry;
+    weather_provider_t *provider;
+    weather_parse_t parse;
+    weather_fetch_t *fetch;
+    uint64_t started;
+} weather_attempt_t;
+
+struct weather_cache_entry_ {
+    unsigned int loc;           /* the cell */
+    unsigned int origin;        /* the location whose request created it */
+    bool valid;
+    time_t expires;
+    weather_record_t record;
+    weather_attempt_t *attempts[WEATHER_PROVIDER_COUNT];   /* in-flight fetches, by provider */
+    unsigned int inflight;
+    bool tried[WEATHER_PROVIDER_COUNT];     /* providers asked during this refresh */
+    weather_alarm_t *hedge;                 /* armed while only the primary is asked */
+    mowgli_list_t waiters;      /* jobs waiting on the fetch */
+    mowgli_node_t node;
+};
+
+static mowgli_list_t weather_cache;
+static unsigned int weather_cache_ttl = WEATHER_CACHE_TTL;
+static mowgli_eventloop_timer_t *weather_cache_timer;
+static unsigned int weather_cache_hits;
+static unsigned int weather_cache_misses;
+static unsigned int weather_cache_coalesced;
+static unsigned int weather_cache_grace = WEATHER_CACHE_GRACE;
+static unsigned int weather_cache_stale;       /* served past the TTL */
+static unsigned int weather_cache_refreshes;   /* background fetches */
+static unsigned int weather_cache_precision = WEATHER_CACHE_PRECISION;
+static unsigned int weather_cache_shared;      /* answered from another location's fetch */
+
+/*
+ * Saved locations are counted on the location record as each account's
+ * settings are decoded and kept up to date by SETWEATHER, together with
+ * how often each has been asked for lately.  The accounts hold the
+ * references.  Every account is decoded once the event loop first runs,
+ * since at startup the module is loaded before the database is.
+ */
+static unsigned int weather_saved_locations;
+static unsigned int weather_refresh_count = WEATHER_REFRESH_COUNT;
+static mowgli_eventloop_timer_t *weather_refresh_timer, *weather_saved_scan_timer;
+
+static void saved_location_add(unsigned int id) {
+    weather_location_t *loc = weather_location(id);
+
+    if (loc && loc->accounts++ == 0)
+        weather_saved_locations++;
+}
+
+static void saved_location_del(unsigned int id) {
+    weather_location_t *loc = weather_location(id);
+
+    if (!loc || !loc->accounts || --loc->accounts > 0)
+        return;
+    loc->demand = 0;
+    weather_saved_locations--;
+}
+
+static void weather_job_finish(weather_job_t *job, const weather_record_t *record) {
+    char output[OUTPUT_SIZE];
+    uint64_t start;
+
+    weather_stats_record(WEATHER_STAGE_WEATHER, job->stage_started);
+    if (job->done) {
+        job->done(job, record);
+        weather_job_destroy(job);
+        return;
+    }
+
+    start = weather_now_us();
+    render_weather_data(record, job->location, job->forecast, job->colors, output, sizeof(output));
+    weather_stats_record(WEATHER_STAGE_RENDER, start);
+    slog(LG_DEBUG, "%s", output);
+
+    start = weather_now_us();
+    weather_job_send(job, output);
+    weather_stats_record(WEATHER_STAGE_DELIVERY, start);
+
+    weather_stats_record(WEATHER_STAGE_TOTAL, job->started);
+    weather_job_destroy(job);
+}
+
+static void weather_cache_entry_free(weather_cache_entry_t *entry) {
+    weather_location(entry->loc)->cache = NULL;
+    weather_location_unref(entry->loc);
+    mowgli_node_delete(&entry->node, &weather_cache);
+    free(entry);
+}
+
+/* Takes a fetch out of its entry; a fetch still running is abandoned. */
+static void weather_attempt_end(weather_attempt_t *attempt) {
+    weather_cache_entry_t *entry = attempt->entry;
+
+    entry->attempts[attempt->provider - weather_providers] = NULL;
+    entry->inflight--;
+    if (attempt->fetch) {
+        /* it has been going this long at least, which keeps slow answers in the percentile */
+        weather_provider_sample(attempt->provider, weather_now_us() - attempt->started);
+        weather_fetch_cancel(attempt->fetch);
+    }
+    free(attempt);
+}
+
+static void weather_fetch_done(weather_fetch_t *fetch, CURLcode res);
+
+static bool weather_attempt_start(weather_cache_entry_t *entry, weather_provider_t *provider, bool background, const char **error) {
+    weather_attempt_t *attempt;
+    weather_api_key_t *key;
+    char url[512];
+
+    key = weather_key_pick(provider->upstream, background, error);
+    if (!key)
+        return false;
+
+    attempt = calloc(1, sizeof(weather_attempt_t));
+    if (!attempt) {
+        *error = _("Failed to fetch weather data.");
+        return false;
+    }
+
+    slog(LG_DEBUG, "Fetching weather! BARK! BARK!");
+    provider->url(key, weather_location(entry->loc), url, sizeof(url));
+    provider->parse_init(&attempt->parse);
+    attempt->entry = entry;
+    attempt->provider = provider;
+    attempt->started = weather_now_us();
+    attempt->fetch = weather_fetch_submit(key, url, &attempt->parse.stream, weather_fetch_done, attempt);
+    if (!attempt->fetch) {
+        free(attempt);
+        *error = weather_fetch_error;
+        return false;
+    }
+
+    entry->attempts[provider - weather_providers] = attempt;
+    entry->inflight++;
+    provider->requests++;
+    return true;
+}
+
+/* Sends the fetch to the next provider that has not had it yet. */
+static bool weather_cache_hedge_start(weather_cache_entry_t *entry) {
+    const char *error;
+
+    for (int i = 0; i < WEATHER_PROVIDER_COUNT; i++) {
+        if (entry->tried[i])
+            continue;
+        entry->tried[i] = true;
+        if (weather_attempt_start(entry, &weather_providers[i], false, &error)) {
+            weather_providers[i].hedges++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void weather_cache_hedge(void *arg) {
+    weather_cache_entry_t *entry = arg;
+
+    entry->hedge = NULL;
+    weather_cache_hedge_start(entry);
+}
+
+/* The negative cache key of a forecast: the lat/long of its cell. */
+static void weather_cache_negative_key(weather_cache_entry_t *entry, char *buf, size_t size) {
+    char latlong[64];
+
+    weather_location_latlong(entry->loc, latlong, sizeof(latlong));
+    negative_cache_key('w', latlong, buf, size);
+}
+
+/* The failure a cell is being left alone after, if any. */
+static negative_cache_entry_t *weather_cache_backoff(weather_cache_entry_t *entry) {
+    char key[80];
+
+    weather_cache_negative_key(entry, key, sizeof(key));
+    return negative_cache_lookup(key);
+}
+
+static void weather_fetch_done(weather_fetch_t *fetch, CURLcode res) {
+    weather_attempt_t *attempt = fetch->privdata;
+    weather_cache_entry_t *entry = attempt->entry;
+    weather_provider_t *provider = attempt->provider;
+    mowgli_node_t *n, *tn;
+    char key[80], message[256];
+    bool ok = false;
+    int class;
+
+    attempt->fetch = NULL;
+    if (res != CURLE_OK) {
+        slog(LG_DEBUG, "Failed to fetch weather data from %s: %s", provider->name, curl_easy_strerror(res));
+    } else if (weather_parse_finish(&attempt->parse)) {
+        weather_provider_sample(provider, weather_now_us() - attempt->started);
+        entry->record = attempt->parse.record;
+        entry->valid = true;
+        entry->expires = CURRTIME + weather_cache_ttl;
+        ok = true;
+    }
+
+    if (!ok) {
+        provider->failures++;
+        weather_attempt_end(attempt);
+
+        /* another provider may still come through */
+        if (entry->inflight)
+            return;
+        if (entry->hedge) {
+            weather_alarm_cancel(entry->hedge);
+            entry->hedge = NULL;
+            if (weather_cache_hedge_start(entry)) {
+                weather_hedge_failovers++;
+                return;
+            }
+        }
+    } else {
+        weather_attempt_end(attempt);
+        if (entry->inflight)
+            provider->wins++;
+        for (int i = 0; i < WEATHER_PROVIDER_COUNT; i++) {
+            if (entry->attempts[i])
+                weather_attempt_end(entry->attempts[i]);
+        }
+        if (entry->hedge) {
+            weather_alarm_cancel(entry->hedge);
+            entry->hedge = NULL;
+        }
+    }
+    memset(entry->tried, 0, sizeof(entry->tried));
+
+    /* the last provider to fail decides how long the cell is left alone */
+    weather_cache_negative_key(entry, key, sizeof(key));
+    if (res != CURLE_OK)
+        snprintf(message, sizeof(message), "Failed to fetch weather data: %s", curl_easy_strerror(res));
+    else
+        mowgli_strlcpy(message, _("Failed to fetch weather data."), sizeof(message));
+    if (ok)
+        negative_cache_clear(key);
+    else if ((class = negative_cache_class(res, fetch->info.status, NEGATIVE_PARSE)) >= 0)
+        negative_cache_store(key, class, 0, message);
+
+    /* a failed refresh leaves the old record to serve until the grace runs out */
+    if (!ok && entry->valid && entry->expires + (time_t)weather_cache_grace > CURRTIME)
+        ok = true;
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, entry->waiters.head) {
+        weather_job_t *job = n->data;
+
+        mowgli_node_delete(n, &entry->waiters);
+        if (ok) {
+            weather_job_finish(job, &entry->record);
+        } else {
+            weather_job_reply(job, "%s", message);
+            weather_job_free(job);
+        }
+    }
+
+    if (!ok)
+        weather_cache_entry_free(entry);
+}
+
+/*
+ * Starts a fetch into entry; anyone who wants the result must already be
+ * waiting on it.  Goes to the first provider with quota, and for a user
+ * who is waiting arms the hedge to the next one.
+ */
+static bool weather_cache_fetch(weather_cache_entry_t *entry, bool background, const char **error) {
+    const char *first_error = NULL;
+    negative_cache_entry_t *negative;
+    int i;
+
+    if ((negative = weather_cache_backoff(entry))) {
+        *error = negative->message;
+        return false;
+    }
+
+    for (i = 0; i < WEATHER_PROVIDER_COUNT; i++) {
+        entry->tried[i] = true;
+        if (weather_attempt_start(entry, &weather_providers[i], background, error))
+            break;
+        if (!first_error)
+            first_error = *error;
+    }
+    if (i == WEATHER_PROVIDER_COUNT) {
+        memset(entry->tried, 0, sizeof(entry->tried));
+        *error = first_error;
+        return false;
+    }
+
+    if (!background && weather_hedge_percentile && i + 1 < WEATHER_PROVIDER_COUNT) {
+        weather_hedge_armed++;
+        entry->hedge = weather_alarm_add(weather_provider_hedge_delay(&weather_providers[i]), weather_cache_hedge, entry);
+    }
+    return true;
+}
+
+/* The centre of the geohash cell v falls in, along an axis of the given range and bits. */
+static double weather_cache_snap(double v, double range, unsigned int bits) {
+    double cells = ldexp(1.0, bits), i = floor((v + range) / (2 * range) * cells);
+
+    if (i < 0)
+        i = 0;
+    else if (i >= cells)
+        i = cells - 1;
+    return -range + (i + 0.5) * (2 * range) / cells;
+}
+
+/* The cell location id shares a forecast with; itself with the grid off or out of memory. */
+static unsigned int weather_cache_cell(unsigned int id) {
+    weather_location_t *loc = weather_location(id), *cell;
+    unsigned int bits = weather_cache_precision * 5, cell_id = id;
+
+    if (loc->cell && loc->cell_precision == weather_cache_precision)
+        return loc->cell;
+    weather_location_uncell(loc, id);
+
+    /* geohash gives longitude the odd bit */
+    if (bits && (cell_id = weather_location_get(weather_cache_snap(loc->lat, 90, bits / 2), weather_cache_snap(loc->lng, 180, (bits + 1) / 2)))) {
+        if (cell_id == id)
+            weather_location_unref(id);
+    } else {
+        cell_id = id;
+    }
+
+    loc->cell = cell_id;
+    loc->cell_precision = weather_cache_precision;
+    cell = weather_location(cell_id);
+    if (cell->cell_members++ == 0)
+        weather_cells++;
+    return cell_id;
+}
+
+static void fetch_weather_data(weather_job_t *job) {
+    weather_location_t *loc = weather_location(job->loc);
+    weather_location_t *cell = weather_location(weather_cache_cell(job->loc));
+    weather_cache_entry_t *entry = cell->cache;
+    bool shared = entry && entry->origin != job->loc;
+    const char *error;
+
+    job->stage_started = weather_now_us();
+    if (loc->accounts && !job->background)
+        loc->demand++;
+
+    if (entry && entry->valid && entry->expires > CURRTIME) {
+        weather_cache_hits++;
+        weather_cache_shared += shared;
+        weather_job_finish(job, &entry->record);
+        return;
+    }
+
+    if (entry && entry->valid && entry->expires + (time_t)weather_cache_grace > CURRTIME) {
+        weather_cache_stale++;
+        weather_cache_shared += shared;
+        if (!entry->inflight && weather_cache_fetch(entry, true, &error))
+            weather_cache_refreshes++;
+        weather_job_finish(job, &entry->record);
+        return;
+    }
+
+    if (entry && entry->inflight) {
+        weather_cache_coalesced++;
+        weather_cache_shared += shared;
+        mowgli_node_add(job, &job->node, &entry->waiters);
+        return;
+    }
+
+    weather_cache_misses++;
+    if (!entry) {
+        entry = calloc(1, sizeof(weather_cache_entry_t));
+        if (!entry) {
+            weather_job_reply(job, "%s", _("Failed to fetch weather data."));
+            weather_job_free(job);
+            return;
+        }
+        entry->loc = weather_location_ref(weather_cache_cell(job->loc));
+        entry->origin = job->loc;
+        cell->cache = entry;
+        mowgli_node_add(entry, &entry->node, &weather_cache);
+    }
+
+    mowgli_node_add(job, &job->node, &entry->waiters);
+    if (!weather_cache_fetch(entry, job->background, &error)) {
+        mowgli_node_delete(&job->node, &entry->waiters);
+        if (!job->background)
+            weather_job_reply(job, "%s", error);
+        weather_job_free(job);
+        if (!entry->valid)
+            weather_cache_entry_free(entry);
+    }
+}
+
+static int saved_location_cmp(const void *a, const void *b) {
+    const weather_location_t *x = *(weather_location_t *const *)a, *y = *(weather_location_t *const *)b;
+
+    if (x->demand != y->demand)
+        return x->demand < y->demand ? 1 : -1;
+    return x->accounts < y->accounts ? 1 : x->accounts > y->accounts ? -1 : 0;
+}
+
+/*
+ * Refreshes the most asked-for saved locations whose entries would expire
+ * before the next round.  Locations nobody has asked for are left alone,
+ * so this never spends quota on demand that isn't there.
+ */
+static void weather_refresh_run(void *arg) {
+    weather_location_t *loc, **ranked;
+    unsigned int count = 0, started = 0;
+    const char *error;
+
+    ranked = malloc((weather_saved_locations + 1) * sizeof(*ranked));
+    if (!ranked)
+        return;
+
+    for (unsigned int id = 1; id < weather_locations_size && count < weather_saved_locations; id++) {
+        if ((loc = weather_locations[id]) && loc->accounts && loc->demand)
+            ranked[count++] = loc;
+    }
+    qsort(ranked, count, sizeof(*ranked), saved_location_cmp);
+
+    for (unsigned int i = 0; i < count && started < weather_refresh_count; i++) {
+        weather_location_t *cell = ranked[i]->cell_precision == weather_cache_precision ? weather_location(ranked[i]->cell) : NULL;
+        weather_cache_entry_t *entry = cell ? cell->cache : NULL;
+
+        if (!entry || !entry->valid || entry->inflight || entry->expires > CURRTIME + WEATHER_REFRESH_INTERVAL)
+            continue;
+        if (weather_cache_backoff(entry))
+            continue;
+        if (!weather_cache_fetch(entry, true, &error))
+            break;
+        weather_cache_refreshes++;
+        started++;
+    }
+    free(ranked);
+
+    for (unsigned int id = 1; id < weather_locations_size; id++) {
+        if ((loc = weather_locations[id]))
+            loc->demand /= 2;
+    }
+}
+
+static void weather_cache_purge(void *arg) {
+    mowgli_node_t *n, *tn;
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, weather_cache.head) {
+        weather_cache_entry_t *entry = n->data;
+
+        if (!entry->inflight && entry->expires + (time_t)weather_cache_grace <= CURRTIME)
+            weather_cache_entry_free(entry);
+    }
+}
+
+static void on_myuser_delete(myuser_t *mu) {
+    weather_settings_t *settings = weather_settings(mu);
+
+    if (settings && (settings->flags & WEATHER_SETTING_LOCATION))
+        saved_location_del(settings->loc);
+    weather_settings_forget(mu);
+}
+
+/* Decoding an account's settings counts its saved location. */
+static void weather_saved_scan(void *arg) {
+    myentity_iteration_state_t state;
+    myentity_t *mt;
+
+    weather_saved_scan_timer = NULL;
+    MYENTITY_FOREACH_T(mt, &state, ENT_USER) {
+        weather_settings(user(mt));
+    }
+    slog(LG_DEBUG, "weather: %u distinct saved locations", weather_saved_locations);
+}
+
+static void init_weather_cache(void) {
+    weather_cache_timer = mowgli_timer_add(base_eventloop, "weather_cache_purge", weather_cache_purge, NULL, WEATHER_CACHE_PURGE_INTERVAL);
+    weather_saved_scan_timer = mowgli_timer_add_once(base_eventloop, "weather_saved_scan", weather_saved_scan, NULL, 0);
+
+    hook_add_event("myuser_delete");
+    hook_add_myuser_delete(on_myuser_delete);
+    weather_refresh_timer = mowgli_timer_add(base_eventloop, "weather_refresh_run", weather_refresh_run, NULL, WEATHER_REFRESH_INTERVAL);
+}
+
+/* Must run after the fetch engine has released every waiting job. */
+static void deinit_weather_cache(void) {
+    mowgli_timer_destroy(base_eventloop, weather_cache_timer);
+    mowgli_timer_destroy(base_eventloop, weather_refresh_timer);
+    if (weather_saved_scan_timer)
+        mowgli_timer_destroy(base_eventloop, weather_saved_scan_timer);
+    hook_del_myuser_delete(on_myuser_delete);
+    while (weather_cache.head)
+        weather_cache_entry_free(weather_cache.head->data);
+}
+
+static void ws_cmd_cachestats(sourceinfo_t *si, int parc, char *parv[]) {
+    unsigned int lookups = weather_cache_hits + weather_cache_misses + weather_cache_coalesced;
+
+    command_success_nodata(si, "\2Weather cache:\2 %zu entries, TTL %us", MOWGLI_LIST_LENGTH(&weather_cache), weather_cache_ttl);
+    command_success_nodata(si, "  Hits: %u  Misses: %u  Coalesced: %u  Hit rate: %.1f%%", weather_cache_hits, weather_cache_misses, weather_cache_coalesced,
+        lookups ? 100.0 * (weather_cache_hits + weather_cache_coalesced) / lookups : 0.0);
+    command_success_nodata(si, "  Served stale: %u (grace %us)  Background refreshes: %u  Saved locations: %u", weather_cache_stale, weather_cache_grace,
+        weather_cache_refreshes, weather_saved_locations);
+    if (weather_cache_precision)
+        command_success_nodata(si, "  Grid: geohash precision %u, %u cells in use  Shared: %u (%.1f%% of lookups answered by a neighbour's forecast)",
+            weather_cache_precision, weather_cells, weather_cache_shared, lookups ? 100.0 * weather_cache_shared / lookups : 0.0);
+    else
+        command_success_nodata(si, "  Grid: off, keyed by exact lat/long");
+    command_success_nodata(si, "\2Geocode cache:\2 %zu entries, TTL %us", MOWGLI_LIST_LENGTH(&geocode_cache_lru), geocode_cache_ttl);
+    command_success_nodata(si, "  Hits: %u  Misses: %u", geocode_cache_hits, geocode_cache_misses);
+    gazetteer_show(si);
+    negative_cache_show(si);
+    command_success_nodata(si, "\2Locations:\2 %u registered, %u names interned", weather_locations_count,
+        weather_strings ? mowgli_patricia_size(weather_strings) : 0);
+    command_success_nodata(si, "\2Time zones:\2 %u loaded, %u unknown (fixed offset used)", weather_zones_loaded, weather_zones_unknown);
+}
+
+/*
+ * Identify greetings.
+ *
+ * A netsplit rejoin or a services restart brings identifies in bursts, so
+ * greetings are not fetched as they come.  They wait in a queue grouped by
+ * saved lat/long; a timer fetches each location once and then sends the
+ * notices at a fixed rate.  A greeting still queued after the deadline is
+ * dropped, since by then it is no longer a greeting, and so is one whose
+ * nick is no longer identified to the account it was queued for.
+ */
+#define GREET_RATE 5            /* notices and fetches per second */
+#define GREET_DEADLINE 120
+
+typedef struct {
+    char nick[NICKLEN + 1];
+    char account[NICKLEN + 1];
+    const char *location;       /* interned */
+    bool colors;
+    time_t queued;
+    mowgli_node_t node;
+} greet_t;
+
+struct greet_group_ {
+    unsigned int loc;
+    mowgli_list_t greets;       /* oldest first */
+    bool fetching;
+    bool failed;
+    bool ready;
+    time_t fetched;
+    weather_record_t record;
+    mowgli_node_t node;
+};
+
+static mowgli_patricia_t *greet_nicks;      /* nick -> greet_t, one greeting each */
+static mowgli_list_t greet_order;           /* groups by their oldest greeting */
+static mowgli_eventloop_timer_t *greet_timer;
+static unsigned int greet_rate = GREET_RATE;
+static unsigned int greet_deadline = GREET_DEADLINE;
+static unsigned int greet_sent;
+static unsigned int greet_dropped;
+static unsigned int greet_fetches;
+
+static void greet_run(void *arg);
+
+static void greet_remove(greet_group_t *group, greet_t *greet) {
+    mowgli_patricia_delete(greet_nicks, greet->nick);
+    mowgli_node_delete(&greet->node, &group->greets);
+    weather_unintern(greet->location);
+    free(greet);
+}
+
+static void greet_group_free(greet_group_t *group) {
+    mowgli_node_t *n, *tn;
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, group->greets.head) {
+        greet_remove(group, n->data);
+    }
+    weather_location(group->loc)->greet = NULL;
+    weather_location_unref(group->loc);
+    mowgli_node_delete(&group->node, &greet_order);
+    free(group);
+}
+
+/* The group's fetch is done; greet_run() takes it from here. */
+static void greet_fetched(weather_job_t *job, const weather_record_t *record) {
+    greet_group_t *group = job->privdata;
+
+    group->fetching = false;
+    if (record) {
+        group->record = *record;
+        group->fetched = CURRTIME;
+        group->ready = true;
+    } else {
+        group->failed = true;
+    }
+}
+
+static void greet_send(greet_t *greet, const weather_record_t *record) {
+    user_t *u = user_find_named(greet->nick);
+    char output[OUTPUT_SIZE];
+    uint64_t start;
+
+    /* they may have quit, logged out or given the nick up while queued */
+    if (!u || !u->myuser || irccasecmp(entity(u->myuser)->name, greet->account)) {
+        greet_dropped++;
+        return;
+    }
+
+    start = weather_now_us();
+    render_weather_data(record, greet->location, 0, greet->colors, output, sizeof(output));
+    weather_stats_record(WEATHER_STAGE_RENDER, start);
+    notice(weather->nick, greet->nick, "%s", output);
+    greet_sent++;
+}
+
+static void greet_run(void *arg) {
+    mowgli_node_t *n, *tn, *gn, *gtn;
+    unsigned int sends = greet_rate, fetches = greet_rate;
+    time_t now = CURRTIME;
+
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, greet_order.head) {
+        greet_group_t *group = n->data;
+
+        MOWGLI_ITER_FOREACH_SAFE(gn, gtn, group->greets.head) {
+            greet_t *greet = gn->data;
+
+            if (greet->queued + (time_t)greet_deadline > now)
+                break;
+            greet_remove(group, greet);
+            greet_dropped++;
+        }
+
+        if (group->failed) {
+            greet_dropped += MOWGLI_LIST_LENGTH(&group->greets);
+            greet_group_free(group);
+            continue;
+        }
+
+        /* a busy location can outlive its forecast */
+        if (group->ready && group->fetched + (time_t)weather_cache_ttl <= now)
+            group->ready = false;
+
+        if (!group->ready && !group->fetching && fetches && group->greets.head) {
+            weather_job_t *job = weather_job_create(WEATHER_REPLY_USER, "");
+
+            if (job) {
+                job->loc = weather_location_ref(group->loc);
+                job->background = true;
+                job->done = greet_fetched;
+                job->privdata = group;
+                group->fetching = true;
+                fetches--;
+                greet_fetches++;
+                /* may finish before it returns, on a cache hit */
+                fetch_weather_data(job);
+            }
+        }
+
+        while (group->ready && sends && group->greets.head) {
+            greet_t *greet = group->greets.head->data;
+
+            greet_send(greet, &group->record);
+            greet_remove(group, greet);
+            sends--;
+        }
+
+        if (!group->greets.head && !group->fetching)
+            greet_group_free(group);
+    }
+
+    if (!greet_order.head && greet_timer) {
+        mowgli_timer_destroy(base_eventloop, greet_timer);
+        greet_timer = NULL;
+    }
+}
+
+static void greet_queue(user_t *u, const char *location, unsigned int id) {
+    weather_location_t *loc = weather_location(id);
+    weather_settings_t *settings;
+    greet_group_t *group;
+    greet_t *greet;
+
+    if (!loc || mowgli_patricia_retrieve(greet_nicks, u->nick))
+        return;
+
+    /* allocated first, so a failure cannot leave an empty group behind */
+    greet = calloc(1, sizeof(greet_t));
+    if (!greet)
+        return;
+
+    group = loc->greet;
+    if (!group) {
+        group = calloc(1, sizeof(greet_group_t));
+        if (!group) {
+            free(greet);
+            return;
+        }
+        group->loc = weather_location_ref(id);
+        loc->greet = group;
+        mowgli_node_add(group, &group->node, &greet_order);
+    }
+    mowgli_strlcpy(greet->nick, u->nick, sizeof(greet->nick));
+    mowgli_strlcpy(greet->account, entity(u->myuser)->name, sizeof(greet->account));
+    greet->location = weather_intern_dup(location);
+    settings = weather_settings(u->myuser);
+    greet->colors = !settings || (settings->flags & WEATHER_SETTING_COLORS);
+    greet->queued = CURRTIME;
+    mowgli_patricia_add(greet_nicks, greet->nick, greet);
+    mowgli_node_add(greet, &greet->node, &group->greets);
+
+    if (!greet_timer)
+        greet_timer = mowgli_timer_add(base_eventloop, "greet_run", greet_run, NULL, 1);
+}
+
+static void weather_greet_stats(sourceinfo_t *si) {
+    command_success_nodata(si, "\2Greetings:\2 %u queued for %zu locations, %u sent, %u dropped, %u fetches",
+        mowgli_patricia_size(greet_nicks), MOWGLI_LIST_LENGTH(&greet_order), greet_sent, greet_dropped, greet_fetches);
+}
+
+static void init_greet_queue(void) {
+    greet_nicks = mowgli_patricia_create(strcasecanon);
+    add_uint_conf_item("GREET_RATE", &weather->conf_table, 0, &greet_rate, 1, 1000, GREET_RATE);
+    add_duration_conf_item("GREET_DEADLINE", &weather->conf_table, 0, &greet_deadline, "s", GREET_DEADLINE);
+}
+
+/* Must run after the fetch engine is gone, so no fetch still points at a group. */
+static void deinit_greet_queue(void) {
+    mowgli_node_t *n, *tn;
+
+    if (greet_timer)
+        mowgli_timer_destroy(base_eventloop, greet_timer);
+    greet_timer = NULL;
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, greet_order.head) {
+        greet_group_free(n->data);
+    }
+    mowgli_patricia_destroy(greet_nicks, NULL, NULL);
+    del_conf_item("GREET_RATE", &weather->conf_table);
+    del_conf_item("GREET_DEADLINE", &weather->conf_table);
+}
+
+/*
+ * Channel triggers.
+ *
+ * on_channel_message() sees every line in every channel the bot sits in,
+ * so ordinary chat is turned away on its first byte: only lines starting
+ * with a trigger prefix go any further.  Those are matched as whole words
+ * against the channel's trigger table, and the rest of the line is used in
+ * place as the location.
+ *
+ * Channels can replace the default triggers with TRIGGERS.  The table is
+ * kept in channel metadata and compiled the first time it is needed.
+ */
+#define TRIGGER_MAX 16
+#define TRIGGER_MAXLEN 16
+#define TRIGGER_DEFAULT "!w=weather !weather=weather !f=forecast !forecast=forecast"
+
+typedef struct {
+    char word[TRIGGER_MAXLEN + 1];
+    size_t len;
+    bool forecast;
+} trigger_t;
+
+typedef struct {
+    unsigned int count;
+    trigger_t triggers[TRIGGER_MAX];
+} trigger_table_t;
+
+static char *trigger_spec;          /* default triggers, from atheme.conf */
+static char *trigger_prefixes;      /* other first characters channels may use */
+static bool trigger_prefix[256];
+static trigger_table_t trigger_default;
+static mowgli_patricia_t *trigger_channels;     /* channel -> its compiled table */
+
+/* Parses "word=weather word=forecast ..." into table. */
+static bool trigger_table_compile(const char *spec, trigger_table_t *table, char *err, size_t errlen) {
+    const char *p = spec;
+
+    table->count = 0;
+    while (*p) {
+        const char *word, *action, *end;
+        trigger_t *trigger;
+
+        while (*p == ' ')
+            p++;
+        if (!*p)
+            break;
+
+        word = p;
+        end = word + strcspn(word, " ");
+        action = memchr(word, '=', end - word);
+        p = end;
+
+        if (!action || action == word) {
+            snprintf(err, errlen, "\"%.*s\" is not of the form trigger=weather or trigger=forecast", (int)(end - word), word);
+            return false;
+        }
+        if (action - word > TRIGGER_MAXLEN) {
+            snprintf(err, errlen, "\"%.*s\" is longer than %d characters", (int)(action - word), word, TRIGGER_MAXLEN);
+            return false;
+        }
+        if (!trigger_prefix[(unsigned char)*word]) {
+            snprintf(err, errlen, "\"%.*s\" does not start with an allowed prefix", (int)(action - word), word);
+            return false;
+        }
+        if (table->count == TRIGGER_MAX) {
+            snprintf(err, errlen, "no more than %d triggers", TRIGGER_MAX);
+            return false;
+        }
+
+        trigger = &table->triggers[table->count];
+        action++;
+        if ((size_t)(end - action) == 7 && !strncasecmp(action, "weather", 7)) {
+            trigger->forecast = false;
+        } else if ((size_t)(end - action) == 8 && !strncasecmp(action, "forecast", 8)) {
+            trigger->forecast = true;
+        } else {
+            snprintf(err, errlen, "\"%.*s\" is neither weather nor forecast", (int)(end - action), action);
+            return false;
+        }
+        trigger->len = action - 1 - word;
+        memcpy(trigger->word, word, trigger->len);
+        trigger->word[trigger->len] = '\0';
+        table->count++;
+    }
+
+    return true;
+}
+
+static void trigger_table_describe(const trigger_table_t *table, char *buf, size_t size) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (unsigned int i = 0; i < table->count && len < size; i++)
+        len += snprintf(buf + len, size - len, "%s%s=%s", i ? " " : "", table->triggers[i].word,
+                        table->triggers[i].forecast ? "forecast" : "weather");
+}
+
+static void trigger_channel_free(const char *key, void *data, void *privdata) {
+    if (data != &trigger_default)
+        free(data);
+}
+
+static void trigger_channel_forget(const char *channel) {
+    trigger_table_t *table = mowgli_patricia_delete(trigger_channels, channel);
+
+    if (table)
+        trigger_channel_free(channel, table, NULL);
+}
+
+static const trigger_table_t *trigger_table_for(const char *channel) {
+    trigger_table_t *table = mowgli_patricia_retrieve(trigger_channels, channel);
+    mychan_t *mc;
+    metadata_t *md;
+    char err[BUFSIZE];
+
+    if (table)
+        return table;
+
+    mc = mychan_find(channel);
+    md = mc ? metadata_find(mc, "private:weather:triggers") : NULL;
+    if (md && (table = malloc(sizeof(trigger_table_t))) != NULL && !trigger_table_compile(md->value, table, err, sizeof(err))) {
+        slog(LG_INFO, "weather: ignoring triggers for %s: %s", channel, err);
+        free(table);
+        table = NULL;
+    }
+    if (!table)
+        table = &trigger_default;
+
+    mowgli_patricia_add(trigger_channels, channel, table);
+    return table;
+}
+
+/* Rebuilds the prefix set and default table; channel tables are recompiled on next use. */
+static void triggers_configure(void *unused) {
+    const char *spec = trigger_spec && *trigger_spec ? trigger_spec : TRIGGER_DEFAULT;
+    char err[BUFSIZE];
+
+    memset(trigger_prefix, 0, sizeof(trigger_prefix));
+    for (const char *p = spec; *p; p++) {
+        if (p == spec || p[-1] == ' ')
+            trigger_prefix[(unsigned char)*p] = true;
+    }
+    trigger_prefix[(unsigned char)' '] = false;
+    for (const char *p = trigger_prefixes; p && *p; p++) {
+        if (*p != ' ')
+            trigger_prefix[(unsigned char)*p] = true;
+    }
+
+    if (!trigger_table_compile(spec, &trigger_default, err, sizeof(err))) {
+        slog(LG_ERROR, "weather: bad triggers setting, using the default: %s", err);
+        trigger_table_compile(TRIGGER_DEFAULT, &trigger_default, err, sizeof(err));
+    }
+
+    mowgli_patricia_destroy(trigger_channels, trigger_channel_free, NULL);
+    trigger_channels = mowgli_patricia_create(strcasecanon);
+}
+
+static void init_triggers(void) {
+    add_dupstr_conf_item("TRIGGERS", &weather->conf_table, 0, &trigger_spec, NULL);
+    add_dupstr_conf_item("TRIGGER_PREFIXES", &weather->conf_table, 0, &trigger_prefixes, NULL);
+    trigger_channels = mowgli_patricia_create(strcasecanon);
+    trigger_prefix[(unsigned char)'!'] = true;
+    triggers_configure(NULL);
+    hook_add_event("config_ready");
+    hook_add_config_ready(triggers_configure);
+}
+
+static void deinit_triggers(void) {
+    hook_del_config_ready(triggers_configure);
+    mowgli_patricia_destroy(trigger_channels, trigger_channel_free, NULL);
+    del_conf_item("TRIGGERS", &weather->conf_table);
+    del_conf_item("TRIGGER_PREFIXES", &weather->conf_table);
+    free(trigger_spec);
+    free(trigger_prefixes);
+    trigger_spec = trigger_prefixes = NULL;
+}
+
+static void ws_cmd_triggers(sourceinfo_t *si, int parc, char *parv[]) {
+    const char *channel = parv[0], *spec = parv[1];
+    trigger_table_t table;
+    char buf[BUFSIZE];
+    mychan_t *mc;
+
+    if (!channel) {
+        command_fail(si, fault_needmoreparams, _("Usage: TRIGGERS <#channel> [DEFAULT | trigger=weather|forecast ...]"));
+        return;
+    }
+
+    mc = mychan_find(channel);
+    if (!mc) {
+        command_fail(si, fault_nosuch_target, "%s is not registered.", channel);
+        return;
+    }
+
+    if (!spec) {
+        trigger_table_describe(trigger_table_for(channel), buf, sizeof(buf));
+        command_success_nodata(si, "Triggers for \2%s\2: %s", channel, buf);
+        return;
+    }
+
+    if (!chanacs_user_has_flag(mc, si->su, CA_SET) && !has_priv(si, PRIV_ADMIN)) {
+        command_fail(si, fault_noprivs, "You do not have access to change the triggers of %s.", channel);
+        return;
+    }
+
+    if (!strcasecmp(spec, "DEFAULT")) {
+        metadata_delete(mc, "private:weather:triggers");
+        trigger_channel_forget(channel);
+        trigger_table_describe(&trigger_default, buf, sizeof(buf));
+        command_success_nodata(si, "Triggers for \2%s\2 are back to the default: %s", channel, buf);
+        return;
+    }
+
+    if (!trigger_table_compile(spec, &table, buf, sizeof(buf))) {
+        command_fail(si, fault_badparams, "Invalid triggers: %s", buf);
+        return;
+    }
+
+    trigger_table_describe(&table, buf, sizeof(buf));
+    metadata_add(mc, "private:weather:triggers", buf);
+    trigger_channel_forget(channel);
+    command_success_nodata(si, "Triggers for \2%s\2 are now: %s", channel, buf);
+}
+
+static void on_channel_message(hook_cmessage_data_t *data) {
+    const char *line = data->msg;
+    const trigger_table_t *table;
+    const trigger_t *trigger = NULL;
+    const char *location, *error;
+    size_t len = 0;
+
+    /* almost every line is chat and stops here */
+    if (!line || !trigger_prefix[(unsigned char)line[0]]) {
+        return;
+    }
+
+    while (len <= TRIGGER_MAXLEN && line[len] && line[len] != ' ')
+        len++;
+    if (len > TRIGGER_MAXLEN) {
+        return;
+    }
+
+    table = trigger_table_for(data->c->name);
+    for (unsigned int i = 0; i < table->count; i++) {
+        if (table->triggers[i].len == len && !memcmp(table->triggers[i].word, line, len)) {
+            trigger = &table->triggers[i];
+            break;
+        }
+    }
+    if (!trigger) {
+        return;
+    }
+
+    location = line + len;
+    while (*location == ' ')
+        location++;
+
+    error = rate_limit_check(data->u, data->u->myuser, data->c);
+    if (error) {
+        notice(weather->nick, data->u->nick, "%s", error);
+        return;
+    }
+
+    weather_command_counts[trigger->forecast ? WEATHER_COMMAND_CHANNEL_FORECAST : WEATHER_COMMAND_CHANNEL_WEATHER]++;
+
+    if (!weather_request(WEATHER_REPLY_CHANNEL, data->c->name, data->u->myuser, location, trigger->forecast, false, &error)) {
+        msg(weather->nick, data->c->name, "%s", error);
+    }
+}
+
+
+/*
+ * Channel table persistence.
+ *
+ * The channels Weather was asked to JOIN live in a snapshot plus a
+ * journal in the data directory. JOIN and PART append one checksummed
+ * record to the current journal and sync it, so a change is on disk
+ * before the command answers. Once the journal outgrows the table a
+ * forked child writes a fresh snapshot (written aside, synced, renamed
+ * into place) while the parent carries on in the next journal.
+ *
+ * Every journal has a generation number, and a snapshot of generation G
+ * holds everything from journals before G. Loading maps the snapshot and
+ * replays the journals from G upward, so a crash at any point leaves
+ * either the old snapshot with all its journals or the new one with the
+ * journals it does not cover. A torn record at the end of a journal is
+ * where replay stops.
+ *
+ * File layout, all integers little-endian:
+ *   snapshot  "WXCH" u32 version u64 generation u32 count
+ *             count * { u16 len, channel, u16 len, requester } u32 crc32
+ *   journal   "WXCJ" u32 version u64 generation
+ *             records { u8 op, u16 len, channel, u16 len, requester, u32 crc32 }
+ */
+#define CHANNEL_DB_FILE DATADIR "/weather_channels.db"
+#define CHANNEL_DB_JOURNAL DATADIR "/weather_channels.%" PRIu64 ".journal"
+#define CHANNEL_DB_LEGACY "channel_table.db"
+#define CHANNEL_DB_MAGIC "WXCH"
+#define CHANNEL_DB_JOURNAL_MAGIC "WXCJ"
+#define CHANNEL_DB_VERSION 1
+#define CHANNEL_DB_COMPACT_MIN 256     /* journal records before compaction is considered */
+#define CHANNEL_DB_NAMELEN 512
+
+enum {
+    CHANNEL_DB_ADD = 1,
+    CHANNEL_DB_DEL = 2,
+};
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} channel_db_buf_t;
+
+static uint64_t channel_db_gen;        /* generation of the journal being appended to */
+static int channel_db_fd = -1;
+static unsigned int channel_db_records; /* records not yet folded into a snapshot */
+static pid_t channel_db_child;
+static uint64_t channel_db_child_gen;
+static bool channel_db_incomplete;      /* loading failed part way; the files are left alone */
+
+static uint32_t channel_db_crc(const unsigned char *p, size_t len) {
+    uint32_t crc = 0xffffffff;
+
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static bool channel_db_put(channel_db_buf_t *b, const void *p, size_t len) {
+    if (b->len + len > b->size) {
+        size_t size = b->size ? b->size * 2 : 4096;
+        unsigned char *data;
+
+        while (size < b->len + len)
+            size *= 2;
+        if ((data = realloc(b->data, size)) == NULL)
+            return false;
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+    return true;
+}
+
+static bool channel_db_put_uint(channel_db_buf_t *b, uint64_t v, size_t bytes) {
+    unsigned char le[8];
+
+    for (size_t i = 0; i < bytes; i++)
+        le[i] = (v >> (8 * i)) & 0xff;
+    return channel_db_put(b, le, bytes);
+}
+
+static bool channel_db_put_str(channel_db_buf_t *b, const char *s) {
+    size_t len = strlen(s);
+
+    if (len > CHANNEL_DB_NAMELEN)
+        len = CHANNEL_DB_NAMELEN;
+    return channel_db_put_uint(b, len, 2) && channel_db_put(b, s, len);
+}
+
+/* Reads a length-prefixed name that read_str() would have to truncate. */
+static bool channel_db_get_str(weather_reader_t *r, char *buf) {
+    uint16_t len = read_u16(r);
+    const unsigned char *s;
+
+    if (len > CHANNEL_DB_NAMELEN)
+        r->ok = false;
+    if ((s = read_bytes(r, len)) == NULL)
+        return false;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return true;
+}
+
+static bool channel_db_write_all(int fd, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Makes renames and newly created files in the data directory durable. */
+static void channel_db_sync_dir(void) {
+    int fd = open(DATADIR, O_RDONLY);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void *channel_db_map(const char *path, size_t *len) {
+    struct stat st;
+    void *image;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        *len = 0;
+        return NULL;
+    }
+
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return NULL;
+
+    *len = st.st_size;
+    return image;
+}
+
+/* Adds or updates a channel; false, with the table unchanged, if out of memory. */
+static bool channel_table_set(const char *channel, const char *requester) {
+    channel_info_t *ci = mowgli_patricia_retrieve(channel_table, channel);
+    char *copy;
+
+    if (ci) {
+        if ((copy = strdup(requester)) == NULL)
+            return false;
+        free(ci->requester);
+        ci->requester = copy;
+        return true;
+    }
+
+    if ((ci = calloc(1, sizeof(channel_info_t))) == NULL)
+        return false;
+    ci->channel = strdup(channel);
+    ci->requester = strdup(requester);
+    if (!ci->channel || !ci->requester) {
+        free(ci->channel);
+        free(ci->requester);
+        free(ci);
+        return false;
+    }
+    mowgli_patricia_add(channel_table, ci->channel, ci);
+    return true;
+}
+
+static void channel_table_unset(const char *channel) {
+    channel_info_t *ci = mowgli_patricia_delete(channel_table, channel);
+
+    if (ci)
+        channel_info_free(channel, ci, NULL);
+}
+
+/* Loads the snapshot into the table; false if there is one but it cannot be used. */
+static bool channel_db_load_snapshot(uint64_t *genp) {
+    size_t len = 0;
+    unsigned char *image = channel_db_map(CHANNEL_DB_FILE, &len);
+    weather_reader_t r = { image, image + len, image != NULL };
+    char channel[CHANNEL_DB_NAMELEN + 1], requester[CHANNEL_DB_NAMELEN + 1];
+    const unsigned char *magic;
+    uint64_t gen;
+    uint32_t version, count;
+
+    *genp = 0;
+    if (!image)
+        return true;
+
+    if (len < 4 || channel_db_crc(image, len - 4) != (uint32_t)(image[len - 4] | image[len - 3] << 8 | image[len - 2] << 16 | (uint32_t)image[len - 1] << 24)) {
+        slog(LG_ERROR, "weather: %s is damaged, not loading it", CHANNEL_DB_FILE);
+        munmap(image, len);
+        return false;
+    }
+    r.end -= 4;
+
+    magic = read_bytes(&r, 4);
+    version = read_u32(&r);
+    gen = read_u64(&r);
+    count = read_u32(&r);
+    if (!magic || memcmp(magic, CHANNEL_DB_MAGIC, 4) || version != CHANNEL_DB_VERSION) {
+        slog(LG_ERROR, "weather: ignoring %s: unknown format", CHANNEL_DB_FILE);
+        munmap(image, len);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count && r.ok; i++) {
+        if (channel_db_get_str(&r, channel) && channel_db_get_str(&r, requester) && !channel_table_set(channel, requester)) {
+            slog(LG_ERROR, "weather: out of memory loading %s after %u channels", CHANNEL_DB_FILE, i);
+            channel_db_incomplete = true;
+            break;
         }
+    }
+    if (!r.ok)
+        slog(LG_ERROR, "weather: %s is truncated", CHANNEL_DB_FILE);
 
-    metadata_t *md1;
-    md1 = metadata_find(si->smu, "private:weather:location");
-    if((md1 == NULL) && templocation == NULL) {
-        command_fail(si, fault_needmoreparams, _("No location was requested or use SETWEATHER to set default location."));
-        return;
-        }
-    metadata_t *md2 = metadata_find(si->smu, "private:weather:latlong");
-    metadata_t *md3 = metadata_find(si->smu, "private:weather:colors");
+    munmap(image, len);
+    *genp = gen;
+    return true;
+}
 
+/* The oldest journal on disk, for when there is no snapshot to say where to start. */
+static uint64_t channel_db_first_journal(void) {
+    DIR *dir = opendir(DATADIR);
+    struct dirent *de;
+    uint64_t first = UINT64_MAX, gen;
+    char tail[16];
 
-    char location[256];
-    char *latlong;
-    char *colors;
-    if (md1 != NULL) {
-            strcpy(location, md1->value);
+    if (!dir)
+        return 0;
+    while ((de = readdir(dir)) != NULL) {
+        if (sscanf(de->d_name, "weather_channels.%" SCNu64 ".%15s", &gen, tail) == 2 && !strcmp(tail, "journal") && gen < first)
+            first = gen;
     }
+    closedir(dir);
+    return first == UINT64_MAX ? 0 : first;
+}
 
-    if (md2 != NULL) {
-            latlong = md2->value;
-    }
+/* Applies the records of one journal; returns how many were good. */
+static unsigned int channel_db_replay(uint64_t gen) {
+    char path[BUFSIZE];
+    char channel[CHANNEL_DB_NAMELEN + 1], requester[CHANNEL_DB_NAMELEN + 1];
+    size_t len = 0;
+    unsigned char *image;
+    unsigned int records = 0;
 
-    if (md3 != NULL) {
-            colors = md3->value;
-    } else {
-            colors = "ON";
-    }
+    snprintf(path, sizeof(path), CHANNEL_DB_JOURNAL, gen);
+    if ((image = channel_db_map(path, &len)) == NULL)
+        return 0;
 
-    if (!templocation) {
-        if (location) {
-            weather_data = fetch_weather_data(location, latlong, 0);
-            slog(LG_DEBUG, weather_data);
-        }
-        if (colors && !strcasecmp(colors, "OFF")) {
-                remove_colors(weather_data);
-        } 
+    weather_reader_t r = { image, image + len, true };
+    const unsigned char *magic = read_bytes(&r, 4);
+    uint32_t version = read_u32(&r);
 
-        slog(LG_DEBUG, colors);
-        command_success_nodata(si, weather_data);
-           return;
-        }
+    if (!magic || memcmp(magic, CHANNEL_DB_JOURNAL_MAGIC, 4) || version != CHANNEL_DB_VERSION || read_u64(&r) != gen) {
+        slog(LG_ERROR, "weather: ignoring %s: unknown format", path);
+        munmap(image, len);
+        return 0;
+    }
 
-    if(md1 == NULL) {
-        command_fail(si, fault_needmoreparams, _("No location was requested or use SETWEATHER to set default location."));
-        return;
-        }
-    strcpy(location, templocation);
-    slog(LG_DEBUG, "%s %s", location, templocation);
-    replace_spaces_with_underscores(location);
-    OpenCage result = fetch_geocode_data(location);
-    slog(LG_DEBUG, result.location);
-    if (result.error_code == 0) {
-        weather_data = fetch_weather_data(result.location, result.latlong, 0);
-        if (colors && !strcasecmp(colors, "OFF")) {
-                remove_colors(weather_data);
+    while (r.ok && r.p < r.end) {
+        const unsigned char *start = r.p;
+        uint8_t op = *read_bytes(&r, 1);
+        uint32_t crc;
+
+        channel_db_get_str(&r, channel);
+        channel_db_get_str(&r, requester);
+        crc = r.ok ? channel_db_crc(start, r.p - start) : 0;
+        if (read_u32(&r) != crc || !r.ok) {
+            slog(LG_ERROR, "weather: %s ends in a damaged record at offset %zu, ignoring the rest", path, (size_t)(start - image));
+            break;
         }
 
-        command_success_nodata(si, weather_data);
-    } else {
-        command_success_nodata(si, "Error: %s", result.location);
+        if (op == CHANNEL_DB_ADD && !channel_table_set(channel, requester)) {
+            slog(LG_ERROR, "weather: out of memory replaying %s at offset %zu", path, (size_t)(start - image));
+            channel_db_incomplete = true;
+            break;
+        } else if (op == CHANNEL_DB_DEL)
+            channel_table_unset(channel);
+        records++;
     }
+
+    munmap(image, len);
+    return records;
 }
 
-static void ws_cmd_forecast(sourceinfo_t *si, int parc, char *parv[])
-{
-    const char *templocation = parv[0];
-    char *weather_data;
-    if (!check_rate_limit(si)) {
-        // Rate limit check failed
-        return;
-    }
-    if((si->smu == NULL) && templocation == NULL) {
-        command_fail(si, fault_needmoreparams, _("No location was requested or use SETWEATHER to set default location."));
-        return;
-    }
-    if (!templocation) {
-        const char *location;
-        const char *latlong;
-        metadata_t *md = metadata_find(si->smu, "private:weather:location");
-        if (md != NULL) {
-            location = md->value;
-            metadata_t *md = metadata_find(si->smu, "private:weather:latlong");
-            latlong = md->value;
-            weather_data = fetch_weather_data(location, latlong, 1);
-            const char *colors = metadata_find(si->smu, "private:weather:colors")->value;
-            if (colors && !strcasecmp(colors, "OFF")) {
-                  remove_colors(weather_data);
-            }
-            command_success_nodata(si, weather_data);
-            return;
-        } else {
-            command_fail(si, fault_needmoreparams, _("No location was requested or use SETWEATHER to set default location."));
-            return;
-        }
-    }
-    char location[256];
-    snprintf(location, sizeof(location), "%s", templocation);
-    replace_spaces_with_underscores(location);
-    OpenCage result = fetch_geocode_data(location);
-    if (result.error_code == 0) {
-        weather_data = fetch_weather_data(result.location, result.latlong, 1);
-        const char *colors = metadata_find(si->smu, "private:weather:colors")->value;
-        if (colors && !strcasecmp(colors, "OFF")) {
-                remove_colors(weather_data);
-        }
-        command_success_nodata(si, weather_data);
-    } else {
-        command_success_nodata(si, "Error: %s", result.location);
+/* Removes journals below gen, which a snapshot of that generation covers. */
+static void channel_db_prune(uint64_t gen) {
+    char path[BUFSIZE];
+
+    for (uint64_t old = gen; old-- > 0;) {
+        snprintf(path, sizeof(path), CHANNEL_DB_JOURNAL, old);
+        if (unlink(path) < 0 && errno == ENOENT && old + 1 < gen)
+            break;
     }
 }
 
-static void ws_cmd_setweather(sourceinfo_t *si, int parc, char *parv[])
-{
-    const char *templocation = parv[0];
-    char location[256];
-    if (!check_rate_limit(si)) {
-        // Rate limit check failed
-        return;
+static int channel_db_open_journal(uint64_t gen) {
+    char path[BUFSIZE];
+    channel_db_buf_t b = { 0 };
+    int fd;
+
+    snprintf(path, sizeof(path), CHANNEL_DB_JOURNAL, gen);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd < 0) {
+        slog(LG_ERROR, "weather: cannot create %s: %s", path, strerror(errno));
+        return -1;
     }
-    snprintf(location, sizeof(location), "%s", templocation);
 
-    if (!location) {
-        command_fail(si, fault_needmoreparams, _("Usage: SETWEATHER <location>"));
-        return;
+    channel_db_put(&b, CHANNEL_DB_JOURNAL_MAGIC, 4);
+    channel_db_put_uint(&b, CHANNEL_DB_VERSION, 4);
+    channel_db_put_uint(&b, gen, 8);
+    if (!b.data || !channel_db_write_all(fd, b.data, b.len) || fdatasync(fd) < 0) {
+        slog(LG_ERROR, "weather: cannot write %s: %s", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        free(b.data);
+        return -1;
     }
-    replace_spaces_with_underscores(location);
 
-    OpenCage result = fetch_geocode_data(location);
-    if (result.error_code == 0) {
-        command_success_nodata(si, "The following location was set \2%s\2", result.location);
-        metadata_add(si->smu, "private:weather:location", result.location);
-        metadata_add(si->smu, "private:weather:latlong", result.latlong);
-    } else {
-        command_success_nodata(si, "\2Error:\2 %s\2", result.location);
+    free(b.data);
+    channel_db_sync_dir();
+    return fd;
+}
+
+/* Runs in the compaction child: writes the table as a snapshot of generation gen. */
+static bool channel_db_write_snapshot(uint64_t gen) {
+    char tmpname[BUFSIZE];
+    channel_db_buf_t b = { 0 };
+    mowgli_patricia_iteration_state_t state;
+    channel_info_t *ci;
+    bool ok;
+    int fd;
+
+    ok = channel_db_put(&b, CHANNEL_DB_MAGIC, 4) &&
+        channel_db_put_uint(&b, CHANNEL_DB_VERSION, 4) &&
+        channel_db_put_uint(&b, gen, 8) &&
+        channel_db_put_uint(&b, mowgli_patricia_size(channel_table), 4);
+    MOWGLI_PATRICIA_FOREACH(ci, &state, channel_table) {
+        ok = ok && channel_db_put_str(&b, ci->channel) && channel_db_put_str(&b, ci->requester);
     }
-    /* Let's avoid nulls */
-    metadata_t *md1 = metadata_find(si->smu, "private:weather:greet");
-    if (md1 == NULL) {
-       metadata_add(si->smu, "private:weather:greet", "ON");
+    ok = ok && channel_db_put_uint(&b, channel_db_crc(b.data, b.len), 4);
+    if (!ok) {
+        free(b.data);
+        return false;
     }
-    metadata_t *md2 = metadata_find(si->smu, "private:weather:colors");
-    if (md2 == NULL) {
-       metadata_add(si->smu, "private:weather:colors", "ON");
+
+    snprintf(tmpname, sizeof(tmpname), "%s.new", CHANNEL_DB_FILE);
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ok = fd >= 0 && channel_db_write_all(fd, b.data, b.len) && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    free(b.data);
+
+    if (!ok || rename(tmpname, CHANNEL_DB_FILE) < 0) {
+        unlink(tmpname);
+        return false;
     }
 
+    channel_db_sync_dir();
+    return true;
 }
 
-static void ws_cmd_setgreet(sourceinfo_t *si, int parc, char *parv[])
-{
-    const char *option = parv[0];
+static void channel_db_compacted(pid_t pid, int status, void *data) {
+    channel_db_child = 0;
 
-    if (!option) {
-        command_fail(si, fault_needmoreparams, _("Usage: SETGREET <ON|OFF>"));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        slog(LG_ERROR, "weather: writing %s failed, the journal is kept", CHANNEL_DB_FILE);
         return;
     }
 
-    if (strcasecmp(option, "ON") == 0) {
-        metadata_add(si->smu, "private:weather:greet", "ON");
-        command_success_nodata(si, _("Weather greeting enabled."));
-    } else if (strcasecmp(option, "OFF") == 0) {
-        metadata_delete(si->smu, "private:weather:greet");
-        command_success_nodata(si, _("Weather greeting disabled."));
-    } else {
-        command_fail(si, fault_badparams, _("Usage: SETGREET <ON|OFF>"));
-    }
+    channel_db_prune(channel_db_child_gen);
+    slog(LG_DEBUG, "weather: compacted the channel table into generation %" PRIu64, channel_db_child_gen);
 }
 
-static void ws_cmd_setcolors(sourceinfo_t *si, int parc, char *parv[])
-{
-    const char *option = parv[0];
+/* Moves on to a new journal and has a child write the table behind it. */
+static void channel_db_compact(void) {
+    int fd;
+    pid_t pid;
 
-    if (!option) {
-        command_fail(si, fault_needmoreparams, _("Usage: SETCOLOR <ON|OFF>"));
+    if (channel_db_child)
         return;
-    }
 
-    if (strcasecmp(option, "ON") == 0) {
-        metadata_add(si->smu, "private:weather:colors", "ON");
-        command_success_nodata(si, _("Weather colors enabled."));
-    } else if (strcasecmp(option, "OFF") == 0) {
-        metadata_add(si->smu, "private:weather:colors", "OFF");
-        command_success_nodata(si, _("Weather colors disabled."));
-    } else {
-        command_fail(si, fault_badparams, _("Usage: SETCOLORS <ON|OFF>"));
+    if ((fd = channel_db_open_journal(channel_db_gen + 1)) < 0)
+        return;
+
+    pid = fork();
+    if (pid < 0) {
+        char path[BUFSIZE];
+
+        slog(LG_ERROR, "weather: cannot fork to compact the channel table: %s", strerror(errno));
+        close(fd);
+        snprintf(path, sizeof(path), CHANNEL_DB_JOURNAL, channel_db_gen + 1);
+        unlink(path);
+        return;
     }
+    if (pid == 0)
+        _exit(channel_db_write_snapshot(channel_db_gen + 1) ? 0 : 1);
+
+    if (channel_db_fd >= 0)
+        close(channel_db_fd);
+    channel_db_fd = fd;
+    channel_db_gen++;
+    channel_db_records = 0;
+    channel_db_child = pid;
+    channel_db_child_gen = channel_db_gen;
+    childproc_add(pid, "weather channel table", channel_db_compacted, NULL);
 }
 
-static void on_user_identify(user_t *u)
-{
-    char *colors;
-    char *greet;
-    /* If the greet is null lets do nothing */
-    metadata_t *md1 = metadata_find(u->myuser, "private:weather:greet");
-    if (md1 == NULL) {
-         return;
-    } else {
-       greet = md1->value;
-    }
-    /* If no color is set, lets keep it on */
-    metadata_t *md2 = metadata_find(u->myuser, "private:weather:colors");
-    if (md2 != NULL) {
-        colors = md2->value;
-    } else {
-        colors = "ON";
+/*
+ * Records a JOIN (requester set) or PART (requester NULL) in the journal,
+ * before the table is changed; false if it could not be made durable.  A
+ * failed write is cut back off the journal so later records still replay;
+ * if even that fails the journal is abandoned and the next append moves
+ * on to a new generation.
+ */
+static bool channel_db_append(const char *channel, const char *requester) {
+    channel_db_buf_t b = { 0 };
+    off_t offset;
+    bool ok;
+
+    if (channel_db_fd < 0 && !channel_db_incomplete)
+        channel_db_compact();
+    if (channel_db_fd < 0)
+        return false;
 
+    if ((offset = lseek(channel_db_fd, 0, SEEK_END)) < 0) {
+        slog(LG_ERROR, "weather: cannot record %s in the channel journal: %s", channel, strerror(errno));
+        return false;
     }
-    if (greet && !strcasecmp(greet, "ON")) {
-        const char *location = metadata_find(u->myuser, "private:weather:location")->value;
-        const char *latlong = metadata_find(u->myuser, "private:weather:latlong")->value;
-        /* Greet is on but let's not assume a location is set */
-        if (location) {
-            char *weather_data = fetch_weather_data(location, latlong, 0);
-            if (colors && !strcasecmp(colors, "OFF")) {
-                remove_colors(weather_data);
-            }
-            if (weather_data) {
-                notice("Weather", u->nick, weather_data);
-            } else {
-                notice("Weather", u->nick, _("Failed to fetch weather data."));
-            }
+
+    ok = channel_db_put_uint(&b, requester ? CHANNEL_DB_ADD : CHANNEL_DB_DEL, 1) &&
+        channel_db_put_str(&b, channel) &&
+        channel_db_put_str(&b, requester ? requester : "") &&
+        channel_db_put_uint(&b, channel_db_crc(b.data, b.len), 4);
+    if (ok && (!channel_db_write_all(channel_db_fd, b.data, b.len) || fdatasync(channel_db_fd) < 0)) {
+        slog(LG_ERROR, "weather: cannot record %s in the channel journal: %s", channel, strerror(errno));
+        if (ftruncate(channel_db_fd, offset) < 0 || fdatasync(channel_db_fd) < 0) {
+            slog(LG_ERROR, "weather: cannot repair the channel journal, starting a new one: %s", strerror(errno));
+            close(channel_db_fd);
+            channel_db_fd = -1;
         }
+        ok = false;
     }
+    free(b.data);
+
+    if (ok)
+        channel_db_records++;
+    return ok;
 }
 
+/* Once the table has changed, compacts when the journal has outgrown it. */
+static void channel_db_changed(void) {
+    if (channel_db_records >= CHANNEL_DB_COMPACT_MIN && channel_db_records >= mowgli_patricia_size(channel_table))
+        channel_db_compact();
+}
 
-static void ws_cmd_setratelimit(sourceinfo_t *si, int parc, char *parv[]) {
-    const char *value = parv[0];
+/*
+ * Reads channel_table.db as written by older versions (native size_t
+ * lengths, no header) from the working directory.  Returns how many
+ * channels it added, or 0 if it ran out of memory part way.
+ */
+static unsigned int channel_db_import_legacy(void) {
+    size_t len = 0;
+    unsigned char *image = channel_db_map(CHANNEL_DB_LEGACY, &len);
+    const unsigned char *p = image, *end = image + len;
+    unsigned int imported = 0;
+
+    if (!image)
+        return 0;
 
-    // Ensure the command is issued by a priv_admin
-    if (!has_priv(si, PRIV_ADMIN)) {
-        command_fail(si, fault_noprivs, _("You do not have the required privileges to use this command."));
-        return;
-    }
+    while ((size_t)(end - p) >= sizeof(size_t)) {
+        const char *fields[2];
+        size_t flen;
+        int i;
+
+        for (i = 0; i < 2; i++) {
+            if ((size_t)(end - p) < sizeof(size_t))
+                break;
+            memcpy(&flen, p, sizeof(size_t));
+            p += sizeof(size_t);
+            if (flen == 0 || flen > CHANNEL_DB_NAMELEN + 1 || (size_t)(end - p) < flen || p[flen - 1] != '\0')
+                break;
+            fields[i] = (const char *)p;
+            p += flen;
+        }
+        if (i < 2) {
+            slog(LG_ERROR, "weather: %s is damaged after %u channels", CHANNEL_DB_LEGACY, imported);
+            break;
+        }
 
-    if (!value) {
-        command_fail(si, fault_needmoreparams, _("Usage: SETRATELIMIT <value>"));
-        return;
-    }
-    char *endptr;
-    errno = 0;
-    long the_limit = strtol(value, &endptr, 10);
-    if (errno != 0 || *endptr != '\0' || the_limit < 0 || the_limit > INT_MAX) {
-        command_fail(si, fault_badparams, _("Invalid rate limit value. Please provide a positive integer."));
-        return;
+        if (!channel_table_set(fields[0], fields[1])) {
+            slog(LG_ERROR, "weather: out of memory importing %s after %u channels", CHANNEL_DB_LEGACY, imported);
+            channel_db_incomplete = true;
+            imported = 0;
+            break;
+        }
+        imported++;
     }
-    static char output[OUTPUT_SIZE] = "";
-    set_limit.hitvalue = atoi(value);
-    snprintf(output, sizeof(output), "Global rate limit is now %d hits per minute", set_limit.hitvalue);
-    command_success_nodata(si, output);
-}
 
+    munmap(image, len);
+    return imported;
+}
 
+static void load_channel_table(void) {
+    uint64_t gen;
+    unsigned int replayed = 0, last = UINT_MAX;    /* records in the newest journal */
+    struct stat st;
+    char path[BUFSIZE];
 
-static char* fetch_weather_data(const char *location, const char *latlong, int forecast) {
-    CURL *curl;
-    CURLcode res;
-    MemoryStruct chunk;
-    chunk.memory = malloc(1);
-    chunk.size = 0;
-    slog(LG_DEBUG, "Fetching weather! BARK! BARK!");
-    if (!chunk.memory) {
-        slog(LG_DEBUG, "Memory allocation failed\n");
-        return NULL;
+    if (!channel_db_load_snapshot(&gen)) {
+        snprintf(path, sizeof(path), "%s.damaged", CHANNEL_DB_FILE);
+        rename(CHANNEL_DB_FILE, path);
+        gen = channel_db_first_journal();
     }
 
-    static char output[OUTPUT_SIZE] = "";
-    char out[100] = "";
-    snprintf(output, sizeof(output), "\2%s\2 :: ",location);
+    /* journals are numbered consecutively from the snapshot's generation */
+    for (; !channel_db_incomplete; gen++) {
+        snprintf(path, sizeof(path), CHANNEL_DB_JOURNAL, gen);
+        if (stat(path, &st) < 0)
+            break;
+        last = channel_db_replay(gen);
+        replayed += last;
+    }
 
-    curl_global_init(CURL_GLOBAL_ALL);
+    /* an empty last journal is started afresh rather than left behind */
+    if (last == 0)
+        gen--;
 
-    curl = curl_easy_init();
-    if (curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "%s/%s/%s", PIRATE_URL, PIRATE_KEY, latlong);
-        slog(LG_DEBUG, url);
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, weather_write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        res = curl_easy_perform(curl);
-        slog(LG_DEBUG, "CURL");
-        if (res != CURLE_OK) {
-            snprintf(chunk.memory, chunk.size, "Failed to fetch weather data: %s", curl_easy_strerror(res));
-            slog(LG_DEBUG, "Failed to fetch weather data: %s", curl_easy_strerror(res));
-            curl_easy_cleanup(curl);
-            free(chunk.memory);
-            curl_global_cleanup();
-            return chunk.memory;
+    /* the old file is only renamed once a snapshot holds what it had */
+    if (!channel_db_incomplete && gen == 0 && mowgli_patricia_size(channel_table) == 0 && channel_db_import_legacy() > 0) {
+        if (channel_db_write_snapshot(gen + 1)) {
+            gen++;
+            rename(CHANNEL_DB_LEGACY, CHANNEL_DB_LEGACY ".imported");
+            slog(LG_INFO, "weather: imported %u channels from %s", mowgli_patricia_size(channel_table), CHANNEL_DB_LEGACY);
+        } else {
+            slog(LG_ERROR, "weather: cannot write %s: %s", CHANNEL_DB_FILE, strerror(errno));
         }
-        curl_easy_cleanup(curl);
-    } else {
-        snprintf(output, sizeof(output), "curl_easy_init failed!");
-        slog(LG_DEBUG, output);
-        free(chunk.memory);
-        curl_global_cleanup();
-        return strdup(output);
-    }
-    slog(LG_DEBUG, "CURL GOOD");
-    json_t *wroot;
-    json_error_t werror;
-
-    wroot = json_loads(chunk.memory, 0, &werror);
-    slog(LG_DEBUG, "WROOT!");
-    if (!wroot) {
-        slog(LG_DEBUG, "Error parsing JSON data: %s\n", werror.text);
-        free(chunk.memory);
-        curl_global_cleanup();
-        return NULL;
     }
 
-    json_t *wresults = json_object_get(wroot, "currently");
-    if (!wresults) {
-        slog(LG_DEBUG, "Error retrieving 'currently' from JSON data.\n");
-        json_decref(wroot);
-        free(chunk.memory);
-        curl_global_cleanup();
-        return NULL;
+    /* a partial table must not be compacted over the files that hold the rest */
+    if (channel_db_incomplete) {
+        slog(LG_ERROR, "weather: the channel table is incomplete, JOIN and PART will not be saved until the module is reloaded");
+        return;
     }
 
-    const char *wtype = json_string_value(json_object_get(wresults, "summary"));
-    if (wtype) {
-        snprintf(out, sizeof(out), "%s ", wtype);
-        strncat(output, out, sizeof(output) - strlen(output) - 1);
-    }
-
-    double ftemp = json_number_value(json_object_get(wresults, "temperature"));
-    double ctemp = (ftemp - 32) * 5 / 9;
-
-    char temp_buffer[50];
-    format_temp("F/C", ftemp, ctemp, temp_buffer, sizeof(temp_buffer));
-    snprintf(out, sizeof(out), "%s", temp_buffer);
-    strncat(output, out, sizeof(output) - strlen(output) - 1);
-
-    double aftemp = json_number_value(json_object_get(wresults, "apparentTemperature"));
-    double actemp = (aftemp - 32) * 5 / 9;
-
-    format_temp("F/C", aftemp, actemp, temp_buffer, sizeof(temp_buffer));
-    snprintf(out, sizeof(out), " | \2Feels Like\2: %s", temp_buffer);
-    strncat(output, out, sizeof(output) - strlen(output) - 1);
-
-    double whumid = json_number_value(json_object_get(wresults, "humidity"));
-    snprintf(out, sizeof(out), " | \2Humidity\2: %.0f%%", whumid * 100);
-    strncat(output, out, sizeof(output) - strlen(output) - 1);
-
-    double wwind = json_number_value(json_object_get(wresults, "windSpeed"));
-    double wwind_dir = json_number_value(json_object_get(wresults, "windBearing"));
-    double gwind = json_number_value(json_object_get(wresults, "windGust"));
-    double wkwind = wwind * 1.60934;
-    double gkwind = gwind * 1.60934;
-    snprintf(out, sizeof(out), " | \2Wind\2: %.1fmph/%.1fkm/h %s \2Gust\2: %.1fmph/%.1fkm/h", wwind, wkwind, wind_direction((int)wwind_dir), gwind, gkwind);
-    strncat(output, out, sizeof(output) - strlen(output) - 1);
-
-    double wdew = json_number_value(json_object_get(wresults, "dewPoint"));
-    snprintf(out, sizeof(out), " | \2Dew\2: %.0f°", wdew);
-    strncat(output, out, sizeof(output) - strlen(output) - 1);
-
-    double wuv = json_number_value(json_object_get(wresults, "uvIndex"));
-    char* color;
-    const char* risk = format_uv(wuv, &color);
-    snprintf(out, sizeof(out), " | \2UV Index\2: %.1f \2Risk\2: %s%s\017", wuv, color, risk);
-    strncat(output, out, sizeof(output) - strlen(output) - 1);
-
-    struct tm *risetimeinfo;
-    struct tm *settimeinfo;
-    char rise_buffer[20];
-    char set_buffer[20];
-    setenv("TZ", "America/New_York", 1);
-    tzset();
-
-    json_t *daily = json_object_get(wroot, "daily");
-    json_t *dailydate = json_object_get(daily, "data");
-    json_t *today = json_array_get(dailydate, 0);
-
-    int sunrise = json_integer_value(json_object_get(today, "sunriseTime"));
-    int sunset = json_integer_value(json_object_get(today, "sunsetTime"));
-
-    time_t sunset_time = sunset;
-    settimeinfo = convert_to_eastern_time(sunset_time);
-    strftime(set_buffer, sizeof(set_buffer), "%I:%M %p %Z", settimeinfo);
-
-    time_t sunrise_time = sunrise;
-    risetimeinfo = convert_to_eastern_time(sunrise_time);
-    strftime(rise_buffer, sizeof(rise_buffer), "%I:%M %p %Z", risetimeinfo);
-    snprintf(out, sizeof(out), " | \2Sunrise\2: %s \2Sunset\2: %s", rise_buffer, set_buffer);
-    strncat(output, out, sizeof(output) - strlen(output) - 1);
-
-    slog(LG_DEBUG, "MADE IT HERE!");
-    size_t index;
-    json_t *value;
-    time_t current_time = time(NULL);
-    struct tm *ctimeinfo;
-    char cdate_buffer[11];
-    char ncdate_buffer[11];
-    ctimeinfo = convert_to_eastern_time(current_time);
-    strftime(cdate_buffer, sizeof(cdate_buffer), "%Y-%m-%d", ctimeinfo);
-
-    char foutput[FORECAST_SIZE] = "";
-    char fout[250] = "";
-
-    int element_count = 0;
-    char low_temp_buffer[500];
-    char high_temp_buffer[500];
-
-    if (forecast == 1) {
-        snprintf(fout, sizeof(fout), "\2%s\2 :: Forecast",location);
-        strcat(foutput, fout);
-    }
-    json_array_foreach(dailydate, index, value) {
-        if (forecast == 0 && element_count >= 3) {
-            break;
-        }
-
-        int date = json_integer_value(json_object_get(value, "time"));
-        const char *nwtype = json_string_value(json_object_get(value, "summary"));
-        double nwtempH = json_number_value(json_object_get(value, "temperatureHigh"));
-        double nwtempL = json_number_value(json_object_get(value, "temperatureLow"));
-        double nctempH = (nwtempH - 32) * 5 / 9;
-        double nctempL = (nwtempL - 32) * 5 / 9;
-        time_t newdate = date;
-        struct tm *newdateinfo = gmtime(&newdate);
-        char date_buffer[20];
-        strftime(ncdate_buffer, sizeof(ncdate_buffer), "%Y-%m-%d", newdateinfo);
-        if (strcmp(cdate_buffer, ncdate_buffer) != 0) {
-            if (forecast == 0) {
-                strftime(date_buffer, sizeof(date_buffer), "%a", newdateinfo);
-            } else {
-                strftime(date_buffer, sizeof(date_buffer), "%A", newdateinfo);
-            }
-            format_temp("L", nwtempL, nctempL, low_temp_buffer, sizeof(low_temp_buffer));
-            format_temp("H", nwtempH, nctempH, high_temp_buffer, sizeof(high_temp_buffer));
-            snprintf(fout, sizeof(fout), " | \2%s\2: %s %s %s", date_buffer, nwtype, low_temp_buffer, high_temp_buffer);
-            strncat(foutput, fout, sizeof(foutput) - strlen(foutput) - 1);
-        }
+    channel_db_gen = gen;
+    channel_db_fd = channel_db_open_journal(gen);
+    channel_db_records = replayed;
 
-        element_count++;
-    }
+    slog(LG_DEBUG, "weather: loaded %u channels (%u journal records)", mowgli_patricia_size(channel_table), replayed);
+    if (channel_db_records > 0)
+        channel_db_compact();
+}
 
+static void close_channel_table(void) {
+    childproc_delete_all(channel_db_compacted);
+    channel_db_child = 0;
+    if (channel_db_fd >= 0)
+        close(channel_db_fd);
+    channel_db_fd = -1;
+}
 
-    json_decref(wroot);
-    free(chunk.memory);
+/*
+ * Join scheduler.
+ *
+ * CYCLE and the rejoin at load hand every stored channel to a queue that
+ * a timer drains at join_rate channels per second, so a large table does
+ * not flood the uplink. A channel the bot already sits in is skipped. A
+ * join is checked JOIN_VERIFY seconds later; if the bot is not there (a
+ * ban or kick), it is tried again after a doubling delay, up to
+ * JOIN_RETRIES times.
+ */
+#define JOIN_RATE 5             /* joins per second */
+#define JOIN_VERIFY 30
+#define JOIN_RETRY_DELAY 60
+#define JOIN_RETRIES 4
+
+typedef enum {
+    JOIN_QUEUED,                /* in join_ready */
+    JOIN_SENT,                  /* in join_waiting until verified */
+    JOIN_BACKOFF,               /* in join_waiting until retried */
+} join_state_t;
 
-    curl_global_cleanup();
+typedef struct {
+    char channel[CHANNEL_DB_NAMELEN + 1];
+    join_state_t state;
+    unsigned int attempts;
+    time_t due;
+    mowgli_node_t node;
+} join_t;
+
+static mowgli_patricia_t *join_jobs;   /* channel -> join_t */
+static mowgli_list_t join_ready;
+static mowgli_list_t join_waiting;
+static mowgli_eventloop_timer_t *join_timer;
+static unsigned int join_rate = JOIN_RATE;
+static char join_requester[NICKLEN + 1];   /* told when the run is over */
+static unsigned int join_total, join_joined, join_skipped, join_failed, join_retries;
+
+static void join_run(void *arg);
+
+static bool join_present(const char *channel) {
+    channel_t *c = channel_find(channel);
+
+    return c && weather->me && chanuser_find(c, weather->me);
+}
 
-    if (forecast == 1) {
-       char *final_output = malloc(strlen(foutput) + 1);
-       strcpy(final_output, foutput);
-       return final_output;
-       }
-    slog(LG_DEBUG, "AT FINAL!");
-    slog(LG_DEBUG, output);
-    slog(LG_DEBUG, foutput);
-    // Combine output and foutput into one string
-    char *final_output = malloc(strlen(output) + strlen(foutput) + 1);
-    if (final_output) {
-        strcpy(final_output, output);
-        strcat(final_output, foutput);
-    }
+static void join_free(join_t *job, mowgli_list_t *list) {
+    mowgli_patricia_delete(join_jobs, job->channel);
+    mowgli_node_delete(&job->node, list);
+    free(job);
+}
 
-    return final_output;  // Return the combined string
-    slog(LG_DEBUG, final_output);
+static void join_progress(char *buf, size_t size) {
+    snprintf(buf, size, "%u of %u channels done: %u joined, %u already joined, %u failed, %u retries, %u waiting",
+        join_joined + join_skipped + join_failed, join_total, join_joined, join_skipped, join_failed, join_retries,
+        mowgli_patricia_size(join_jobs));
 }
 
+static void join_run(void *arg) {
+    mowgli_node_t *n, *tn;
+    unsigned int joins = join_rate;
+    time_t now = CURRTIME;
+    char buf[BUFSIZE];
+
+    if (!me.connected)
+        return;
 
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, join_waiting.head) {
+        join_t *job = n->data;
 
-// Hook function to handle channel messages
-static void on_channel_message(hook_cmessage_data_t *data) {
-    if (data->msg && (strncmp(data->msg, "!weather", 8) == 0 || strncmp(data->msg, "!w", 2) == 0)) {
-
-       const char *input = data->msg;
-       char command[256];
-       char templocation[256];
- 
-       split_command_location(input, command, templocation);
-       size_t length = strlen(templocation);
-    if (length == 0) {
-        strcpy(templocation, "False");
-    }
-
-    char *weather_data;
-
-    if (strcmp(templocation, "False") == 0) {
-    	if(data->u->myuser == NULL) {
-        	msg("Weather", data->c->name, "No location was requested or use SETWEATHER to set default location.");
-	        return;
-        }
-        const char *location;
-        const char *latlong;
-        metadata_t *md = metadata_find(data->u->myuser, "private:weather:location");
-        if (md != NULL) {
-            location = md->value;
-            metadata_t *md = metadata_find(data->u->myuser, "private:weather:latlong");
-            latlong = md->value;
-            weather_data = fetch_weather_data(location, latlong, 0);
-            const char *colors = metadata_find(data->u->myuser, "private:weather:colors")->value;
-            if (colors && !strcasecmp(colors, "OFF")) {
-                  remove_colors(weather_data);
+        if (job->due > now)
+            continue;
+
+        if (job->state == JOIN_SENT) {
+            if (join_present(job->channel)) {
+                join_joined++;
+                join_free(job, &join_waiting);
+                continue;
             }
-            msg("Weather", data->c->name, weather_data);
-            return;
-        } else {
-            msg("Weather", data->c->name, "No location was requested or use SETWEATHER to set default location.");
-            return;
+            if (++job->attempts > JOIN_RETRIES) {
+                slog(LG_INFO, "weather: giving up joining %s after %u attempts", job->channel, job->attempts);
+                join_failed++;
+                join_free(job, &join_waiting);
+                continue;
+            }
+            job->state = JOIN_BACKOFF;
+            job->due = now + ((time_t)JOIN_RETRY_DELAY << (job->attempts - 1));
+            continue;
         }
-    }
-    char location[256];
-    snprintf(location, sizeof(location), "%s", templocation);
-    replace_spaces_with_underscores(location);
-    OpenCage result = fetch_geocode_data(location);
-    if (result.error_code == 0) {
-        weather_data = fetch_weather_data(result.location, result.latlong, 0);
-        const char *colors = metadata_find(data->u->myuser, "private:weather:colors")->value;
-        if (colors && !strcasecmp(colors, "OFF")) {
-                remove_colors(weather_data);
-        }
-        msg("Weather", data->c->name, weather_data);
-    } else {
-        msg("Weather", data->c->name, "Error: %s", result.location);
-    }
-    }
-    if (data->msg && (strncmp(data->msg, "!forecast", 8) == 0 || strncmp(data->msg, "!f", 2) == 0)) {
 
-       const char *input = data->msg;
-       char command[256];
-       char templocation[256];
-
-       split_command_location(input, command, templocation);
-       size_t length = strlen(templocation);
-    if (length == 0) {
-        strcpy(templocation, "False");
+        job->state = JOIN_QUEUED;
+        join_retries++;
+        mowgli_node_delete(&job->node, &join_waiting);
+        mowgli_node_add(job, &job->node, &join_ready);
     }
 
-    char *weather_data;
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, join_ready.head) {
+        join_t *job = n->data;
 
-    if (strcmp(templocation, "False") == 0) {
-        if(data->u->myuser == NULL) {
-                msg("Weather", data->c->name, "No location was requested or use SETWEATHER to set default location.");
-                return;
-        }
-        const char *location;
-        const char *latlong;
-        metadata_t *md = metadata_find(data->u->myuser, "private:weather:location");
-        if (md != NULL) {
-            location = md->value;
-            metadata_t *md = metadata_find(data->u->myuser, "private:weather:latlong");
-            latlong = md->value;
-            weather_data = fetch_weather_data(location, latlong, 1);
-            const char *colors = metadata_find(data->u->myuser, "private:weather:colors")->value;
-            if (colors && !strcasecmp(colors, "OFF")) {
-                  remove_colors(weather_data);
-            }
-            msg("Weather", data->c->name, weather_data);
-            return;
-        } else {
-            msg("Weather", data->c->name, "No location was requested or use SETWEATHER to set default location.");
-            return;
+        if (join_present(job->channel)) {
+            if (job->attempts)
+                join_joined++;
+            else
+                join_skipped++;
+            join_free(job, &join_ready);
+            continue;
         }
+        if (!joins)
+            break;
+
+        join(job->channel, weather->nick);
+        joins--;
+        job->state = JOIN_SENT;
+        job->due = now + JOIN_VERIFY;
+        mowgli_node_delete(&job->node, &join_ready);
+        mowgli_node_add(job, &job->node, &join_waiting);
     }
-    char location[256];
-    snprintf(location, sizeof(location), "%s", templocation);
-    replace_spaces_with_underscores(location);
-    OpenCage result = fetch_geocode_data(location);
-    if (result.error_code == 0) {
-        weather_data = fetch_weather_data(result.location, result.latlong, 1);
-        const char *colors = metadata_find(data->u->myuser, "private:weather:colors")->value;
-        if (colors && !strcasecmp(colors, "OFF")) {
-                remove_colors(weather_data);
-        }
-        msg("Weather", data->c->name, weather_data);
-    } else {
-        msg("Weather", data->c->name, "Error: %s", result.location);
-    }
+
+    if (join_ready.head || join_waiting.head)
+        return;
+
+    join_progress(buf, sizeof(buf));
+    slog(LG_INFO, "weather: channel joins finished, %s", buf);
+    if (*join_requester && user_find_named(join_requester))
+        notice(weather->nick, join_requester, "Cycle complete. %s", buf);
+    join_requester[0] = '\0';
+
+    mowgli_timer_destroy(base_eventloop, join_timer);
+    join_timer = NULL;
+}
+
+/* Queues every stored channel not already queued; returns how many were added. */
+static unsigned int join_schedule_all(void) {
+    mowgli_patricia_iteration_state_t state;
+    channel_info_t *ci;
+    unsigned int added = 0;
+
+    if (!join_timer)
+        join_total = join_joined = join_skipped = join_failed = join_retries = 0;
+
+    MOWGLI_PATRICIA_FOREACH(ci, &state, channel_table) {
+        join_t *job;
+
+        if (mowgli_patricia_retrieve(join_jobs, ci->channel) || (job = calloc(1, sizeof(join_t))) == NULL)
+            continue;
+        mowgli_strlcpy(job->channel, ci->channel, sizeof(job->channel));
+        job->state = JOIN_QUEUED;
+        mowgli_patricia_add(join_jobs, job->channel, job);
+        mowgli_node_add(job, &job->node, &join_ready);
+        added++;
     }
 
+    join_total += added;
+    if (!join_timer && (join_ready.head || join_waiting.head))
+        join_timer = mowgli_timer_add(base_eventloop, "join_run", join_run, NULL, 1);
+    return added;
+}
+
+/* A PART while the channel is queued must not join it again. */
+static void join_cancel(const char *channel) {
+    join_t *job = mowgli_patricia_retrieve(join_jobs, channel);
+
+    if (job)
+        join_free(job, job->state == JOIN_QUEUED ? &join_ready : &join_waiting);
+}
 
+static void init_join_scheduler(void) {
+    join_jobs = mowgli_patricia_create(strcasecanon);
+    add_uint_conf_item("JOIN_RATE", &weather->conf_table, 0, &join_rate, 1, 1000, JOIN_RATE);
 }
 
+static void deinit_join_scheduler(void) {
+    mowgli_node_t *n, *tn;
+
+    if (join_timer)
+        mowgli_timer_destroy(base_eventloop, join_timer);
+    join_timer = NULL;
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, join_ready.head) {
+        join_free(n->data, &join_ready);
+    }
+    MOWGLI_ITER_FOREACH_SAFE(n, tn, join_waiting.head) {
+        join_free(n->data, &join_waiting);
+    }
+    mowgli_patricia_destroy(join_jobs, NULL, NULL);
+    del_conf_item("JOIN_RATE", &weather->conf_table);
+}
 
 // Function to join a channel and update the channel table
 static void ws_cmd_join(sourceinfo_t *si, int parc, char *parv[]) {
@@ -1123,11 +8165,16 @@ static void ws_cmd_join(sourceinfo_t *si, int parc, char *parv[]) {
         // Check if the bot is already in the channel
         channel_info_t *ci = mowgli_patricia_retrieve(channel_table, channel);
         if (!ci) {
-                ci = malloc(sizeof(channel_info_t));
-                ci->channel = strdup(channel);
-                ci->requester = strdup(si->su->nick);
-
-                mowgli_patricia_add(channel_table, ci->channel, ci);
+                if (!channel_db_append(channel, si->su->nick)) {
+                        command_fail(si, fault_internalerror, "Could not save %s to the channel table, not joining.", channel);
+                        return;
+                }
+                if (!channel_table_set(channel, si->su->nick)) {
+                        channel_db_append(channel, NULL);
+                        command_fail(si, fault_internalerror, "Out of memory, not joining %s.", channel);
+                        return;
+                }
+                channel_db_changed();
 
                 // Join the channel
                 command_success_nodata(si, "Joining %s...", channel);
@@ -1142,81 +8189,74 @@ static void ws_cmd_join(sourceinfo_t *si, int parc, char *parv[]) {
 }
 
 
-// Function to save the channel table to a file
-void save_channel_table(const char *filename) {
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        perror("Failed to open file for writing");
-        return;
-    }
-
-    mowgli_patricia_iteration_state_t state;
-    channel_info_t *ci;
-    
-    MOWGLI_PATRICIA_FOREACH(ci, &state, channel_table) {
-        size_t channel_len = strlen(ci->channel) + 1;
-        size_t requester_len = strlen(ci->requester) + 1;
-
-        fwrite(&channel_len, sizeof(size_t), 1, file);
-        fwrite(ci->channel, sizeof(char), channel_len, file);
-
-        fwrite(&requester_len, sizeof(size_t), 1, file);
-        fwrite(ci->requester, sizeof(char), requester_len, file);
-    }
-
-    fclose(file);
-}
-
-// Function to load the channel table from a file
-void load_channel_table(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        save_channel_table("channel_table.db");
-    }
-
-    while (!feof(file)) {
-        size_t channel_len;
-        size_t requester_len;
-
-        if (fread(&channel_len, sizeof(size_t), 1, file) != 1) break;
-        char *channel = malloc(channel_len);
-        fread(channel, sizeof(char), channel_len, file);
+// Function to leave a channel and drop it from the channel table
+static void ws_cmd_part(sourceinfo_t *si, int parc, char *parv[]) {
+        if (parc < 1) {
+                command_fail(si, fault_needmoreparams, "Usage: PART <#channel>");
+                return;
+        }
 
-        if (fread(&requester_len, sizeof(size_t), 1, file) != 1) break;
-        char *requester = malloc(requester_len);
-        fread(requester, sizeof(char), requester_len, file);
+        const char *channel = parv[0];
 
-        channel_info_t *ci = malloc(sizeof(channel_info_t));
-        ci->channel = channel;
-        ci->requester = requester;
+        mychan_t *mc = mychan_find(channel);
+        if ((!mc || !chanacs_user_has_flag(mc, si->su, CA_INVITE)) && !has_priv(si, PRIV_ADMIN)) {
+                command_fail(si, fault_noprivs, "You do not have access for %s to part %s.", si->service->nick, channel);
+                return;
+        }
 
-        mowgli_patricia_add(channel_table, ci->channel, ci);
-    }
+        if (mowgli_patricia_retrieve(channel_table, channel)) {
+                if (!channel_db_append(channel, NULL)) {
+                        command_fail(si, fault_internalerror, "Could not remove %s from the channel table, not leaving.", channel);
+                        return;
+                }
+                channel_table_unset(channel);
+                channel_db_changed();
+        }
+        join_cancel(channel);
 
-    fclose(file);
+        command_success_nodata(si, "Leaving %s...", channel);
+        if (channel_find(channel))
+                part(channel, si->service->nick);
 }
 
 
-// Function to cycle through channels and join if not already in
+// Function to queue the stored channels for joining, or report on a cycle under way
 static void ws_cmd_cycle(sourceinfo_t *si, int parc, char *parv[]) {
-        int channels_joined = 0;
-        mowgli_patricia_iteration_state_t state;
-        channel_info_t *ci;
+        char buf[BUFSIZE];
 
-        MOWGLI_PATRICIA_FOREACH(ci, &state, channel_table) {
-                        join(ci->channel, si->service->nick);
-                        channels_joined++;
+        if (join_timer) {
+                join_progress(buf, sizeof(buf));
+                command_success_nodata(si, "Cycle in progress. %s", buf);
+                return;
         }
 
-        command_success_nodata(si, "Cycle complete. Channels joined: %d", channels_joined);
-        save_channel_table("channel_table.db");
+        unsigned int queued = join_schedule_all();
+
+        if (!join_timer) {
+                command_success_nodata(si, "Cycle complete. No channels to join.");
+                return;
+        }
 
+        mowgli_strlcpy(join_requester, si->su->nick, sizeof(join_requester));
+        command_success_nodata(si, "Joining %u channels at %u per second. Use CYCLE again to see progress.", queued, join_rate);
 }
 
 void _modinit(module_t *m)
 {
     weather = service_add("weather", NULL);
-    set_limit.hitvalue = 10;
+
+    add_uint_conf_item("GEOCODE_CACHE_SIZE", &weather->conf_table, 0, &geocode_cache_max, 0, 1000000, GEOCODE_CACHE_SIZE);
+    add_duration_conf_item("GEOCODE_CACHE_TTL", &weather->conf_table, 0, &geocode_cache_ttl, "d", GEOCODE_CACHE_TTL);
+    add_uint_conf_item("RATELIMIT_MAX_ENTRIES", &weather->conf_table, 0, &rate_limit_max, RATE_LIMIT_LEVELS, 10000000, RATE_LIMIT_MAX_ENTRIES);
+    add_duration_conf_item("WEATHER_CACHE_TTL", &weather->conf_table, 0, &weather_cache_ttl, "m", WEATHER_CACHE_TTL);
+    add_duration_conf_item("WEATHER_CACHE_GRACE", &weather->conf_table, 0, &weather_cache_grace, "m", WEATHER_CACHE_GRACE);
+    add_uint_conf_item("WEATHER_REFRESH_COUNT", &weather->conf_table, 0, &weather_refresh_count, 0, 10000, WEATHER_REFRESH_COUNT);
+    add_uint_conf_item("WEATHER_CACHE_PRECISION", &weather->conf_table, 0, &weather_cache_precision, 0, WEATHER_CACHE_PRECISION_MAX, WEATHER_CACHE_PRECISION);
+    add_dupstr_conf_item("OPENCAGE_URL", &weather->conf_table, 0, &weather_opencage_url, NULL);
+    add_dupstr_conf_item("PIRATE_URL", &weather->conf_table, 0, &weather_pirate_url, NULL);
+    add_dupstr_conf_item("OPENMETEO_URL", &weather->conf_table, 0, &weather_openmeteo_url, NULL);
+    add_uint_conf_item("HEDGE_PERCENTILE", &weather->conf_table, 0, &weather_hedge_percentile, 0, 99, WEATHER_HEDGE_PERCENTILE);
+
     service_bind_command(weather, &ws_help);
     service_bind_command(weather, &ws_weather);
     service_bind_command(weather, &ws_w);
@@ -1226,9 +8266,14 @@ void _modinit(module_t *m)
     service_bind_command(weather, &ws_setcolors);
     service_bind_command(weather, &ws_setgreet);
     service_bind_command(weather, &ws_setratelimit);
+    service_bind_command(weather, &ws_stats);
+    service_bind_command(weather, &ws_triggers);
     service_bind_command(weather, &ws_info);
     service_bind_command(weather, &ws_join);
+    service_bind_command(weather, &ws_part);
     service_bind_command(weather, &ws_cycle);
+    service_bind_command(weather, &ws_cachestats);
+    service_bind_command(weather, &ws_upstreams);
 
     hook_add_event("channel_message");
     hook_add_channel_message(on_channel_message);
@@ -1238,9 +8283,21 @@ void _modinit(module_t *m)
 
     init_rate_limit();
     init_channel_table();
-
-    load_channel_table("channel_table.db");
-   // ws_cmd_cycle(NULL, 0, NULL);
+    init_fetch_engine();
+    init_fetch_worker();
+    init_geocode_cache();
+    init_gazetteer();
+    init_negative_cache();
+    init_weather_cache();
+    init_weather_templates();
+    init_weather_stats();
+    init_weather_keys();
+    init_greet_queue();
+    init_triggers();
+    init_join_scheduler();
+
+    load_channel_table();
+    join_schedule_all();
 }
 
 void _moddeinit(module_unload_intent_t intent)
@@ -1253,15 +8310,49 @@ void _moddeinit(module_unload_intent_t intent)
     service_unbind_command(weather, &ws_setweather);
     service_unbind_command(weather, &ws_setgreet);
     service_unbind_command(weather, &ws_setratelimit);
+    service_unbind_command(weather, &ws_stats);
+    service_unbind_command(weather, &ws_triggers);
     service_unbind_command(weather, &ws_setcolors);
     service_unbind_command(weather, &ws_info);
     service_unbind_command(weather, &ws_join);
+    service_unbind_command(weather, &ws_part);
     service_unbind_command(weather, &ws_cycle);
+    service_unbind_command(weather, &ws_cachestats);
+    service_unbind_command(weather, &ws_upstreams);
     hook_del_channel_message(on_channel_message);
     hook_del_user_identify(on_user_identify);
-    mowgli_patricia_destroy(rate_limit_table, rate_limit_free, NULL);
+    deinit_fetch_engine();
+    deinit_fetch_worker();
+    deinit_weather_keys();
+    deinit_greet_queue();
+    deinit_triggers();
+    deinit_join_scheduler();
+    deinit_geocode_cache();
+    deinit_gazetteer();
+    deinit_weather_cache();
+    deinit_negative_cache();
+    deinit_weather_templates();
+    deinit_weather_zones();
+    deinit_weather_settings();
+    deinit_weather_locations();
+    deinit_weather_stats();
+    del_conf_item("GEOCODE_CACHE_SIZE", &weather->conf_table);
+    del_conf_item("GEOCODE_CACHE_TTL", &weather->conf_table);
+    del_conf_item("RATELIMIT_MAX_ENTRIES", &weather->conf_table);
+    del_conf_item("WEATHER_CACHE_TTL", &weather->conf_table);
+    del_conf_item("WEATHER_CACHE_GRACE", &weather->conf_table);
+    del_conf_item("WEATHER_REFRESH_COUNT", &weather->conf_table);
+    del_conf_item("WEATHER_CACHE_PRECISION", &weather->conf_table);
+    del_conf_item("OPENCAGE_URL", &weather->conf_table);
+    del_conf_item("PIRATE_URL", &weather->conf_table);
+    del_conf_item("OPENMETEO_URL", &weather->conf_table);
+    del_conf_item("HEDGE_PERCENTILE", &weather->conf_table);
+    free(weather_opencage_url);
+    free(weather_pirate_url);
+    free(weather_openmeteo_url);
+    deinit_rate_limit();
+    close_channel_table();
     mowgli_patricia_destroy(channel_table, channel_info_free, NULL);
-    save_channel_table("channel_table.db");
     service_delete(weather);
 
 }